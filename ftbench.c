@@ -0,0 +1,905 @@
+/*******************************************************************************************
+ * Author:		Keisha Arnold
+ * Filename: 	ftbench.c
+ * Description: Loopback benchmark and load generator for ftserver.
+ *              Starts ftserver (-S) in a fixture directory it fills with test files, or
+ *              drives one that is already running (-p), over the framed protocol
+ *              (ftproto.h). Every client connection is a small state machine on one
+ *              epoll loop, so thousands of them cost a socket each, not a thread.
+ *              Each case (one file size x one concurrency) runs for -t seconds with a
+ *              weighted mix of -l, -g and cd, then lets the requests in flight finish.
+ *              A case's results go out as one JSON object per line (-o, appended):
+ *              requests/s, MB/s, p50/p99/p999 latency in microseconds, the client's
+ *              and server's CPU seconds per GB moved and, with -S, the syscalls the
+ *              server's transfer engine made per MB (from its metrics endpoint).
+ * Usage:       ftbench [-S server [-u] | -p port] [-d dir] [-t seconds] [-s sizes]
+ *                      [-c conns] [-m mix] [-P] [-o file]
+ *              sizes and conns are comma separated lists (sizes take K, M, G suffixes),
+ *              mix is "g:8,l:1,cd:1" style weights, -P gets through passive data ports
+ *              instead of inline FT_DATA frames, -u starts the server with io_uring.
+ ********************************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "ftproto.h"
+
+#define MAX_SIZES		16
+#define MAX_CONNS_LISTS	16
+#define MAX_EVENTS		512
+#define RECV_BUF		(256 * 1024)
+#define LIST_FILES		1000				//small files in the fixture, so -l has something to read
+#define REAL_DATA_MAX	(256LL * 1024 * 1024)	//bigger fixture files are sparse
+#define DRAIN_SECONDS	120					//requests in flight get this long to finish
+#define SERVER_PORT		5990				//-S: port the started server listens on
+#define METRICS_SOCKET	"metrics.sock"		//-S: the started server's metrics, in the fixture directory
+
+enum op { OP_GET, OP_LIST, OP_CD, OP_COUNT };
+static const char* opNames[OP_COUNT] = { "g", "l", "cd" };
+
+enum connState { C_CONNECTING, C_LOGIN, C_IDLE, C_BUSY, C_DONE };
+
+struct conn {
+	int fd;
+	int dataFD;					//passive data connection of the current request
+	enum connState state;
+	unsigned char head[FT_HEADER_LEN];	//frame being parsed
+	size_t headPos;
+	uint32_t left;				//payload bytes of the frame still to come
+	int type;
+	unsigned char status[FT_STATUS_LEN + 64];	//start of an FT_STATUS payload
+	size_t statusPos;
+	enum op op;
+	uint32_t requestID;
+	int inSub;					//cd alternates between the fixture and its subdirectory
+	int doneSeen;				//passive: FT_DONE arrived, the data socket may still be open
+	struct timespec start;
+};
+
+struct results {
+	uint32_t* latency;			//microseconds per completed request
+	size_t count;
+	size_t cap;
+	long long errors;
+	long long bytes;			//file/listing bytes received
+};
+
+struct bench {
+	struct sockaddr_in server;
+	int epollFD;
+	struct conn* conns;
+	int nConns;
+	int live;					//connections not C_DONE
+	int weights[OP_COUNT];
+	int weightSum;
+	int passive;
+	int uring;					//-u: the started server sends through io_uring
+	long long size;				//file size of the current case
+	int issuing;				//still starting new requests
+	int refused;				//connections that never got logged in
+	struct results res;
+	unsigned seed;
+};
+
+/*******************************************************************************************
+ * Function:        double now(void)
+ * Returns:         seconds on the monotonic clock
+ ********************************************************************************************/
+static double now(void) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*******************************************************************************************
+ * Function:        long long parseSize(const char* s)
+ * Description:		"4096", "1K", "10M", "10G" (powers of 1024)
+ ********************************************************************************************/
+static long long parseSize(const char* s) {
+	char* end;
+	long long v = strtoll(s, &end, 10);
+
+	switch (*end) {
+	case 'k': case 'K': return v << 10;
+	case 'm': case 'M': return v << 20;
+	case 'g': case 'G': return v << 30;
+	default: return v;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        int parseList(char* list, long long* out, int max)
+ * Description:		Splits a comma separated list of sizes/counts
+ * Returns:         the number of entries
+ ********************************************************************************************/
+static int parseList(char* list, long long* out, int max) {
+	char* save = NULL;
+	char* item;
+	int n = 0;
+
+	for (item = strtok_r(list, ",", &save); item != NULL && n < max; item = strtok_r(NULL, ",", &save)) {
+		out[n++] = parseSize(item);
+	}
+	return n;
+}
+
+/*******************************************************************************************
+ * Function:        int parseMix(struct bench* b, char* mix)
+ * Description:		"g:8,l:1,cd:1" -> op weights, an op without a weight counts 1
+ * Returns:         0, or -1 if an op isn't g, l or cd
+ ********************************************************************************************/
+static int parseMix(struct bench* b, char* mix) {
+	char* save = NULL;
+	char* item;
+	char* colon;
+	int i;
+
+	memset(b->weights, 0, sizeof(b->weights));
+	b->weightSum = 0;
+	for (item = strtok_r(mix, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		colon = strchr(item, ':');
+		if (colon) {
+			*colon = '\0';
+		}
+		for (i = 0; i < OP_COUNT && strcmp(item, opNames[i]) != 0; i++)
+			;
+		if (i == OP_COUNT) {
+			return -1;
+		}
+		b->weights[i] += colon ? atoi(colon + 1) : 1;
+		b->weightSum += colon ? atoi(colon + 1) : 1;
+	}
+	return b->weightSum > 0 ? 0 : -1;
+}
+
+/*******************************************************************************************
+ * Function:        int makeFixture(const char* dir, long long* sizes, int nSizes)
+ * Description:		Fills the fixture directory: f<size> per file size (real bytes up to
+ *                  REAL_DATA_MAX, sparse beyond so a 10G case doesn't need 10G of disk),
+ *                  a subdirectory "d" with links to them for the cd mix, and LIST_FILES
+ *                  small files to list. Files that are already there are kept.
+ * Returns:         0, or -1 on failure
+ ********************************************************************************************/
+static int makeFixture(const char* dir, long long* sizes, int nSizes) {
+	char path[64];
+	char link[64];
+	struct stat info;
+	char* block;
+	long long done;
+	ssize_t n;
+	int fd;
+	int i;
+
+	if ((mkdir(dir, 0755) < 0 && errno != EEXIST) || chdir(dir) < 0 ||
+			(mkdir("d", 0755) < 0 && errno != EEXIST)) {
+		perror("ftbench: fixture directory");
+		return -1;
+	}
+	block = malloc(1 << 20);
+	if (block == NULL) {
+		return -1;
+	}
+	for (i = 0; i < (1 << 20); i++) {
+		block[i] = "abcdefghijklmnopqrstuvwxyz0123456789\n"[(i * 7 + i / 37) % 37];
+	}
+	for (i = 0; i < nSizes; i++) {
+		snprintf(path, sizeof(path), "f%lld", sizes[i]);
+		snprintf(link, sizeof(link), "d/f%lld", sizes[i]);
+		if (stat(path, &info) == 0 && info.st_size == sizes[i]) {
+			continue;
+		}
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror("ftbench: fixture file");
+			free(block);
+			return -1;
+		}
+		for (done = 0; done < sizes[i] && done < REAL_DATA_MAX; done += n) {
+			n = write(fd, block, sizes[i] - done < (1 << 20) ? sizes[i] - done : (1 << 20));
+			if (n <= 0) {
+				perror("ftbench: fixture file");
+				close(fd);
+				free(block);
+				return -1;
+			}
+		}
+		if (ftruncate(fd, sizes[i]) < 0) {
+			perror("ftbench: fixture file");
+		}
+		close(fd);
+		snprintf(path, sizeof(path), "../f%lld", sizes[i]);
+		unlink(link);
+		if (symlink(path, link) < 0) {
+			perror("ftbench: fixture link");
+		}
+	}
+	free(block);
+	for (i = 0; i < LIST_FILES; i++) {
+		snprintf(path, sizeof(path), "n%04d", i);
+		if (access(path, F_OK) < 0 && (fd = open(path, O_WRONLY | O_CREAT, 0644)) >= 0) {
+			close(fd);
+		}
+	}
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        void record(struct bench* b, struct conn* c, int failed)
+ * Description:		A request finished: its latency goes into the results
+ ********************************************************************************************/
+static void record(struct bench* b, struct conn* c, int failed) {
+	struct timespec t;
+	uint32_t* grown;
+	double us;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	us = (t.tv_sec - c->start.tv_sec) * 1e6 + (t.tv_nsec - c->start.tv_nsec) / 1e3;
+	if (failed) {
+		b->res.errors++;
+	}
+	if (b->res.count == b->res.cap) {
+		grown = realloc(b->res.latency, (b->res.cap ? 2 * b->res.cap : 65536) * sizeof(*grown));
+		if (grown == NULL) {
+			return;
+		}
+		b->res.latency = grown;
+		b->res.cap = b->res.cap ? 2 * b->res.cap : 65536;
+	}
+	b->res.latency[b->res.count++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+/*******************************************************************************************
+ * Function:        int sendFrame(struct conn* c, int type, const void* payload, size_t len)
+ * Description:		Writes a whole (small) frame on the control socket
+ * Returns:         0, or -1 if the socket didn't take it
+ ********************************************************************************************/
+static int sendFrame(struct conn* c, int type, const void* payload, size_t len) {
+	unsigned char frame[FT_HEADER_LEN + 256];
+
+	ftEncodeHeader(frame, type, c->requestID, len);
+	memcpy(frame + FT_HEADER_LEN, payload, len);
+	return send(c->fd, frame, FT_HEADER_LEN + len, MSG_NOSIGNAL) == (ssize_t)(FT_HEADER_LEN + len) ? 0 : -1;
+}
+
+/*******************************************************************************************
+ * Function:        void closeConn(struct bench* b, struct conn* c)
+ ********************************************************************************************/
+static void closeConn(struct bench* b, struct conn* c) {
+	struct linger reset = { 1, 0 };
+
+	if (c->dataFD >= 0) {
+		close(c->dataFD);
+		c->dataFD = -1;
+	}
+	if (c->fd >= 0) {
+		//the bench closes first: without a reset every connection would hold its port in
+		//TIME_WAIT, and a 10k case would run the next one out of ephemeral ports
+		setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+		close(c->fd);
+		c->fd = -1;
+	}
+	if (c->state == C_CONNECTING || c->state == C_LOGIN) {
+		b->refused++;
+	}
+	if (c->state != C_DONE) {
+		c->state = C_DONE;
+		b->live--;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void issue(struct bench* b, struct conn* c)
+ * Description:		Starts the connection's next request, an op picked by the mix weights,
+ *                  or closes it once the case has stopped issuing
+ ********************************************************************************************/
+static void issue(struct bench* b, struct conn* c) {
+	unsigned char cmd[FT_COMMAND_LEN + 64];
+	size_t len = FT_COMMAND_LEN;
+	int pick;
+	int flags = b->passive ? FT_FLAG_PASSIVE : FT_FLAG_INLINE;
+
+	if (!b->issuing) {
+		closeConn(b, c);
+		return;
+	}
+	pick = rand_r(&b->seed) % b->weightSum;
+	for (c->op = 0; pick >= b->weights[c->op]; c->op++) {
+		pick -= b->weights[c->op];
+	}
+	switch (c->op) {
+	case OP_GET:
+		cmd[0] = FT_OP_GET;
+		len += snprintf((char*)cmd + len, sizeof(cmd) - len, "f%lld", b->size);
+		break;
+	case OP_LIST:
+		cmd[0] = FT_OP_LIST;
+		break;
+	default:
+		cmd[0] = FT_OP_CD;
+		flags = 0;
+		len += snprintf((char*)cmd + len, sizeof(cmd) - len, "%s", c->inSub ? ".." : "d");
+		c->inSub = !c->inSub;
+		break;
+	}
+	cmd[1] = flags;
+	ftPut16(cmd + 2, 0);
+	c->requestID++;
+	c->doneSeen = 0;
+	c->state = C_BUSY;
+	clock_gettime(CLOCK_MONOTONIC, &c->start);
+	if (sendFrame(c, FT_COMMAND, cmd, len) < 0) {
+		record(b, c, 1);
+		closeConn(b, c);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void openData(struct bench* b, struct conn* c, int port)
+ * Description:		FT_PASV: connects to the request's passive data port
+ ********************************************************************************************/
+static void openData(struct bench* b, struct conn* c, int port) {
+	struct sockaddr_in addr = b->server;
+	struct epoll_event ev;
+
+	addr.sin_port = htons(port);
+	c->dataFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (c->dataFD < 0 || (connect(c->dataFD, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)) {
+		record(b, c, 1);
+		closeConn(b, c);
+		return;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.u64 = (uint64_t)(c - b->conns) << 1 | 1;
+	epoll_ctl(b->epollFD, EPOLL_CTL_ADD, c->dataFD, &ev);
+}
+
+/*******************************************************************************************
+ * Function:        void onStatus(struct bench* b, struct conn* c)
+ * Description:		A whole FT_STATUS frame (up to its message's first bytes) arrived.
+ *                  A request is complete on FT_DONE or FT_ERROR, cd on its FT_OK; a passive
+ *                  request also waits for its data connection to close.
+ ********************************************************************************************/
+static void onStatus(struct bench* b, struct conn* c) {
+	int code = c->status[0];
+	long long value = ftGet64(c->status + 4);
+
+	if (c->state == C_LOGIN) {
+		if (code != FT_OK) {
+			fprintf(stderr, "ftbench: login refused\n");
+			closeConn(b, c);
+			return;
+		}
+		c->state = C_IDLE;
+		issue(b, c);
+		return;
+	}
+	if (code == FT_PASV) {
+		openData(b, c, (int)value);
+		return;
+	}
+	if (code == FT_ERROR || code == FT_DONE || (code == FT_OK && c->op == OP_CD)) {
+		if (code == FT_DONE && c->dataFD >= 0) {
+			c->doneSeen = 1;		//finishes when the data socket drains
+			return;
+		}
+		record(b, c, code == FT_ERROR);
+		issue(b, c);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void readControl(struct bench* b, struct conn* c, unsigned char* buf)
+ * Description:		Parses whatever frames the control socket has, counting FT_DATA bytes
+ *                  without keeping them
+ ********************************************************************************************/
+static void readControl(struct bench* b, struct conn* c, unsigned char* buf) {
+	struct ftHeader h;
+	ssize_t n;
+	size_t pos;
+	size_t take;
+
+	while (c->fd >= 0) {
+		n = recv(c->fd, buf, RECV_BUF, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && errno == EAGAIN) {
+			return;
+		}
+		if (n <= 0) {
+			if (c->state == C_BUSY) {
+				record(b, c, 1);
+			}
+			closeConn(b, c);
+			return;
+		}
+		for (pos = 0; pos < (size_t)n && c->fd >= 0; ) {
+			if (c->headPos < FT_HEADER_LEN) {
+				take = FT_HEADER_LEN - c->headPos < n - pos ? FT_HEADER_LEN - c->headPos : n - pos;
+				memcpy(c->head + c->headPos, buf + pos, take);
+				c->headPos += take;
+				pos += take;
+				if (c->headPos < FT_HEADER_LEN) {
+					break;
+				}
+				if (ftDecodeHeader(c->head, FT_HEADER_LEN, &h) < 0) {
+					fprintf(stderr, "ftbench: bad frame from the server\n");
+					record(b, c, 1);
+					closeConn(b, c);
+					return;
+				}
+				c->type = h.type;
+				c->left = h.length;
+				c->statusPos = 0;
+			}
+			take = c->left < n - pos ? c->left : n - pos;
+			if (c->type == FT_DATA) {
+				b->res.bytes += take;
+			}
+			else if (c->statusPos < sizeof(c->status)) {
+				size_t keep = take < sizeof(c->status) - c->statusPos ? take : sizeof(c->status) - c->statusPos;
+				memcpy(c->status + c->statusPos, buf + pos, keep);
+				c->statusPos += keep;
+			}
+			pos += take;
+			c->left -= take;
+			if (c->left == 0) {
+				c->headPos = 0;
+				if (c->type == FT_STATUS && c->statusPos >= FT_STATUS_LEN) {
+					onStatus(b, c);
+				}
+			}
+		}
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void readData(struct bench* b, struct conn* c, unsigned char* buf)
+ * Description:		Drains a passive data connection, the request is done once it closed
+ *                  and FT_DONE came in
+ ********************************************************************************************/
+static void readData(struct bench* b, struct conn* c, unsigned char* buf) {
+	ssize_t n;
+
+	while (c->dataFD >= 0) {
+		n = recv(c->dataFD, buf, RECV_BUF, 0);
+		if (n > 0) {
+			b->res.bytes += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && errno == EAGAIN) {
+			return;
+		}
+		close(c->dataFD);
+		c->dataFD = -1;
+		if (c->doneSeen) {
+			record(b, c, 0);
+			issue(b, c);
+		}
+		return;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void onConnect(struct bench* b, struct conn* c)
+ * Description:		Control connection is up: log in
+ ********************************************************************************************/
+static void onConnect(struct bench* b, struct conn* c) {
+	static const char login[] = "client\0pass";
+	struct epoll_event ev;
+	int err = 0;
+	socklen_t errLen = sizeof(err);
+
+	if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0 || err != 0) {
+		closeConn(b, c);
+		return;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.u64 = (uint64_t)(c - b->conns) << 1;
+	epoll_ctl(b->epollFD, EPOLL_CTL_MOD, c->fd, &ev);
+	c->state = C_LOGIN;
+	if (sendFrame(c, FT_HELLO, login, sizeof(login) - 1) < 0) {
+		closeConn(b, c);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void pollConns(struct bench* b, unsigned char* buf, double until)
+ * Description:		Runs the event loop until the deadline or until no connection is left
+ ********************************************************************************************/
+static void pollConns(struct bench* b, unsigned char* buf, double until) {
+	struct epoll_event events[MAX_EVENTS];
+	struct conn* c;
+	int timeout;
+	int n;
+	int i;
+
+	while (b->live > 0 && now() < until) {
+		timeout = (int)((until - now()) * 1000) + 1;
+		n = epoll_wait(b->epollFD, events, MAX_EVENTS, timeout > 100 ? 100 : timeout);
+		for (i = 0; i < n; i++) {
+			c = &b->conns[events[i].data.u64 >> 1];
+			if (c->state == C_DONE) {
+				continue;
+			}
+			if (events[i].data.u64 & 1) {
+				readData(b, c, buf);
+			}
+			else if (c->state == C_CONNECTING) {
+				onConnect(b, c);
+			}
+			else {
+				readControl(b, c, buf);
+			}
+		}
+	}
+}
+
+/*******************************************************************************************
+ * Function:        double serverCpu(pid_t pid)
+ * Returns:         user + system CPU seconds of a process, from /proc, 0 if unknown
+ ********************************************************************************************/
+static double serverCpu(pid_t pid) {
+	char path[64];
+	char line[1024];
+	unsigned long utime;
+	unsigned long stime;
+	char* p;
+	FILE* f;
+
+	if (pid <= 0) {
+		return 0;
+	}
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		return 0;
+	}
+	p = fgets(line, sizeof(line), f);
+	fclose(f);
+	p = p ? strrchr(line, ')') : NULL;		//the command name may have spaces
+	if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+		return 0;
+	}
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/*******************************************************************************************
+ * Function:        double selfCpu(void)
+ * Returns:         user + system CPU seconds of ftbench
+ ********************************************************************************************/
+static double selfCpu(void) {
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/*******************************************************************************************
+ * Function:        long long serverSyscalls(void)
+ * Description:		Scrapes ftserver_transfer_syscalls_total from the started server's
+ *                  metrics socket
+ * Returns:         the count, -1 if there is no server of ours to ask
+ ********************************************************************************************/
+static long long serverSyscalls(void) {
+	static const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+	struct sockaddr_un addr;
+	char reply[64 * 1024];
+	size_t got = 0;
+	long long count = -1;
+	ssize_t n;
+	char* p;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", METRICS_SOCKET);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+			write(fd, request, sizeof(request) - 1) != sizeof(request) - 1) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	while (got < sizeof(reply) - 1 && (n = read(fd, reply + got, sizeof(reply) - 1 - got)) > 0) {
+		got += n;
+	}
+	close(fd);
+	reply[got] = '\0';
+	p = strstr(reply, "\nftserver_transfer_syscalls_total ");
+	if (p != NULL) {
+		count = atoll(p + strlen("\nftserver_transfer_syscalls_total "));
+	}
+	return count;
+}
+
+static int compareU32(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*******************************************************************************************
+ * Function:        uint32_t percentile(struct results* r, double p)
+ * Pre-Conditions: 	r->latency is sorted
+ ********************************************************************************************/
+static uint32_t percentile(struct results* r, double p) {
+	size_t i;
+
+	if (r->count == 0) {
+		return 0;
+	}
+	i = (size_t)(p * r->count);
+	return r->latency[i < r->count ? i : r->count - 1];
+}
+
+/*******************************************************************************************
+ * Function:        int runCase(struct bench* b, int conns, double seconds, pid_t serverPid,
+ *                              const char* mix, FILE* out)
+ * Description:		One case: opens conns connections, measures from the moment they start
+ *                  issuing for the given seconds, waits for the requests in flight and
+ *                  writes the case's JSON line
+ * Returns:         0, or -1 if no connection got through
+ ********************************************************************************************/
+static int runCase(struct bench* b, int conns, double seconds, pid_t serverPid, const char* mix, FILE* out) {
+	static unsigned char buf[RECV_BUF];
+	struct epoll_event ev;
+	struct conn* c;
+	double start;
+	double elapsed;
+	double cpu0;
+	double serverCpu0;
+	long long syscalls0;
+	long long syscalls;
+	double perMB;
+	double gb;
+	char line[1024];
+	int i;
+
+	b->conns = calloc(conns, sizeof(*b->conns));
+	if (b->conns == NULL) {
+		return -1;
+	}
+	b->nConns = conns;
+	b->live = 0;
+	b->issuing = 1;
+	b->refused = 0;
+	memset(&b->res, 0, sizeof(b->res));
+
+	cpu0 = selfCpu();
+	serverCpu0 = serverCpu(serverPid);
+	syscalls0 = serverPid > 0 ? serverSyscalls() : -1;
+	start = now();
+	for (i = 0; i < conns; i++) {
+		c = &b->conns[i];
+		c->dataFD = -1;
+		c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (c->fd < 0) {
+			perror("ftbench: socket");
+			c->state = C_DONE;
+			continue;
+		}
+		if (connect(c->fd, (struct sockaddr*)&b->server, sizeof(b->server)) < 0 && errno != EINPROGRESS) {
+			close(c->fd);
+			c->fd = -1;
+			c->state = C_DONE;
+			b->refused++;
+			continue;
+		}
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLOUT;
+		ev.data.u64 = (uint64_t)i << 1;
+		epoll_ctl(b->epollFD, EPOLL_CTL_ADD, c->fd, &ev);
+		c->state = C_CONNECTING;
+		b->live++;
+	}
+	pollConns(b, buf, start + seconds);
+	b->issuing = 0;			//connections close as their requests finish
+	pollConns(b, buf, start + seconds + DRAIN_SECONDS);
+	elapsed = now() - start;
+	for (i = 0; i < conns; i++) {
+		if (b->conns[i].state == C_BUSY) {
+			b->res.errors++;	//never finished
+		}
+		closeConn(b, &b->conns[i]);
+	}
+	if (b->refused > 0) {
+		fprintf(stderr, "ftbench: %d of %d connections failed to connect or log in\n", b->refused, conns);
+	}
+	free(b->conns);
+	b->conns = NULL;
+
+	qsort(b->res.latency, b->res.count, sizeof(*b->res.latency), compareU32);
+	gb = b->res.bytes / 1e9;
+	syscalls = syscalls0 >= 0 ? serverSyscalls() : -1;
+	perMB = syscalls >= syscalls0 && syscalls0 >= 0 && gb > 0 ? (syscalls - syscalls0) / (gb * 1000) : -1;
+	snprintf(line, sizeof(line),
+			 "{\"mix\":\"%s\",\"size\":%lld,\"concurrency\":%d,\"mode\":\"%s\",\"uring\":%s,\"seconds\":%.3f,"
+			 "\"connections\":%d,\"requests\":%zu,\"errors\":%lld,\"bytes\":%lld,\"rps\":%.1f,\"mbps\":%.1f,"
+			 "\"p50_us\":%u,\"p99_us\":%u,\"p999_us\":%u,\"client_cpu_s_per_gb\":%.3f,\"server_cpu_s_per_gb\":%.3f,"
+			 "\"server_syscalls_per_mb\":%.2f}\n",
+			 mix, b->size, conns, b->passive ? "passive" : "inline", b->uring ? "true" : "false", elapsed, conns - b->refused,
+			 b->res.count, b->res.errors, b->res.bytes, b->res.count / elapsed, b->res.bytes / elapsed / 1e6,
+			 percentile(&b->res, 0.50), percentile(&b->res, 0.99), percentile(&b->res, 0.999),
+			 gb > 0 ? (selfCpu() - cpu0) / gb : 0, gb > 0 && serverPid > 0 ? (serverCpu(serverPid) - serverCpu0) / gb : 0,
+			 perMB);
+	fputs(line, out);
+	fflush(out);
+	fprintf(stderr, "%-14s %6lld B x %5d conns: %9.1f req/s %9.1f MB/s  p50 %u us  p99 %u us  p999 %u us  "
+			"syscalls/MB %.2f  errors %lld\n",
+			mix, b->size, conns, b->res.count / elapsed, b->res.bytes / elapsed / 1e6, percentile(&b->res, 0.50),
+			percentile(&b->res, 0.99), percentile(&b->res, 0.999), perMB, b->res.errors);
+	free(b->res.latency);
+	return b->res.count > 0 ? 0 : -1;
+}
+
+/*******************************************************************************************
+ * Function:        pid_t startServer(const char* server, int port, int uring, struct sockaddr_in* addr)
+ * Description:		Starts ftserver in the fixture directory (the current one), with its
+ *                  metrics on METRICS_SOCKET and io_uring if asked, and waits until it
+ *                  accepts connections
+ * Returns:         its pid, or -1
+ ********************************************************************************************/
+static pid_t startServer(const char* server, int port, int uring, struct sockaddr_in* addr) {
+	char portArg[16];
+	pid_t pid;
+	int fd;
+	int i;
+
+	snprintf(portArg, sizeof(portArg), "%d", port);
+	pid = fork();
+	if (pid == 0) {
+		fd = open("server.log", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		unlink(METRICS_SOCKET);
+		if (uring) {
+			execl(server, server, "-i", "none", "-m", METRICS_SOCKET, "-u", portArg, (char*)NULL);
+		}
+		else {
+			execl(server, server, "-i", "none", "-m", METRICS_SOCKET, portArg, (char*)NULL);
+		}
+		perror("ftbench: exec server");
+		_exit(127);
+	}
+	if (pid < 0) {
+		return -1;
+	}
+	for (i = 0; i < 100; i++) {
+		usleep(50000);
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (connect(fd, (struct sockaddr*)addr, sizeof(*addr)) == 0) {
+			close(fd);
+			return pid;
+		}
+		close(fd);
+		if (waitpid(pid, NULL, WNOHANG) == pid) {
+			break;
+		}
+	}
+	fprintf(stderr, "ftbench: %s didn't start, see server.log\n", server);
+	kill(pid, SIGTERM);
+	return -1;
+}
+
+/*******************************************************************************************
+ * Function:        int main(int argc, char *argv[])
+ * Description:		Parses the options, sets up the fixture and server, runs every size x
+ *                  concurrency case
+ ********************************************************************************************/
+int main(int argc, char *argv[]) {
+	struct bench b;
+	struct rlimit files;
+	long long sizes[MAX_SIZES] = { 1024 };
+	long long conns[MAX_CONNS_LISTS] = { 1 };
+	int nSizes = 1;
+	int nConns = 1;
+	const char* server = NULL;
+	const char* dir = "benchdata";
+	const char* outPath = NULL;
+	char mix[128] = "g";
+	char mixCopy[128];
+	char absServer[4096];
+	double seconds = 3;
+	int port = SERVER_PORT;
+	pid_t pid = -1;
+	FILE* out = stdout;
+	int failed = 0;
+	int opt;
+	int i;
+	int k;
+
+	memset(&b, 0, sizeof(b));
+	while ((opt = getopt(argc, argv, "S:p:d:t:s:c:m:Puo:")) != -1) {
+		switch (opt) {
+		case 'S': server = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'd': dir = optarg; break;
+		case 't': seconds = atof(optarg); break;
+		case 's': nSizes = parseList(optarg, sizes, MAX_SIZES); break;
+		case 'c': nConns = parseList(optarg, conns, MAX_CONNS_LISTS); break;
+		case 'm': snprintf(mix, sizeof(mix), "%s", optarg); break;
+		case 'P': b.passive = 1; break;
+		case 'u': b.uring = 1; break;
+		case 'o': outPath = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-S server [-u] | -p port] [-d dir] [-t seconds] [-s sizes] [-c conns] "
+					"[-m g:8,l:1,cd:1] [-P] [-o file]\n", argv[0]);
+			exit(1);
+		}
+	}
+	snprintf(mixCopy, sizeof(mixCopy), "%s", mix);
+	if (parseMix(&b, mixCopy) < 0 || nSizes == 0 || nConns == 0) {
+		fprintf(stderr, "ftbench: bad -m, -s or -c\n");
+		exit(1);
+	}
+	if (outPath && (out = fopen(outPath, "a")) == NULL) {
+		perror("ftbench: output");
+		exit(1);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	if (getrlimit(RLIMIT_NOFILE, &files) == 0) {	//10k connections, and the server inherits it
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+	if (server && realpath(server, absServer) == NULL) {
+		perror("ftbench: server");
+		exit(1);
+	}
+
+	b.server.sin_family = AF_INET;
+	b.server.sin_port = htons(port);
+	b.server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	b.epollFD = epoll_create1(EPOLL_CLOEXEC);
+	b.seed = 1;
+	if (server) {
+		if (makeFixture(dir, sizes, nSizes) < 0 || (pid = startServer(absServer, port, b.uring, &b.server)) < 0) {
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < nSizes; i++) {
+		for (k = 0; k < nConns; k++) {
+			b.size = sizes[i];
+			if (runCase(&b, (int)conns[k], seconds, pid, mix, out) < 0) {
+				failed = 1;
+			}
+		}
+	}
+
+	if (pid > 0) {
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+	}
+	if (out != stdout) {
+		fclose(out);
+	}
+	return failed;
+}
@@ -23,7 +23,11 @@ import fcntl
 import string
 import fileinput
 import threading
+import os
 import os.path
+import zlib
+import struct
+import hashlib
 
 #****************************************************************************************#
 # Function:			validateCL()
@@ -36,6 +40,13 @@ def validateCL():
     if (len(sys.argv) < 5 or len(sys.argv) > 6):
 	print("usage: ftclient.py <host> <ctrl port> <-l> <data port>")
 	print("       ftclient.py <host> <ctrl port> <-g> <filename> <data port>")
+	print("       ftclient.py <host> <ctrl port> <-r> <filename> <data port>   (resume)")
+	print("       ftclient.py <host> <ctrl port> <-s> <filename> <streams>     (striped)")
+	print("       ftclient.py <host> <ctrl port> <-z> <filename> <data port>   (compressed)")
+	print("       ftclient.py <host> <ctrl port> <-c> <filename>               (compare checksums)")
+	print("       ftclient.py <host> <ctrl port> <-d> <filename> <data port>   (delta against the local copy)")
+	print("       ftclient.py <host> <ctrl port> <-p> <filename> <data port>   (upload, resumes a stopped one)")
+	print("       ftclient.py <host> <ctrl port> <-m> <pattern> <data port>    (batch: glob, directory or @manifest)")
 	print("       ftclient.py <host> <ctrl port> <cd> <path>")
 	exit(1)
 	#valid ports [1024, 49151]
@@ -45,10 +56,16 @@ def validateCL():
     elif (sys.argv[3] == "-l" and (int(sys.argv[4]) < 1024 or int(sys.argv[4]) > 49151)):
         print("Invalid data port. Use port [1024, 49151].")
         exit(1)
-    elif (len(sys.argv) == 6 and (int(sys.argv[5]) < 1024 or int(sys.argv[5]) > 49151)):
+    elif (sys.argv[3] == "-s" and (len(sys.argv) != 6 or int(sys.argv[5]) < 1 or int(sys.argv[5]) > 64)):
+        print("Invalid stream count. Use [1, 64] streams.")
+        exit(1)
+    elif (sys.argv[3] != "-s" and len(sys.argv) == 6 and (int(sys.argv[5]) < 1024 or int(sys.argv[5]) > 49151)):
         print("Invalid data port. Use port [1024, 49151].")
         exit(1)
-    elif (sys.argv[3] != "-l" and sys.argv[3] != "-g" and sys.argv[3] != "cd"):
+    elif (sys.argv[3] == "-p" and not os.path.isfile(sys.argv[4])):
+        print("No such file: {0}".format(sys.argv[4]))
+        exit(1)
+    elif (sys.argv[3] != "-l" and sys.argv[3] != "-g" and sys.argv[3] != "-r" and sys.argv[3] != "-s" and sys.argv[3] != "-z" and sys.argv[3] != "-c" and sys.argv[3] != "-d" and sys.argv[3] != "-p" and sys.argv[3] != "-m" and sys.argv[3] != "cd"):
         print("command {0} not recognized".format(sys.argv[3]))
         exit(1)
 
@@ -77,6 +94,7 @@ def ctrlConnectServer():
 #					the server and client must have an established TCP control connection
 # Post-Conditions:	The server replies verifying the user or if username/password
 #					was invalid the program exits
+# Returns:			the verified username/password, for the extra sessions of -s
 #****************************************************************************************#
 def verifyUser(ctrlSocket):
 	user = raw_input("Username: ")
@@ -89,6 +107,17 @@ def verifyUser(ctrlSocket):
 	if "fail" in replyMsg:
 		ctrlSocket.close()
 		sys.exit(0)
+	return verify
+
+
+#****************************************************************************************#
+# Function:			getClientIP(ctrlSocket)
+# Description:		Finds the address the server sees this host connect from: the local
+#					end of the control connection (no lookups, works offline)
+# Returns:			the client IP address as a string
+#****************************************************************************************#
+def getClientIP(ctrlSocket):
+	return ctrlSocket.getsockname()[0] #retuns a tuple, get the 1st element[0]
 
 
 #****************************************************************************************#
@@ -100,12 +129,34 @@ def verifyUser(ctrlSocket):
 # Post-Conditions:	Client IP address and command sent to the server
 #****************************************************************************************#
 def sendCommand(ctrlSocket):
-	#get client address
-	sckt = socket(AF_INET, SOCK_DGRAM)
-	sckt.connect(("8.8.8.8", 80))
-	clientIP = sckt.getsockname()[0] #retuns a tuple, get the 1st element[0]
+	clientIP = getClientIP(ctrlSocket)
 	
-	if len(sys.argv) != 6:
+	if sys.argv[3] == "-r":
+		#resume: ask for the rest of the file, from the size of the local copy
+		offset = 0
+		if os.path.exists(sys.argv[4]):
+			offset = os.path.getsize(sys.argv[4])
+		cmd = sys.argv[1] + " " + clientIP + " -g " + sys.argv[4] + " " + sys.argv[5] + " " + str(offset)
+	elif sys.argv[3] == "-s":
+		#striped: find out how big the file is first
+		cmd = sys.argv[1] + " " + clientIP + " size " + sys.argv[4]
+	elif sys.argv[3] == "-c":
+		#checksum of the server's copy, the local one is summed below
+		cmd = sys.argv[1] + " " + clientIP + " sum " + sys.argv[4]
+	elif sys.argv[3] == "-d":
+		#delta: the server sends what the local copy doesn't have
+		blockSize, blocks = deltaBlocks(sys.argv[4])
+		cmd = sys.argv[1] + " " + clientIP + " delta " + sys.argv[4] + " " + sys.argv[5] + " " + str(blockSize) + " " + str(blocks)
+	elif sys.argv[3] == "-p":
+		#upload: the server answers with the offset to send from
+		cmd = sys.argv[1] + " " + clientIP + " put " + sys.argv[4] + " " + sys.argv[5] + " " + str(os.path.getsize(sys.argv[4]))
+	elif sys.argv[3] == "-m":
+		#batch get
+		cmd = sys.argv[1] + " " + clientIP + " mget " + sys.argv[4] + " " + sys.argv[5]
+	elif sys.argv[3] == "-z":
+		#compressed: the server decides whether the file is worth it
+		cmd = sys.argv[1] + " " + clientIP + " -g " + sys.argv[4] + " " + sys.argv[5] + " gzip"
+	elif len(sys.argv) != 6:
 		cmd = sys.argv[1] + " " + clientIP + " " + sys.argv[3] + " " + sys.argv[4]
 	else:
 		cmd = sys.argv[1] + " " + clientIP + " " + sys.argv[3] + " " + sys.argv[4] + " " + sys.argv[5]
@@ -153,36 +204,315 @@ def getDirList(dataSocket):
 #					the server and client must have an established TCP control connection,
 #					the server and client must have an established TCP data connection
 # Post-Conditions:	Client receives requested file and writes it to current directory
+#					("a" as the mode appends to it instead)
 #****************************************************************************************#
-def receiveFile(dataSocket, fileName):
-    if ".txt" in fileName:
-		#open file in write mode
-        file = open(fileName, "w")
-        dataRecv = dataSocket.recv(10000)
-		#loop while still recv data
-        while (dataRecv):
-            fileBuffer = dataRecv.decode("utf-8")
-            file.write(fileBuffer)
-            dataRecv = dataSocket.recv(10000)
-            if not dataRecv:
-				break
-            if len(dataRecv) == 0:
-				break
-        file.close()
-			
-    else:
-		#open file in write+binary mode
-		#b differentiates btwn text & binary files
-        file = open(fileName, "wb")
-        dataRecv = dataSocket.recv(10000)
-        while (dataRecv):
-            file.write(dataRecv)
-            dataRecv = dataSocket.recv(10000)
-            if not dataRecv:
-				break
-            if len(dataRecv) == 0:
+def receiveFile(dataSocket, fileName, mode = "w"):
+	#bytes are written as they arrive, text files too: decoding chunk by chunk
+	#would break multibyte characters split across two recv()s
+	file = open(fileName, mode + "b")
+	dataRecv = dataSocket.recv(1048576)
+	while (dataRecv):
+		file.write(dataRecv)
+		dataRecv = dataSocket.recv(1048576)
+	file.close()
+
+
+#****************************************************************************************#
+# Function:			receiveCompressed(dataSocket, fileName)
+# Description:		Receives a file the server sent gzip compressed and writes it out
+#					decompressed
+# Parameters:		dataSocket, filename
+# Pre-Conditions:	The server answered the -g ... gzip request with "(gzip)"
+# Post-Conditions:	Client writes the decompressed file to current directory
+#****************************************************************************************#
+def receiveCompressed(dataSocket, fileName):
+	file = open(fileName, "wb")
+	inflater = zlib.decompressobj(16 + zlib.MAX_WBITS) #expect a gzip header
+	dataRecv = dataSocket.recv(65536)
+	while (dataRecv):
+		file.write(inflater.decompress(dataRecv))
+		dataRecv = dataSocket.recv(65536)
+	file.write(inflater.flush())
+	file.close()
+
+
+#****************************************************************************************#
+# Function:			crc32c(fileName)
+# Description:		CRC32C (Castagnoli) of a local file, the checksum the server reports
+# Parameters:		fileName
+# Pre-Conditions:	the file exists
+# Post-Conditions:	returns the checksum as 8 hex digits
+#****************************************************************************************#
+def crc32c(fileName):
+	table = []
+	for b in range(256):
+		crc = b
+		for k in range(8):
+			if crc & 1:
+				crc = (crc >> 1) ^ 0x82f63b78
+			else:
+				crc = crc >> 1
+		table.append(crc)
+	crc = 0xffffffff
+	file = open(fileName, "rb")
+	data = file.read(65536)
+	while (data):
+		for byte in bytearray(data):
+			crc = table[(crc ^ byte) & 0xff] ^ (crc >> 8)
+		data = file.read(65536)
+	file.close()
+	return "%08x" % (crc ^ 0xffffffff)
+
+
+#****************************************************************************************#
+# Function:			deltaBlocks(fileName)
+# Description:		Picks the block size for a delta of a local file: a power of two from
+#					4KB to 1MB, about 16K blocks for a big file
+# Parameters:		fileName
+# Pre-Conditions:	none, a missing file has no blocks
+# Post-Conditions:	returns (block size, number of whole blocks)
+#****************************************************************************************#
+def deltaBlocks(fileName):
+	size = 0
+	if os.path.exists(fileName):
+		size = os.path.getsize(fileName)
+	blockSize = 4096
+	while blockSize < 1024 * 1024 and blockSize * 16384 < size:
+		blockSize = blockSize * 2
+	return blockSize, size // blockSize
+
+
+#****************************************************************************************#
+# Function:			sendSignatures(dataSocket, fileName, blockSize, blocks)
+# Description:		Describes the local copy to the server: per block its rsync weak
+#					checksum and MD5
+# Parameters:		dataSocket, fileName, the block size and count sent with the command
+# Pre-Conditions:	The server accepted the delta and connected
+# Post-Conditions:	blocks * 20 bytes written to the data socket
+#****************************************************************************************#
+def sendSignatures(dataSocket, fileName, blockSize, blocks):
+	if blocks == 0:
+		return
+	file = open(fileName, "rb")
+	for i in range(blocks):
+		block = file.read(blockSize)
+		a = 0
+		b = 0
+		for byte in bytearray(block):
+			a = a + byte
+			b = b + a
+		weak = (a & 0xffff) | (b & 0xffff) << 16
+		dataSocket.sendall(struct.pack(">I", weak) + hashlib.md5(block).digest())
+	file.close()
+
+
+#****************************************************************************************#
+# Function:			receiveDelta(dataSocket, fileName, blockSize)
+# Description:		Rebuilds the server's file from the delta ops: literal bytes from the
+#					socket, copied blocks from the local copy. The new file is written
+#					next to the old one and renamed over it when complete.
+# Parameters:		dataSocket, fileName, the block size
+# Pre-Conditions:	The signatures have been sent
+# Post-Conditions:	returns the server's CRC32C of the file, or None if the stream was cut
+#****************************************************************************************#
+def receiveDelta(dataSocket, fileName, blockSize):
+	def recvAll(n):
+		data = b""
+		while len(data) < n:
+			more = dataSocket.recv(min(n - len(data), 65536))
+			if not more:
+				return None
+			data = data + more
+		return data
+	old = None
+	if os.path.exists(fileName):
+		old = open(fileName, "rb")
+	new = open(fileName + ".delta", "wb")
+	crc = None
+	while True:
+		head = recvAll(9)
+		if head is None:
+			break
+		type, a, b = struct.unpack(">BII", head)
+		if type == 0:
+			crc = "%08x" % a
+			break
+		elif type == 1:
+			while a > 0:
+				data = recvAll(min(a, 65536))
+				if data is None:
+					a = -1
+					break
+				new.write(data)
+				a = a - len(data)
+			if a < 0:
 				break
-        file.close()
+		else:
+			old.seek(a * blockSize)
+			new.write(old.read(b * blockSize))
+	new.close()
+	if old:
+		old.close()
+	if crc is None:
+		os.remove(fileName + ".delta")
+		return None
+	os.rename(fileName + ".delta", fileName)
+	return crc
+
+
+#****************************************************************************************#
+# Function:			receiveBatch(dataSocket)
+# Description:		Receives a batch get: one stream of entries, each a head (size, mtime,
+#					name), the file's bytes and its CRC32C. Writes every file under the
+#					current directory, making its directories, and checks the ones the
+#					server summed. Names that would leave the current directory are dropped.
+# Parameters:		dataSocket
+# Pre-Conditions:	The server accepted the mget and connected
+# Post-Conditions:	returns (files, skipped by the server, bad checksums), or None if the
+#					stream was cut
+#****************************************************************************************#
+def receiveBatch(dataSocket):
+	def recvAll(n):
+		data = b""
+		while len(data) < n:
+			more = dataSocket.recv(min(n - len(data), 65536))
+			if not more:
+				return None
+			data = data + more
+		return data
+	files = 0
+	bad = 0
+	while True:
+		head = recvAll(18)
+		if head is None:
+			return None
+		size, mtime, nameLen = struct.unpack(">QQH", head)
+		if nameLen == 0:
+			return files, mtime, bad
+		name = recvAll(nameLen)
+		if name is None:
+			return None
+		fileName = os.path.normpath(name.decode("utf-8")).lstrip("/")
+		keep = fileName != ".." and not fileName.startswith("../")
+		if keep:
+			if os.path.dirname(fileName) and not os.path.isdir(os.path.dirname(fileName)):
+				os.makedirs(os.path.dirname(fileName))
+			file = open(fileName, "wb")
+		while size > 0:
+			data = recvAll(min(size, 65536))
+			if data is None:
+				return None
+			if keep:
+				file.write(data)
+			size = size - len(data)
+		tail = recvAll(5)
+		if tail is None:
+			return None
+		summed, crc = struct.unpack(">BI", tail)
+		if keep:
+			file.close()
+			os.utime(fileName, (mtime, mtime))
+			if summed and crc32c(fileName) != "%08x" % crc:
+				print("CRC32C mismatch: {0}".format(fileName))
+				bad = bad + 1
+			files = files + 1
+
+
+#****************************************************************************************#
+# Function:			sendFile(dataSocket, fileName, offset)
+# Description:		Uploads a local file to the server, from offset on
+# Parameters:		dataSocket, fileName, the offset the server asked for
+# Pre-Conditions:	The server accepted the put and connected
+# Post-Conditions:	The rest of the file is written to the data socket
+#****************************************************************************************#
+def sendFile(dataSocket, fileName, offset):
+	file = open(fileName, "rb")
+	file.seek(offset)
+	data = file.read(65536)
+	while (data):
+		dataSocket.sendall(data)
+		data = file.read(65536)
+	file.close()
+
+
+#****************************************************************************************#
+# Function:			getStripe(verify, fileName, fd, offset, length, results, index)
+# Description:		Fetches one stripe of a striped download on its own control session:
+#					logs in (line mode), asks for the byte range with a passive data port,
+#					then writes what arrives at its offset in the preallocated file
+# Parameters:		username/password, the file, an open descriptor of the local copy,
+#					the byte range, and where to report the bytes received
+# Pre-Conditions:	The server supports ranged gets and passive data ports
+# Post-Conditions:	results[index] holds the bytes written, or -1 on error
+#****************************************************************************************#
+def getStripe(verify, fileName, fd, offset, length, results, index):
+	results[index] = -1
+	ctrlSocket = ctrlConnectServer()
+	replies = ctrlSocket.makefile("rb")
+	ctrlSocket.sendall((verify + "\n").encode("utf-8"))
+	if "verified" not in replies.readline():
+		ctrlSocket.close()
+		return
+	cmd = "#{0} {1} {2} -g {3} pasv {4} {5}\n".format(index, sys.argv[1], getClientIP(ctrlSocket), fileName, offset, length)
+	ctrlSocket.sendall(cmd.encode("utf-8"))
+	reply = replies.readline()
+	if "ERROR" in reply:
+		print(reply.strip())
+		ctrlSocket.close()
+		return
+	passive = replies.readline().split()
+	dataSocket = socket(AF_INET, SOCK_STREAM)
+	dataSocket.connect((sys.argv[1], int(passive[2])))
+	received = 0
+	dataRecv = dataSocket.recv(65536)
+	while dataRecv:
+		#positioned write: each stream has its own descriptor and file offset
+		os.lseek(fd, offset + received, os.SEEK_SET)
+		written = 0
+		while written < len(dataRecv):
+			written += os.write(fd, dataRecv[written:])
+		received += len(dataRecv)
+		dataRecv = dataSocket.recv(65536)
+	dataSocket.close()
+	if "DONE" in replies.readline():
+		results[index] = received
+	ctrlSocket.close()
+
+
+#****************************************************************************************#
+# Function:			stripedGet(verify, fileName, fileSize, streams)
+# Description:		Downloads a file as disjoint byte ranges over parallel data streams,
+#					one control session each, and reassembles it in place
+# Parameters:		username/password, the file, its size on the server, stream count
+# Post-Conditions:	The file is written to the current directory, or an error is printed
+#****************************************************************************************#
+def stripedGet(verify, fileName, fileSize, streams):
+	stripe = (fileSize + streams - 1) // streams
+	if stripe == 0:
+		stripe = 1
+	fd = os.open(fileName, os.O_WRONLY | os.O_CREAT, 0644)
+	os.ftruncate(fd, fileSize) #preallocate, the stripes land at their own offsets
+	os.close(fd)
+	threads = []
+	fds = []
+	results = [0] * streams
+	for i in range(streams):
+		offset = i * stripe
+		if offset >= fileSize:
+			break
+		length = min(stripe, fileSize - offset)
+		fds.append(os.open(fileName, os.O_WRONLY))
+		t = threading.Thread(target = getStripe, args = (verify, fileName, fds[i], offset, length, results, i))
+		t.start()
+		threads.append(t)
+	for t in threads:
+		t.join()
+	for fd in fds:
+		os.close(fd)
+	if -1 in results:
+		print("File Transfer Failed.")
+	else:
+		print("File Transfer Complete: {0} bytes over {1} streams.".format(sum(results), len(threads)))
 
 
 #****************************************************************************************#
@@ -194,7 +524,7 @@ if __name__ == "__main__":
 	ctrlSocket = ctrlConnectServer()
 	
 	# send client username/password to server
-	verifyUser(ctrlSocket)
+	verify = verifyUser(ctrlSocket)
 	
 	# send command to server
 	sendCommand(ctrlSocket)
@@ -231,6 +561,98 @@ if __name__ == "__main__":
                 		receiveFile(dataSocket, fileName)
             		print("File Transfer Complete.")
             		dataSocket.close()
+		#command -r: resume a partial download, append the rest
+	elif sys.argv[3] == "-r":
+		fileName = sys.argv[4]
+		dataPort = int(sys.argv[5])
+		print("Resuming file transfer: {0} from {1}:{2}".format(fileName, sys.argv[1], dataPort))
+		fileStat = ctrlSocket.recv(1024)
+		print("Message from {0}:{1}: {2}".format(sys.argv[1], sys.argv[2], fileStat.decode("utf-8")))
+		if "ERROR" not in fileStat.decode("utf-8"):
+			dataSocket = dataSocketSetup(dataPort)
+			receiveFile(dataSocket, fileName, "a")
+			print("File Transfer Complete.")
+			dataSocket.close()
+		#command -z: get, compressed on the wire if the server thinks it's worth it
+	elif sys.argv[3] == "-z":
+		fileName = sys.argv[4]
+		dataPort = int(sys.argv[5])
+		print("Requesting compressed file transfer: {0} from {1}:{2}".format(fileName, sys.argv[1], dataPort))
+		fileStat = ctrlSocket.recv(1024)
+		print("Message from {0}:{1}: {2}".format(sys.argv[1], sys.argv[2], fileStat.decode("utf-8")))
+		if "ERROR" not in fileStat.decode("utf-8"):
+			dataSocket = dataSocketSetup(dataPort)
+			if "(gzip)" in fileStat.decode("utf-8"):
+				receiveCompressed(dataSocket, fileName)
+			else:
+				receiveFile(dataSocket, fileName)
+			print("File Transfer Complete.")
+			dataSocket.close()
+		#command -d: get, sending only what differs from the local copy
+	elif sys.argv[3] == "-d":
+		fileName = sys.argv[4]
+		dataPort = int(sys.argv[5])
+		blockSize, blocks = deltaBlocks(fileName)
+		print("Requesting delta transfer: {0} from {1}:{2} ({3} blocks of {4} bytes)".format(fileName, sys.argv[1], dataPort, blocks, blockSize))
+		fileStat = ctrlSocket.recv(1024)
+		print("Message from {0}:{1}: {2}".format(sys.argv[1], sys.argv[2], fileStat.decode("utf-8")))
+		if "ERROR" not in fileStat.decode("utf-8"):
+			dataSocket = dataSocketSetup(dataPort)
+			sendSignatures(dataSocket, fileName, blockSize, blocks)
+			crc = receiveDelta(dataSocket, fileName, blockSize)
+			if crc is None:
+				print("File Transfer Failed.")
+			else:
+				print("File Transfer Complete. CRC32C {0}".format(crc))
+			dataSocket.close()
+		#command -p: put a local file on the server
+	elif sys.argv[3] == "-p":
+		fileName = sys.argv[4]
+		dataPort = int(sys.argv[5])
+		print("Uploading file: {0} to {1}:{2}".format(fileName, sys.argv[1], dataPort))
+		fileStat = ctrlSocket.recv(1024)
+		print("Message from {0}:{1}: {2}".format(sys.argv[1], sys.argv[2], fileStat.decode("utf-8")))
+		if "ERROR" not in fileStat.decode("utf-8"):
+			offset = int(fileStat.decode("utf-8").split("(bytes ")[1].split("-")[0])
+			dataSocket = dataSocketSetup(dataPort)
+			sendFile(dataSocket, fileName, offset)
+			print("File Upload Complete.")
+			dataSocket.close()
+		#command -m: batch get, every file the pattern names on one data connection
+	elif sys.argv[3] == "-m":
+		dataPort = int(sys.argv[5])
+		print("Requesting batch transfer: {0} from {1}:{2}".format(sys.argv[4], sys.argv[1], dataPort))
+		fileStat = ctrlSocket.recv(1024)
+		print("Message from {0}:{1}: {2}".format(sys.argv[1], sys.argv[2], fileStat.decode("utf-8")))
+		if "ERROR" not in fileStat.decode("utf-8"):
+			dataSocket = dataSocketSetup(dataPort)
+			result = receiveBatch(dataSocket)
+			if result is None:
+				print("Batch Transfer Failed.")
+			else:
+				print("Batch Transfer Complete. {0} files, {1} skipped, {2} bad checksums".format(result[0], result[1], result[2]))
+			dataSocket.close()
+		#command -c: does the server have the same file as we do
+	elif sys.argv[3] == "-c":
+		fileName = sys.argv[4]
+		fileSum = ctrlSocket.recv(1024).decode("utf-8")
+		if "ERROR" in fileSum:
+			print("Message from {0}:{1}: {2}".format(sys.argv[1], sys.argv[2], fileSum))
+		elif not os.path.exists(fileName):
+			print("Server: {0} (no local copy)".format(fileSum))
+		elif fileSum.split()[3] == crc32c(fileName):
+			print("Same file: CRC32C {0}".format(fileSum.split()[3]))
+		else:
+			print("Files differ: server CRC32C {0}, local CRC32C {1}".format(fileSum.split()[3], crc32c(fileName)))
+		#command -s: striped download over parallel streams
+	elif sys.argv[3] == "-s":
+		fileName = sys.argv[4]
+		fileSize = ctrlSocket.recv(1024).decode("utf-8")
+		if "ERROR" in fileSize:
+			print("Message from {0}:{1}: {2}".format(sys.argv[1], sys.argv[2], fileSize))
+		else:
+			print("Requesting striped file transfer: {0} ({1} bytes) over {2} streams".format(fileName, fileSize.split()[1], sys.argv[5]))
+			stripedGet(verify, fileName, int(fileSize.split()[1]), int(sys.argv[5]))
 		#command cd: change directory
     	elif sys.argv[3] == "cd":
         	newDir = sys.argv[4]
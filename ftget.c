@@ -0,0 +1,134 @@
+/*******************************************************************************************
+ * Author:		Keisha Arnold
+ * Filename: 	ftget.c
+ * Description: Command line front end of libft (ftlib.h): fetches any number of files
+ *              from ftserver concurrently over a pool of connections.
+ * Usage:       ftget [-c connections] [-u user] [-o dir] <host> <port> [file...]
+ *              With no files on the command line the names are read from stdin, one per
+ *              line. Each file is written to dir (default .) under the last component
+ *              of its name. The password is $FT_PASSWORD (default "pass"). Exits 1 if
+ *              any get failed, after reporting each failure on stderr.
+ ********************************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "ftlib.h"
+
+/*******************************************************************************************
+ * Function:        double now(void)
+ * Returns:         seconds on the monotonic clock
+ ********************************************************************************************/
+static double now(void) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*******************************************************************************************
+ * Function:        int addGet(struct ftGet** gets, int* count, int* cap, const char* name, const char* dir)
+ * Description:		Appends a get of name, written to dir/<last component of name>
+ * Returns:         0, -1 if out of memory
+ ********************************************************************************************/
+static int addGet(struct ftGet** gets, int* count, int* cap, const char* name, const char* dir) {
+	struct ftGet* more;
+	const char* leaf = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+	char* remote = strdup(name);
+	char* local = NULL;
+
+	if (*count == *cap) {
+		*cap = *cap ? 2 * *cap : 64;
+		more = realloc(*gets, *cap * sizeof(**gets));
+		if (more == NULL) {
+			free(remote);
+			return -1;
+		}
+		*gets = more;
+	}
+	if (remote == NULL || asprintf(&local, "%s/%s", dir, leaf) < 0) {
+		free(remote);
+		return -1;
+	}
+	memset(&(*gets)[*count], 0, sizeof(**gets));
+	(*gets)[*count].remote = remote;
+	(*gets)[*count].local = local;
+	(*count)++;
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct ftOptions options;
+	struct ftClient* client;
+	struct ftGet* gets = NULL;
+	const char* dir = ".";
+	char error[FT_MESSAGE_LEN];
+	char* line = NULL;
+	size_t lineCap = 0;
+	ssize_t lineLen;
+	long long bytes = 0;
+	double start;
+	double seconds;
+	int count = 0;
+	int cap = 0;
+	int failed;
+	int opt;
+	int i;
+
+	memset(&options, 0, sizeof(options));
+	options.password = getenv("FT_PASSWORD");
+	while ((opt = getopt(argc, argv, "c:u:o:")) != -1) {
+		switch (opt) {
+		case 'c': options.connections = atoi(optarg); break;
+		case 'u': options.user = optarg; break;
+		case 'o': dir = optarg; break;
+		default: optind = argc; break;	//usage below
+		}
+	}
+	if (argc - optind < 2) {
+		fprintf(stderr, "USAGE: %s [-c connections] [-u user] [-o dir] <host> <port> [file...]\n", argv[0]);
+		exit(1);
+	}
+	options.host = argv[optind];
+	options.port = atoi(argv[optind + 1]);
+	for (i = optind + 2; i < argc; i++) {
+		if (addGet(&gets, &count, &cap, argv[i], dir) < 0) {
+			perror("ftget");
+			exit(1);
+		}
+	}
+	while (optind + 2 == argc && (lineLen = getline(&line, &lineCap, stdin)) > 0) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] != '\0' && addGet(&gets, &count, &cap, line, dir) < 0) {
+			perror("ftget");
+			exit(1);
+		}
+	}
+	free(line);
+
+	start = now();
+	client = ftClientOpen(&options, error, sizeof(error));
+	if (client == NULL) {
+		fprintf(stderr, "ftget: %s:%d: %s\n", options.host, options.port, error);
+		exit(1);
+	}
+	failed = ftClientGetAll(client, gets, count);
+	ftClientClose(client);
+	seconds = now() - start;
+
+	for (i = 0; i < count; i++) {
+		if (gets[i].failed) {
+			fprintf(stderr, "ftget: %s: %s\n", gets[i].remote, gets[i].message);
+		}
+		bytes += gets[i].bytes;
+		free((char*)gets[i].remote);
+		free((char*)gets[i].local);
+	}
+	free(gets);
+	printf("%d files, %lld bytes in %.3fs (%.1f MB/s), %d failed\n", count - failed, bytes, seconds,
+		   seconds > 0 ? bytes / seconds / (1024 * 1024) : 0.0, failed);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,520 @@
+/*******************************************************************************************
+ * Author:		Keisha Arnold
+ * Filename: 	ftlib.c
+ * Description: Native client library for ftserver, see ftlib.h.
+ *              Every connection of the pool is driven by its own thread with blocking
+ *              sockets: ftClientGetAll() runs one per connection (the caller's thread is
+ *              the first) and each takes the next get off the list until none are left.
+ *              A get asks for the file inline (FT_FLAG_INLINE), so it costs one round trip
+ *              and no data connection, and each FT_DATA payload goes socket -> pipe ->
+ *              file with splice(2). Sockets that can't splice fall back to 1MB recv()s.
+ ********************************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "ftproto.h"
+#include "ftlib.h"
+
+#define PIPE_SIZE		FT_MAX_DATA			//one FT_DATA payload fills the pipe
+#define RECV_BUF		FT_MAX_DATA			//fallback when the socket can't splice
+#define PART_SUFFIX		".ftpart"			//a file still arriving
+
+struct ftConn {
+	int fd;						//-1: not connected (lost, reopened by the next get)
+	int pipeFD[2];				//-1: the socket can't splice, buffer is used
+	char* buffer;				//RECV_BUF, allocated the first time it's needed
+	uint32_t requestID;
+	struct ftClient* client;
+	pthread_t thread;
+};
+
+struct sink {					//where the bytes of a get go
+	int fd;
+	off_t offset;
+	int error;					//errno of the first failed write, the rest is discarded
+};
+
+struct ftClient {
+	pthread_mutex_t lock;		//one ftClientGetAll() at a time
+	struct sockaddr_in server;
+	char login[FT_MAX_PAYLOAD];	//FT_HELLO payload, "<user>\0<password>"
+	size_t loginLen;
+	struct ftConn* conns;
+	int count;
+	struct ftGet* gets;			//of the current ftClientGetAll()
+	int total;
+	int next;					//next get to start, taken atomically
+};
+
+/*******************************************************************************************
+ * Function:        int sendAll(int fd, const void* buf, size_t len)
+ * Returns:         0 once all of buf is sent, -1 on failure
+ ********************************************************************************************/
+static int sendAll(int fd, const void* buf, size_t len) {
+	const char* p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        int recvAll(int fd, void* buf, size_t len)
+ * Returns:         0 once len bytes are in buf, -1 on failure or EOF
+ ********************************************************************************************/
+static int recvAll(int fd, void* buf, size_t len) {
+	char* p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = recv(fd, p, len, 0);
+		if (n == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        int readFrame(struct ftConn* c, struct ftHeader* h, unsigned char* payload)
+ * Description:		Reads the next frame's header and, unless it's FT_DATA (which the caller
+ *                  moves straight to the file), its payload
+ * Parameters:		payload has room for FT_MAX_PAYLOAD + 1 bytes, a '\0' is added
+ * Returns:         0, -1 if the connection failed or the frame isn't valid
+ ********************************************************************************************/
+static int readFrame(struct ftConn* c, struct ftHeader* h, unsigned char* payload) {
+	unsigned char head[FT_HEADER_LEN];
+
+	if (recvAll(c->fd, head, sizeof(head)) < 0) {
+		return -1;
+	}
+	if (ftDecodeHeader(head, sizeof(head), h) < 0 || h->requestID != c->requestID) {
+		errno = EPROTO;
+		return -1;
+	}
+	if (h->type == FT_DATA) {
+		return 0;
+	}
+	if (recvAll(c->fd, payload, h->length) < 0) {
+		return -1;
+	}
+	payload[h->length] = '\0';
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        int sendFrame(struct ftConn* c, int type, const void* payload, size_t len)
+ * Description:		Sends one frame with the connection's current request id
+ ********************************************************************************************/
+static int sendFrame(struct ftConn* c, int type, const void* payload, size_t len) {
+	unsigned char frame[FT_HEADER_LEN + FT_MAX_PAYLOAD];
+
+	ftEncodeHeader(frame, type, c->requestID, len);
+	memcpy(frame + FT_HEADER_LEN, payload, len);
+	return sendAll(c->fd, frame, FT_HEADER_LEN + len);
+}
+
+/*******************************************************************************************
+ * Function:        void statusText(const struct ftHeader* h, const unsigned char* payload, char* out)
+ * Description:		Copies an FT_STATUS frame's message into a FT_MESSAGE_LEN buffer
+ ********************************************************************************************/
+static void statusText(const struct ftHeader* h, const unsigned char* payload, char* out) {
+	snprintf(out, FT_MESSAGE_LEN, "%.*s", FT_MESSAGE_LEN - 1,
+			 h->length > FT_STATUS_LEN ? (const char*)payload + FT_STATUS_LEN : "");
+}
+
+/*******************************************************************************************
+ * Function:        void connClose(struct ftConn* c, int quit)
+ * Description:		Closes a connection, telling the server first (FT_OP_QUIT) if quit is set
+ ********************************************************************************************/
+static void connClose(struct ftConn* c, int quit) {
+	unsigned char cmd[FT_COMMAND_LEN] = { FT_OP_QUIT, 0, 0, 0 };
+
+	if (c->fd >= 0) {
+		if (quit) {
+			c->requestID++;
+			sendFrame(c, FT_COMMAND, cmd, sizeof(cmd));
+		}
+		close(c->fd);
+		c->fd = -1;
+	}
+	if (c->pipeFD[0] >= 0) {
+		close(c->pipeFD[0]);
+		close(c->pipeFD[1]);
+		c->pipeFD[0] = c->pipeFD[1] = -1;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        int connOpen(struct ftConn* c, char* error, size_t errorLen)
+ * Description:		Connects and logs in one connection of the pool, with a pipe to splice
+ *                  its data through
+ * Returns:         0, -1 on failure (error says why)
+ ********************************************************************************************/
+static int connOpen(struct ftConn* c, char* error, size_t errorLen) {
+	unsigned char payload[FT_MAX_PAYLOAD + 1];
+	struct ftHeader h;
+	char message[FT_MESSAGE_LEN];
+	int one = 1;
+
+	c->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (c->fd < 0 || connect(c->fd, (struct sockaddr *)&c->client->server, sizeof(c->client->server)) < 0) {
+		snprintf(error, errorLen, "can't connect: %s", strerror(errno));
+		connClose(c, 0);
+		return -1;
+	}
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	c->requestID = 0;
+	if (sendFrame(c, FT_HELLO, c->client->login, c->client->loginLen) < 0 || readFrame(c, &h, payload) < 0 ||
+			h.type != FT_STATUS || h.length < FT_STATUS_LEN) {
+		snprintf(error, errorLen, "login failed: %s", strerror(errno == 0 ? EPROTO : errno));
+		connClose(c, 0);
+		return -1;
+	}
+	if (payload[0] != FT_OK) {
+		statusText(&h, payload, message);
+		snprintf(error, errorLen, "%s", message);
+		connClose(c, 0);
+		return -1;
+	}
+	if (pipe2(c->pipeFD, O_CLOEXEC) == 0) {
+		fcntl(c->pipeFD[1], F_SETPIPE_SZ, PIPE_SIZE);	//best effort, default is 64K
+	}
+	else {
+		c->pipeFD[0] = c->pipeFD[1] = -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        void sinkWrite(struct sink* out, const char* buf, size_t len)
+ * Description:		Writes received bytes at the sink's offset. After a failed write the
+ *                  rest of the get is read and dropped so the connection stays in step.
+ ********************************************************************************************/
+static void sinkWrite(struct sink* out, const char* buf, size_t len) {
+	ssize_t n;
+
+	while (len > 0 && out->error == 0) {
+		n = pwrite(out->fd, buf, len, out->offset);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			out->error = errno;
+			return;
+		}
+		buf += n;
+		len -= n;
+		out->offset += n;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        int receiveData(struct ftConn* c, uint32_t len, struct sink* out)
+ * Description:		Moves one FT_DATA payload from the socket to the file: spliced through
+ *                  the connection's pipe, or read into the buffer when the socket (or the
+ *                  file) doesn't splice or the file is past saving
+ * Returns:         0, -1 if the connection failed
+ ********************************************************************************************/
+static int receiveData(struct ftConn* c, uint32_t len, struct sink* out) {
+	ssize_t n;
+	ssize_t m;
+
+	while (len > 0 && c->pipeFD[0] >= 0 && out->error == 0) {
+		n = splice(c->fd, NULL, c->pipeFD[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EINVAL || errno == EOPNOTSUPP)) {
+			close(c->pipeFD[0]);		//the socket can't splice, the pipe is empty
+			close(c->pipeFD[1]);
+			c->pipeFD[0] = c->pipeFD[1] = -1;
+			break;
+		}
+		if (n <= 0) {
+			if (n == 0) errno = ECONNRESET;
+			return -1;
+		}
+		len -= n;
+		while (n > 0) {
+			m = out->error ? -1 : splice(c->pipeFD[0], NULL, out->fd, &out->offset, n, SPLICE_F_MOVE);
+			if (m < 0 && errno == EINTR && out->error == 0) continue;
+			if (m <= 0) {		//the file is full or can't splice: copy what's in the pipe
+				if (c->buffer == NULL && (c->buffer = malloc(RECV_BUF)) == NULL) {
+					return -1;
+				}
+				m = read(c->pipeFD[0], c->buffer, n);
+				if (m <= 0) {
+					return -1;
+				}
+				sinkWrite(out, c->buffer, m);
+			}
+			n -= m;
+		}
+	}
+	if (len > 0 && c->buffer == NULL && (c->buffer = malloc(RECV_BUF)) == NULL) {
+		return -1;
+	}
+	while (len > 0) {
+		n = recv(c->fd, c->buffer, len < RECV_BUF ? len : RECV_BUF, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			if (n == 0) errno = ECONNRESET;
+			return -1;
+		}
+		sinkWrite(out, c->buffer, n);
+		len -= n;
+	}
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        int connGet(struct ftConn* c, struct ftGet* g)
+ * Description:		One get on one connection: the file (or range) is preallocated from the
+ *                  size in FT_OK, written as <local>.ftpart and renamed over local once the
+ *                  server's FT_DONE says it's all there
+ * Returns:         0 whether or not the get worked (g says), -1 if the connection is lost
+ ********************************************************************************************/
+static int connGet(struct ftConn* c, struct ftGet* g) {
+	unsigned char cmd[FT_MAX_PAYLOAD];
+	unsigned char payload[FT_MAX_PAYLOAD + 1];
+	char part[4096];
+	const char* crc;
+	struct ftHeader h;
+	struct sink out = { -1, 0, 0 };
+	size_t nameLen = strlen(g->remote);
+	size_t len = FT_COMMAND_LEN;
+	long long size;
+
+	g->failed = 1;
+	if (nameLen > sizeof(cmd) - FT_COMMAND_LEN - FT_RANGE_LEN ||
+			snprintf(part, sizeof(part), "%s%s", g->local, PART_SUFFIX) >= (int)sizeof(part)) {
+		snprintf(g->message, FT_MESSAGE_LEN, "name too long");
+		return 0;
+	}
+	cmd[0] = FT_OP_GET;
+	cmd[1] = FT_FLAG_INLINE;
+	ftPut16(cmd + 2, 0);
+	if (g->offset != 0 || g->length != 0) {
+		cmd[1] |= FT_FLAG_RANGE;
+		ftPut64(cmd + len, g->offset);
+		ftPut64(cmd + len + 8, g->length);
+		len += FT_RANGE_LEN;
+	}
+	memcpy(cmd + len, g->remote, nameLen);
+	len += nameLen;
+	c->requestID++;
+	if (sendFrame(c, FT_COMMAND, cmd, len) < 0 || readFrame(c, &h, payload) < 0 ||
+			h.type != FT_STATUS || h.length < FT_STATUS_LEN) {
+		return -1;
+	}
+	if (payload[0] != FT_OK) {
+		statusText(&h, payload, g->message);
+		return 0;
+	}
+	size = ftGet64(payload + 4);
+
+	out.fd = open(part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out.fd < 0) {
+		out.error = errno;		//the data still has to be read
+	}
+	else if (size > 0 && fallocate(out.fd, 0, 0, size) < 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+		out.error = errno;		//no room for it
+	}
+	while (1) {
+		if (readFrame(c, &h, payload) < 0 || (h.type == FT_DATA && receiveData(c, h.length, &out) < 0)) {
+			if (out.fd >= 0) {
+				close(out.fd);
+				unlink(part);
+			}
+			return -1;
+		}
+		if (h.type == FT_STATUS && h.length >= FT_STATUS_LEN) {
+			break;
+		}
+		if (h.type != FT_DATA) {
+			errno = EPROTO;
+			if (out.fd >= 0) {
+				close(out.fd);
+				unlink(part);
+			}
+			return -1;
+		}
+	}
+	g->bytes = out.offset;
+	statusText(&h, payload, g->message);
+	if (payload[0] == FT_DONE) {
+		crc = strstr(g->message, "CRC32C ");
+		g->summed = crc != NULL && sscanf(crc + 7, "%x", &g->crc) == 1;
+	}
+	if (out.fd >= 0 && close(out.fd) < 0 && out.error == 0) {
+		out.error = errno;
+	}
+	if (payload[0] == FT_DONE && out.error == 0 && out.offset == size && rename(part, g->local) == 0) {
+		g->failed = 0;
+		g->message[0] = '\0';
+		return 0;
+	}
+	if (payload[0] == FT_DONE) {
+		snprintf(g->message, FT_MESSAGE_LEN, "%s: %s", g->local,
+				 out.error ? strerror(out.error) : out.offset != size ? "short transfer" : strerror(errno));
+	}
+	unlink(part);
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        void* connMain(void* arg)
+ * Description:		Runs gets on one connection until the client's list is used up. A lost
+ *                  connection fails the get it was on and is reopened for the next one.
+ ********************************************************************************************/
+static void* connMain(void* arg) {
+	struct ftConn* c = arg;
+	struct ftClient* client = c->client;
+	struct ftGet* g;
+	char error[FT_MESSAGE_LEN];
+	int i;
+
+	while ((i = __atomic_fetch_add(&client->next, 1, __ATOMIC_RELAXED)) < client->total) {
+		g = &client->gets[i];
+		g->failed = 1;
+		g->bytes = 0;
+		g->summed = 0;
+		g->message[0] = '\0';
+		if (c->fd < 0 && connOpen(c, error, sizeof(error)) < 0) {
+			snprintf(g->message, FT_MESSAGE_LEN, "%s", error);
+			continue;
+		}
+		if (connGet(c, g) < 0) {
+			snprintf(g->message, FT_MESSAGE_LEN, "connection lost: %s", strerror(errno));
+			connClose(c, 0);
+		}
+	}
+	return NULL;
+}
+
+struct ftClient* ftClientOpen(const struct ftOptions* options, char* error, size_t errorLen) {
+	struct addrinfo hints;
+	struct addrinfo* found;
+	struct ftClient* client;
+	const char* user = options->user ? options->user : "client";
+	const char* password = options->password ? options->password : "pass";
+	int count = options->connections ? options->connections : FT_DEFAULT_CONNECTIONS;
+	int i;
+
+	if (count < 1 || count > FT_MAX_CONNECTIONS || options->port < 1 || options->port > 65535 ||
+			strlen(user) + 1 + strlen(password) > FT_MAX_PAYLOAD) {
+		snprintf(error, errorLen, "bad options");
+		return NULL;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	i = getaddrinfo(options->host, NULL, &hints, &found);
+	if (i != 0) {
+		snprintf(error, errorLen, "%s: %s", options->host, gai_strerror(i));
+		return NULL;
+	}
+	client = calloc(1, sizeof(*client));
+	if (client == NULL || (client->conns = calloc(count, sizeof(*client->conns))) == NULL) {
+		freeaddrinfo(found);
+		free(client);
+		snprintf(error, errorLen, "out of memory");
+		return NULL;
+	}
+	pthread_mutex_init(&client->lock, NULL);
+	memcpy(&client->server, found->ai_addr, sizeof(client->server));
+	client->server.sin_port = htons(options->port);
+	freeaddrinfo(found);
+	client->loginLen = strlen(user) + 1 + strlen(password);
+	memcpy(client->login, user, strlen(user) + 1);
+	memcpy(client->login + strlen(user) + 1, password, strlen(password));
+	client->count = count;
+	for (i = 0; i < count; i++) {
+		client->conns[i].client = client;
+		client->conns[i].fd = -1;
+		client->conns[i].pipeFD[0] = client->conns[i].pipeFD[1] = -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (connOpen(&client->conns[i], error, errorLen) < 0) {
+			ftClientClose(client);
+			return NULL;
+		}
+	}
+	return client;
+}
+
+int ftClientGetAll(struct ftClient* client, struct ftGet* gets, int count) {
+	int threads = count < client->count ? count : client->count;
+	int failed = 0;
+	int i;
+
+	pthread_mutex_lock(&client->lock);
+	client->gets = gets;
+	client->total = count;
+	client->next = 0;
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&client->conns[i].thread, NULL, connMain, &client->conns[i]) != 0) {
+			threads = i;		//the ones running take the rest
+			break;
+		}
+	}
+	connMain(&client->conns[0]);
+	for (i = 1; i < threads; i++) {
+		pthread_join(client->conns[i].thread, NULL);
+	}
+	client->gets = NULL;
+	pthread_mutex_unlock(&client->lock);
+	for (i = 0; i < count; i++) {
+		failed += gets[i].failed;
+	}
+	return failed;
+}
+
+int ftClientGet(struct ftClient* client, const char* remote, const char* local) {
+	struct ftGet g;
+
+	memset(&g, 0, sizeof(g));
+	g.remote = remote;
+	g.local = local;
+	return ftClientGetAll(client, &g, 1) == 0 ? 0 : -1;
+}
+
+void ftClientClose(struct ftClient* client) {
+	int i;
+
+	if (client == NULL) {
+		return;
+	}
+	for (i = 0; i < client->count; i++) {
+		connClose(&client->conns[i], 1);
+		free(client->conns[i].buffer);
+	}
+	pthread_mutex_destroy(&client->lock);
+	free(client->conns);
+	free(client);
+}
@@ -0,0 +1,85 @@
+/*******************************************************************************************
+ * Author:		Keisha Arnold
+ * Filename: 	ftlib.h
+ * Description: Native client library for ftserver (libft.a), for programs that fetch
+ *              files in-process instead of running ftclient.py once per file.
+ *
+ *              A client is a pool of logged in framed connections (ftproto.h) to one
+ *              server. ftClientGetAll() spreads a list of gets over the pool, each
+ *              connection fetching the next file as soon as its last one is done. The
+ *              data comes back inline on the control connection and every FT_DATA
+ *              payload is spliced from the socket into the local file (preallocated
+ *              from the size in FT_OK), so file bytes never pass through user space.
+ *              A file is written as "<local>.ftpart" and renamed once it's complete.
+ *
+ *                  struct ftOptions o = { .host = "build-cache", .port = 5988, .connections = 8 };
+ *                  struct ftClient* c = ftClientOpen(&o, error, sizeof(error));
+ *                  failed = ftClientGetAll(c, gets, count);
+ *                  ftClientClose(c);
+ *
+ *              A client may be used from several threads, ftClientGetAll() calls take
+ *              turns. Cleartext only: servers started with -S refuse it.
+ ********************************************************************************************/
+#ifndef FTLIB_H
+#define FTLIB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FT_DEFAULT_CONNECTIONS	4
+#define FT_MAX_CONNECTIONS		64
+#define FT_MESSAGE_LEN			128
+
+struct ftClient;
+
+struct ftOptions {
+	const char* host;			//name or IPv4 address of the server
+	int port;
+	const char* user;			//NULL: "client"
+	const char* password;		//NULL: "pass"
+	int connections;			//size of the pool, 0: FT_DEFAULT_CONNECTIONS
+};
+
+struct ftGet {
+	const char* remote;			//file name on the server, relative to its directory
+	const char* local;			//where it's written, replaced if it's there
+	long long offset;			//a range of the file, length 0 = to EOF
+	long long length;
+	// filled in by ftClientGet()/ftClientGetAll()
+	int failed;					//0: local holds the file (or range)
+	long long bytes;			//bytes written
+	int summed;					//the server knew the file's CRC32C
+	uint32_t crc;
+	char message[FT_MESSAGE_LEN];	//the server's error or what went wrong, "" if nothing
+};
+
+/*******************************************************************************************
+ * Function:        struct ftClient* ftClientOpen(const struct ftOptions* options, char* error, size_t errorLen)
+ * Description:		Connects and logs in the pool's connections
+ * Returns:         the client, NULL if the server can't be reached or refused the login
+ *                  (error says why)
+ ********************************************************************************************/
+struct ftClient* ftClientOpen(const struct ftOptions* options, char* error, size_t errorLen);
+
+/*******************************************************************************************
+ * Function:        int ftClientGetAll(struct ftClient* client, struct ftGet* gets, int count)
+ * Description:		Fetches count files concurrently over the pool. A connection that is lost
+ *                  fails the get it was on and is reopened for the rest.
+ * Returns:         the number of gets that failed
+ ********************************************************************************************/
+int ftClientGetAll(struct ftClient* client, struct ftGet* gets, int count);
+
+/*******************************************************************************************
+ * Function:        int ftClientGet(struct ftClient* client, const char* remote, const char* local)
+ * Description:		Fetches one whole file on the first connection of the pool
+ * Returns:         0, -1 on failure
+ ********************************************************************************************/
+int ftClientGet(struct ftClient* client, const char* remote, const char* local);
+
+/*******************************************************************************************
+ * Function:        void ftClientClose(struct ftClient* client)
+ * Description:		Says goodbye on every connection and frees the client
+ ********************************************************************************************/
+void ftClientClose(struct ftClient* client);
+
+#endif
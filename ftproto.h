@@ -0,0 +1,178 @@
+/*******************************************************************************************
+ * Author:		Keisha Arnold
+ * Filename: 	ftproto.h
+ * Description: Wire format of the framed (binary) file transfer protocol, shared by
+ *              the server and native clients.
+ *
+ *              Every message on the control connection is a frame: a fixed 12 byte
+ *              header followed by length bytes of payload. All integers are big endian.
+ *
+ *                0      2      3      4             8             12
+ *                +------+------+------+-------------+-------------+----------
+ *                |magic |vers  |type  | request id  | length      | payload
+ *                +------+------+------+-------------+-------------+----------
+ *
+ *              The magic's first byte (0xF7) is never the first byte of a legacy text
+ *              login, so the server tells the two protocols apart from the first byte.
+ *              A client opens with FT_HELLO, then sends FT_COMMANDs; the server answers
+ *              each command with FT_STATUS frames carrying the command's request id.
+ *              Payloads are never scanned for terminators, so any byte value is fine.
+ ********************************************************************************************/
+#ifndef FTPROTO_H
+#define FTPROTO_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define FT_MAGIC		0xF71Eu
+#define FT_VERSION		1
+#define FT_HEADER_LEN	12
+#define FT_MAX_PAYLOAD	(2048 - 1 - FT_HEADER_LEN)	//a frame always fits the server's input buffer
+												//(2048 bytes, one kept for a terminating NUL)
+#define FT_MAX_DATA		(1024 * 1024)			//FT_DATA frames are streamed, not buffered
+
+// frame types
+enum ftType {
+	FT_HELLO = 1,		//client: "<username>\0<password>"
+	FT_COMMAND = 2,		//client: ftCommand + argument
+	FT_STATUS = 3,		//server: ftStatus + message text
+	FT_DATA = 4			//server: file/listing bytes of an FT_FLAG_INLINE command
+};
+
+// FT_COMMAND payload: op(1) flags(1) dataPort(2) argument(rest: file name or directory)
+#define FT_COMMAND_LEN	4
+#define FT_FLAG_PASSIVE	0x01	//server opens the data port, answers FT_PASV with its number
+#define FT_FLAG_INLINE	0x02	//data comes back as FT_DATA frames on this connection
+#define FT_FLAG_RANGE	0x04	//get: argument starts with offset(8) length(8), length 0 = to EOF
+#define FT_RANGE_LEN	16
+#define FT_FLAG_LONG	0x08	//list: "<type> <size> <mtime> <name>\n" per entry
+#define FT_FLAG_COMPRESS 0x10	//get: gzip the data if it's worth it, FT_OK says (encoding)
+enum ftOp {
+	FT_OP_LIST = 1,
+	FT_OP_GET = 2,
+	FT_OP_CD = 3,
+	FT_OP_QUIT = 4,
+	FT_OP_SIZE = 5,			//FT_OK value: file size
+	FT_OP_STATS = 6,		//FT_OK message: server counters
+	FT_OP_SUM = 7,			//FT_OK value: CRC32C of the file
+	FT_OP_DELTA = 8,		//get as a delta against the client's copy, see below
+	FT_OP_PUT = 9,			//upload; argument: size(8) file name. FT_OK value: offset to
+							//send from (a stopped upload resumes), then the client sends
+							//the rest of the file on the data connection and closes it
+	FT_OP_MGET = 10			//batch get, see below
+};
+#define FT_PUT_ARG_LEN		8
+
+// FT_OP_MGET argument: a glob (wildcards in the last component only), a directory (every
+// file under it) or "@<manifest>" (a server file naming one file per line). The data is one
+// stream of entries, each size(8) mtime(8) nameLen(2) name, size bytes of the file, then
+// summed(1) crc(4): the file's CRC32C if summed is 1. An entry with nameLen 0 ends the stream,
+// its size is the number of files sent and its mtime the number skipped (unreadable).
+#define FT_BATCH_HEAD		18
+#define FT_BATCH_TAIL		5
+
+// FT_OP_DELTA argument: blockSize(4) blocks(4) file name. On the data connection the client
+// first writes blocks signatures of its copy's whole blocks, block i at byte i * blockSize:
+// weak(4) md5(16), weak = a | b << 16 with a = sum of the bytes, b = sum of a after each
+// byte, both mod 2^16 (rsync's rolling checksum). The server answers with ops, each
+// type(1) a(4) b(4); the new file is the ops' bytes in order.
+#define FT_DELTA_ARG_LEN	8
+#define FT_SIG_LEN			20
+#define FT_DELTA_HEAD		9
+enum ftDeltaOp {
+	FT_DELTA_END = 0,		//a: CRC32C of the new file, nothing follows
+	FT_DELTA_LITERAL = 1,	//a: length, then that many bytes of the file
+	FT_DELTA_COPY = 2		//a: first block of the client's copy, b: count of blocks
+};
+
+// FT_STATUS payload: code(1) encoding(1) reserved(2) value(8) message(rest)
+#define FT_STATUS_LEN	12
+enum ftStatusCode {
+	FT_OK = 0,			//accepted; value: bytes that will follow on the data connection (get)
+						//or the offset the client's data has to start from (put)
+	FT_DONE = 1,		//data connection closed; value: bytes sent (received for a put);
+						//get: message "DONE <bytes> CRC32C <hex>" of the raw bytes
+	FT_ERROR = 2,		//request failed; value: 0
+	FT_PASV = 3			//passive data port is open; value: its port number
+};
+enum ftEncoding {		//of the data that follows a get
+	FT_ENC_NONE = 0,
+	FT_ENC_GZIP = 1		//one gzip stream (RFC 1952); FT_OK value is still the raw length
+};
+
+struct ftHeader {
+	uint16_t magic;
+	uint8_t version;
+	uint8_t type;
+	uint32_t requestID;
+	uint32_t length;
+};
+
+static inline void ftPut16(unsigned char* p, uint16_t v) {
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static inline void ftPut32(unsigned char* p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static inline void ftPut64(unsigned char* p, uint64_t v) {
+	ftPut32(p, v >> 32);
+	ftPut32(p + 4, (uint32_t)v);
+}
+
+static inline uint16_t ftGet16(const unsigned char* p) {
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t ftGet32(const unsigned char* p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline uint64_t ftGet64(const unsigned char* p) {
+	return (uint64_t)ftGet32(p) << 32 | ftGet32(p + 4);
+}
+
+/*******************************************************************************************
+ * Function:        void ftEncodeHeader(unsigned char* out, int type, uint32_t requestID, uint32_t length)
+ * Description:		Writes a frame header into out (FT_HEADER_LEN bytes)
+ ********************************************************************************************/
+static inline void ftEncodeHeader(unsigned char* out, int type, uint32_t requestID, uint32_t length) {
+	ftPut16(out, FT_MAGIC);
+	out[2] = FT_VERSION;
+	out[3] = type;
+	ftPut32(out + 4, requestID);
+	ftPut32(out + 8, length);
+}
+
+/*******************************************************************************************
+ * Function:        int ftDecodeHeader(const unsigned char* in, size_t avail, struct ftHeader* h)
+ * Description:		Zero-allocation, incremental parse of the frame at the start of in. Never
+ *                  copies the payload, the caller uses it in place.
+ * Returns:         1 if a whole frame (header + payload) is available, 0 if more bytes
+ *                  are needed, -1 if the bytes aren't a valid frame of this version
+ ********************************************************************************************/
+static inline int ftDecodeHeader(const unsigned char* in, size_t avail, struct ftHeader* h) {
+	if (avail >= 1 && in[0] != (FT_MAGIC >> 8)) {
+		return -1;
+	}
+	if (avail < FT_HEADER_LEN) {
+		return 0;
+	}
+	h->magic = ftGet16(in);
+	h->version = in[2];
+	h->type = in[3];
+	h->requestID = ftGet32(in + 4);
+	h->length = ftGet32(in + 8);
+	if (h->magic != FT_MAGIC || h->version != FT_VERSION ||
+			h->length > (h->type == FT_DATA ? FT_MAX_DATA : FT_MAX_PAYLOAD)) {
+		return -1;
+	}
+	return avail - FT_HEADER_LEN >= h->length;
+}
+
+#endif
@@ -6,16 +6,36 @@
  *              and when a client connects it establishes a TCP control connection.
  *              When the client sends a command to the server, the server initiates a
  *              TCP data connection and completes the request or reports and error at
- *				which point the connection is closed.  The server keeps listening for 
+ *				which point the connection is closed.  The server keeps listening for
  *				client connections until a SIGINT is received.
+ *				All sockets are non-blocking and driven by edge-triggered epoll loops
+ *				(reactors), one per listener thread, each with its own SO_REUSEPORT
+ *				listen socket; each client is a session state machine. Large files are
+ *				handed to a fixed pool of transfer workers that steal work from each
+ *				other's deques. With -u the workers send through io_uring instead.
  * Citations:   gethostname: http://www.retran.com/beej/getnameinfoman.html
- *				multi-threaded: 
- *	https://stackoverflow.com/questions/6990888/c-how-to-create-thread-using-pthread-create-function
- *	https://stackoverflow.com/questions/13505340/passing-a-file-descriptor-to-a-thread-and-using-it-in-the-functionhomework
- *	http://man7.org/linux/man-pages/man3/pthread_create.3.html
+ *				epoll: http://man7.org/linux/man-pages/man7/epoll.7.html
+ *				timerfd: http://man7.org/linux/man-pages/man2/timerfd_create.2.html
+ *				SO_REUSEPORT: https://lwn.net/Articles/542629/
+ *				work stealing: Blumofe & Leiserson, "Scheduling Multithreaded
+ *				Computations by Work Stealing", JACM 1999
+ *				io_uring: https://kernel.dk/io_uring.pdf
+ *				gzip format: https://tools.ietf.org/html/rfc1952
+ *				parallel deflate: pigz, https://zlib.net/pigz/
+ *				CRC32C: Gopal et al., "Fast CRC Computation for iSCSI Polynomial Using
+ *				CRC32 Instruction", Intel 2011; zlib crc32_combine()
+ *				delta transfers: Tridgell & Mackerras, "The rsync algorithm", 1996
+ *				metrics: https://prometheus.io/docs/instrumenting/exposition_formats/,
+ *				HdrHistogram: http://hdrhistogram.org/
+ *				GCRA: ITU-T I.371, "Traffic control and congestion control in B-ISDN";
+ *				deficit round robin: Shreedhar & Varghese, SIGCOMM 1995
  ********************************************************************************************/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
@@ -26,6 +46,7 @@
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <dirent.h>
 #include <fcntl.h>
@@ -35,9 +56,704 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
+#include <linux/openat2.h>
+#include <sys/un.h>
+#include <fnmatch.h>
+#include <linux/io_uring.h>
+#include <linux/aio_abi.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#include "ftproto.h"
 
 #define DEBUG 0
 #define BUF_LEN	2048
+_Static_assert(FT_HEADER_LEN + FT_MAX_PAYLOAD <= BUF_LEN - 1, "a frame has to fit what readControl() reads");
+
+// file transfer engine
+#define TRANSFER_CHUNK	(4 * 1024 * 1024)	//max bytes moved per transferStep() call
+#define PIPE_SIZE		(1024 * 1024)		//requested pipe capacity for the splice path
+
+// transfer buffers
+#define POOL_BUF		(1024 * 1024)		//every pooled buffer, page aligned, at least PIPE_SIZE
+#define POOL_SLAB		(8 * 1024 * 1024)	//mapped at a time, four 2MB huge pages
+#define POOL_MAX		(256 * 1024 * 1024)	//buffer memory the pool maps at most
+#define POOL_CACHE		8					//buffers a thread keeps for itself
+#define DIRECT_MIN		256					//default MB from which cold files are read O_DIRECT (-D)
+#define DIRECT_ALIGN	4096				//O_DIRECT offsets and lengths are multiples of this
+
+// reactor
+#define MAX_EVENTS			256
+#define CTRL_OUT_LEN		(4 * BUF_LEN)	//control replies queued per session before commands wait
+#define CTRL_REPLY_MAX		(BUF_LEN + FT_HEADER_LEN + FT_STATUS_LEN)	//longest single reply
+#define CONNECT_RETRY_MS	10				//first data connection retry, doubles each try
+#define CONNECT_RETRY_MAX	500
+#define CONNECT_TRIES		20				//~5 seconds for the client to open its data port
+#define PASSIVE_TIMEOUT		5				//seconds a passive data port waits for the client
+#define INLINE_FRAMES		(TRANSFER_CHUNK / FT_MAX_DATA)	//FT_DATA frames per reactor turn
+
+// worker pool
+#define OFFLOAD_MIN			(1024 * 1024)	//files at least this big are sent by a transfer worker
+#define SEND_TIMEOUT		60				//seconds a worker waits on a stalled client
+#define DEQUE_INIT			64				//initial job deque capacity, grows as needed
+#define MAX_CPUS			256
+
+// hot-file cache
+#define CACHE_BUCKETS		1024			//hash buckets, keyed by (dev, inode)
+#define CACHE_MAX_FILES		1024			//open descriptors the cache keeps at most
+#define CACHE_COPY_MAX		(4 * 1024 * 1024)	//bigger files are only sendfile()d, never held in memory
+#define CACHE_BUDGET		256				//default MB of small files held in memory (-c)
+
+// per-session working directory
+#define PATH_CACHE			8				//resolved parent directories kept per session
+#define PATH_CACHE_TTL		1				//seconds a resolved directory is trusted
+
+// directory listings
+#define LIST_BATCH			(64 * 1024)		//getdents64 buffer, one batch per listingRead()
+#define LIST_TURN			8				//batches a session reads per reactor turn
+#define LIST_CACHE_MAX		64				//directories whose listings are kept
+#define LIST_CACHE_BYTES	(64 * 1024 * 1024)
+#define LIST_EVENTS			(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+							 IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// compression stage
+#define ZIP_CHUNK			(256 * 1024)	//raw bytes per compressed block, one worker job each
+#define ZIP_WINDOW			8				//blocks compressing or waiting for the socket, per request
+#define ZIP_LEVEL			6				//zlib level a request starts at, adapted per block
+#define ZIP_MIN				512				//smaller ranges aren't worth the gzip framing
+
+// checksums
+#define CRC32C_POLY			0x82f63b78		//Castagnoli, bit reversed
+#define CRC32C_LANE			4096			//bytes per lane of the 3-way SSE4.2 loop
+#define SUM_BUCKETS			4096			//checksum index hash buckets, keyed by (dev, inode)
+#define SUM_INDEX			"ftserver.sums"	//default checksum index (-i), in $XDG_CACHE_HOME or ~/.cache
+
+// delta transfers
+#define DELTA_BLOCK_MIN		512				//block sizes a client may pick
+#define DELTA_BLOCK_MAX		(16 * 1024 * 1024)
+#define DELTA_BLOCKS_MAX	(1024 * 1024)	//signatures a client may send
+#define DELTA_SEGMENT		(16 * 1024 * 1024)	//least bytes of the file one worker scans
+#define DELTA_WINDOW		(4 * 1024 * 1024)	//bytes a scan reads at a time (at least two blocks)
+#define DELTA_LITERAL_MAX	(64 * 1024 * 1024)	//bytes per literal op, longer runs are split
+#define DELTA_NONE			0xffffffffu		//end of a signature hash chain
+
+// uploads
+#define PUT_SUFFIX			".ftpart"		//an upload is written to <file>.ftpart, renamed when complete
+#define PUT_SYNC			(64 * 1024 * 1024)	//writeback is started every this many bytes received
+
+// metrics (-m)
+#define HIST_SUB_BITS		4				//16 linear sub-buckets per power of two, <7% error
+#define HIST_MAX_BIT		44				//latencies are clamped to 2^44 ns (~4.9 hours)
+#define HIST_BUCKETS		((HIST_MAX_BIT - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+#define HIST_LE_MIN			10				//exported buckets: le = 2^10 .. 2^HIST_LE_MAX ns
+#define HIST_LE_MAX			40
+#define METRICS_REQUEST		4096			//bytes of an HTTP scrape request that are read
+
+// batch gets
+#define BATCH_WINDOW		64				//files opened ahead of the one being sent
+#define BATCH_AHEAD			(64 * 1024 * 1024)	//bytes opened ahead at most
+#define BATCH_READAHEAD		(2 * 1024 * 1024)	//of each file, asked for when it's opened
+#define BATCH_TURN			64				//files a session sends per reactor turn
+#define BATCH_NAME_MAX		1024
+
+// bandwidth scheduler (-L)
+#define SCHED_QUANTUM		(64 * 1024)		//bytes a paced session sends per turn
+#define SCHED_BURST			(1024 * 1024)	//bytes interactive data may get ahead of a limit
+#define SCHED_BULK			OFFLOAD_MIN		//gets/deltas of files this big queue behind interactive data
+#define SCHED_BUCKETS		256				//client hash buckets, keyed by address
+
+// TLS and logins (-T, -U)
+#define TLS_HANDSHAKE		0x16			//first byte of a TLS record carrying a ClientHello
+#define TLS_SESSION_TIMEOUT	(12 * 3600)		//seconds a session ticket can be resumed
+#define AUTH_ITERATIONS		100000			//PBKDF2-HMAC-SHA256 rounds for new accounts (-A)
+#define AUTH_SALT_LEN		16
+#define AUTH_KEY_LEN		32
+#define AUTH_NAME_MAX		64
+
+// io_uring transfer backend (-u)
+#define URING_BUFS			16				//registered buffers per worker, read/written in two halves
+#define URING_BUF_LEN		(128 * 1024)
+
+#define containerOf(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+enum transferMethod { XFER_SENDFILE, XFER_SPLICE, XFER_BUFFERED, XFER_MEMORY, XFER_DIRECT };
+enum transferStatus { TRANSFER_ERROR = -1, TRANSFER_DONE = 0, TRANSFER_MORE, TRANSFER_BLOCKED };
+
+struct transfer {
+	int fileFD;
+	off_t offset;			//next file byte to put on the wire
+	off_t end;				//one past the last byte to send
+	enum transferMethod method;
+	int pipeFD[2];			//splice path: file -> pipe -> socket
+	size_t pipeBytes;		//bytes sitting in the pipe, not yet on the socket
+	char* buffer;			//buffered and direct paths, from the buffer pool
+	size_t bufLen;
+	size_t bufPos;
+	const char* data;		//memory path: the whole file, held by the hot-file cache
+	int checksum;			//1: crc the bytes as they go out, -1: couldn't
+	uint32_t crc;			//CRC32C of the bytes sent so far
+	unsigned long syscalls;	//made moving the range, counted in the metrics by transferFree()
+	size_t stepMax;			//bytes one transferStep() may move, 0: TRANSFER_CHUNK
+	int directFD;			//direct path: the file opened O_DIRECT, past the page cache
+	char* next;				//direct path: the buffer being read while buffer goes out
+	int nextPending;		//a read into next is in flight
+	off_t nextOffset;		//where it reads from
+	off_t readOffset;		//next aligned file offset to read
+	aio_context_t aio;		//kernel AIO context for the read ahead, 0: reads are synchronous
+	struct iocb iocb;
+	SSL* tls;				//encrypt in user space (no kernel TLS): no sendfile/splice
+};
+
+struct bufferPool {			//page aligned transfer buffers, all POOL_BUF bytes
+	pthread_mutex_t lock;
+	char* free;				//central free list, linked through each buffer's first word
+	size_t mapped;			//bytes of slabs mapped, never unmapped
+	int huge;				//-H: slabs from hugetlbfs, else transparent huge pages if any
+};
+
+struct bufferCache {		//a thread's own buffers, taken and returned without the lock
+	char* buffers[POOL_CACHE];
+	int count;
+};
+
+struct account {			//one login of the credential store
+	char name[AUTH_NAME_MAX];
+	int iterations;
+	unsigned char salt[AUTH_SALT_LEN];
+	unsigned char key[AUTH_KEY_LEN];	//PBKDF2-HMAC-SHA256(password, salt, iterations)
+	struct account* next;
+};
+
+struct accounts {
+	struct account* head;	//doesn't change after startup, workers read it without a lock
+};
+
+struct tlsConfig {
+	SSL_CTX* ctx;			//NULL: no -T, cleartext only
+	int required;			//-S: refuse cleartext logins
+};
+
+struct reactor;
+
+struct job {
+	void (*run)(struct job* job);		//called on a worker thread
+	void (*done)(struct job* job);		//called back on the owner's reactor thread
+	struct reactor* owner;
+	struct job* doneNext;
+};
+
+struct cacheEntry {			//one open file (and maybe its contents), shared by every request for it
+	dev_t dev;				//key: (dev, ino, mtime, size)
+	ino_t ino;
+	struct timespec mtime;
+	struct timespec ctime;	//not part of the key, tells the checksum index if the file was touched
+	off_t size;
+	int fd;
+	char* _Atomic data;		//the contents once a worker has read them; NULL until then, and for
+							//good if too big, over budget, empty, unlinked or changed while read
+	int filling;			//a worker is reading data, its size is already counted in held
+	char* fillData;			//the fill's copy, until cacheFillDone() publishes it
+	struct job fillJob;
+	int refs;				//requests using the entry (and the fill job while it runs)
+	int linked;				//in the hash table; stale or overflow entries die on last release
+	struct cacheEntry* hashNext;
+	struct cacheEntry* lruPrev;	//idle (refs == 0) entries, most recently used first
+	struct cacheEntry* lruNext;
+};
+
+struct sumEntry {			//CRC32C of one version of a file, in the checksum index
+	dev_t dev;				//key: (dev, ino), matched against (mtime, ctime, size)
+	ino_t ino;
+	struct timespec mtime;
+	struct timespec ctime;	//catches rewrites that put the old mtime back
+	off_t size;
+	uint32_t crc;
+	struct sumEntry* next;
+};
+
+struct sumRecord {			//on disk, appended per checksum learned, the last one for a file wins
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtimeSec;
+	int64_t mtimeNsec;
+	int64_t ctimeSec;
+	int64_t ctimeNsec;
+	int64_t size;
+	uint32_t crc;
+	uint32_t check;			//crc32c of the fields above, a record torn by a crash is skipped
+};
+
+struct listing {			//serialized contents of one directory, shared once complete
+	dev_t dev;				//key: (dev, ino, format)
+	ino_t ino;
+	int longFormat;			//"<type> <size> <mtime> <name>\n" instead of "<name> "
+	int wd;					//inotify watch on the directory, -1 if none
+	int dirFD;				//open while the directory is still being read
+	char* data;
+	size_t len;
+	size_t cap;
+	int complete;			//whole directory serialized, data no longer changes
+	int stale;				//directory changed since, never handed out again
+	int refs;
+	unsigned long lastUsed;
+	struct listing* next;
+};
+
+struct listCache {
+	pthread_mutex_t lock;
+	int inotifyFD;			//-1: listings aren't cached
+	struct listing* head;	//complete and in-progress listings
+	int count;
+	size_t bytes;			//data of complete listings
+	unsigned long clock;
+};
+
+struct fileCache {
+	pthread_mutex_t lock;
+	struct cacheEntry* buckets[CACHE_BUCKETS];
+	struct cacheEntry* lruHead;
+	struct cacheEntry* lruTail;
+	int files;				//linked entries
+	size_t held;			//bytes of contents held by linked entries
+	size_t budget;
+	atomic_ulong hits;
+	atomic_ulong misses;
+	atomic_ulong evictions;
+};
+
+enum handleKind { H_LISTEN, H_WAKE, H_CONTROL, H_DATA, H_PASSIVE, H_TIMER };
+
+struct session;
+
+struct sumIndex {
+	pthread_mutex_t lock;
+	struct sumEntry* buckets[SUM_BUCKETS];
+	int fd;					//the index file (append only), only the flush job uses it after startup
+	int lockFD;				//<path>.lock, flock()ed by whoever writes the index file; -1: in memory only
+	char path[1024];
+	unsigned long entries;
+	unsigned long records;	//records in the file, superseded ones included
+	struct sumRecord* pending;	//learned on a reactor, not appended to the file yet
+	size_t pendingCount;
+	size_t pendingCap;
+	int flushing;			//flushJob is queued or running, it alone writes the file
+	struct job flushJob;
+	atomic_ulong hits;
+	atomic_ulong misses;
+};
+
+struct zipStream;
+
+struct zipChunk {			//one block of a compressed get, deflated by a worker
+	struct job job;
+	struct zipStream* zip;
+	int fd;
+	const char* data;		//the file's contents if the cache holds them, else read with pread()
+	off_t offset;			//raw range of the block
+	size_t len;
+	int level;
+	int last;				//ends the deflate stream (Z_FINISH instead of Z_SYNC_FLUSH)
+	unsigned char* out;		//raw deflate data
+	size_t outLen;
+	size_t outPos;			//bytes of out already on the socket
+	uLong crc;				//crc32 of the raw bytes
+	uint32_t sum;			//CRC32C of the raw bytes
+	long long nanos;		//time the worker took
+	struct timespec started;	//when the block started going out
+	int ready;
+	int failed;
+	struct zipChunk* next;
+};
+
+struct zipStream {			//gzip framing and block pipeline of a compressed get
+	struct session* session;
+	struct zipChunk* head;	//blocks in file order, head is the one on the wire
+	struct zipChunk* tail;
+	int inFlight;			//blocks a worker still owns
+	int queued;				//blocks in the list
+	int parallel;			//workers the blocks can spread over
+	off_t next;				//first raw byte not handed to a worker yet
+	off_t end;
+	int level;
+	double compressRate;	//raw bytes/s of one worker, moving average
+	double drainRate;		//wire bytes/s of the data socket while it had a block to send
+	double sendSeconds;
+	double sendBytes;
+	uLong crc;				//crc32 of the raw bytes sent so far
+	uint32_t sum;			//CRC32C of the raw bytes sent so far
+	uLong rawLen;
+	unsigned char trailer[8];
+	size_t trailerPos;
+	int filled;				//every block has been handed out
+	int aborted;			//failed, waiting for the workers to let go of their blocks
+};
+
+struct delta;
+
+struct deltaOp {			//a run of the file: literal bytes, or blocks the client already has
+	int type;				//FT_DELTA_LITERAL or FT_DELTA_COPY
+	off_t offset;			//where in the file
+	off_t length;			//copies: a whole number of blocks
+	uint32_t block;			//copies: the client's first block
+};
+
+struct deltaScan {			//one segment of the file, scanned by a worker
+	struct job job;
+	struct delta* delta;
+	off_t start;			//block starts the segment owns; a match may run past end
+	off_t end;
+	struct deltaOp* ops;
+	size_t count;
+	size_t cap;
+	uint32_t crc;			//CRC32C of start..end
+	int failed;
+};
+
+enum deltaState {
+	DELTA_SIGS,				//reading the client's block signatures
+	DELTA_SCAN,				//workers are matching them against the file
+	DELTA_SEND				//ops going out
+};
+
+struct delta {				//rsync-style delta of a file against the client's copy
+	struct session* session;
+	enum deltaState state;
+	uint32_t blockSize;
+	uint32_t blocks;
+	unsigned char* sigs;	//FT_SIG_LEN bytes per client block
+	size_t got;
+	uint32_t* heads;		//weak checksum hash table, chains through next
+	uint32_t* next;
+	uint32_t mask;
+	off_t size;
+	struct deltaScan* scans;
+	int segments;
+	int inFlight;			//segments a worker still owns
+	int aborted;			//failed, waiting for the workers to let go of the file
+	struct deltaOp* ops;	//merged, in file order
+	size_t count;
+	size_t cap;
+	size_t sent;			//ops whose header is out
+	unsigned char head[FT_DELTA_HEAD];
+	size_t headPos;
+	int literal;			//a literal op's bytes are going out through xfer
+	off_t literalStart;
+	int ended;				//FT_DELTA_END is queued
+};
+
+struct batchFile {			//a file of a batch get, opened (and read ahead) by the prefetcher
+	int fd;					//-1 between files; not through the hot-file cache, see runBatchFetch()
+	struct stat opened;		//what fd was when it was opened, for the checksum index
+	off_t size;
+	time_t mtime;
+	int sumKnown;			//the checksum index had it, crc is from there
+	uint32_t crc;
+	char name[BATCH_NAME_MAX];
+};
+
+struct batch {				//the files of a batch get and the one going out
+	struct job job;			//prefetch, one at a time
+	struct session* session;
+	char pattern[256];
+	int dirFD;				//the session's directory when the request came in
+	char* names;			//every file of the batch, NUL separated, filled by the first fetch
+	size_t namesLen;
+	size_t namesCap;
+	size_t nextName;		//first name the prefetcher hasn't opened
+	int listed;
+	int failed;				//the pattern couldn't be read
+	int inFlight;			//a worker is fetching
+	int aborted;			//failed, waiting for the worker to let go
+	int wantFiles;			//room the reactor left for this fetch
+	off_t wantBytes;
+	struct batchFile* fetched;	//BATCH_WINDOW, filled by the worker
+	int fetchedCount;
+	struct batchFile* ready;	//BATCH_WINDOW ring, consumed by the reactor
+	int readyHead;
+	int readyCount;
+	off_t readyBytes;
+	struct batchFile current;	//file going out, fd -1 between files
+	unsigned char head[FT_BATCH_HEAD + BATCH_NAME_MAX];	//entry head, tail or end record
+	size_t headLen;
+	size_t headPos;
+	unsigned long sent;
+	unsigned long skipped;
+	int ended;				//end record queued
+};
+
+struct jobDeque {			//owner pushes/pops at the bottom, thieves take from the top
+	pthread_mutex_t lock;
+	struct job** ring;
+	size_t cap;				//power of two
+	size_t top;
+	size_t bottom;
+};
+
+struct worker {
+	struct workerPool* pool;
+	int id;
+	int cpu;				//-1 if not pinned
+	pthread_t thread;
+	struct jobDeque deque;
+};
+
+struct uring {				//one per worker, set up by uringInit()
+	int fd;
+	unsigned entries;
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned* sqMask;
+	unsigned* sqArray;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned* cqMask;
+	unsigned sqQueued;		//sqes filled in but not yet published to the kernel
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* ringMem;
+	size_t ringLen;
+	size_t sqesLen;
+	char* buffers;			//URING_BUFS * URING_BUF_LEN, registered with the ring
+};
+
+struct workerPool {
+	struct worker* workers;
+	int count;
+	int useUring;			//-u: workers send through io_uring
+	atomic_int pending;		//jobs submitted but not yet picked up
+	pthread_mutex_t lock;	//only guards sleeping on wake
+	pthread_cond_t wake;
+};
+
+enum counter {
+	M_ACCEPTED,				//control connections
+	M_CLOSED,				//sessions destroyed
+	M_LOGIN_FAILED,
+	M_REQ_LIST,				//requests, by command
+	M_REQ_GET,
+	M_REQ_DELTA,
+	M_REQ_PUT,
+	M_REQ_MGET,
+	M_REQ_SIZE,
+	M_REQ_SUM,
+	M_REQ_CD,
+	M_REQ_STATS,
+	M_ERRORS,				//error replies
+	M_TRANSFERS,			//data transfers completed, failed ones included
+	M_TRANSFERS_FAILED,
+	M_BYTES_SENT,			//data connection bytes
+	M_BYTES_RECEIVED,
+	M_JOBS,					//worker jobs run
+	M_PACED,				//times a sender waited for its bandwidth share
+	M_DIRECT,				//files read O_DIRECT (-D)
+	M_TLS,					//TLS handshakes completed, control and data connections
+	M_TLS_RESUMED,			//of them resumed from a session ticket
+	M_TLS_KERNEL,			//of them sending through kernel TLS
+	M_XFER_SYSCALLS,		//syscalls the transfer engine made to move file data
+	M_COUNTERS
+};
+
+enum stage {				//latency histograms
+	ST_AUTH,				//accept -> login verified
+	ST_COMMAND,				//login -> first command
+	ST_HANDLER,				//parsing and dispatching one command on the reactor
+	ST_SETUP,				//data connection: command accepted -> connected
+	ST_FIRST_BYTE,			//command -> its data starts going out
+	ST_TRANSFER,			//command -> DONE
+	ST_STAGES
+};
+
+struct metrics {			//one per reactor/worker thread, only that thread writes it
+	atomic_ullong counters[M_COUNTERS];
+	atomic_ullong hist[ST_STAGES][HIST_BUCKETS];
+	atomic_ullong histSum[ST_STAGES];	//ns
+	struct metrics* next;
+};
+
+struct metricsRegistry {
+	pthread_mutex_t lock;	//guards the list, never the counters
+	struct metrics* head;
+	int listenFD;			//-m endpoint, -1: none
+};
+
+struct schedRule {			//a "client <address> <rate>" line of the limits file
+	char address[INET_ADDRSTRLEN];
+	double rate;
+	struct schedRule* next;
+};
+
+struct schedClient {		//one client address, shared by all of its sessions
+	char address[INET_ADDRSTRLEN];
+	double rate;			//bytes/s, 0: unlimited
+	long long due;			//virtual clock: when its bytes so far are paid for (ns)
+	int refs;
+	struct schedClient* next;
+};
+
+struct scheduler {			//outbound bandwidth, GCRA token buckets on a virtual clock
+	pthread_mutex_t lock;
+	char path[1024];		//-L limits file, "": no limits
+	atomic_int enabled;		//some limit is set, senders are paced; read without the lock
+	double totalRate;		//the whole uplink, bytes/s, 0: unlimited
+	long long totalDue;
+	double clientRate;		//every client address without a rule of its own
+	struct schedRule* rules;
+	struct schedClient* clients[SCHED_BUCKETS];
+};
+
+struct handle {				//what an epoll event points back to
+	enum handleKind kind;
+	struct session* session;
+};
+
+enum sessionState {
+	SESSION_LOGIN,			//waiting for username/password
+	SESSION_VERIFYING,		//a worker is checking the login, input waits in inBuf
+	SESSION_COMMAND,		//waiting for a command
+	SESSION_CONNECTING,		//connecting the data socket back to the client, or waiting for
+							//the client to connect to the passive port
+	SESSION_SENDING,		//data socket is draining a listing or a file
+	SESSION_DEAD			//closed, freed at the end of the reactor pass
+};
+
+enum command { CMD_NONE, CMD_LIST, CMD_GET, CMD_DELTA, CMD_PUT, CMD_MGET };
+
+struct pathSlot {			//a directory path resolved relative to the session's directory
+	char path[256];
+	int fd;					//O_PATH descriptor, -1 if the slot is empty
+	time_t resolved;
+};
+
+enum dataMode {
+	DATA_ACTIVE,			//server connects to the client's data port
+	DATA_PASSIVE,			//client connects to a port the server opened for the request
+	DATA_INLINE				//FT_DATA frames on the control connection, no second socket
+};
+
+struct session {
+	struct reactor* reactor;
+	enum sessionState state;
+	int controlFD;
+	int dataFD;
+	int timerFD;			//data connection retry timer, created on first retry
+	int fileFD;
+	int passiveFD;			//passive mode listen socket
+	int dirFD;				//the session's working directory, all paths resolve against it
+	struct pathSlot paths[PATH_CACHE];	//recently resolved parent directories (round robin)
+	int nextPath;
+	struct cacheEntry* cached;	//the file of the current get, fileFD is its descriptor
+	struct listing* listing;	//the listing of the current -l, dataBuf points into it
+	int listLong;				//-l with sizes, times and types
+	struct handle controlHandle;
+	struct handle dataHandle;
+	struct handle passiveHandle;
+	struct handle timerHandle;
+
+	char inBuf[BUF_LEN];		//control bytes received, not yet handled
+	size_t inLen;
+	char* outBuf;				//control bytes waiting for the socket to drain, NULL until
+	size_t outCap;				//the first reply; grows past CTRL_OUT_LEN rather than drop one
+	size_t outLen;
+	size_t outPos;
+	int closing;				//close the session once outBuf is flushed
+	int peerClosed;
+	int lineMode;				//login ended in '\n': newline framed, pipelined commands
+	SSL* controlTLS;			//the control connection started with a TLS ClientHello
+	int controlHandshake;		//its handshake is still going
+	SSL* dataTLS;				//and so does the data connection of a TLS session
+	int framed;					//binary frames (ftproto.h) instead of text
+	uint32_t requestID;			//framed: id of the command being answered
+	int inHandler;				//handleControl() is on the stack
+	char tag[24];				//"#<request id> " echoed on replies in line mode
+	long long acceptedAt;		//CLOCK_MONOTONIC ns, for the latency histograms
+	long long authAt;			//login verified, 0 once the first command came
+	long long commandAt;		//current command arrived
+	long long setupAt;			//data connection requested, 0 once it's up
+
+	enum command command;		//request being served on the data socket
+	enum dataMode dataMode;
+	char clientIP[20];
+	char peerIP[INET_ADDRSTRLEN];	//other end of the control connection
+	struct schedClient* client;	//its bandwidth limit, NULL: no limits file
+	int bulk;					//current request waits behind interactive ones
+	long long schedCredit;		//bytes the scheduler granted that haven't gone out yet
+	int paced;					//the timer is armed for the next bandwidth share
+	int pacedOffload;			//...and it resubmits an offloaded transfer, not pumpData()
+	long long paceDelay;		//ns a worker's transfer has to wait for its next share
+	int dataPort;
+	int connectTries;
+	int retryDelay;
+	char fileName[256];
+	off_t rangeOffset;			//get: first byte to send
+	off_t rangeLength;			//get: bytes to send, 0 = to the end of the file
+	off_t dataTotal;			//bytes the current request puts on the data socket
+	int compress;				//get: client asked for (and the file gets) gzip on the data socket
+	int sumKnown;				//get: the checksum index had the file, crc is from it
+	uint32_t crc;				//get/sum: CRC32C of the file
+	struct zipStream* zip;		//compression pipeline of the current get
+	struct delta* delta;		//the current delta request
+	struct batch* batch;		//the current batch get
+	int putFD;					//put: the temporary file, locked while it's written
+	int putDirFD;				//put: the directory the file goes to, beneath startDir
+	const char* putLeaf;		//put: the file's name in there, points into fileName
+	off_t putOffset;			//put: bytes of the file in it
+	off_t putSize;				//put: size of the complete file
+	int dataFailed;
+	struct transfer xfer;
+	char* dataBuf;				//listing or error text headed for the data socket
+	size_t dataLen;
+	size_t dataPos;
+	unsigned char frameHead[FT_HEADER_LEN];	//inline: header of the FT_DATA frame being sent
+	size_t frameHeadPos;
+	size_t frameLeft;			//inline: payload bytes of the current frame still to send
+	off_t dataEnd;				//inline: end of the file range, xfer.end is the frame's end
+
+	struct job transferJob;		//big files are sent from the worker pool
+	int offloaded;				//a worker owns the data socket and file right now
+	int destroyPending;			//destroy once the worker hands the session back
+	int transferStatus;
+	int transferErrno;
+	char* login;				//username & password a worker is verifying, freed by it
+	int verified;
+
+	struct session* readyNext;	//reactor run queue, sessions with more to send
+	int queued;
+	struct session* deadNext;
+};
+
+struct reactor {
+	int id;
+	int cpu;					//-1 if not pinned
+	pthread_t thread;
+	int epollFD;
+	int listenFD;
+	struct handle listenHandle;
+	int wakeFD;					//eventfd, workers ring it when a job is done
+	struct handle wakeHandle;
+	pthread_mutex_t doneLock;
+	struct job* doneHead;		//finished jobs waiting for their done() callback
+	struct workerPool* pool;
+	struct session* readyHead;
+	struct session* readyTail;
+	struct session* dead;		//sessions closed during this pass
+	int sessions;
+};
 
 
 /*******************************************************************************************
@@ -54,13 +770,15 @@ void error(const char *msg) {
 /*********************************************************************************************
  * Function: 		int serverSocketInit(int portNum)
  * Description:		Sets up the server socket sockaddr_in struct
- * Parameters:      int portNum, specified on command line: argv[1]
+ * Parameters:      int portNum, specified on command line
  * Pre-Conditions: 	Valid port number given on command line
- * Post-Conditions: Returns an initialized, binded sockaddr_in struct
+ * Post-Conditions: Returns a non-blocking SO_REUSEPORT socket bound to the port, one per
+ *                  listener thread
  **********************************************************************************************/
 int serverSocketInit(int portNum) {
 	struct sockaddr_in serverAddress;
 	int listenSocketFD;
+	int on = 1;
 	
 	// Set up the address struct for this process (the server)
 	memset((char *)&serverAddress, '\0', sizeof(serverAddress)); // Clear out the address struct
@@ -69,12 +787,19 @@ int serverSocketInit(int portNum) {
 	serverAddress.sin_addr.s_addr = INADDR_ANY; // Any address is allowed for connection to this process
 	
 	// Set up the socket
-	listenSocketFD = socket(AF_INET, SOCK_STREAM, 0); // Create the socket
+	listenSocketFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0); // Create the socket
 	if(listenSocketFD < 0) {
 		perror("ERROR opening socket");
 		exit(1);
 	}
 	
+	// Every listener thread binds its own socket to the port, the kernel spreads accepts
+	if(setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+			setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+		perror("ERROR setting SO_REUSEPORT");
+		exit(1);
+	}
+	
 	// Connect socket to port
 	if(bind(listenSocketFD, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0) {
 		perror("ERROR on binding");
@@ -84,486 +809,7698 @@ int serverSocketInit(int portNum) {
 	return listenSocketFD;
 }
 
-/***********************************************************************************************
- * Function: 		int recvMessage(int socketFD, char* buff)
- * Description:		Function to receive messages from the client through the control socket.
- * Parameters:		int socketFD, char* buff
- * Pre-Conditions: 	The server must be running at the specified socket,
- *					the server and client are connected with a dedicated control socket.
- * Post-Conditions: The server receives a message from the server, or the server closes
- *					the connection.
- ************************************************************************************************/
-char* recvMessage(int socketFD, char* buff) {
-	int charsRecv;
-	
-	// Get return message from server
-	memset(buff, '\0', BUF_LEN);
-	if(DEBUG) {
-		printf("sizeof(buff): %lu\n", sizeof(buff));
+static struct bufferPool bufferPool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static __thread struct bufferCache bufferCache;
+static off_t directMin = (off_t)DIRECT_MIN << 20;		//-D, 0: never O_DIRECT
+static struct stat startDir;							//puts stay beneath where the server was started
+static int verbose;										//-v: log every connection and request
+static struct accounts accounts;
+static struct tlsConfig tlsConfig;
+
+/*******************************************************************************************
+ * Function:        int poolGrow(void)
+ * Description:		Maps another slab and puts its buffers on the central free list. With -H
+ *                  the slab comes from hugetlbfs (falls back for good, with a warning, once
+ *                  none are left), otherwise the kernel is asked to back it with transparent
+ *                  huge pages: one TLB entry per 2MB of buffers either way.
+ * Pre-Conditions: 	bufferPool.lock is held
+ * Returns:         0, -1 if the pool is at POOL_MAX or out of memory
+ ********************************************************************************************/
+static int poolGrow(void) {
+	char* slab = MAP_FAILED;
+	size_t i;
+
+	if (bufferPool.mapped + POOL_SLAB > POOL_MAX) {
+		errno = ENOMEM;
+		return -1;
 	}
-	
-	// Read data from the socket, leaving \0 at end
-	charsRecv = recv(socketFD, buff, (BUF_LEN - 1), 0);
-	if(DEBUG) {
-		printf("%s\n", buff);
+	if (bufferPool.huge) {
+		slab = mmap(NULL, POOL_SLAB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (slab == MAP_FAILED) {
+			perror("WARNING: no huge pages for transfer buffers (vm.nr_hugepages)");
+			bufferPool.huge = 0;
+		}
 	}
-	
-	if(charsRecv == 0) {
-		printf("No data received, closing the connection...\n");
-		return NULL;
+	if (slab == MAP_FAILED) {
+		slab = mmap(NULL, POOL_SLAB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slab == MAP_FAILED) {
+			return -1;
+		}
+		madvise(slab, POOL_SLAB, MADV_HUGEPAGE);	//best effort
 	}
-	if(charsRecv < 0) {
-		printf("ERROR receiving data.\n");
-		return NULL;
+	for (i = 0; i < POOL_SLAB; i += POOL_BUF) {
+		*(char**)(slab + i) = bufferPool.free;
+		bufferPool.free = slab + i;
 	}
-	
-	return buff;
+	bufferPool.mapped += POOL_SLAB;
+	return 0;
 }
 
-/***********************************************************************************************
- * Function: 		int sendMessage(int socketFD, char* userHandle, , char* serverHandle)
- * Description:		Function to send messages to the server through the connected socket
- *			        until the client closes the connection with "\quit".
- * Parameters:		int socketFD, char* userHandle, , char* serverHandle
- * Pre-Conditions: 	The server must be running at the specified socket,
- *                  userHandle initialized with user specified handle,
- *			        serverHandle initialized with user specified handle,
- *			        the server and client are connected with a dedicated socket.
- * Post-Conditions: The client sends a message to the server, or closes the connection.
- ************************************************************************************************/
-int sendMessage(int socketFD, char* buff) {
-	int charsWritten;
-	
-	// send message to client
-	charsWritten = send(socketFD, buff, strlen(buff), 0);
-	
-	if(charsWritten < 0) {
-		error("ERROR writing to socket");
+/*******************************************************************************************
+ * Function:        char* bufferGet(void)
+ * Description:		Takes a POOL_BUF byte, page aligned buffer: from the calling thread's
+ *                  cache, or half a cache's worth at once from the central list. Never
+ *                  calls malloc(), buffers are recycled for the life of the process.
+ * Returns:         the buffer (release it with bufferPut()), NULL with errno set if the
+ *                  pool is exhausted
+ ********************************************************************************************/
+static char* bufferGet(void) {
+	struct bufferCache* c = &bufferCache;
+
+	if (c->count == 0) {
+		pthread_mutex_lock(&bufferPool.lock);
+		while (c->count < POOL_CACHE / 2 && (bufferPool.free != NULL || poolGrow() == 0)) {
+			c->buffers[c->count++] = bufferPool.free;
+			bufferPool.free = *(char**)bufferPool.free;
+		}
+		pthread_mutex_unlock(&bufferPool.lock);
+		if (c->count == 0) {
+			return NULL;
+		}
 	}
-	
-	if (charsWritten < strlen(buff)) {
-		send(socketFD, &buff[charsWritten], strlen(buff) - charsWritten, 0);
+	return c->buffers[--c->count];
+}
+
+/*******************************************************************************************
+ * Function:        void bufferPut(char* buffer)
+ * Description:		Returns a buffer to the calling thread's cache (any thread may return
+ *                  any buffer); a full cache hands half of it back to the central list
+ ********************************************************************************************/
+static void bufferPut(char* buffer) {
+	struct bufferCache* c = &bufferCache;
+
+	if (buffer == NULL) {
+		return;
+	}
+	if (c->count == POOL_CACHE) {
+		pthread_mutex_lock(&bufferPool.lock);
+		while (c->count > POOL_CACHE / 2) {
+			c->count--;
+			*(char**)c->buffers[c->count] = bufferPool.free;
+			bufferPool.free = c->buffers[c->count];
+		}
+		pthread_mutex_unlock(&bufferPool.lock);
 	}
-    
-	return charsWritten;
+	c->buffers[c->count++] = buffer;
 }
 
 /*******************************************************************************************
- * Function:        int openDataSocket(int dataPort, char* host)
- * Description:		Function to set up the server's data transfer socket
- * Parameters:		The client's hostname and data transfer port
- * Pre-Conditions: 	The server and client are ready to exchange data through the socket
- * Post-Conditions: The server's data transfer socket is initialized and connected to the client
- * Returns:         The data socket, connected to the client process.
+ * Function:        SSL* tlsSoftware(SSL* tls, int sending)
+ * Description:		Whether bytes going one way on a TLS connection need OpenSSL. After the
+ *                  handshake OpenSSL hands the keys to the kernel (TLS_TX, and TLS_RX where
+ *                  supported): from then on send(), sendfile() and splice() on the socket
+ *                  are encrypted by the kernel and the transfer engine works unchanged.
+ *                  Without the kernel's tls module the records are built in user space.
+ * Returns:         tls if this direction goes through SSL_write()/SSL_read(), NULL if it's
+ *                  plain socket calls (cleartext or kernel TLS)
  ********************************************************************************************/
-int initTCPDataConnection(int dataPort, char* host) {
-	struct sockaddr_in serverAddress;
-	struct hostent *serverHost;
-	int dataSocketFD;
-	
-	//set up the server address struct
-	memset((char *)&serverAddress, '\0', sizeof(serverAddress));  // Clear out the address struct
-	serverAddress.sin_family = AF_INET; // Create a network-capable socket
-	serverAddress.sin_port = htons(dataPort);  // Store the port number
-	serverHost = gethostbyname(host);  // Convert the machine name into a special form of address
-	// Copy in the address
-	memcpy((char*)&serverAddress.sin_addr.s_addr, (char*)serverHost->h_addr, serverHost->h_length);
-	
-	// Set up the socket
-	sleep(1); //wait for client
-	dataSocketFD = socket(AF_INET, SOCK_STREAM, 0);
-	if (dataSocketFD < 0) {
-		error("ERROR opening socket");
+static SSL* tlsSoftware(SSL* tls, int sending) {
+	if (tls == NULL) {
+		return NULL;
 	}
-	
-	// Connect socket to address
-	if (connect(dataSocketFD, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) != 0) {
-		error("ERROR on connecting data socket");
+	if (sending ? BIO_get_ktls_send(SSL_get_wbio(tls)) : BIO_get_ktls_recv(SSL_get_rbio(tls))) {
+		return NULL;
 	}
-	
-	return dataSocketFD;
+	return tls;
 }
 
 /*******************************************************************************************
- * Function:        void listCmd(int dataPort, char* host)
- * Description:		Function to send current directory contents to the client
- * Parameters:		The client's hostname and data transfer port
- * Pre-Conditions: 	The client is ready to receive the directory through the data socket
- * Post-Conditions: The server sent the requested directory contents to the client
- *                  and closes out the the data socket (created within this function)
- ********************************************************************************************/
-void listCmd(int dataPort, char* host) {
-	int dataSocket;
-	int dataWritten;
-	DIR* directory;
-	struct dirent *dirList;
-	char sendBuffer[BUF_LEN];
-	memset(sendBuffer, '\0', sizeof(sendBuffer));
-	
-	fflush(stdout);
-	printf("Sending directory list to %s:%d\n", host, dataPort);
-	fflush(stdout);
-	
-	dataSocket = initTCPDataConnection(dataPort, host);
-	directory = opendir("."); //from current directory
-	
-	if(directory != NULL) {
-		 //build dir list
-		while((dirList = readdir(directory))) {
-			strcat(sendBuffer, dirList->d_name);
-			strcat(sendBuffer, " ");
+ * Function:        ssize_t tlsError(SSL* tls, int ret)
+ * Description:		Turns a failed SSL_write_ex()/SSL_read_ex() into what send()/recv()
+ *                  would have said: -1 with EAGAIN when the socket is full/empty, 0 for
+ *                  the peer's close_notify
+ ********************************************************************************************/
+static ssize_t tlsError(SSL* tls, int ret) {
+	switch (SSL_get_error(tls, ret)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return -1;
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	case SSL_ERROR_SYSCALL:
+		if (errno == 0) {
+			return 0;		//EOF without close_notify
 		}
-		//send dir list
-		sendMessage(dataSocket, sendBuffer);
+		return -1;
+	default:
+		errno = EPROTO;
+		return -1;
 	}
-	else error("ERROR: unable to open directory.");
-	
-	closedir(directory);
-	close(dataSocket);
 }
 
 /*******************************************************************************************
- * Function:        void sendFile(int dataPort, char* fileName, char* host)
- * Description:		Function to send the requested file to the client
- * Parameters:		The client's hostname, data transfer port, and file name of wanted file
- * Pre-Conditions: 	The client is ready to receive the file through the data socket
- * Post-Conditions: The server sent the requested file to the client and closes out the
- *                  the data socket (created within this function)
+ * Function:        ssize_t tlsSend(SSL* tls, int fd, const void* buf, size_t len, int flags)
+ * Description:		send(2) on a socket that may carry TLS. A short write is retried by the
+ *                  caller with the rest of the same bytes, as SSL_MODE_ENABLE_PARTIAL_WRITE
+ *                  and SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER expect.
  ********************************************************************************************/
-void sendFile(int dataPort, char* fileName, char* host) {
-	int fileFD;
-	int dataSocket;
-	int fileSize;
-	int pos;
-	int dataWritten;
-	int dataRead;
-	int dataSent = 0;
-	char sendBuffer[BUF_LEN];
-	
-	fflush(stdout);
-	printf("Sending \"%s\" to %s:%d\n", fileName, host, dataPort);
-	fflush(stdout);
-	
-	//set up data connection
-	dataSocket = initTCPDataConnection(dataPort, host);
-	memset(sendBuffer, '\0', sizeof(sendBuffer));
-	
-	//open the file and copy it to the buffer
-	fileFD = open(fileName, O_RDONLY);
-	if (fileFD < 1) { //error
-		printf("Error opening %s\n", fileName);
-		strncpy(sendBuffer, "ERROR: File not found/could not be opened\n", sizeof(sendBuffer));
-		sendMessage(dataSocket, sendBuffer);
-		return;
+static ssize_t tlsSend(SSL* tls, int fd, const void* buf, size_t len, int flags) {
+	size_t n;
+	ssize_t ret;
+
+	tls = tlsSoftware(tls, 1);
+	if (tls == NULL) {
+		return send(fd, buf, len, flags);
 	}
-	//get file size, then reset file pointer
-	fileSize = lseek(fileFD, 0, SEEK_END);
-	if(DEBUG) {
-		printf("file size: %d bytes\n", fileSize);
+	if (len == 0) {
+		return 0;
 	}
-	pos = lseek(fileFD, 0, SEEK_SET);
-	
-	//small files: up to 1MB
-	if (fileSize < 1000000) {
-		char fileBuffer[fileSize + 1];  //one extra for null terminator
-		memset(fileBuffer, '\0', sizeof(fileBuffer));
-		dataRead = read(fileFD, fileBuffer, sizeof(fileBuffer)-1);
-		if(DEBUG) {
-			printf("file bytes read: %d bytes\n", dataRead);
-		}
-		//send the file
-		dataSent = 0;
-		if (fileSize < BUF_LEN) {
-			sendMessage(dataSocket, fileBuffer);
-		}
-		else {  //fileSize is bigger than send buffer
-			while (dataSent <= fileSize){
-				if ((fileSize - dataSent) < BUF_LEN) {
-					memset(sendBuffer, '\0', sizeof(sendBuffer));
-					//memcpy for non text files
-					memcpy(sendBuffer, &fileBuffer[dataSent], fileSize - dataSent);
-					dataWritten = sendMessage(dataSocket, sendBuffer);
-					dataSent += dataWritten;
-					if(DEBUG){
-						printf("bytes sent(now): %d\nbytes sent(total): %d\n", dataWritten, dataSent);
-					}
-					break;
-				}
-				//break up the fileBuffer
-				memset(sendBuffer, '\0', sizeof(sendBuffer));
-				memcpy(sendBuffer, &fileBuffer[dataSent], BUF_LEN-1);
-				
-				//send
-				dataWritten = sendMessage(dataSocket, sendBuffer);
-				dataSent += dataWritten;
-				if(DEBUG){
-					printf("bytes sent(now): %d\nbytes sent(total): %d\n", dataWritten, dataSent);
-				}
-			}
-		}
-		close(fileFD);
+	ERR_clear_error();
+	errno = 0;
+	if (SSL_write_ex(tls, buf, len, &n) == 1) {
+		return n;
 	}
-	//big files: 100's MB
-	else {
-		close(fileFD);
-		size_t fileSize;
-		ssize_t partSize;
-		char* filePart = NULL;
-		
-		//open file
-		FILE* file = fopen(fileName, "r");
-		
-		//send file in pieces
-		while ((partSize = getline(&filePart, &fileSize, file)) != -1) {
-			dataSent = send(dataSocket, filePart, partSize, 0);
-			if (dataSent < 0) {
-				error("ERROR writing to socket");
-				break;
-			}
-		}
-		free(filePart);
-		fclose(file);
+	ret = tlsError(tls, 0);
+	if (ret == 0) {
+		errno = EPIPE;		//close_notify or EOF while sending
+		return -1;
 	}
-	close(dataSocket);
+	return ret;
 }
 
-
 /*******************************************************************************************
- * Function:        int verifyUser(char* clientLogin)
- * Description:		Function to verify the connecting client
- * Parameters:		A concatenated string containing the username & password from client
- * Pre-Conditions: 	char* clientLogin initialized with username & password from client
- * Post-Conditions: Returns 1 if there isa  match, otherwise returns 0
+ * Function:        ssize_t tlsRecv(SSL* tls, int fd, void* buf, size_t len, int flags)
+ * Description:		recv(2) on a socket that may carry TLS
  ********************************************************************************************/
-int verifyUser(char* clientLogin) {
-	printf("Verifying user... ");
-	
-	if (strcmp(clientLogin, "clientpass") != 0) {
-		printf("\n... username/password failed.\n");
-		return 0;
+static ssize_t tlsRecv(SSL* tls, int fd, void* buf, size_t len, int flags) {
+	size_t n;
+
+	tls = tlsSoftware(tls, 0);
+	if (tls == NULL) {
+		return recv(fd, buf, len, flags);
 	}
-	else {
-		printf("\n... username/password verified.\n");
-		return 1;
+	ERR_clear_error();
+	errno = 0;
+	if (SSL_read_ex(tls, buf, len, &n) == 1) {
+		return n;
 	}
+	return tlsError(tls, 0);
 }
 
-/*********************************************************************************************
- * Function: 		void* ftp_work(void* arg)
- * Description:		in main, pthread_create() uses this to start execution.  It is the method
- *					where all the file transfer work is done between server and client
- * Parameters:		pointer to the data that ftp_work will use, passed in via the
- *					fourth parameter in pthread_create()
- * Pre-Conditions: 	The server must be running at the specified socket socket,
- *                  the struct sockaddr_in must be properly initialized
- * Post-Conditions: The client and server successfully connect or it throws an error and exits
- **********************************************************************************************/
-void* ftp_work(void* socketFD) {
-	int serverSocket;
-	int controlSocket;
-	int dataPort;
-	int verify_cd;
-	char buffer[BUF_LEN];
-	char commandLine[BUF_LEN];
-	char newDir[256];
-	char fileName[256];
-	char client[64];
-	char clientIP[20];
-	char cwd[1024];
-	char* token = NULL;
-	struct sockaddr_in serverAddress, clientAddress;
-	struct stat findFile;
-	memset(buffer, '\0', sizeof(buffer));
-	memset(commandLine, '\0', sizeof(commandLine));
-	memset(newDir, '\0', sizeof(newDir));
-	memset(fileName, '\0', sizeof(fileName));
-	memset(client, '\0', sizeof(client));
-	memset(clientIP, '\0', sizeof(clientIP));
-	
-	//cast the socket file descriptor
-	controlSocket = *(int*)socketFD;
-	
-	//receive client login info
-	recvMessage(controlSocket, buffer);
-	
-	//verify client
-	if (verifyUser(buffer)) {
-		memset(buffer, '\0', sizeof(buffer));
-		strncpy(buffer, "User verified!", sizeof(buffer));
-		sendMessage(controlSocket, buffer);
+/*******************************************************************************************
+ * Function:        void transferInit(struct transfer* xfer, int fileFD, off_t offset, off_t length)
+ * Description:		Prepares a transfer of length bytes of fileFD starting at offset.
+ *                  Starts out on sendfile(2); transferStep() drops down to splice(2) and
+ *                  then to a plain read/send loop if the filesystem can't do zero-copy.
+ * Parameters:		the transfer state, an open file, the byte range to send
+ * Pre-Conditions: 	fileFD is open for reading
+ * Post-Conditions: xfer is ready for transferStep(), release it with transferFree()
+ ********************************************************************************************/
+void transferInit(struct transfer* xfer, int fileFD, off_t offset, off_t length) {
+	memset(xfer, 0, sizeof(*xfer));
+	xfer->fileFD = fileFD;
+	xfer->offset = offset;
+	xfer->end = offset + length;
+	xfer->method = XFER_SENDFILE;
+	xfer->pipeFD[0] = -1;
+	xfer->pipeFD[1] = -1;
+	xfer->directFD = -1;
+}
+
+static void metricsAdd(enum counter c, unsigned long long n);
+
+/*******************************************************************************************
+ * Function:        void transferFree(struct transfer* xfer)
+ * Description:		Releases the pipe/buffers a transfer picked up along the way, waiting
+ *                  for a read ahead still in flight. Does not close the file, the caller
+ *                  owns it.
+ ********************************************************************************************/
+void transferFree(struct transfer* xfer) {
+	if (xfer->pipeFD[0] >= 0) {
+		close(xfer->pipeFD[0]);
+		close(xfer->pipeFD[1]);
 	}
-	else {
-		memset(buffer, '\0', sizeof(buffer));
-		strncpy(buffer, "Verification failed: username/password incorrect", sizeof(buffer));
-		sendMessage(controlSocket, buffer);
-		return NULL;
+	if (xfer->aio) {
+		syscall(__NR_io_destroy, xfer->aio);	//returns once the read is done with next
 	}
-	
-	//receive command from the client
-	memset(buffer, '\0', sizeof(buffer));
-	recvMessage(controlSocket, buffer);
-	
-	//copy buffer into commandLine to parse for commands
-	strcpy(commandLine, buffer);
-	if(DEBUG) {
-		printf("commandLine: %s\n", commandLine);
+	if (xfer->directFD >= 0) {
+		close(xfer->directFD);
 	}
-	
-	//first strtok call parses first part of msg (<server name>)
-	token = strtok(commandLine, " \n\0");
-	strcpy(client, token);
-	if(DEBUG) {
-		printf("client: %s\n", client);
+	bufferPut(xfer->buffer);
+	bufferPut(xfer->next);
+	metricsAdd(M_XFER_SYSCALLS, xfer->syscalls);
+	xfer->syscalls = 0;
+	xfer->pipeFD[0] = xfer->pipeFD[1] = -1;
+	xfer->directFD = -1;
+	xfer->aio = 0;
+	xfer->buffer = xfer->next = NULL;
+}
+
+/*******************************************************************************************
+ * Function:        int transferDirect(struct transfer* xfer)
+ * Description:		Switches a transfer of a big, cold file to O_DIRECT reads into two
+ *                  pooled buffers: one goes out while the kernel reads the next one (Linux
+ *                  AIO, synchronous reads if that's unavailable). A one-off multi-GB get
+ *                  then doesn't push everyone else's hot files out of the page cache. A
+ *                  file whose first page is cached (another reader, or the same file sent
+ *                  a moment ago) stays on sendfile, which serves it from memory.
+ * Returns:         0 if the transfer reads O_DIRECT now, -1 if it stays as it was (small,
+ *                  cached, filesystem without O_DIRECT, or no buffers)
+ ********************************************************************************************/
+static int transferDirect(struct transfer* xfer) {
+	char path[64];
+	char probe;
+	struct iovec iov = { &probe, 1 };
+	int fd;
+
+	if (directMin == 0 || xfer->end - xfer->offset < directMin || xfer->method != XFER_SENDFILE ||
+			preadv2(xfer->fileFD, &iov, 1, xfer->offset, RWF_NOWAIT) >= 0 || errno != EAGAIN) {
+		return -1;
 	}
-	
-	//2nd strtok call parses second part of msg (<client IP address>)
-	token = strtok(NULL, " \n\0");
-	strcpy(clientIP, token);
-	printf("Servicing client %s\n", clientIP);
-	
-	//3rd strtok call parses third part of msg (<command>, can be -l -g)
-	token = strtok(NULL, " \n\0");
-	if(DEBUG) {
-		printf("Command: %s\n", token);
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", xfer->fileFD);
+	fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
 	}
-	
-	//command -l (list)
-	if(strcmp(token, "-l") == 0) {
-		//4th strtok call parses fourth part of msg (<data port>)
-		token = strtok(NULL, " \n\0");
-		dataPort = atoi(token);	// Get the port number, convert to an integer from a string
-		printf("List directory requested on port %d\n", dataPort);
-		listCmd(dataPort, clientIP);
+	xfer->buffer = bufferGet();
+	xfer->next = bufferGet();
+	if (xfer->buffer == NULL || xfer->next == NULL) {
+		bufferPut(xfer->buffer);
+		bufferPut(xfer->next);
+		xfer->buffer = xfer->next = NULL;
+		close(fd);
+		return -1;
 	}
-	
-	//command -g (get)
-	else if(strcmp(token, "-g") == 0) {
-		//4th strtok call parses fourth part of msg (<filename>)
-		token = strtok(NULL, " \n\0");
-		strcpy(fileName, token);
-		//5th strtok call parses fifth part of msg (<data port>)
-		token = strtok(NULL, " \n\0");
-		dataPort = atoi(token);	 // Get the port number, convert to an integer from a string
-		printf("File %s requested on port %d\n", fileName, dataPort);
-		
-		if(stat(fileName, &findFile) == 0) {
-			memset(buffer, '\0', sizeof(buffer));
-			sprintf(buffer, "Transferring file: %s...", fileName);
-			write(controlSocket, buffer, strlen(buffer));
-			sendFile(dataPort, fileName, clientIP);
-		}
-		else {
-			printf("ERROR: file stat error. Sending error message to %s:%d\n", clientIP, dataPort);
-			memset(buffer, '\0', sizeof(buffer));
-			sprintf(buffer, "ERROR: file not found, unable to open %s", fileName);
-			sendMessage(controlSocket, buffer);
+	if (syscall(__NR_io_setup, 1, &xfer->aio) < 0) {
+		xfer->aio = 0;
+	}
+	xfer->directFD = fd;
+	xfer->readOffset = xfer->offset & ~(off_t)(DIRECT_ALIGN - 1);
+	xfer->bufLen = xfer->bufPos = 0;
+	xfer->method = XFER_DIRECT;
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        int transferFallback(struct transfer* xfer)
+ * Description:		Moves a transfer to the next slower method after the current one
+ *                  reported EINVAL/ENOSYS/EOPNOTSUPP on its first use.
+ * Returns:         0, or -1 if there was nothing left to fall back to
+ ********************************************************************************************/
+static int transferFallback(struct transfer* xfer) {
+	if (xfer->method == XFER_SENDFILE) {
+		if (pipe2(xfer->pipeFD, O_CLOEXEC) == 0) {
+			fcntl(xfer->pipeFD[1], F_SETPIPE_SZ, PIPE_SIZE);	//best effort, default is 64K
+			xfer->method = XFER_SPLICE;
+			return 0;
 		}
+		xfer->pipeFD[0] = xfer->pipeFD[1] = -1;
 	}
-	
-	//command cd (change directory)
-	else if (strncmp(token, "cd", 2) == 0) {
-		//4th strtok call parses fourth part of msg (<directory>)
-		token = strtok(NULL, " \n\0");
-		strcpy(newDir, token);
-		printf("Server directory change to \"%s\" requested\n", newDir);
-		verify_cd = chdir(newDir);
-		
-		if(verify_cd == 0) {
-			printf("Directory successfully changed.\n");
-			memset(cwd, '\0', sizeof(cwd));
-			if(getcwd(cwd, sizeof(cwd)) != NULL) {
-				printf("Current Working Dir: %s\n", cwd);
-			}
-			else {
-				perror("getcwd() error\n");
-			}
-			memset(buffer, '\0', sizeof(buffer));
-			sprintf(buffer, "Server Current Directory: %s", cwd);
-			write(controlSocket, buffer, strlen(buffer));
+	if (xfer->method != XFER_BUFFERED) {
+		if (xfer->pipeFD[0] >= 0) {
+			close(xfer->pipeFD[0]);
+			close(xfer->pipeFD[1]);
+			xfer->pipeFD[0] = xfer->pipeFD[1] = -1;
 		}
-		else {
-			error("ERROR changing directories");
-			memset(buffer, '\0', sizeof(buffer));
-			sprintf(buffer, "ERROR: directory change failure");
-			write(controlSocket, buffer, strlen(buffer));
+		xfer->buffer = bufferGet();
+		if (xfer->buffer == NULL) {
+			return -1;
 		}
-		
+		xfer->method = XFER_BUFFERED;
+		return 0;
 	}
-	return NULL;
+	return -1;
 }
 
+static uint32_t crc32cTable[256];			//bytewise, when the cpu has no SSE4.2
+static uint32_t crc32cLaneShift[4][256];	//moves a crc register past CRC32C_LANE zero bytes
+static int crc32cHardware;
 
 /*******************************************************************************************
- * Function: 		int main(int argc, char *argv[])
- * Description:		main function of the client gets CL arguments, sets up server address,
- *			        connects to the socket, gets the user's handle, completes the TCP
- *			        handshake, send messages and receives messages from the server, closes
- *			        the connection when done chatting.
- * Parameters:		argv[0] is the program filename
- *                  argv[1] is the server's hostName (localhost)
- *                  argv[2] is the server's port #
- * Pre-Conditions: 	The server must be running at the specified socket
- * Post-Conditions: The two hosts exchange messages, when the client or server quits the
- *			        socket is closed and the program terminates.
+ * Function:        uint32_t gf2Times(const uint32_t* mat, uint32_t vec)
+ * Description:		Multiplies a 32x32 matrix over GF(2) (one column per word) by a vector
  ********************************************************************************************/
-int main(int argc, char *argv[]) {
-	int portNumber;			//server port #
-	int listenSocket;		//server listening socket
-	int establishedConnect;	//client socket
-	
-	// for getnameinfo()
-	char host[1024];
-	char service[20];
-	
-	struct sockaddr_in serverAddress;
-	struct sockaddr_in clientAddress;
-	socklen_t sizeOfClientInfo;	//size of client address
-	pthread_t newThread;	//multi-threaded
+static uint32_t gf2Times(const uint32_t* mat, uint32_t vec) {
+	uint32_t sum = 0;
 
-	// Check usage & args
-	if (argc != 2) {
-		fprintf(stderr,"USAGE: %s <port number>\n", argv[0]);
-		exit(1);
+	while (vec) {
+		if (vec & 1) {
+			sum ^= *mat;
+		}
+		vec >>= 1;
+		mat++;
 	}
+	return sum;
+}
 
-	// Get the port number, convert to an integer from a string
-	portNumber = atoi(argv[1]);
-	
-	// Set up server address struct, connect socket to port
-	listenSocket = serverSocketInit(portNumber);
-	
-	// Flip the socket on- can now receive up to 5 connections
-	listen(listenSocket, 5);
-	printf("FTServer listening on port %d...\n", portNumber);
-	
-	// Get the size of the address for the client that will connect
-	sizeOfClientInfo = sizeof(clientAddress);
+static void gf2Square(uint32_t* square, const uint32_t* mat) {
+	int n;
+
+	for (n = 0; n < 32; n++) {
+		square[n] = gf2Times(mat, mat[n]);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        uint32_t crc32cShift(uint32_t crc, uint64_t len)
+ * Description:		Feeds len zero bytes through a crc register in O(log len) steps, by
+ *                  squaring the one-zero-bit operator (the zlib crc32_combine() method)
+ ********************************************************************************************/
+static uint32_t crc32cShift(uint32_t crc, uint64_t len) {
+	uint32_t even[32];
+	uint32_t odd[32];
+	uint32_t row = 1;
+	int n;
 
-	while(1) {
-		// Accept connections from clients
-		establishedConnect = accept(listenSocket, (struct sockaddr *)&clientAddress, &sizeOfClientInfo);
-		if(establishedConnect < 0) {
-			error("ERROR on accept");
+	if (len == 0) {
+		return crc;
+	}
+	odd[0] = CRC32C_POLY;		//one zero bit
+	for (n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2Square(even, odd);		//two zero bits
+	gf2Square(odd, even);		//four zero bits
+	do {
+		gf2Square(even, odd);
+		if (len & 1) {
+			crc = gf2Times(even, crc);
 		}
-		
-		// Get client's hostname
-		getnameinfo(&clientAddress, sizeof(clientAddress), host, sizeof(host), service, sizeof(service), 0);
-		printf("Connection established with %s\n", host);
-		
-		// New thread for each client
-		// https://stackoverflow.com/questions/6990888/c-how-to-create-thread-using-pthread-create-function
-		// 1) pointer to pthread_t structure which will be filled with info
-		// 2) attributes for thread (NULL- default)
-		// 3) start_routine (a function pointer)- where the new thread starts execution
-		// 4) argument passed to start_routine
-		if(pthread_create(&newThread, NULL, ftp_work, (void*)&establishedConnect) < 0) {
-			error("ERROR creating thread");
+		len >>= 1;
+		if (len == 0) {
+			break;
 		}
-	}
-	
-	// Close the socket
-	close(listenSocket);
-	printf("Connection closed. Goodbye!\n");
- 
+		gf2Square(odd, even);
+		if (len & 1) {
+			crc = gf2Times(odd, crc);
+		}
+		len >>= 1;
+	} while (len != 0);
+	return crc;
+}
+
+/*******************************************************************************************
+ * Function:        uint32_t crc32cCombine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+ * Description:		The CRC32C of A followed by B from the CRC32Cs of A and B (B len2 long)
+ ********************************************************************************************/
+static uint32_t crc32cCombine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+	return crc32cShift(crc1, len2) ^ crc2;
+}
+
+/*******************************************************************************************
+ * Function:        void crc32cInit(void)
+ * Description:		Builds the tables and picks the SSE4.2 path if the cpu has it
+ ********************************************************************************************/
+static void crc32cInit(void) {
+	uint32_t lane[32];
+	uint32_t crc;
+	int b;
+	int k;
+
+	for (b = 0; b < 256; b++) {
+		crc = b;
+		for (k = 0; k < 8; k++) {
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc32cTable[b] = crc;
+	}
+	for (k = 0; k < 32; k++) {
+		lane[k] = crc32cShift(1u << k, CRC32C_LANE);
+	}
+	for (k = 0; k < 4; k++) {
+		for (b = 0; b < 256; b++) {
+			crc32cLaneShift[k][b] = gf2Times(lane, (uint32_t)b << (8 * k));
+		}
+	}
+#if defined(__x86_64__)
+	crc32cHardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+/*******************************************************************************************
+ * Function:        uint32_t crc32cSSE42(uint32_t crc, const unsigned char* p, size_t len)
+ * Description:		The crc32 instruction has a latency of 3 cycles but issues every cycle,
+ *                  so blocks of 3 * CRC32C_LANE bytes run as three independent lanes,
+ *                  joined with the lane shift table
+ * Parameters:		the (un-inverted) crc register, the bytes
+ ********************************************************************************************/
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSSE42(uint32_t crc, const unsigned char* p, size_t len) {
+	uint64_t c0 = crc;
+	uint64_t c1;
+	uint64_t c2;
+	uint64_t v0;
+	uint64_t v1;
+	uint64_t v2;
+	size_t i;
+
+	while (len > 0 && ((uintptr_t)p & 7)) {
+		c0 = _mm_crc32_u8(c0, *p++);
+		len--;
+	}
+	while (len >= 3 * CRC32C_LANE) {
+		c1 = c2 = 0;
+		for (i = 0; i < CRC32C_LANE; i += 8) {
+			memcpy(&v0, p + i, 8);
+			memcpy(&v1, p + CRC32C_LANE + i, 8);
+			memcpy(&v2, p + 2 * CRC32C_LANE + i, 8);
+			c0 = _mm_crc32_u64(c0, v0);
+			c1 = _mm_crc32_u64(c1, v1);
+			c2 = _mm_crc32_u64(c2, v2);
+		}
+		c0 = crc32cLaneShift[0][c0 & 0xff] ^ crc32cLaneShift[1][(c0 >> 8) & 0xff] ^
+			 crc32cLaneShift[2][(c0 >> 16) & 0xff] ^ crc32cLaneShift[3][c0 >> 24] ^ c1;
+		c0 = crc32cLaneShift[0][c0 & 0xff] ^ crc32cLaneShift[1][(c0 >> 8) & 0xff] ^
+			 crc32cLaneShift[2][(c0 >> 16) & 0xff] ^ crc32cLaneShift[3][c0 >> 24] ^ c2;
+		p += 3 * CRC32C_LANE;
+		len -= 3 * CRC32C_LANE;
+	}
+	while (len >= 8) {
+		memcpy(&v0, p, 8);
+		c0 = _mm_crc32_u64(c0, v0);
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		c0 = _mm_crc32_u8(c0, *p++);
+	}
+	return c0;
+}
+#endif
+
+/*******************************************************************************************
+ * Function:        uint32_t crc32c(uint32_t crc, const void* buf, size_t len)
+ * Description:		Extends a CRC32C (Castagnoli, as in iSCSI/ext4) with len more bytes.
+ *                  Start from 0.
+ ********************************************************************************************/
+static uint32_t crc32c(uint32_t crc, const void* buf, size_t len) {
+	const unsigned char* p = buf;
+
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (crc32cHardware) {
+		return ~crc32cSSE42(crc, p, len);
+	}
+#endif
+	while (len-- > 0) {
+		crc = crc32cTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+/*******************************************************************************************
+ * Function:        void transferSum(struct transfer* xfer, const char* bytes, size_t len)
+ * Description:		Adds bytes that just went out to the transfer's checksum, from the buffer
+ *                  they were sent from. sendfile/splice never bring the data into user
+ *                  space, so a transfer that has to be summed doesn't use them: transferStep()
+ *                  moves it to the buffered path, and only gets whose CRC the index already
+ *                  has go out zero-copy.
+ * Pre-Conditions: 	bytes were sent in file order
+ ********************************************************************************************/
+static void transferSum(struct transfer* xfer, const char* bytes, size_t len) {
+	if (xfer->checksum == 1 && len > 0) {
+		xfer->crc = crc32c(xfer->crc, bytes, len);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void directAhead(struct transfer* xfer)
+ * Description:		Starts the read of the next POOL_BUF of the file into xfer->next. If
+ *                  it can't be queued the next fill reads synchronously.
+ ********************************************************************************************/
+static void directAhead(struct transfer* xfer) {
+	struct iocb* queue[1] = { &xfer->iocb };
+
+	if (xfer->aio == 0 || xfer->readOffset >= xfer->end) {
+		return;
+	}
+	memset(&xfer->iocb, 0, sizeof(xfer->iocb));
+	xfer->iocb.aio_lio_opcode = IOCB_CMD_PREAD;
+	xfer->iocb.aio_fildes = xfer->directFD;
+	xfer->iocb.aio_buf = (uint64_t)(uintptr_t)xfer->next;
+	xfer->iocb.aio_nbytes = POOL_BUF;
+	xfer->iocb.aio_offset = xfer->readOffset;
+	xfer->syscalls++;
+	if (syscall(__NR_io_submit, xfer->aio, 1, queue) == 1) {
+		xfer->nextPending = 1;
+		xfer->nextOffset = xfer->readOffset;
+		xfer->readOffset += POOL_BUF;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        int directFill(struct transfer* xfer)
+ * Description:		Refills the (empty) send buffer: takes the read ahead if one is in
+ *                  flight, otherwise reads, and starts the next read ahead. Only the bytes
+ *                  of the range go out, the aligned read may start before it and end past it.
+ * Returns:         0, -1 with errno set on a read error or a file that got shorter
+ ********************************************************************************************/
+static int directFill(struct transfer* xfer) {
+	struct io_event event;
+	char* swap;
+	off_t at;
+	ssize_t n;
+	size_t skip;
+
+	if (xfer->nextPending) {
+		while ((n = syscall(__NR_io_getevents, xfer->aio, 1, 1, &event, NULL)) < 0 && errno == EINTR)
+			;
+		xfer->syscalls++;
+		if (n == 1 && event.res < 0) {
+			errno = -event.res;
+			n = -1;
+		}
+		else if (n == 1) {
+			n = event.res;
+		}
+		xfer->nextPending = 0;
+		at = xfer->nextOffset;
+		swap = xfer->buffer;
+		xfer->buffer = xfer->next;
+		xfer->next = swap;
+	}
+	else {
+		at = xfer->readOffset;
+		while ((n = pread(xfer->directFD, xfer->buffer, POOL_BUF, at)) < 0 && errno == EINTR)
+			;
+		xfer->syscalls++;
+		xfer->readOffset += POOL_BUF;
+	}
+	if (n < 0) {
+		return -1;
+	}
+	skip = xfer->offset - at;
+	if ((size_t)n <= skip || (n < POOL_BUF && at + n < xfer->end)) {	//shrank underneath us
+		errno = EIO;
+		return -1;
+	}
+	xfer->bufPos = skip;
+	xfer->bufLen = at + n < xfer->end ? (size_t)n : (size_t)(xfer->end - at);
+	transferSum(xfer, xfer->buffer + skip, xfer->bufLen - skip);
+	xfer->offset = at + xfer->bufLen;
+	directAhead(xfer);
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        int transferStep(struct transfer* xfer, int socketFD)
+ * Description:		Pushes up to TRANSFER_CHUNK bytes of the file to socketFD. Short writes
+ *                  and EINTR are retried, EAGAIN on a non-blocking socket is reported back
+ *                  so the caller can wait for the socket to drain. With xfer->checksum
+ *                  the bytes are added to xfer->crc as they go.
+ * Parameters:		the transfer state and the connected data socket
+ * Returns:         TRANSFER_DONE when the whole range is on the wire, TRANSFER_MORE if
+ *                  there is more to send, TRANSFER_BLOCKED if the socket is full,
+ *                  TRANSFER_ERROR (errno set) on failure
+ ********************************************************************************************/
+int transferStep(struct transfer* xfer, int socketFD) {
+	size_t budget = xfer->stepMax ? xfer->stepMax : TRANSFER_CHUNK;
+	ssize_t n;
+	
+	while (budget > 0) {
+		size_t want;
+		
+		if (xfer->offset >= xfer->end && xfer->pipeBytes == 0 && xfer->bufPos >= xfer->bufLen) {
+			return TRANSFER_DONE;
+		}
+		want = xfer->end - xfer->offset;
+		if (want > budget) {
+			want = budget;
+		}
+		
+		switch (xfer->method) {
+		case XFER_SENDFILE:
+			if (xfer->tls != NULL || xfer->checksum == 1) {	//the kernel can't encrypt or sum what sendfile() moves
+				xfer->buffer = bufferGet();
+				if (xfer->buffer == NULL) {
+					return TRANSFER_ERROR;
+				}
+				xfer->method = XFER_BUFFERED;
+				continue;
+			}
+			n = sendfile(socketFD, xfer->fileFD, &xfer->offset, want);
+			xfer->syscalls++;
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN) return TRANSFER_BLOCKED;
+				if ((errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) &&
+						transferFallback(xfer) == 0) continue;
+				return TRANSFER_ERROR;
+			}
+			if (n == 0) {	//file shrank underneath us
+				errno = EIO;
+				return TRANSFER_ERROR;
+			}
+			budget -= n;
+			break;
+		
+		case XFER_SPLICE:
+			if (xfer->pipeBytes == 0) {
+				loff_t off = xfer->offset;
+				n = splice(xfer->fileFD, &off, xfer->pipeFD[1], NULL, want, SPLICE_F_MOVE);
+				xfer->syscalls++;
+				if (n < 0) {
+					if (errno == EINTR) continue;
+					if ((errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) &&
+							transferFallback(xfer) == 0) continue;
+					return TRANSFER_ERROR;
+				}
+				if (n == 0) {
+					errno = EIO;
+					return TRANSFER_ERROR;
+				}
+				xfer->offset = off;
+				xfer->pipeBytes = n;
+			}
+			n = splice(xfer->pipeFD[0], NULL, socketFD, NULL, xfer->pipeBytes,
+					   SPLICE_F_MOVE | (xfer->offset < xfer->end ? SPLICE_F_MORE : 0));
+			xfer->syscalls++;
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN) return TRANSFER_BLOCKED;
+				return TRANSFER_ERROR;
+			}
+			xfer->pipeBytes -= n;
+			budget -= (size_t)n < budget ? (size_t)n : budget;
+			break;
+		
+		case XFER_MEMORY:
+			n = tlsSend(xfer->tls, socketFD, xfer->data + xfer->offset, want,
+						MSG_NOSIGNAL | (xfer->offset + (off_t)want < xfer->end ? MSG_MORE : 0));
+			xfer->syscalls++;
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN) return TRANSFER_BLOCKED;
+				return TRANSFER_ERROR;
+			}
+			transferSum(xfer, xfer->data + xfer->offset, n);
+			xfer->offset += n;
+			budget -= n;
+			break;
+
+		case XFER_BUFFERED:
+			if (xfer->bufPos >= xfer->bufLen) {
+				if (want > POOL_BUF) {
+					want = POOL_BUF;
+				}
+				n = pread(xfer->fileFD, xfer->buffer, want, xfer->offset);
+				xfer->syscalls++;
+				if (n < 0) {
+					if (errno == EINTR) continue;
+					return TRANSFER_ERROR;
+				}
+				if (n == 0) {
+					errno = EIO;
+					return TRANSFER_ERROR;
+				}
+				transferSum(xfer, xfer->buffer, n);
+				xfer->offset += n;
+				xfer->bufLen = n;
+				xfer->bufPos = 0;
+			}
+			n = tlsSend(xfer->tls, socketFD, xfer->buffer + xfer->bufPos, xfer->bufLen - xfer->bufPos, MSG_NOSIGNAL);
+			xfer->syscalls++;
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN) return TRANSFER_BLOCKED;
+				return TRANSFER_ERROR;
+			}
+			xfer->bufPos += n;
+			budget -= (size_t)n < budget ? (size_t)n : budget;
+			break;
+
+		case XFER_DIRECT:
+			if (xfer->bufPos >= xfer->bufLen && directFill(xfer) < 0) {
+				return TRANSFER_ERROR;
+			}
+			n = tlsSend(xfer->tls, socketFD, xfer->buffer + xfer->bufPos, xfer->bufLen - xfer->bufPos,
+						MSG_NOSIGNAL | (xfer->offset < xfer->end ? MSG_MORE : 0));
+			xfer->syscalls++;
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN) return TRANSFER_BLOCKED;
+				return TRANSFER_ERROR;
+			}
+			xfer->bufPos += n;
+			budget -= (size_t)n < budget ? (size_t)n : budget;
+			break;
+		}
+	}
+	
+	if (xfer->offset >= xfer->end && xfer->pipeBytes == 0 && xfer->bufPos >= xfer->bufLen) {
+		return TRANSFER_DONE;
+	}
+	return TRANSFER_MORE;
+}
+
+static struct fileCache fileCache = { .lock = PTHREAD_MUTEX_INITIALIZER, .budget = (size_t)CACHE_BUDGET << 20 };
+
+static void submitJob(struct workerPool* pool, int home, struct job* job);
+static void cacheRelease(struct cacheEntry* e);
+
+/*******************************************************************************************
+ * Function:        void lruUnlink(struct cacheEntry* e)
+ * Description:		Takes an entry off the idle list
+ * Pre-Conditions: 	fileCache.lock is held
+ ********************************************************************************************/
+static void lruUnlink(struct cacheEntry* e) {
+	if (e->lruPrev) e->lruPrev->lruNext = e->lruNext;
+	else fileCache.lruHead = e->lruNext;
+	if (e->lruNext) e->lruNext->lruPrev = e->lruPrev;
+	else fileCache.lruTail = e->lruPrev;
+	e->lruPrev = e->lruNext = NULL;
+}
+
+/*******************************************************************************************
+ * Function:        void cacheUnhash(struct cacheEntry* e)
+ * Description:		Removes an entry from the hash table and the cache's totals. It stays
+ *                  valid for whoever still holds a reference.
+ * Pre-Conditions: 	fileCache.lock is held, e is linked
+ ********************************************************************************************/
+static void cacheUnhash(struct cacheEntry* e) {
+	struct cacheEntry** link = &fileCache.buckets[(e->dev ^ e->ino) % CACHE_BUCKETS];
+
+	while (*link != e) {
+		link = &(*link)->hashNext;
+	}
+	*link = e->hashNext;
+	e->linked = 0;
+	fileCache.files--;
+	if (e->data || e->filling) {
+		fileCache.held -= e->size;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void cacheEntryFree(struct cacheEntry* e)
+ * Description:		Frees and closes an entry nobody uses any more
+ ********************************************************************************************/
+static void cacheEntryFree(struct cacheEntry* e) {
+	free(e->data);
+	close(e->fd);
+	free(e);
+}
+
+/*******************************************************************************************
+ * Function:        struct cacheEntry* cacheEvict(void)
+ * Description:		Unlinks the least recently used idle entry
+ * Pre-Conditions: 	fileCache.lock is held
+ * Returns:         the entry for the caller to free outside the lock, NULL if every
+ *                  entry is in use
+ ********************************************************************************************/
+static struct cacheEntry* cacheEvict(void) {
+	struct cacheEntry* e = fileCache.lruTail;
+
+	if (e == NULL) {
+		return NULL;
+	}
+	lruUnlink(e);
+	cacheUnhash(e);
+	fileCache.evictions++;
+	return e;
+}
+
+/*******************************************************************************************
+ * Function:        char* cacheRead(int fd, off_t size)
+ * Description:		Reads a small file into memory for the cache. A copy rather than a
+ *                  mapping: a file truncated while it's being sent would raise SIGBUS on
+ *                  a mapping and take the whole server down, a copy just goes on being the
+ *                  version the entry is keyed on. The server never maps files for the
+ *                  same reason, everything that reads them uses pread().
+ * Returns:         the contents, NULL if out of memory or the file didn't have size bytes
+ ********************************************************************************************/
+static char* cacheRead(int fd, off_t size) {
+	char* data = malloc(size);
+	off_t have = 0;
+	ssize_t n;
+
+	while (data != NULL && have < size) {
+		n = pread(fd, data + have, size - have, have);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			free(data);
+			return NULL;
+		}
+		have += n;
+	}
+	return data;
+}
+
+/*******************************************************************************************
+ * Function:        void runCacheFill(struct job* job)
+ * Description:		Worker side of a cache fill: reads the entry's file into a copy, kept
+ *                  only if the file still has the size and mtime the entry was made with
+ ********************************************************************************************/
+static void runCacheFill(struct job* job) {
+	struct cacheEntry* e = containerOf(job, struct cacheEntry, fillJob);
+	struct stat after;
+
+	e->fillData = cacheRead(e->fd, e->size);
+	if (e->fillData != NULL && (fstat(e->fd, &after) < 0 || after.st_size != e->size ||
+			after.st_mtim.tv_sec != e->mtime.tv_sec || after.st_mtim.tv_nsec != e->mtime.tv_nsec)) {
+		free(e->fillData);
+		e->fillData = NULL;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void cacheFillDone(struct job* job)
+ * Description:		Reactor side of a cache fill: publishes the copy if the entry is still
+ *                  cached, else gives the budget it had reserved back, and drops the fill's
+ *                  reference. Requests that started before this keep sending from the fd.
+ ********************************************************************************************/
+static void cacheFillDone(struct job* job) {
+	struct cacheEntry* e = containerOf(job, struct cacheEntry, fillJob);
+	char* unused = NULL;
+
+	pthread_mutex_lock(&fileCache.lock);
+	if (e->linked && e->fillData != NULL) {
+		e->data = e->fillData;
+	}
+	else {
+		if (e->linked) {
+			fileCache.held -= e->size;
+		}
+		unused = e->fillData;		//unlinked entries hold no copy, they'd be outside the budget
+	}
+	e->fillData = NULL;
+	e->filling = 0;
+	pthread_mutex_unlock(&fileCache.lock);
+	free(unused);
+	cacheRelease(e);
+}
+
+/*******************************************************************************************
+ * Function:        struct cacheEntry* cacheAcquire(struct reactor* r, int dirFD, const char* path,
+ *                                                  struct stat* info)
+ * Description:		Looks a file up in the process-wide hot-file cache, opening it on a miss.
+ *                  Entries are keyed by (dev, inode, mtime, size), so a file that changed
+ *                  since it was cached gets a fresh entry; requests already using the old
+ *                  one keep it until they release it. A new entry goes into the table at
+ *                  once, so concurrent misses on the same file share it (and its one
+ *                  read). If the file is small enough and its size fits in the -c budget
+ *                  (after evicting idle entries), the budget is reserved and a worker reads
+ *                  the copy (runCacheFill()); until it's there requests send from the fd.
+ *                  Idle entries are evicted least recently used first to stay within
+ *                  CACHE_MAX_FILES and the budget. Only open and fstat run on the caller.
+ * Parameters:		the calling reactor (NULL: never copy the file), the directory the path
+ *                  is relative to, the path and where to put its stat() information
+ * Returns:         a referenced entry (release it with cacheRelease()), or NULL with errno
+ *                  set if the file can't be opened
+ ********************************************************************************************/
+static struct cacheEntry* cacheAcquire(struct reactor* r, int dirFD, const char* path, struct stat* info) {
+	struct cacheEntry* e;
+	struct cacheEntry* stale = NULL;
+	struct cacheEntry* evicted[8];
+	struct cacheEntry* fresh;
+	struct stat opened;
+	int nEvicted = 0;
+	int copy;
+	int fd;
+
+	if (fstatat(dirFD, path, info, 0) < 0) {
+		return NULL;
+	}
+	if (!S_ISREG(info->st_mode)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&fileCache.lock);
+	for (e = fileCache.buckets[(info->st_dev ^ info->st_ino) % CACHE_BUCKETS]; e != NULL; e = e->hashNext) {
+		if (e->dev == info->st_dev && e->ino == info->st_ino) {
+			break;
+		}
+	}
+	if (e != NULL && e->size == info->st_size && e->mtime.tv_sec == info->st_mtim.tv_sec &&
+			e->mtime.tv_nsec == info->st_mtim.tv_nsec) {
+		if (e->refs++ == 0) {
+			lruUnlink(e);
+		}
+		pthread_mutex_unlock(&fileCache.lock);
+		fileCache.hits++;
+		return e;
+	}
+	if (e != NULL) {		//the file changed, drop the old version
+		cacheUnhash(e);
+		if (e->refs == 0) {
+			lruUnlink(e);
+			stale = e;
+		}
+	}
+	pthread_mutex_unlock(&fileCache.lock);
+	if (stale) {
+		cacheEntryFree(stale);
+	}
+	fileCache.misses++;
+
+	// miss: open outside the lock
+	fd = openat(dirFD, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	e = calloc(1, sizeof(*e));
+	if (e == NULL || fstat(fd, &opened) < 0) {
+		free(e);
+		close(fd);
+		return NULL;
+	}
+	*info = opened;		//what we actually opened is what gets served
+	e->dev = opened.st_dev;
+	e->ino = opened.st_ino;
+	e->mtime = opened.st_mtim;
+	e->ctime = opened.st_ctim;
+	e->size = opened.st_size;
+	e->fd = fd;
+	e->refs = 1;
+	copy = r != NULL && e->size > 0 && e->size <= CACHE_COPY_MAX && (size_t)e->size <= fileCache.budget;
+
+	pthread_mutex_lock(&fileCache.lock);
+	for (fresh = fileCache.buckets[(e->dev ^ e->ino) % CACHE_BUCKETS]; fresh != NULL; fresh = fresh->hashNext) {
+		if (fresh->dev == e->dev && fresh->ino == e->ino) {
+			break;
+		}
+	}
+	if (fresh != NULL && fresh->size == e->size && fresh->mtime.tv_sec == e->mtime.tv_sec &&
+			fresh->mtime.tv_nsec == e->mtime.tv_nsec) {
+		// another request opened it first, share theirs
+		if (fresh->refs++ == 0) {
+			lruUnlink(fresh);
+		}
+		pthread_mutex_unlock(&fileCache.lock);
+		cacheEntryFree(e);
+		return fresh;
+	}
+	if (fresh != NULL) {
+		cacheUnhash(fresh);
+		if (fresh->refs == 0) {
+			lruUnlink(fresh);
+			evicted[nEvicted++] = fresh;
+		}
+	}
+	while (nEvicted < 8 && (fileCache.files >= CACHE_MAX_FILES ||
+			(copy && fileCache.held + e->size > fileCache.budget))) {
+		if ((evicted[nEvicted] = cacheEvict()) == NULL) {
+			break;
+		}
+		nEvicted++;
+	}
+	if (fileCache.files < CACHE_MAX_FILES) {
+		e->hashNext = fileCache.buckets[(e->dev ^ e->ino) % CACHE_BUCKETS];
+		fileCache.buckets[(e->dev ^ e->ino) % CACHE_BUCKETS] = e;
+		e->linked = 1;
+		fileCache.files++;
+		if (copy && fileCache.held + e->size <= fileCache.budget) {
+			fileCache.held += e->size;		//reserved now, so concurrent fills can't overrun it
+			e->filling = 1;
+			e->refs++;						//the fill's, dropped by cacheFillDone()
+		}
+	}
+	pthread_mutex_unlock(&fileCache.lock);
+	while (nEvicted > 0) {
+		cacheEntryFree(evicted[--nEvicted]);
+	}
+	if (e->filling) {
+		e->fillJob.run = runCacheFill;
+		e->fillJob.done = cacheFillDone;
+		e->fillJob.owner = r;
+		submitJob(r->pool, r->id, &e->fillJob);
+	}
+	return e;		//unlinked if the cache is full of busy files: private, never copied, freed on release
+}
+
+/*******************************************************************************************
+ * Function:        void cacheRelease(struct cacheEntry* e)
+ * Description:		Drops a request's reference. The last reference to a cached entry makes
+ *                  it the most recently used idle entry, an unlinked one is freed.
+ ********************************************************************************************/
+static void cacheRelease(struct cacheEntry* e) {
+	int dead = 0;
+
+	pthread_mutex_lock(&fileCache.lock);
+	if (--e->refs == 0) {
+		if (e->linked) {
+			e->lruPrev = NULL;
+			e->lruNext = fileCache.lruHead;
+			if (fileCache.lruHead) {
+				fileCache.lruHead->lruPrev = e;
+			}
+			else {
+				fileCache.lruTail = e;
+			}
+			fileCache.lruHead = e;
+		}
+		else {
+			dead = 1;
+		}
+	}
+	pthread_mutex_unlock(&fileCache.lock);
+	if (dead) {
+		cacheEntryFree(e);
+	}
+}
+
+static struct sumIndex sumIndex = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1, .lockFD = -1 };
+
+/*******************************************************************************************
+ * Function:        struct sumEntry* sumFind(dev_t dev, ino_t ino)
+ * Description:		Looks up the index entry of a file, whatever version of it was summed
+ * Pre-Conditions: 	sumIndex.lock is held
+ ********************************************************************************************/
+static struct sumEntry* sumFind(dev_t dev, ino_t ino) {
+	struct sumEntry* e;
+
+	for (e = sumIndex.buckets[(ino ^ dev) % SUM_BUCKETS]; e != NULL; e = e->next) {
+		if (e->dev == dev && e->ino == ino) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/*******************************************************************************************
+ * Function:        void sumInsert(const struct sumRecord* r)
+ * Description:		Puts a checksum in the in-memory index. A file keeps one entry, a newer
+ *                  version replaces the old one's.
+ * Pre-Conditions: 	sumIndex.lock is held
+ ********************************************************************************************/
+static void sumInsert(const struct sumRecord* r) {
+	struct sumEntry* e = sumFind(r->dev, r->ino);
+	size_t bucket;
+
+	if (e == NULL) {
+		e = calloc(1, sizeof(*e));
+		if (e == NULL) {
+			return;
+		}
+		e->dev = r->dev;
+		e->ino = r->ino;
+		bucket = (e->ino ^ e->dev) % SUM_BUCKETS;
+		e->next = sumIndex.buckets[bucket];
+		sumIndex.buckets[bucket] = e;
+		sumIndex.entries++;
+	}
+	e->mtime.tv_sec = r->mtimeSec;
+	e->mtime.tv_nsec = r->mtimeNsec;
+	e->ctime.tv_sec = r->ctimeSec;
+	e->ctime.tv_nsec = r->ctimeNsec;
+	e->size = r->size;
+	e->crc = r->crc;
+}
+
+/*******************************************************************************************
+ * Function:        void sumRecordOf(struct sumRecord* r, const struct stat* info, uint32_t crc)
+ * Description:		Fills in the on-disk record of a file's checksum
+ ********************************************************************************************/
+static void sumRecordOf(struct sumRecord* r, const struct stat* info, uint32_t crc) {
+	memset(r, 0, sizeof(*r));
+	r->dev = info->st_dev;
+	r->ino = info->st_ino;
+	r->mtimeSec = info->st_mtim.tv_sec;
+	r->mtimeNsec = info->st_mtim.tv_nsec;
+	r->ctimeSec = info->st_ctim.tv_sec;
+	r->ctimeNsec = info->st_ctim.tv_nsec;
+	r->size = info->st_size;
+	r->crc = crc;
+	r->check = crc32c(0, r, offsetof(struct sumRecord, check));
+}
+
+/*******************************************************************************************
+ * Function:        int sumReopen(void)
+ * Description:		Makes sumIndex.fd the file that is at sumIndex.path now: another server
+ *                  sharing the index may have compacted it (renamed a new file over it)
+ *                  since it was opened, and appends to the old one would be lost.
+ * Returns:         0, or -1 with errno set if the index can't be opened
+ * Pre-Conditions: 	sumIndex.lockFD is flock()ed exclusively
+ ********************************************************************************************/
+static int sumReopen(void) {
+	struct stat named;
+	struct stat held;
+
+	if (sumIndex.fd >= 0 && stat(sumIndex.path, &named) == 0 && fstat(sumIndex.fd, &held) == 0 &&
+			named.st_dev == held.st_dev && named.st_ino == held.st_ino) {
+		return 0;
+	}
+	if (sumIndex.fd >= 0) {
+		close(sumIndex.fd);
+	}
+	sumIndex.fd = open(sumIndex.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	return sumIndex.fd < 0 ? -1 : 0;
+}
+
+static const struct sumRecord* sumSorting;		//the records sumOrder() compares, set by sumCompact()
+
+/*******************************************************************************************
+ * Function:        int sumOrder(const void* a, const void* b)
+ * Description:		qsort() order of record numbers: by file (device, inode), then by
+ *                  position, so the last record of a file ends its run
+ ********************************************************************************************/
+static int sumOrder(const void* a, const void* b) {
+	size_t i = *(const size_t*)a;
+	size_t j = *(const size_t*)b;
+	const struct sumRecord* x = &sumSorting[i];
+	const struct sumRecord* y = &sumSorting[j];
+
+	if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+	if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+	return i < j ? -1 : i > j;
+}
+
+/*******************************************************************************************
+ * Function:        void sumCompact(void)
+ * Description:		Rewrites the index file with one record per file, the last one. The
+ *                  file is read back rather than written from memory, since other servers
+ *                  sharing it append files this one never saw. Runs under the index's
+ *                  flock, through a temporary file named after this process and rename(),
+ *                  so a crash leaves the old or the new one and two servers compacting at
+ *                  once don't write each other's temporary file. Lookups go on meanwhile.
+ * Pre-Conditions: 	the index is persistent and the caller is this process's only writer
+ *                  (sumLoad() at startup, the flush job after that)
+ ********************************************************************************************/
+static void sumCompact(void) {
+	char tmp[sizeof(sumIndex.path) + 32];
+	struct sumRecord* records = NULL;
+	struct sumRecord* kept = NULL;
+	size_t* order = NULL;
+	struct stat info;
+	size_t count = 0;
+	size_t live = 0;
+	size_t i;
+	ssize_t n;
+	int fd;
+
+	flock(sumIndex.lockFD, LOCK_EX);
+	fd = open(sumIndex.path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &info) < 0) {
+		goto out;
+	}
+	records = malloc(info.st_size + sizeof(*records));
+	order = malloc((info.st_size / sizeof(*records) + 1) * sizeof(*order));
+	kept = malloc(info.st_size + sizeof(*records));
+	if (records == NULL || order == NULL || kept == NULL) {
+		goto out;
+	}
+	while (count < info.st_size / sizeof(*records) &&
+			(n = read(fd, &records[count], sizeof(*records))) == sizeof(*records)) {
+		if (records[count].check == crc32c(0, &records[count], offsetof(struct sumRecord, check))) {
+			order[count] = count;
+			count++;
+		}
+	}
+	sumSorting = records;
+	qsort(order, count, sizeof(*order), sumOrder);
+	for (i = 0; i < count; i++) {
+		if (i + 1 == count || records[order[i]].dev != records[order[i + 1]].dev ||
+				records[order[i]].ino != records[order[i + 1]].ino) {
+			kept[live++] = records[order[i]];
+		}
+	}
+	close(fd);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp.%d", sumIndex.path, (int)getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "WARNING: can't compact the checksum index: %s: %s\n", tmp, strerror(errno));
+		goto out;
+	}
+	if (write(fd, kept, live * sizeof(*kept)) != (ssize_t)(live * sizeof(*kept)) ||
+			fsync(fd) < 0 || rename(tmp, sumIndex.path) < 0) {
+		fprintf(stderr, "WARNING: can't compact the checksum index %s: %s\n", sumIndex.path, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+	if (sumReopen() == 0) {
+		pthread_mutex_lock(&sumIndex.lock);
+		sumIndex.records = live;
+		pthread_mutex_unlock(&sumIndex.lock);
+	}
+out:
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(records);
+	free(order);
+	free(kept);
+	flock(sumIndex.lockFD, LOCK_UN);
+}
+
+/*******************************************************************************************
+ * Function:        const char* sumDefaultPath(char* path, size_t len)
+ * Description:		Where the index lives without -i: SUM_INDEX in $XDG_CACHE_HOME, else in
+ *                  ~/.cache (created if missing). Never the served directory, where a
+ *                  list would show it and a get or put could reach it.
+ * Returns:         path, NULL if there's no home to put it in (memory only)
+ ********************************************************************************************/
+static const char* sumDefaultPath(char* path, size_t len) {
+	const char* cache = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+
+	if (cache != NULL && cache[0] == '/') {
+		snprintf(path, len, "%s", cache);
+	}
+	else if (home != NULL && home[0] == '/') {
+		snprintf(path, len, "%s/.cache", home);
+	}
+	else {
+		return NULL;
+	}
+	mkdir(path, 0700);		//usually there already
+	snprintf(path + strlen(path), len - strlen(path), "/%s", SUM_INDEX);
+	return path;
+}
+
+/*******************************************************************************************
+ * Function:        void sumLoad(const char* path)
+ * Description:		Opens the persistent checksum index (creating it if needed) and loads
+ *                  it. Records are appended as checksums are learned; the file is
+ *                  compacted here and whenever superseded records outnumber live ones.
+ *                  Several servers may share the file: each append and compaction holds
+ *                  an flock() on <path>.lock (the index itself is replaced by compaction,
+ *                  a lock on it wouldn't be seen by whoever opens the new one).
+ * Parameters:		the index file, NULL keeps the index in memory only
+ ********************************************************************************************/
+static void sumLoad(const char* path) {
+	char lockPath[sizeof(sumIndex.path) + 8];
+	struct sumRecord r;
+	ssize_t n;
+	int fd;
+	int torn = 0;
+
+	if (path == NULL) {
+		return;
+	}
+	snprintf(sumIndex.path, sizeof(sumIndex.path), "%s", path);
+	snprintf(lockPath, sizeof(lockPath), "%s.lock", path);
+	sumIndex.lockFD = open(lockPath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (sumIndex.lockFD < 0) {
+		perror("WARNING: can't open the checksum index lock, keeping the index in memory");
+		return;
+	}
+	flock(sumIndex.lockFD, LOCK_SH);		//no append or compaction half done while it's read
+	fd = open(path, O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		perror("WARNING: can't open the checksum index, keeping it in memory");
+		close(sumIndex.lockFD);
+		sumIndex.lockFD = -1;
+		return;
+	}
+	while ((n = read(fd, &r, sizeof(r))) == sizeof(r)) {
+		if (r.check != crc32c(0, &r, offsetof(struct sumRecord, check))) {
+			torn = 1;
+			continue;
+		}
+		sumInsert(&r);
+		sumIndex.records++;
+	}
+	close(fd);
+	flock(sumIndex.lockFD, LOCK_UN);
+	if (n != 0) {
+		torn = 1;
+	}
+	if (torn || sumIndex.records > 2 * sumIndex.entries) {
+		sumCompact();
+	}
+	printf("Checksum index %s: %lu files\n", path, sumIndex.entries);
+}
+
+/*******************************************************************************************
+ * Function:        int sumLookup(const struct stat* info, uint32_t* crc)
+ * Description:		Finds the CRC32C of exactly this version of a file (same device, inode,
+ *                  mtime, ctime and size), without reading it
+ * Returns:         1 and *crc set if the index has it, 0 if not
+ ********************************************************************************************/
+static int sumLookup(const struct stat* info, uint32_t* crc) {
+	struct sumEntry* e;
+	int found = 0;
+
+	pthread_mutex_lock(&sumIndex.lock);
+	e = sumFind(info->st_dev, info->st_ino);
+	if (e != NULL && e->size == info->st_size && e->mtime.tv_sec == info->st_mtim.tv_sec &&
+			e->mtime.tv_nsec == info->st_mtim.tv_nsec && e->ctime.tv_sec == info->st_ctim.tv_sec &&
+			e->ctime.tv_nsec == info->st_ctim.tv_nsec) {
+		*crc = e->crc;
+		found = 1;
+	}
+	pthread_mutex_unlock(&sumIndex.lock);
+	atomic_fetch_add(found ? &sumIndex.hits : &sumIndex.misses, 1);
+	return found;
+}
+
+/*******************************************************************************************
+ * Function:        void runSumFlush(struct job* job)
+ * Description:		Worker side of the index file: appends the records learned since the
+ *                  last flush in one write, under the index's flock and to whatever file
+ *                  is at its path now, and compacts the file once superseded records
+ *                  outnumber live ones. A failed append is reported, its records are
+ *                  dropped (they are learned again on the next miss).
+ ********************************************************************************************/
+static void runSumFlush(struct job* job) {
+	struct sumRecord* records;
+	size_t count;
+	ssize_t want;
+	ssize_t written;
+	int compact;
+
+	(void)job;
+	pthread_mutex_lock(&sumIndex.lock);
+	records = sumIndex.pending;
+	count = sumIndex.pendingCount;
+	sumIndex.pending = NULL;
+	sumIndex.pendingCount = sumIndex.pendingCap = 0;
+	pthread_mutex_unlock(&sumIndex.lock);
+
+	want = count * sizeof(*records);
+	if (count > 0) {
+		flock(sumIndex.lockFD, LOCK_EX);
+		if (sumReopen() < 0) {
+			fprintf(stderr, "WARNING: can't open the checksum index %s: %s\n", sumIndex.path, strerror(errno));
+		}
+		else if ((written = write(sumIndex.fd, records, want)) != want) {
+			if (written >= 0) {
+				errno = ENOSPC;
+			}
+			fprintf(stderr, "WARNING: checksum index %s: %zu records not written: %s\n", sumIndex.path,
+					count, strerror(errno));
+			if (written > 0 && ftruncate(sumIndex.fd, lseek(sumIndex.fd, 0, SEEK_END) - written) < 0) {
+				perror("WARNING: can't cut a short append off the checksum index");
+			}
+		}
+		else {
+			pthread_mutex_lock(&sumIndex.lock);
+			sumIndex.records += count;
+			pthread_mutex_unlock(&sumIndex.lock);
+		}
+		flock(sumIndex.lockFD, LOCK_UN);
+	}
+	free(records);
+	pthread_mutex_lock(&sumIndex.lock);
+	compact = sumIndex.records > 2 * sumIndex.entries + SUM_BUCKETS;
+	pthread_mutex_unlock(&sumIndex.lock);
+	if (compact) {
+		sumCompact();
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void sumFlushDone(struct job* job)
+ * Description:		Reactor side of an index flush: goes again if more records came in
+ *                  while the worker was writing, else lets the next sumStore() start one
+ ********************************************************************************************/
+static void sumFlushDone(struct job* job) {
+	pthread_mutex_lock(&sumIndex.lock);
+	if (sumIndex.pendingCount > 0) {
+		submitJob(job->owner->pool, job->owner->id, job);
+	}
+	else {
+		sumIndex.flushing = 0;
+	}
+	pthread_mutex_unlock(&sumIndex.lock);
+}
+
+/*******************************************************************************************
+ * Function:        void sumStore(struct reactor* r, const struct stat* info, uint32_t crc)
+ * Description:		Records the CRC32C of a file version in the index. The in-memory index
+ *                  answers at once; the record is queued for the index file, which a
+ *                  worker appends to (and compacts), never the reactor.
+ * Parameters:		the calling reactor (owns the flush job if this starts one), the file's
+ *                  stat() information and its checksum
+ ********************************************************************************************/
+static void sumStore(struct reactor* r, const struct stat* info, uint32_t crc) {
+	struct sumRecord record;
+	struct sumRecord* grown;
+
+	sumRecordOf(&record, info, crc);
+	pthread_mutex_lock(&sumIndex.lock);
+	sumInsert(&record);
+	if (sumIndex.lockFD >= 0) {
+		if (sumIndex.pendingCount == sumIndex.pendingCap) {
+			grown = realloc(sumIndex.pending, (sumIndex.pendingCap ? 2 * sumIndex.pendingCap : 64) * sizeof(*grown));
+			if (grown != NULL) {
+				sumIndex.pending = grown;
+				sumIndex.pendingCap = sumIndex.pendingCap ? 2 * sumIndex.pendingCap : 64;
+			}
+		}
+		if (sumIndex.pendingCount < sumIndex.pendingCap) {
+			sumIndex.pending[sumIndex.pendingCount++] = record;
+		}
+		if (!sumIndex.flushing) {
+			sumIndex.flushing = 1;
+			sumIndex.flushJob.run = runSumFlush;
+			sumIndex.flushJob.done = sumFlushDone;
+			sumIndex.flushJob.owner = r;
+			submitJob(r->pool, r->id, &sumIndex.flushJob);
+		}
+	}
+	pthread_mutex_unlock(&sumIndex.lock);
+}
+
+/*******************************************************************************************
+ * Function:        void sumRememberFile(struct reactor* r, int fd, const struct stat* opened, uint32_t crc)
+ * Description:		Stores the checksum of a whole file that was just read through fd, if
+ *                  the file wasn't touched since it was opened (same size, mtime and ctime)
+ ********************************************************************************************/
+static void sumRememberFile(struct reactor* r, int fd, const struct stat* opened, uint32_t crc) {
+	struct stat now;
+
+	if (fstat(fd, &now) == 0 && now.st_size == opened->st_size &&
+			now.st_mtim.tv_sec == opened->st_mtim.tv_sec && now.st_mtim.tv_nsec == opened->st_mtim.tv_nsec &&
+			now.st_ctim.tv_sec == opened->st_ctim.tv_sec && now.st_ctim.tv_nsec == opened->st_ctim.tv_nsec) {
+		sumStore(r, &now, crc);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void sumRemember(struct reactor* r, struct cacheEntry* e, uint32_t crc)
+ * Description:		sumRememberFile() for a file read through the hot-file cache entry e
+ ********************************************************************************************/
+static void sumRemember(struct reactor* r, struct cacheEntry* e, uint32_t crc) {
+	struct stat opened;
+
+	opened.st_size = e->size;
+	opened.st_mtim = e->mtime;
+	opened.st_ctim = e->ctime;
+	sumRememberFile(r, e->fd, &opened, crc);
+}
+
+/*******************************************************************************************
+ * Function:        int sumFile(struct cacheEntry* e, uint32_t* crc)
+ * Description:		Computes the CRC32C of a whole file (index miss on a sum query): from
+ *                  its cached copy, else read through a pooled buffer
+ * Returns:         0, or -1 if the file can't be read
+ ********************************************************************************************/
+static int sumFile(struct cacheEntry* e, uint32_t* crc) {
+	char* buffer;
+	off_t offset;
+	ssize_t n;
+
+	*crc = 0;
+	if (e->data) {
+		*crc = crc32c(0, e->data, e->size);
+		return 0;
+	}
+	buffer = bufferGet();
+	if (buffer == NULL) {
+		return -1;
+	}
+	posix_fadvise(e->fd, 0, e->size, POSIX_FADV_SEQUENTIAL);
+	for (offset = 0; offset < e->size; offset += n) {
+		n = pread(e->fd, buffer, e->size - offset < POOL_BUF ? e->size - offset : POOL_BUF, offset);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0) {	//error, or the file shrank
+			bufferPut(buffer);
+			return -1;
+		}
+		*crc = crc32c(*crc, buffer, n);
+	}
+	bufferPut(buffer);
+	return 0;
+}
+
+static struct metricsRegistry metricsRegistry = { .lock = PTHREAD_MUTEX_INITIALIZER, .listenFD = -1 };
+static __thread struct metrics* threadMetrics;	//the calling thread's block, NULL: not counted
+
+static const char* counterNames[M_COUNTERS] = {
+	"connections_accepted", "sessions_closed", "logins_failed",
+	"list", "get", "delta", "put", "mget", "size", "sum", "cd", "stats",
+	"errors", "transfers", "transfers_failed", "bytes_sent", "bytes_received", "worker_jobs",
+	"sends_paced", "transfers_direct", "tls_handshakes", "tls_resumed", "tls_kernel",
+	"transfer_syscalls"
+};
+static const char* stageNames[ST_STAGES] = {
+	"auth", "command", "handler", "setup", "first_byte", "transfer"
+};
+
+/*******************************************************************************************
+ * Function:        long long metricsNow(void)
+ * Description:		CLOCK_MONOTONIC in ns (a vDSO call, no system call)
+ ********************************************************************************************/
+static long long metricsNow(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*******************************************************************************************
+ * Function:        void metricsAttach(void)
+ * Description:		Gives the calling reactor or worker thread its own counters. Threads
+ *                  never share a block, so counting is a plain load and store with no
+ *                  lock or locked instruction; a scrape adds the blocks up.
+ ********************************************************************************************/
+static void metricsAttach(void) {
+	struct metrics* m = calloc(1, sizeof(*m));
+
+	if (m == NULL) {
+		fprintf(stderr, "WARNING: no memory for metrics, this thread isn't counted\n");
+		return;
+	}
+	pthread_mutex_lock(&metricsRegistry.lock);
+	m->next = metricsRegistry.head;
+	metricsRegistry.head = m;
+	pthread_mutex_unlock(&metricsRegistry.lock);
+	threadMetrics = m;
+}
+
+/*******************************************************************************************
+ * Function:        void metricsAdd(enum counter c, unsigned long long n)
+ * Description:		Adds n to one of the calling thread's counters
+ ********************************************************************************************/
+static void metricsAdd(enum counter c, unsigned long long n) {
+	struct metrics* m = threadMetrics;
+
+	if (m != NULL) {
+		atomic_store_explicit(&m->counters[c],
+							  atomic_load_explicit(&m->counters[c], memory_order_relaxed) + n,
+							  memory_order_relaxed);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        int histBucket(unsigned long long ns)
+ * Description:		Log-linear (HDR histogram style) bucket of a latency: exact below
+ *                  2^HIST_SUB_BITS, then 2^HIST_SUB_BITS buckets per power of two
+ ********************************************************************************************/
+static int histBucket(unsigned long long ns) {
+	int msb;
+
+	if (ns < (1ULL << HIST_SUB_BITS)) {
+		return (int)ns;
+	}
+	if (ns >= (1ULL << HIST_MAX_BIT)) {
+		ns = (1ULL << HIST_MAX_BIT) - 1;
+	}
+	msb = 63 - __builtin_clzll(ns);
+	return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+		   (int)((ns >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/*******************************************************************************************
+ * Function:        unsigned long long histLower(int bucket)
+ * Description:		Smallest latency (ns) that falls in a bucket, the inverse of histBucket()
+ ********************************************************************************************/
+static unsigned long long histLower(int bucket) {
+	int msb = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+
+	if (bucket < (1 << HIST_SUB_BITS)) {
+		return bucket;
+	}
+	return (unsigned long long)((1 << HIST_SUB_BITS) + (bucket & ((1 << HIST_SUB_BITS) - 1)))
+		   << (msb - HIST_SUB_BITS);
+}
+
+/*******************************************************************************************
+ * Function:        void metricsRecord(enum stage st, long long ns)
+ * Description:		Counts one latency in the calling thread's histogram of a stage
+ ********************************************************************************************/
+static void metricsRecord(enum stage st, long long ns) {
+	struct metrics* m = threadMetrics;
+	atomic_ullong* bucket;
+
+	if (m == NULL || ns < 0) {
+		return;
+	}
+	bucket = &m->hist[st][histBucket(ns)];
+	atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1,
+						  memory_order_relaxed);
+	atomic_store_explicit(&m->histSum[st],
+						  atomic_load_explicit(&m->histSum[st], memory_order_relaxed) + ns,
+						  memory_order_relaxed);
+}
+
+/*******************************************************************************************
+ * Function:        double histQuantile(const unsigned long long* hist, unsigned long long count, double q)
+ * Description:		Latency (seconds) at quantile q of a merged histogram, the middle of
+ *                  the bucket it falls in
+ ********************************************************************************************/
+static double histQuantile(const unsigned long long* hist, unsigned long long count, double q) {
+	unsigned long long rank = (unsigned long long)(q * count);
+	unsigned long long seen = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen > rank) {
+			return (histLower(i) + (i + 1 < HIST_BUCKETS ? histLower(i + 1) : histLower(i))) / 2e9;
+		}
+	}
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        void metricsRender(FILE* out)
+ * Description:		Adds up every thread's block and writes the Prometheus text exposition
+ *                  format (version 0.0.4): counters, active sessions, the hot-file cache
+ *                  and checksum index counters, and one histogram per stage with its
+ *                  p50/p99/p999. The blocks are read without stopping their writers, a
+ *                  scrape can be a few events behind but never blocks a reactor.
+ ********************************************************************************************/
+static void metricsRender(FILE* out) {
+	static unsigned long long hist[ST_STAGES][HIST_BUCKETS];	//only the -m thread renders
+	unsigned long long counters[M_COUNTERS] = {0};
+	unsigned long long sums[ST_STAGES] = {0};
+	unsigned long long count;
+	unsigned long long cumulative;
+	struct metrics* m;
+	int st;
+	int i;
+	int k;
+
+	memset(hist, 0, sizeof(hist));
+	pthread_mutex_lock(&metricsRegistry.lock);
+	for (m = metricsRegistry.head; m != NULL; m = m->next) {
+		for (i = 0; i < M_COUNTERS; i++) {
+			counters[i] += atomic_load_explicit(&m->counters[i], memory_order_relaxed);
+		}
+		for (st = 0; st < ST_STAGES; st++) {
+			sums[st] += atomic_load_explicit(&m->histSum[st], memory_order_relaxed);
+			for (i = 0; i < HIST_BUCKETS; i++) {
+				hist[st][i] += atomic_load_explicit(&m->hist[st][i], memory_order_relaxed);
+			}
+		}
+	}
+	pthread_mutex_unlock(&metricsRegistry.lock);
+
+	fprintf(out, "# HELP ftserver_sessions_active Control connections currently open.\n"
+			"# TYPE ftserver_sessions_active gauge\n"
+			"ftserver_sessions_active %llu\n",
+			counters[M_ACCEPTED] >= counters[M_CLOSED] ? counters[M_ACCEPTED] - counters[M_CLOSED] : 0);
+	fprintf(out, "# HELP ftserver_requests_total Commands received, by command.\n"
+			"# TYPE ftserver_requests_total counter\n");
+	for (i = M_REQ_LIST; i <= M_REQ_STATS; i++) {
+		fprintf(out, "ftserver_requests_total{command=\"%s\"} %llu\n", counterNames[i], counters[i]);
+	}
+	for (i = 0; i < M_COUNTERS; i++) {
+		if (i >= M_REQ_LIST && i <= M_REQ_STATS) {
+			continue;
+		}
+		fprintf(out, "# TYPE ftserver_%s_total counter\nftserver_%s_total %llu\n",
+				counterNames[i], counterNames[i], counters[i]);
+	}
+	fprintf(out, "# TYPE ftserver_cache_hits_total counter\nftserver_cache_hits_total %lu\n"
+			"# TYPE ftserver_cache_misses_total counter\nftserver_cache_misses_total %lu\n"
+			"# TYPE ftserver_cache_evictions_total counter\nftserver_cache_evictions_total %lu\n"
+			"# TYPE ftserver_checksum_index_hits_total counter\nftserver_checksum_index_hits_total %lu\n"
+			"# TYPE ftserver_checksum_index_misses_total counter\nftserver_checksum_index_misses_total %lu\n",
+			(unsigned long)fileCache.hits, (unsigned long)fileCache.misses,
+			(unsigned long)fileCache.evictions, (unsigned long)sumIndex.hits,
+			(unsigned long)sumIndex.misses);
+
+	fprintf(out, "# HELP ftserver_stage_seconds Latency of each stage of a session.\n"
+			"# TYPE ftserver_stage_seconds histogram\n");
+	for (st = 0; st < ST_STAGES; st++) {
+		cumulative = 0;
+		i = 0;
+		for (k = HIST_LE_MIN; k <= HIST_LE_MAX; k++) {
+			for (; i < HIST_BUCKETS && histLower(i) < (1ULL << k); i++) {
+				cumulative += hist[st][i];
+			}
+			fprintf(out, "ftserver_stage_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n",
+					stageNames[st], (double)(1ULL << k) / 1e9, cumulative);
+		}
+		for (count = cumulative; i < HIST_BUCKETS; i++) {
+			count += hist[st][i];
+		}
+		fprintf(out, "ftserver_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+				"ftserver_stage_seconds_sum{stage=\"%s\"} %.9f\n"
+				"ftserver_stage_seconds_count{stage=\"%s\"} %llu\n",
+				stageNames[st], count, stageNames[st], sums[st] / 1e9, stageNames[st], count);
+	}
+	fprintf(out, "# HELP ftserver_stage_quantile_seconds Latency quantiles of each stage, since start.\n"
+			"# TYPE ftserver_stage_quantile_seconds gauge\n");
+	for (st = 0; st < ST_STAGES; st++) {
+		for (count = 0, i = 0; i < HIST_BUCKETS; i++) {
+			count += hist[st][i];
+		}
+		fprintf(out, "ftserver_stage_quantile_seconds{stage=\"%s\",quantile=\"0.5\"} %.9f\n"
+				"ftserver_stage_quantile_seconds{stage=\"%s\",quantile=\"0.99\"} %.9f\n"
+				"ftserver_stage_quantile_seconds{stage=\"%s\",quantile=\"0.999\"} %.9f\n",
+				stageNames[st], histQuantile(hist[st], count, 0.5),
+				stageNames[st], histQuantile(hist[st], count, 0.99),
+				stageNames[st], histQuantile(hist[st], count, 0.999));
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void* metricsMain(void* arg)
+ * Description:		The -m endpoint: answers one HTTP/1.0 request per connection, GET
+ *                  /metrics (or /) with the rendered counters. Runs on its own thread with
+ *                  blocking sockets, so a slow scraper never holds up a reactor.
+ ********************************************************************************************/
+static void* metricsMain(void* arg) {
+	struct timeval timeout = { 1, 0 };
+	char request[METRICS_REQUEST + 1];
+	char head[256];
+	char* body;
+	size_t bodyLen;
+	ssize_t n;
+	size_t got;
+	FILE* out;
+	int fd;
+
+	(void)arg;
+	while (1) {
+		fd = accept4(metricsRegistry.listenFD, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED) {
+				error("ERROR on metrics accept");
+				sleep(1);
+			}
+			continue;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		got = 0;
+		while (got < METRICS_REQUEST && (n = recv(fd, request + got, METRICS_REQUEST - got, 0)) > 0) {
+			got += n;
+			request[got] = '\0';
+			if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+				break;
+			}
+		}
+		request[got] = '\0';
+
+		body = NULL;
+		bodyLen = 0;
+		if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+			out = open_memstream(&body, &bodyLen);
+			if (out != NULL) {
+				metricsRender(out);
+				fclose(out);
+			}
+		}
+		if (body != NULL) {
+			snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+					 "Content-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", bodyLen);
+		}
+		else {
+			snprintf(head, sizeof(head), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+		}
+		if (send(fd, head, strlen(head), MSG_NOSIGNAL) > 0 && body != NULL) {
+			for (got = 0; got < bodyLen; got += n) {
+				n = send(fd, body + got, bodyLen - got, MSG_NOSIGNAL);
+				if (n <= 0) {
+					break;
+				}
+			}
+		}
+		free(body);
+		close(fd);
+	}
+	return NULL;
+}
+
+/*******************************************************************************************
+ * Function:        void startMetrics(const char* where)
+ * Description:		Opens the -m endpoint and starts its thread. A number is a TCP port on
+ *                  127.0.0.1 (the counters are never exposed beyond this host), anything
+ *                  else the path of a Unix socket; both speak HTTP.
+ * Returns:         exits if the endpoint can't be opened
+ ********************************************************************************************/
+static void startMetrics(const char* where) {
+	struct sockaddr_in inet;
+	struct sockaddr_un local;
+	pthread_t thread;
+	char* end;
+	long port = strtol(where, &end, 10);
+	int on = 1;
+	int fd;
+
+	if (*where != '\0' && *end == '\0') {
+		memset(&inet, 0, sizeof(inet));
+		inet.sin_family = AF_INET;
+		inet.sin_port = htons(port);
+		inet.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd >= 0) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		}
+		if (fd < 0 || bind(fd, (struct sockaddr*)&inet, sizeof(inet)) < 0) {
+			perror("ERROR opening metrics port");
+			exit(1);
+		}
+		printf("Metrics at http://127.0.0.1:%ld/metrics\n", port);
+	}
+	else {
+		memset(&local, 0, sizeof(local));
+		local.sun_family = AF_UNIX;
+		if (strlen(where) >= sizeof(local.sun_path)) {
+			fprintf(stderr, "ERROR metrics socket path too long: %s\n", where);
+			exit(1);
+		}
+		strcpy(local.sun_path, where);
+		unlink(where);		//left behind by a previous run
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr*)&local, sizeof(local)) < 0) {
+			perror("ERROR opening metrics socket");
+			exit(1);
+		}
+		printf("Metrics at unix:%s (GET /metrics)\n", where);
+	}
+	if (listen(fd, 16) < 0) {
+		perror("ERROR listening for metrics scrapes");
+		exit(1);
+	}
+	metricsRegistry.listenFD = fd;
+	if (pthread_create(&thread, NULL, metricsMain, NULL) != 0) {
+		perror("ERROR creating metrics thread");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
+
+static __thread struct uring* workerRing;	//the calling worker's ring, NULL: no io_uring
+
+/*******************************************************************************************
+ * Function:        void uringFree(struct uring* u)
+ * Description:		Unmaps and closes a ring set up by uringInit()
+ ********************************************************************************************/
+static void uringFree(struct uring* u) {
+	if (u->buffers != NULL && u->buffers != MAP_FAILED) {
+		munmap(u->buffers, URING_BUFS * URING_BUF_LEN);
+	}
+	if (u->sqes != NULL && u->sqes != MAP_FAILED) {
+		munmap(u->sqes, u->sqesLen);
+	}
+	if (u->ringMem != NULL && u->ringMem != MAP_FAILED) {
+		munmap(u->ringMem, u->ringLen);
+	}
+	if (u->fd >= 0) {
+		close(u->fd);
+	}
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+/*******************************************************************************************
+ * Function:        int uringInit(struct uring* u)
+ * Description:		Creates an io_uring for one worker, maps its queues, registers the
+ *                  worker's transfer buffers and an empty two slot fixed file table
+ *                  (slot 0: data socket, slot 1: file). No liburing, raw syscalls only.
+ * Returns:         0 on success, -1 (errno set) if the kernel can't do it
+ ********************************************************************************************/
+static int uringInit(struct uring* u) {
+	struct io_uring_params params;
+	struct iovec iov[URING_BUFS];
+	int fds[2] = { -1, -1 };
+	size_t sqLen;
+	size_t cqLen;
+	char* ring;
+	int i;
+	int err;
+
+	memset(u, 0, sizeof(*u));
+	memset(&params, 0, sizeof(params));
+	u->fd = syscall(__NR_io_uring_setup, URING_BUFS * 2, &params);
+	if (u->fd < 0) {
+		return -1;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+		errno = ENOSYS;		//5.11+ only, keeps the mapping and timeout code simple
+		goto fail;
+	}
+	u->entries = params.sq_entries;
+	sqLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	u->ringLen = sqLen > cqLen ? sqLen : cqLen;
+	u->ringMem = mmap(NULL, u->ringLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					  u->fd, IORING_OFF_SQ_RING);
+	u->sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				   u->fd, IORING_OFF_SQES);
+	u->buffers = mmap(NULL, URING_BUFS * URING_BUF_LEN, PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->ringMem == MAP_FAILED || u->sqes == MAP_FAILED || u->buffers == MAP_FAILED) {
+		goto fail;
+	}
+	ring = u->ringMem;
+	u->sqHead = (unsigned*)(ring + params.sq_off.head);
+	u->sqTail = (unsigned*)(ring + params.sq_off.tail);
+	u->sqMask = (unsigned*)(ring + params.sq_off.ring_mask);
+	u->sqArray = (unsigned*)(ring + params.sq_off.array);
+	u->cqHead = (unsigned*)(ring + params.cq_off.head);
+	u->cqTail = (unsigned*)(ring + params.cq_off.tail);
+	u->cqMask = (unsigned*)(ring + params.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+
+	for (i = 0; i < URING_BUFS; i++) {
+		iov[i].iov_base = u->buffers + (size_t)i * URING_BUF_LEN;
+		iov[i].iov_len = URING_BUF_LEN;
+	}
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFS) < 0 ||
+			syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES, fds, 2) < 0) {
+		goto fail;
+	}
+	return 0;
+
+fail:
+	err = errno;
+	uringFree(u);
+	errno = err;
+	return -1;
+}
+
+/*******************************************************************************************
+ * Function:        struct io_uring_sqe* uringSqe(struct uring* u)
+ * Description:		Hands out the next free submission entry, cleared. It is published to
+ *                  the kernel by the next uringEnter().
+ ********************************************************************************************/
+static struct io_uring_sqe* uringSqe(struct uring* u) {
+	unsigned tail = *u->sqTail + u->sqQueued;
+	unsigned index = tail & *u->sqMask;
+	struct io_uring_sqe* sqe = &u->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	u->sqArray[index] = index;
+	u->sqQueued++;
+	return sqe;
+}
+
+/*******************************************************************************************
+ * Function:        int uringEnter(struct uring* u, unsigned wait, int timeoutSec)
+ * Description:		Submits every queued sqe and waits for wait completions, in one syscall
+ * Returns:         0, or -1 with errno ETIME if the timeout expired first
+ ********************************************************************************************/
+static int uringEnter(struct uring* u, unsigned wait, int timeoutSec) {
+	struct __kernel_timespec timeout = { timeoutSec, 0 };
+	struct io_uring_getevents_arg arg;
+	unsigned submit = u->sqQueued;
+	int n;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t)(uintptr_t)&timeout;
+	__atomic_store_n(u->sqTail, *u->sqTail + submit, __ATOMIC_RELEASE);
+	u->sqQueued = 0;
+	while (1) {
+		n = syscall(__NR_io_uring_enter, u->fd, submit, wait,
+					IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+		if (n >= 0 || errno != EINTR) {
+			break;
+		}
+		submit = 0;	//already consumed
+	}
+	return n < 0 ? -1 : 0;
+}
+
+static int uringPump(struct uring* u, struct transfer* xfer, int socketFD);
+
+/*******************************************************************************************
+ * Function:        int uringTransfer(struct uring* u, struct transfer* xfer, int socketFD)
+ * Description:		Sends xfer's range through the worker's ring with registered buffers and
+ *                  fixed files. The buffers are split in two halves: while one half's
+ *                  writes go out as an ordered IOSQE_IO_LINK chain, the other half is
+ *                  being read from the file, and both are submitted and reaped with a
+ *                  single io_uring_enter(). A 1MB file is 4-5 syscalls instead of ~1000
+ *                  read()/send() pairs of the old 2KB loop.
+ * Parameters:		the worker's ring, the transfer, the (blocking) data socket
+ * Returns:         TRANSFER_DONE or TRANSFER_ERROR (errno set)
+ ********************************************************************************************/
+static int uringTransfer(struct uring* u, struct transfer* xfer, int socketFD) {
+	struct io_uring_files_update update;
+	int fds[2];
+	int err;
+
+	fds[0] = socketFD;
+	fds[1] = xfer->fileFD;
+	memset(&update, 0, sizeof(update));
+	update.fds = (uint64_t)(uintptr_t)fds;
+	xfer->syscalls += 2;		//this and the update that clears the table again
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES_UPDATE, &update, 2) < 0) {
+		return TRANSFER_ERROR;
+	}
+
+	err = uringPump(u, xfer, socketFD);
+
+	// the table holds references: without this close() would not really close the socket
+	fds[0] = fds[1] = -1;
+	syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES_UPDATE, &update, 2);
+	if (err != 0) {
+		errno = err;
+		return TRANSFER_ERROR;
+	}
+	return TRANSFER_DONE;
+}
+
+/*******************************************************************************************
+ * Function:        int uringPump(struct uring* u, struct transfer* xfer, int socketFD)
+ * Description:		The submit/reap loop of uringTransfer(), with the socket in fixed file
+ *                  slot 0 and the file in slot 1
+ * Returns:         0 when the range is sent, otherwise an errno value
+ ********************************************************************************************/
+static int uringPump(struct uring* u, struct transfer* xfer, int socketFD) {
+	enum { HALF = URING_BUFS / 2, OP_READ = 1, OP_WRITE = 2 };
+	struct io_uring_sqe* sqe;
+	struct io_uring_cqe* cqe;
+	size_t len[URING_BUFS];
+	size_t sent[URING_BUFS];
+	int used[2] = { 0, 0 };		//buffers holding data in each half
+	int readHalf = -1;			//half being filled from the file
+	int readyHalf = -1;			//half filled, not yet being written
+	int writeHalf = -1;			//half whose chain of writes is going out
+	int err = 0;
+	unsigned queued;
+	unsigned head;
+	int i;
+	int b;
+
+	while (err == 0) {
+		if (writeHalf < 0 && readyHalf >= 0) {
+			writeHalf = readyHalf;
+			readyHalf = -1;
+		}
+		queued = 0;
+
+		// fill the half nobody is using
+		if (readHalf < 0 && readyHalf < 0 && xfer->offset < xfer->end) {
+			readHalf = writeHalf == 0 ? 1 : 0;
+			for (i = 0; i < HALF && xfer->offset < xfer->end; i++) {
+				b = readHalf * HALF + i;
+				len[b] = xfer->end - xfer->offset < URING_BUF_LEN ? xfer->end - xfer->offset : URING_BUF_LEN;
+				sent[b] = 0;
+				sqe = uringSqe(u);
+				sqe->opcode = IORING_OP_READ_FIXED;
+				sqe->flags = IOSQE_FIXED_FILE;
+				sqe->fd = 1;
+				sqe->addr = (uint64_t)(uintptr_t)(u->buffers + (size_t)b * URING_BUF_LEN);
+				sqe->len = len[b];
+				sqe->off = xfer->offset;
+				sqe->buf_index = b;
+				sqe->user_data = (OP_READ << 16) | b;
+				xfer->offset += len[b];
+				queued++;
+			}
+			used[readHalf] = i;
+		}
+
+		// drain the written half in order, a short write breaks the chain and the rest
+		// come back -ECANCELED to be resubmitted on the next pass
+		if (writeHalf >= 0) {
+			for (i = 0; i < used[writeHalf]; i++) {
+				b = writeHalf * HALF + i;
+				if (sent[b] == len[b]) {
+					continue;
+				}
+				sqe = uringSqe(u);
+				sqe->opcode = IORING_OP_WRITE_FIXED;
+				sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+				sqe->fd = 0;
+				sqe->addr = (uint64_t)(uintptr_t)(u->buffers + (size_t)b * URING_BUF_LEN + sent[b]);
+				sqe->len = len[b] - sent[b];
+				sqe->buf_index = b;
+				sqe->user_data = (OP_WRITE << 16) | b;
+				queued++;
+			}
+			u->sqes[(*u->sqTail + u->sqQueued - 1) & *u->sqMask].flags &= ~IOSQE_IO_LINK;
+		}
+
+		if (queued == 0) {
+			return 0;
+		}
+		xfer->syscalls++;
+		if (uringEnter(u, queued, SEND_TIMEOUT) < 0) {
+			// stalled client: make everything in flight fail, then reap it below
+			err = errno == ETIME ? ETIMEDOUT : errno;
+			shutdown(socketFD, SHUT_RDWR);
+			uringEnter(u, queued, SEND_TIMEOUT);
+		}
+
+		head = *u->cqHead;
+		while (queued > 0 && head != __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE)) {
+			cqe = &u->cqes[head & *u->cqMask];
+			b = cqe->user_data & 0xffff;
+			if ((cqe->user_data >> 16) == OP_READ) {
+				if (cqe->res != (int)len[b] && err == 0) {
+					err = cqe->res < 0 ? -cqe->res : EIO;	//file shrank underneath us
+				}
+			}
+			else if (cqe->res > 0) {
+				sent[b] += cqe->res;
+			}
+			else if (cqe->res != -ECANCELED && err == 0) {
+				err = cqe->res < 0 ? -cqe->res : EPIPE;
+			}
+			head++;
+			queued--;
+		}
+		__atomic_store_n(u->cqHead, head, __ATOMIC_RELEASE);
+
+		if (readHalf >= 0) {
+			for (i = 0; i < used[readHalf] && err == 0; i++) {	//reads complete in file order
+				b = readHalf * HALF + i;
+				transferSum(xfer, u->buffers + (size_t)b * URING_BUF_LEN, len[b]);
+			}
+			readyHalf = readHalf;
+			readHalf = -1;
+		}
+		if (writeHalf >= 0) {
+			for (i = 0; i < used[writeHalf] && sent[writeHalf * HALF + i] == len[writeHalf * HALF + i]; i++)
+				;
+			if (i == used[writeHalf]) {
+				used[writeHalf] = 0;
+				writeHalf = -1;
+			}
+		}
+	}
+	return err;
+}
+
+/*******************************************************************************************
+ * Function:        void pinThread(pthread_t thread, int cpu)
+ * Description:		Restricts a listener or worker thread to one core (-1 leaves it alone)
+ ********************************************************************************************/
+static void pinThread(pthread_t thread, int cpu) {
+	cpu_set_t cpus;
+
+	if (cpu < 0) {
+		return;
+	}
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus) != 0) {
+		fprintf(stderr, "WARNING: could not pin thread to cpu %d\n", cpu);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void dequeInit(struct jobDeque* d)
+ * Description:		Sets up an empty job deque
+ ********************************************************************************************/
+static void dequeInit(struct jobDeque* d) {
+	pthread_mutex_init(&d->lock, NULL);
+	d->cap = DEQUE_INIT;
+	d->ring = calloc(d->cap, sizeof(*d->ring));
+	d->top = d->bottom = 0;
+	if (d->ring == NULL) {
+		perror("ERROR allocating job deque");
+		exit(1);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void dequePush(struct jobDeque* d, struct job* job)
+ * Description:		Adds a job at the bottom of the deque, doubling the ring when full
+ ********************************************************************************************/
+static void dequePush(struct jobDeque* d, struct job* job) {
+	struct job** grown;
+	size_t i;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->bottom - d->top == d->cap) {
+		grown = calloc(d->cap * 2, sizeof(*grown));
+		if (grown == NULL) {
+			perror("ERROR growing job deque");
+			exit(1);
+		}
+		for (i = d->top; i != d->bottom; i++) {
+			grown[i & (d->cap * 2 - 1)] = d->ring[i & (d->cap - 1)];
+		}
+		free(d->ring);
+		d->ring = grown;
+		d->cap *= 2;
+	}
+	d->ring[d->bottom++ & (d->cap - 1)] = job;
+	pthread_mutex_unlock(&d->lock);
+}
+
+/*******************************************************************************************
+ * Function:        struct job* dequeTake(struct jobDeque* d, int steal)
+ * Description:		The owning worker takes its newest job from the bottom (steal == 0),
+ *                  a thief takes the oldest one from the top (steal == 1)
+ * Returns:         the job, or NULL if the deque is empty
+ ********************************************************************************************/
+static struct job* dequeTake(struct jobDeque* d, int steal) {
+	struct job* job = NULL;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->bottom != d->top) {
+		if (steal) {
+			job = d->ring[d->top++ & (d->cap - 1)];
+		}
+		else {
+			job = d->ring[--d->bottom & (d->cap - 1)];
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+	return job;
+}
+
+/*******************************************************************************************
+ * Function:        void submitJob(struct workerPool* pool, int home, struct job* job)
+ * Description:		Queues a job on the deque of worker home (the one sharing the caller's
+ *                  core when pinned) and wakes a sleeping worker. If home is busy an idle
+ *                  worker steals it.
+ ********************************************************************************************/
+static void submitJob(struct workerPool* pool, int home, struct job* job) {
+	dequePush(&pool->workers[home % pool->count].deque, job);
+	pthread_mutex_lock(&pool->lock);
+	atomic_fetch_add(&pool->pending, 1);
+	pthread_cond_signal(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*******************************************************************************************
+ * Function:        void completeJob(struct job* job)
+ * Description:		Hands a finished job back to the reactor that submitted it and rings
+ *                  its eventfd, done() then runs on that reactor's thread
+ ********************************************************************************************/
+static void completeJob(struct job* job) {
+	struct reactor* r = job->owner;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&r->doneLock);
+	job->doneNext = r->doneHead;
+	r->doneHead = job;
+	pthread_mutex_unlock(&r->doneLock);
+	if (write(r->wakeFD, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		error("ERROR waking reactor");
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void* workerMain(void* arg)
+ * Description:		Transfer worker: runs jobs from its own deque, steals from the others
+ *                  when it runs dry, and sleeps when the whole pool is idle. With -u it
+ *                  sets up its own io_uring first.
+ * Parameters:		the worker
+ ********************************************************************************************/
+static void* workerMain(void* arg) {
+	struct worker* w = arg;
+	struct workerPool* pool = w->pool;
+	struct job* job;
+	struct uring ring;
+	int i;
+
+	metricsAttach();
+	if (pool->useUring) {
+		if (uringInit(&ring) == 0) {
+			workerRing = &ring;
+		}
+		else {
+			fprintf(stderr, "WARNING: worker %d: io_uring setup failed (%s), using sendfile\n",
+					w->id, strerror(errno));
+		}
+	}
+
+	while (1) {
+		job = dequeTake(&w->deque, 0);
+		for (i = 1; job == NULL && i < pool->count; i++) {
+			job = dequeTake(&pool->workers[(w->id + i) % pool->count].deque, 1);
+		}
+		if (job != NULL) {
+			atomic_fetch_sub(&pool->pending, 1);
+			job->run(job);
+			metricsAdd(M_JOBS, 1);
+			completeJob(job);
+			continue;
+		}
+		
+		pthread_mutex_lock(&pool->lock);
+		while (atomic_load(&pool->pending) == 0) {
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return NULL;
+}
+
+/*******************************************************************************************
+ * Function:        struct workerPool* startWorkers(int count, int* cpus, int nCpus, int useUring)
+ * Description:		Starts count transfer workers, worker i pinned to cpus[i % nCpus]
+ * Parameters:		pool size, the cpu list from -a (nCpus == 0: no pinning) and whether
+ *                  the workers should send through io_uring
+ * Returns:         the running pool, exits on failure
+ ********************************************************************************************/
+static struct workerPool* startWorkers(int count, int* cpus, int nCpus, int useUring) {
+	struct workerPool* pool;
+	int i;
+
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL || (pool->workers = calloc(count, sizeof(*pool->workers))) == NULL) {
+		perror("ERROR allocating worker pool");
+		exit(1);
+	}
+	pool->count = count;
+	pool->useUring = useUring;
+	atomic_init(&pool->pending, 0);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	for (i = 0; i < count; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].id = i;
+		pool->workers[i].cpu = nCpus ? cpus[i % nCpus] : -1;
+		dequeInit(&pool->workers[i].deque);
+	}
+	for (i = 0; i < count; i++) {
+		if (pthread_create(&pool->workers[i].thread, NULL, workerMain, &pool->workers[i]) != 0) {
+			perror("ERROR creating worker thread");
+			exit(1);
+		}
+		pinThread(pool->workers[i].thread, pool->workers[i].cpu);
+	}
+	return pool;
+}
+
+static void destroySession(struct session* s);
+static void startData(struct session* s);
+static void finishData(struct session* s);
+static void failData(struct session* s);
+static void pumpData(struct session* s);
+static void queueReady(struct session* s);
+static void offloadPut(struct session* s);
+static void resumeTransfer(struct session* s);
+static void readControl(struct session* s);
+static void closeSession(struct session* s);
+static void handleControl(struct session* s);
+static int listMore(struct session* s);
+static void listingRelease(struct listing* l);
+void listCmd(struct session* s);
+void sendFile(struct session* s);
+
+/*******************************************************************************************
+ * Function:        int watchFD(struct reactor* r, int fd, struct handle* h, uint32_t events)
+ * Description:		Registers one of the session's sockets with the reactor's epoll set
+ * Returns:         0 on success, -1 on failure
+ ********************************************************************************************/
+static int watchFD(struct reactor* r, int fd, struct handle* h, uint32_t events) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = h;
+	if (epoll_ctl(r->epollFD, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		error("ERROR adding socket to epoll");
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        int tlsHandshake(SSL* tls)
+ * Description:		Moves a server side handshake along as far as the socket allows
+ * Returns:         1 when it's done, 0 when it waits for the socket, -1 if it failed
+ ********************************************************************************************/
+static int tlsHandshake(SSL* tls) {
+	int ret;
+
+	ERR_clear_error();
+	ret = SSL_do_handshake(tls);
+	if (ret == 1) {
+		return 1;
+	}
+	switch (SSL_get_error(tls, ret)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void peerName(int fd, char* ip, size_t len)
+ * Description:		The address a socket is connected to, for the log: clientIP is only
+ *                  known once a command names it
+ ********************************************************************************************/
+static void peerName(int fd, char* ip, size_t len) {
+	struct sockaddr_in peer;
+	socklen_t peerLen = sizeof(peer);
+
+	if (getpeername(fd, (struct sockaddr *)&peer, &peerLen) < 0 ||
+			inet_ntop(AF_INET, &peer.sin_addr, ip, len) == NULL) {
+		snprintf(ip, len, "?");
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void tlsEstablished(SSL* tls, const char* which)
+ * Description:		Counts and logs a finished handshake: whether the client resumed a
+ *                  session ticket and whether the kernel took over the encryption
+ ********************************************************************************************/
+static void tlsEstablished(SSL* tls, const char* which) {
+	char ip[INET_ADDRSTRLEN];
+	int resumed = SSL_session_reused(tls);
+	int kernel = BIO_get_ktls_send(SSL_get_wbio(tls));
+
+	metricsAdd(M_TLS, 1);
+	metricsAdd(M_TLS_RESUMED, resumed);
+	metricsAdd(M_TLS_KERNEL, kernel);
+	peerName(SSL_get_fd(tls), ip, sizeof(ip));
+	if (verbose) {
+		printf("%s %s connection from %s (%s, %s)\n", SSL_get_version(tls), which, ip,
+			   resumed ? "resumed" : "full handshake", kernel ? "kernel TLS" : "user-space TLS");
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void tlsClose(SSL** tls)
+ * Description:		Sends close_notify (best effort, the socket may be full) and frees the
+ *                  connection's TLS state. The caller closes the socket.
+ ********************************************************************************************/
+static void tlsClose(SSL** tls) {
+	if (*tls == NULL) {
+		return;
+	}
+	if (SSL_is_init_finished(*tls)) {
+		SSL_shutdown(*tls);
+	}
+	SSL_free(*tls);
+	*tls = NULL;
+}
+
+/***********************************************************************************************
+ * Function: 		void flushControl(struct session* s)
+ * Description:		Writes as much of the session's queued control output as the socket
+ *					takes. The rest goes out on the next EPOLLOUT edge.
+ * Pre-Conditions: 	s is a live session
+ * Post-Conditions: outBuf is drained or the socket is full; a session marked closing is
+ *					destroyed once everything has been written
+ ************************************************************************************************/
+static void flushControl(struct session* s) {
+	ssize_t charsWritten;
+
+	if (s->controlHandshake) {
+		readControl(s);		//the handshake was waiting for room on the socket
+		return;
+	}
+	while (s->outPos < s->outLen) {
+		charsWritten = tlsSend(s->controlTLS, s->controlFD, s->outBuf + s->outPos, s->outLen - s->outPos, MSG_NOSIGNAL);
+		if (charsWritten < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) return;
+			destroySession(s);	//client went away
+			return;
+		}
+		s->outPos += charsWritten;
+	}
+	s->outPos = s->outLen = 0;
+	if (s->outCap > CTRL_OUT_LEN) {		//a burst made it grow, don't keep it
+		free(s->outBuf);
+		s->outBuf = NULL;
+		s->outCap = 0;
+	}
+	if (s->closing) {
+		destroySession(s);
+	}
+	else if (s->state == SESSION_COMMAND && s->inLen > 0 && !s->inHandler) {
+		readControl(s);		//commands held back while the replies were stuck
+	}
+	else if (s->state == SESSION_SENDING && s->dataMode == DATA_INLINE) {
+		pumpData(s);		//FT_DATA frames wait for the replies ahead of them
+	}
+}
+
+/***********************************************************************************************
+ * Function: 		int outReserve(struct session* s, size_t len)
+ * Description:		Makes room for len more bytes of control output. Commands aren't read
+ *					while the buffer is close to CTRL_OUT_LEN (handleControl()), so it only
+ *					grows for the replies of the request in flight (OK, PASV, then the DONE
+ *					of a completion), and a reply is never dropped for want of room.
+ * Returns:         0, -1 if out of memory (the session is closed)
+ ************************************************************************************************/
+static int outReserve(struct session* s, size_t len) {
+	size_t cap = s->outCap ? s->outCap : CTRL_OUT_LEN;
+	char* grown;
+
+	if (s->outBuf != NULL && s->outCap - s->outLen >= len) {
+		return 0;
+	}
+	while (cap - s->outLen < len) {
+		cap *= 2;
+	}
+	grown = realloc(s->outBuf, cap);
+	if (grown == NULL) {
+		error("ERROR growing control output");
+		closeSession(s);		//better than a client waiting for a reply that never comes
+		return -1;
+	}
+	s->outBuf = grown;
+	s->outCap = cap;
+	return 0;
+}
+
+/***********************************************************************************************
+ * Function: 		int sendMessage(struct session* s, char* buff)
+ * Description:		Queues a message for the client on the control socket and starts
+ *					writing it. Replaces the blocking send() + single retry. In line mode
+ *					the reply is "#<request id> <message>\n".
+ * Parameters:		the session and the NUL terminated message
+ * Returns:         the number of bytes queued
+ ************************************************************************************************/
+int sendMessage(struct session* s, char* buff) {
+	char line[BUF_LEN + sizeof(s->tag) + 1];
+	size_t len;
+
+	if (s->state == SESSION_DEAD) {
+		return 0;
+	}
+	if (s->lineMode) {
+		len = snprintf(line, sizeof(line), "%s%s\n", s->tag, buff);
+		if (len >= sizeof(line)) {
+			len = sizeof(line) - 1;
+			line[len - 1] = '\n';
+		}
+		buff = line;
+	}
+	else {
+		len = strlen(buff);
+	}
+	if (outReserve(s, len) < 0) {
+		return 0;
+	}
+	memcpy(s->outBuf + s->outLen, buff, len);
+	s->outLen += len;
+	flushControl(s);
+
+	return len;
+}
+
+/***********************************************************************************************
+ * Function: 		int queueFrame(struct session* s, int type, const void* payload, size_t len)
+ * Description:		Queues one frame (header + payload) for a framed client, tagged with the
+ *					id of the command being answered
+ * Returns:         0, or -1 if the session is gone or out of memory
+ ************************************************************************************************/
+static int queueFrame(struct session* s, int type, const void* payload, size_t len) {
+	if (s->state == SESSION_DEAD || outReserve(s, FT_HEADER_LEN + len) < 0) {
+		return -1;
+	}
+	ftEncodeHeader((unsigned char*)s->outBuf + s->outLen, type, s->requestID, len);
+	memcpy(s->outBuf + s->outLen + FT_HEADER_LEN, payload, len);
+	s->outLen += FT_HEADER_LEN + len;
+	flushControl(s);
+	return 0;
+}
+
+/***********************************************************************************************
+ * Function: 		void replyStatus(struct session* s, int code, long long value, const char* text)
+ * Description:		Answers the current command. Framed clients get an FT_STATUS frame with
+ *					the code and value, text clients get the message text. Legacy one-shot
+ *					clients don't expect a reply when a transfer completes (FT_DONE).
+ * Parameters:		the session, an ftStatusCode, its value and the human readable message
+ ************************************************************************************************/
+static void replyStatus(struct session* s, int code, long long value, const char* text) {
+	unsigned char status[FT_STATUS_LEN + BUF_LEN];
+	size_t textLen = strlen(text);
+
+	if (code == FT_ERROR) {
+		metricsAdd(M_ERRORS, 1);
+	}
+	if (s->framed) {
+		if (textLen > FT_MAX_PAYLOAD - FT_STATUS_LEN) {
+			textLen = FT_MAX_PAYLOAD - FT_STATUS_LEN;	//a status is a frame like any other
+		}
+		memset(status, 0, FT_STATUS_LEN);
+		status[0] = code;
+		status[1] = s->compress ? FT_ENC_GZIP : FT_ENC_NONE;
+		ftPut64(status + 4, value);
+		memcpy(status + FT_STATUS_LEN, text, textLen);
+		queueFrame(s, FT_STATUS, status, FT_STATUS_LEN + textLen);
+	}
+	else if (code != FT_DONE || s->lineMode) {
+		sendMessage(s, (char*)text);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void closeSession(struct session* s)
+ * Description:		Flush whatever the client still has coming on the control socket, then
+ *                  close the session (bad login, quit, or the client hung up).
+ ********************************************************************************************/
+static void closeSession(struct session* s) {
+	if (s->state == SESSION_DEAD) {
+		return;
+	}
+	s->closing = 1;
+	flushControl(s);
+}
+
+/*******************************************************************************************
+ * Function:        void requestDone(struct session* s)
+ * Description:		The current request is answered. The session goes back to waiting for
+ *                  commands and picks up any the client has already pipelined.
+ ********************************************************************************************/
+static void requestDone(struct session* s) {
+	if (s->state == SESSION_DEAD) {
+		return;
+	}
+	s->command = CMD_NONE;
+	s->dataMode = DATA_ACTIVE;
+	s->rangeOffset = s->rangeLength = 0;
+	s->listLong = 0;
+	s->compress = 0;
+	s->sumKnown = 0;
+	s->bulk = 0;
+	s->state = SESSION_COMMAND;
+	if (!s->inHandler) {
+		readControl(s);
+	}
+}
+
+static struct scheduler scheduler = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*******************************************************************************************
+ * Function:        double parseRate(const char* text)
+ * Description:		Reads a limits file rate: bytes/s with an optional K, M or G (powers of
+ *                  1024), "0" or "none" for unlimited
+ * Returns:         the rate, -1 if text isn't one
+ ********************************************************************************************/
+static double parseRate(const char* text) {
+	char* end;
+	double rate;
+
+	if (strcmp(text, "none") == 0) {
+		return 0;
+	}
+	rate = strtod(text, &end);
+	switch (*end) {
+	case 'G': case 'g': rate *= 1024;	//fall through
+	case 'M': case 'm': rate *= 1024;	//fall through
+	case 'K': case 'k': rate *= 1024; end++; break;
+	default: break;
+	}
+	return end == text || *end != '\0' || rate < 0 ? -1 : rate;
+}
+
+/*******************************************************************************************
+ * Function:        double schedRuleRate(const char* address)
+ * Description:		The limit of one client address: its own rule, else the default
+ * Pre-Conditions: 	scheduler.lock is held
+ ********************************************************************************************/
+static double schedRuleRate(const char* address) {
+	struct schedRule* rule;
+
+	for (rule = scheduler.rules; rule != NULL; rule = rule->next) {
+		if (strcmp(rule->address, address) == 0) {
+			return rule->rate;
+		}
+	}
+	return scheduler.clientRate;
+}
+
+/*******************************************************************************************
+ * Function:        void schedLoad(void)
+ * Description:		(Re)reads the -L limits file, one setting per line, # comments:
+ *                      total <rate>               the whole uplink
+ *                      client * <rate>            each client address
+ *                      client <address> <rate>    one client address
+ *                  and applies it to the sessions already running. A file with errors is
+ *                  reported and ignored, the limits stay as they were.
+ ********************************************************************************************/
+static void schedLoad(void) {
+	FILE* in = fopen(scheduler.path, "r");
+	char line[256];
+	char key[32];
+	char address[INET_ADDRSTRLEN + 1];
+	char rate[32];
+	double totalRate = 0;
+	double clientRate = 0;
+	struct schedRule* rules = NULL;
+	struct schedRule* rule;
+	struct schedClient* c;
+	int lineNo = 0;
+	int enabled;
+	int fields;
+	int i;
+
+	if (in == NULL) {
+		fprintf(stderr, "WARNING: can't read limits file %s (%s), limits unchanged\n",
+				scheduler.path, strerror(errno));
+		return;
+	}
+	while (fgets(line, sizeof(line), in) != NULL) {
+		lineNo++;
+		if (strchr(line, '#') != NULL) {
+			*strchr(line, '#') = '\0';
+		}
+		fields = sscanf(line, "%31s %46s %31s", key, address, rate);
+		if (fields <= 0) {
+			continue;
+		}
+		if (fields == 2 && strcmp(key, "total") == 0 && (totalRate = parseRate(address)) >= 0) {
+			continue;
+		}
+		if (fields == 3 && strcmp(key, "client") == 0 && strcmp(address, "*") == 0 &&
+				(clientRate = parseRate(rate)) >= 0) {
+			continue;
+		}
+		if (fields == 3 && strcmp(key, "client") == 0 && strlen(address) < INET_ADDRSTRLEN &&
+				parseRate(rate) >= 0 && (rule = calloc(1, sizeof(*rule))) != NULL) {
+			strcpy(rule->address, address);
+			rule->rate = parseRate(rate);
+			rule->next = rules;
+			rules = rule;
+			continue;
+		}
+		fprintf(stderr, "WARNING: %s line %d is not a limit, limits unchanged\n", scheduler.path, lineNo);
+		totalRate = -1;
+		break;
+	}
+	fclose(in);
+	if (totalRate < 0 || clientRate < 0) {
+		for (; rules != NULL; rules = rule) {
+			rule = rules->next;
+			free(rules);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&scheduler.lock);
+	for (rule = scheduler.rules; rule != NULL; rule = scheduler.rules) {
+		scheduler.rules = rule->next;
+		free(rule);
+	}
+	scheduler.rules = rules;
+	scheduler.totalRate = totalRate;
+	scheduler.clientRate = clientRate;
+	enabled = totalRate > 0 || clientRate > 0;
+	for (rule = rules; rule != NULL; rule = rule->next) {
+		enabled |= rule->rate > 0;
+	}
+	for (i = 0; i < SCHED_BUCKETS; i++) {
+		for (c = scheduler.clients[i]; c != NULL; c = c->next) {
+			c->rate = schedRuleRate(c->address);
+		}
+	}
+	scheduler.enabled = enabled;
+	pthread_mutex_unlock(&scheduler.lock);
+	printf("Limits from %s: total %.0f B/s, per client %.0f B/s (0: unlimited)\n",
+		   scheduler.path, totalRate, clientRate);
+}
+
+/*******************************************************************************************
+ * Function:        void* schedReloadMain(void* arg)
+ * Description:		Reads the limits file again on every SIGHUP. SIGHUP is blocked in every
+ *                  thread and taken here with sigwait(), so the file I/O and the report
+ *                  never run on a reactor or a worker.
+ * Parameters:		the signal set holding SIGHUP
+ ********************************************************************************************/
+static void* schedReloadMain(void* arg) {
+	const sigset_t* hup = arg;
+	int signum;
+
+	while (1) {
+		if (sigwait(hup, &signum) == 0) {
+			schedLoad();
+		}
+	}
+	return NULL;
+}
+
+/*******************************************************************************************
+ * Function:        void schedJoin(struct session* s)
+ * Description:		Attaches a new session to the shared limit of its client address
+ ********************************************************************************************/
+static void schedJoin(struct session* s) {
+	unsigned hash = 5381;
+	const char* p;
+	struct schedClient* c;
+
+	if (scheduler.path[0] == '\0') {
+		return;
+	}
+	for (p = s->peerIP; *p != '\0'; p++) {
+		hash = hash * 33 + (unsigned char)*p;
+	}
+	pthread_mutex_lock(&scheduler.lock);
+	for (c = scheduler.clients[hash % SCHED_BUCKETS]; c != NULL; c = c->next) {
+		if (strcmp(c->address, s->peerIP) == 0) {
+			break;
+		}
+	}
+	if (c == NULL && (c = calloc(1, sizeof(*c))) != NULL) {
+		strcpy(c->address, s->peerIP);
+		c->rate = schedRuleRate(c->address);
+		c->next = scheduler.clients[hash % SCHED_BUCKETS];
+		scheduler.clients[hash % SCHED_BUCKETS] = c;
+	}
+	if (c != NULL) {
+		c->refs++;
+	}
+	s->client = c;
+	pthread_mutex_unlock(&scheduler.lock);
+}
+
+/*******************************************************************************************
+ * Function:        void schedLeave(struct session* s)
+ * Description:		Detaches a closing session, the last one of an address frees it
+ ********************************************************************************************/
+static void schedLeave(struct session* s) {
+	unsigned hash = 5381;
+	const char* p;
+	struct schedClient** link;
+
+	if (s->client == NULL) {
+		return;
+	}
+	for (p = s->client->address; *p != '\0'; p++) {
+		hash = hash * 33 + (unsigned char)*p;
+	}
+	pthread_mutex_lock(&scheduler.lock);
+	if (--s->client->refs == 0) {
+		for (link = &scheduler.clients[hash % SCHED_BUCKETS]; *link != s->client; link = &(*link)->next)
+			;
+		*link = s->client->next;
+		free(s->client);
+	}
+	pthread_mutex_unlock(&scheduler.lock);
+	s->client = NULL;
+}
+
+/*******************************************************************************************
+ * Function:        long long schedReserve(struct session* s)
+ * Description:		Asks for the session's next SCHED_QUANTUM. Every limit is a token bucket
+ *                  kept as a virtual clock (GCRA): "due" is when the bytes granted so far
+ *                  are paid for at the limit's rate. Interactive requests (listings, small
+ *                  gets) may run SCHED_BURST worth of time ahead of the client's clock and
+ *                  of the total's; bulk ones wait until both clocks have caught up with
+ *                  now. So interactive data goes ahead of bulk data, even the same
+ *                  client's, but still uses up the limits and can't exceed the total by
+ *                  more than a burst, and bulk transfers get whatever is left. Bulk senders take a quantum at a time in the order their
+ *                  grants fall due, which round-robins the leftover between them.
+ * Returns:         0 and the quantum added to s->schedCredit, or the ns to wait first
+ ********************************************************************************************/
+static long long schedReserve(struct session* s) {
+	struct schedClient* c = s->client;
+	long long now = metricsNow();
+	long long start = now;
+	long long due;
+
+	pthread_mutex_lock(&scheduler.lock);
+	if (c != NULL && c->rate > 0) {
+		due = s->bulk ? c->due : c->due - (long long)(SCHED_BURST * 1e9 / c->rate);
+		start = due > start ? due : start;
+	}
+	if (scheduler.totalRate > 0) {
+		due = s->bulk ? scheduler.totalDue : scheduler.totalDue - (long long)(SCHED_BURST * 1e9 / scheduler.totalRate);
+		start = due > start ? due : start;
+	}
+	if (start > now) {
+		pthread_mutex_unlock(&scheduler.lock);
+		return start - now;
+	}
+	if (c != NULL && c->rate > 0) {
+		c->due = (c->due > now ? c->due : now) + (long long)(SCHED_QUANTUM * 1e9 / c->rate);
+	}
+	if (scheduler.totalRate > 0) {
+		scheduler.totalDue = (scheduler.totalDue > now ? scheduler.totalDue : now) +
+							 (long long)(SCHED_QUANTUM * 1e9 / scheduler.totalRate);
+	}
+	pthread_mutex_unlock(&scheduler.lock);
+	s->schedCredit += SCHED_QUANTUM;
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        int schedArm(struct session* s, long long delay)
+ * Description:		Arms the session's timer to go off in delay ns (creating it on first
+ *                  use), on the session's reactor
+ * Returns:         0, or -1 if there's no timer
+ ********************************************************************************************/
+static int schedArm(struct session* s, long long delay) {
+	struct itimerspec timer;
+
+	if (s->timerFD < 0) {
+		s->timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (s->timerFD < 0 || watchFD(s->reactor, s->timerFD, &s->timerHandle, EPOLLIN | EPOLLET) < 0) {
+			error("ERROR creating pacing timer");
+			return -1;
+		}
+	}
+	memset(&timer, 0, sizeof(timer));
+	timer.it_value.tv_sec = delay / 1000000000LL;
+	timer.it_value.tv_nsec = delay % 1000000000LL;
+	timerfd_settime(s->timerFD, 0, &timer, NULL);
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        int schedAllow(struct session* s, int wait)
+ * Description:		Called before a session puts data on the wire. Without limits that's
+ *                  one load and a branch. A reactor (wait 0) arms the session's timer for
+ *                  the next grant instead of waiting. A worker (wait 1) never sleeps on
+ *                  it: it leaves the delay in s->paceDelay and hands the job back, and the
+ *                  reactor arms the timer (transferJobDone()).
+ * Returns:         0: send up to s->schedCredit bytes (any amount without limits),
+ *                  1: paced, the timer calls pumpData() back (or the worker returns)
+ ********************************************************************************************/
+static int schedAllow(struct session* s, int wait) {
+	long long delay;
+
+	if (!scheduler.enabled || s->client == NULL) {
+		return 0;
+	}
+	while (s->schedCredit <= 0) {
+		delay = schedReserve(s);
+		if (delay == 0) {
+			continue;
+		}
+		metricsAdd(M_PACED, 1);
+		if (wait) {
+			s->paceDelay = delay;
+			return 1;
+		}
+		if (schedArm(s, delay) < 0) {
+			return 0;		//unpaced beats stalled
+		}
+		s->paced = 1;
+		return 1;
+	}
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        void schedSpent(struct session* s, long long bytes)
+ * Description:		Takes bytes that went out off the session's credit; going over it is
+ *                  fine, the next schedAllow() pays the difference first
+ ********************************************************************************************/
+static void schedSpent(struct session* s, long long bytes) {
+	if (scheduler.enabled && s->client != NULL) {
+		s->schedCredit -= bytes;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void schedRelease(struct session* s)
+ * Description:		The request is over: gives a grant it didn't use back to the limits
+ *                  and stops its pacing timer
+ ********************************************************************************************/
+static void schedRelease(struct session* s) {
+	struct itimerspec off;
+
+	if (s->schedCredit > 0 && s->client != NULL) {
+		pthread_mutex_lock(&scheduler.lock);
+		if (s->client->rate > 0) {
+			s->client->due -= (long long)(s->schedCredit * 1e9 / s->client->rate);
+		}
+		if (scheduler.totalRate > 0) {
+			scheduler.totalDue -= (long long)(s->schedCredit * 1e9 / scheduler.totalRate);
+		}
+		pthread_mutex_unlock(&scheduler.lock);
+	}
+	s->schedCredit = 0;
+	if (s->paced && s->timerFD >= 0) {
+		memset(&off, 0, sizeof(off));
+		timerfd_settime(s->timerFD, 0, &off, NULL);
+	}
+	s->paced = 0;
+	s->pacedOffload = 0;
+}
+
+/*******************************************************************************************
+ * Function:        int pacedStep(struct session* s, int socketFD, int wait)
+ * Description:		transferStep() of the session's file within its bandwidth share
+ * Parameters:		the session, the socket the file goes to, 1 on a worker (returns with
+ *                  s->paceDelay set), 0 on a reactor (arms the timer and returns)
+ * Returns:         a transferStatus, TRANSFER_BLOCKED while paced
+ ********************************************************************************************/
+static int pacedStep(struct session* s, int socketFD, int wait) {
+	off_t before = s->xfer.offset;
+	int status;
+
+	if (schedAllow(s, wait)) {
+		return TRANSFER_BLOCKED;
+	}
+	s->xfer.stepMax = scheduler.enabled && s->client != NULL ? (size_t)s->schedCredit : 0;
+	status = transferStep(&s->xfer, socketFD);
+	schedSpent(s, s->xfer.offset - before);
+	return status;
+}
+
+/*******************************************************************************************
+ * Function:        void scheduleRetry(struct session* s)
+ * Description:		The client hasn't opened its data port yet. Arms the session's timer
+ *                  to try again after a short backoff instead of sleeping the reactor.
+ * Post-Conditions: The timer is armed or, after CONNECT_TRIES, the request is abandoned
+ ********************************************************************************************/
+static void scheduleRetry(struct session* s) {
+	struct itimerspec wait;
+
+	if (++s->connectTries >= CONNECT_TRIES) {
+		printf("ERROR: %s never opened data port %d\n", s->clientIP, s->dataPort);
+		failData(s);
+		return;
+	}
+	if (s->timerFD < 0) {
+		s->timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (s->timerFD < 0 || watchFD(s->reactor, s->timerFD, &s->timerHandle, EPOLLIN | EPOLLET) < 0) {
+			error("ERROR creating retry timer");
+			failData(s);
+			return;
+		}
+	}
+	memset(&wait, 0, sizeof(wait));
+	wait.it_value.tv_sec = s->retryDelay / 1000;
+	wait.it_value.tv_nsec = (s->retryDelay % 1000) * 1000000L;
+	timerfd_settime(s->timerFD, 0, &wait, NULL);
+
+	s->retryDelay *= 2;
+	if (s->retryDelay > CONNECT_RETRY_MAX) {
+		s->retryDelay = CONNECT_RETRY_MAX;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void initTCPDataConnection(struct session* s)
+ * Description:		Starts a non-blocking connect of the session's data socket to the client.
+ *                  The client's address is taken as a numeric IP, no name lookup, falling
+ *                  back to the peer address of the control connection.
+ * Parameters:		The session, clientIP and dataPort filled in from the command
+ * Pre-Conditions: 	The client is (about to be) listening on dataPort
+ * Post-Conditions: The session is SESSION_CONNECTING and waiting for EPOLLOUT on the data
+ *                  socket or for its retry timer
+ ********************************************************************************************/
+void initTCPDataConnection(struct session* s) {
+	struct sockaddr_in clientAddress;
+	socklen_t addrLen = sizeof(clientAddress);
+
+	memset((char *)&clientAddress, '\0', sizeof(clientAddress));  // Clear out the address struct
+	if (inet_pton(AF_INET, s->clientIP, &clientAddress.sin_addr) != 1 &&
+			getpeername(s->controlFD, (struct sockaddr *)&clientAddress, &addrLen) < 0) {
+		error("ERROR finding client address");
+		failData(s);
+		return;
+	}
+	clientAddress.sin_family = AF_INET; // Create a network-capable socket
+	clientAddress.sin_port = htons(s->dataPort);  // Store the port number
+
+	s->state = SESSION_CONNECTING;
+	s->dataFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (s->dataFD < 0) {
+		error("ERROR opening socket");
+		failData(s);
+		return;
+	}
+	if (watchFD(s->reactor, s->dataFD, &s->dataHandle, EPOLLOUT | EPOLLET) < 0) {
+		failData(s);
+		return;
+	}
+
+	// Connect socket to address, completion is reported as EPOLLOUT
+	if (connect(s->dataFD, (struct sockaddr *)&clientAddress, sizeof(clientAddress)) < 0 &&
+			errno != EINPROGRESS) {
+		if (errno == ECONNREFUSED) {	//client isn't listening yet
+			close(s->dataFD);
+			s->dataFD = -1;
+			scheduleRetry(s);
+			return;
+		}
+		error("ERROR on connecting data socket");
+		failData(s);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        int openPassive(struct session* s)
+ * Description:		Passive mode: opens a listen socket on an ephemeral port of the address
+ *                  the client reached us on, for the client to connect its data socket to.
+ *                  The session's timer gives up on it after PASSIVE_TIMEOUT.
+ * Returns:         the port number, or -1 on failure
+ ********************************************************************************************/
+static int openPassive(struct session* s) {
+	struct sockaddr_in address;
+	socklen_t addrLen = sizeof(address);
+	struct itimerspec wait;
+
+	if (getsockname(s->controlFD, (struct sockaddr *)&address, &addrLen) < 0) {
+		return -1;
+	}
+	address.sin_port = 0;
+	s->passiveFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (s->passiveFD < 0 ||
+			bind(s->passiveFD, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+			listen(s->passiveFD, 1) < 0 ||
+			getsockname(s->passiveFD, (struct sockaddr *)&address, &addrLen) < 0 ||
+			watchFD(s->reactor, s->passiveFD, &s->passiveHandle, EPOLLIN | EPOLLET) < 0) {
+		return -1;
+	}
+	if (s->timerFD < 0) {
+		s->timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (s->timerFD < 0 || watchFD(s->reactor, s->timerFD, &s->timerHandle, EPOLLIN | EPOLLET) < 0) {
+			return -1;
+		}
+	}
+	memset(&wait, 0, sizeof(wait));
+	wait.it_value.tv_sec = PASSIVE_TIMEOUT;
+	timerfd_settime(s->timerFD, 0, &wait, NULL);
+	s->state = SESSION_CONNECTING;
+	return ntohs(address.sin_port);
+}
+
+/*******************************************************************************************
+ * Function:        void closePassive(struct session* s)
+ * Description:		Closes the passive listen socket (if any) and disarms its timer
+ ********************************************************************************************/
+static void closePassive(struct session* s) {
+	struct itimerspec off;
+
+	if (s->passiveFD < 0) {
+		return;
+	}
+	close(s->passiveFD);
+	s->passiveFD = -1;
+	if (s->timerFD >= 0) {
+		memset(&off, 0, sizeof(off));
+		timerfd_settime(s->timerFD, 0, &off, NULL);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void dataHandshake(struct session* s)
+ * Description:		Drives the TLS handshake on the data connection of a TLS session, the
+ *                  request starts once it's done. The client is the TLS client whichever
+ *                  side connected (as in FTPS) and usually resumes the control connection's
+ *                  session ticket, so this costs no certificate or key exchange.
+ ********************************************************************************************/
+static void dataHandshake(struct session* s) {
+	switch (tlsHandshake(s->dataTLS)) {
+	case 0:
+		return;
+	case 1:
+		tlsEstablished(s->dataTLS, "data");
+		startData(s);
+		return;
+	default:
+		printf("ERROR: TLS handshake failed on the data connection from %s\n", s->clientIP);
+		failData(s);
+		return;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void dataConnected(struct session* s)
+ * Description:		The data connection is up (connected back or accepted): start the
+ *                  request, after a TLS handshake if the control connection is TLS
+ ********************************************************************************************/
+static void dataConnected(struct session* s) {
+	struct epoll_event ev;
+
+	if (s->controlTLS == NULL) {
+		startData(s);
+		return;
+	}
+	s->dataTLS = SSL_new(tlsConfig.ctx);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;		//the handshake reads as well
+	ev.data.ptr = &s->dataHandle;
+	if (s->dataTLS == NULL || SSL_set_fd(s->dataTLS, s->dataFD) != 1 ||
+			epoll_ctl(s->reactor->epollFD, EPOLL_CTL_MOD, s->dataFD, &ev) < 0) {
+		failData(s);
+		return;
+	}
+	SSL_set_accept_state(s->dataTLS);
+	SSL_set_num_tickets(s->dataTLS, 0);		//the control connection's ticket is the one to keep
+	dataHandshake(s);
+}
+
+/*******************************************************************************************
+ * Function:        void passiveAccept(struct session* s)
+ * Description:		EPOLLIN on the passive port: takes the client's data connection. Only
+ *                  the host on the other end of the control connection may connect.
+ ********************************************************************************************/
+static void passiveAccept(struct session* s) {
+	struct sockaddr_in peer;
+	struct sockaddr_in client;
+	socklen_t peerLen;
+	socklen_t clientLen = sizeof(client);
+	int fd;
+
+	if (getpeername(s->controlFD, (struct sockaddr *)&client, &clientLen) < 0) {
+		failData(s);
+		return;
+	}
+	while (1) {
+		peerLen = sizeof(peer);
+		fd = accept4(s->passiveFD, (struct sockaddr *)&peer, &peerLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			if (errno != EAGAIN) {
+				error("ERROR on passive accept");
+				failData(s);
+			}
+			return;
+		}
+		if (peer.sin_addr.s_addr == client.sin_addr.s_addr) {
+			break;
+		}
+		close(fd);		//someone else found the port
+	}
+	closePassive(s);
+	s->dataFD = fd;
+	if (watchFD(s->reactor, s->dataFD, &s->dataHandle, EPOLLOUT | EPOLLET) < 0) {
+		failData(s);
+		return;
+	}
+	dataConnected(s);
+}
+
+/*******************************************************************************************
+ * Function:        void openDataChannel(struct session* s)
+ * Description:		Gets the data for an accepted -l/-g request moving the way the client
+ *                  asked for it: connect back to its port, open a passive port and tell
+ *                  it the number, or send it inline on the control connection. None of
+ *                  them wait on a timer or a name lookup.
+ ********************************************************************************************/
+static void openDataChannel(struct session* s) {
+	char buffer[64];
+	int port;
+
+	s->setupAt = metricsNow();
+	switch (s->dataMode) {
+	case DATA_INLINE:
+		startData(s);
+		break;
+	case DATA_PASSIVE:
+		port = openPassive(s);
+		if (port < 0) {
+			error("ERROR opening passive data port");
+			closePassive(s);
+			s->dataFailed = 1;
+			finishData(s);
+			break;
+		}
+		if (verbose) {
+			printf("Waiting for %s on passive port %d\n", s->clientIP, port);
+		}
+		snprintf(buffer, sizeof(buffer), "PASV %d", port);
+		replyStatus(s, FT_PASV, port, buffer);
+		break;
+	default:
+		initTCPDataConnection(s);
+		break;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void runTransferJob(struct job* job)
+ * Description:		Worker side of an offloaded file: the data socket is blocking (with
+ *                  SEND_TIMEOUT so a stalled client can't hold the worker forever) and
+ *                  the whole range is sent in one go, through the worker's io_uring if
+ *                  it has one. A paced transfer sends until it runs out of bandwidth
+ *                  share and gives the worker back; it is resubmitted when its share is due.
+ ********************************************************************************************/
+static void runTransferJob(struct job* job) {
+	struct session* s = containerOf(job, struct session, transferJob);
+	int status;
+
+	s->paceDelay = 0;
+	if (workerRing != NULL && !scheduler.enabled && s->xfer.method != XFER_DIRECT && s->xfer.tls == NULL) {
+		status = uringTransfer(workerRing, &s->xfer, s->dataFD);
+	}
+	else {		//paced a quantum at a time, io_uring would queue the whole file (through the page cache)
+		while ((status = pacedStep(s, s->dataFD, 1)) == TRANSFER_MORE)
+			;
+	}
+	if (status == TRANSFER_BLOCKED && s->paceDelay == 0) {	//SO_SNDTIMEO expired
+		errno = ETIMEDOUT;
+		status = TRANSFER_ERROR;
+	}
+	s->transferStatus = status;
+	s->transferErrno = errno;
+}
+
+
+/*******************************************************************************************
+ * Function:        void transferJobDone(struct job* job)
+ * Description:		Reactor side of an offloaded file: the worker is finished with the
+ *                  session, report errors and complete the request. A paced transfer
+ *                  waits for its next share on the session's timer, off the pool, and
+ *                  goes back to a worker when it fires.
+ ********************************************************************************************/
+static void transferJobDone(struct job* job) {
+	struct session* s = containerOf(job, struct session, transferJob);
+
+	s->offloaded = 0;
+	if (s->transferStatus == TRANSFER_BLOCKED && !s->destroyPending) {
+		if (schedArm(s, s->paceDelay) < 0) {
+			resumeTransfer(s);		//unpaced beats stalled
+			return;
+		}
+		s->paced = 1;
+		s->pacedOffload = 1;
+		return;
+	}
+	if (s->transferStatus == TRANSFER_ERROR) {
+		errno = s->transferErrno;
+		error("ERROR writing to socket");
+		s->dataFailed = 1;
+	}
+	if (s->destroyPending) {
+		destroySession(s);
+		return;
+	}
+	finishData(s);
+}
+
+/*******************************************************************************************
+ * Function:        void resumeTransfer(struct session* s)
+ * Description:		Hands an offloaded transfer (back) to the worker pool
+ ********************************************************************************************/
+static void resumeTransfer(struct session* s) {
+	s->offloaded = 1;
+	s->transferJob.run = runTransferJob;
+	s->transferJob.done = transferJobDone;
+	s->transferJob.owner = s->reactor;
+	submitJob(s->reactor->pool, s->reactor->id, &s->transferJob);
+}
+
+/*******************************************************************************************
+ * Function:        void offloadTransfer(struct session* s)
+ * Description:		Moves a large file transfer off the reactor onto the worker pool so
+ *                  slow disks and big sends don't hold up the reactor's other sessions.
+ * Pre-Conditions: 	s->xfer is initialized and the data socket is connected
+ * Post-Conditions: The data socket is out of the epoll set and owned by a worker until
+ *                  transferJobDone() runs
+ ********************************************************************************************/
+static void offloadTransfer(struct session* s) {
+	struct timeval timeout = { SEND_TIMEOUT, 0 };
+
+	epoll_ctl(s->reactor->epollFD, EPOLL_CTL_DEL, s->dataFD, NULL);
+	fcntl(s->dataFD, F_SETFL, fcntl(s->dataFD, F_GETFL) & ~O_NONBLOCK);
+	setsockopt(s->dataFD, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	resumeTransfer(s);
+}
+
+/*******************************************************************************************
+ * Function:        int compressible(struct cacheEntry* e, const char* name, off_t length)
+ * Description:		Decides whether a get asking for compression gets it: files that are
+ *                  already compressed (by extension or by their first bytes) and tiny
+ *                  ranges go out raw, deflating them would only cost CPU
+ * Returns:         1 to compress, 0 to send the file as is
+ ********************************************************************************************/
+static int compressible(struct cacheEntry* e, const char* name, off_t length) {
+	static const char* packed[] = { ".gz", ".tgz", ".zip", ".bz2", ".xz", ".zst", ".7z", ".rar",
+		".jpg", ".jpeg", ".png", ".gif", ".webp", ".mp3", ".mp4", ".m4a", ".mkv", ".webm", ".mov",
+		".avi", ".ogg", ".flac", ".jar", ".deb", ".rpm", ".pdf", NULL };
+	static const struct { const char* bytes; int len; int at; } magic[] = {
+		{ "\x1f\x8b", 2, 0 },				//gzip
+		{ "PK\x03\x04", 4, 0 },				//zip, jar, docx
+		{ "BZh", 3, 0 },					//bzip2
+		{ "\xfd" "7zXZ", 5, 0 },			//xz
+		{ "\x28\xb5\x2f\xfd", 4, 0 },		//zstd
+		{ "7z\xbc\xaf", 4, 0 },				//7z
+		{ "\x89PNG", 4, 0 },				//png
+		{ "\xff\xd8\xff", 3, 0 },			//jpeg
+		{ "GIF8", 4, 0 },					//gif
+		{ "ftyp", 4, 4 },					//mp4, mov, m4a
+		{ "\x1a\x45\xdf\xa3", 4, 0 },		//mkv, webm
+		{ "OggS", 4, 0 },					//ogg
+		{ "ID3", 3, 0 },					//mp3
+	};
+	unsigned char head[16];
+	const char* dot = strrchr(name, '.');
+	ssize_t n;
+	size_t i;
+
+	if (length < ZIP_MIN) {
+		return 0;
+	}
+	for (i = 0; dot != NULL && packed[i] != NULL; i++) {
+		if (strcasecmp(dot, packed[i]) == 0) {
+			return 0;
+		}
+	}
+	if (e->data) {
+		n = e->size < (off_t)sizeof(head) ? e->size : (off_t)sizeof(head);
+		memcpy(head, e->data, n);
+	}
+	else {
+		n = pread(e->fd, head, sizeof(head), 0);
+	}
+	for (i = 0; i < sizeof(magic) / sizeof(magic[0]); i++) {
+		if (n >= magic[i].at + magic[i].len && memcmp(head + magic[i].at, magic[i].bytes, magic[i].len) == 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*******************************************************************************************
+ * Function:        void runZipChunk(struct job* job)
+ * Description:		Worker side of a compressed get: deflates one block on its own (raw
+ *                  deflate, no dictionary carried over from the previous block) so blocks
+ *                  compress in parallel. Every block but the last ends in a sync flush,
+ *                  which leaves it byte aligned, so the blocks concatenate into one
+ *                  deflate stream. A block the cache doesn't hold is read into a pooled
+ *                  buffer (see cacheRead()).
+ ********************************************************************************************/
+static void runZipChunk(struct job* job) {
+	struct zipChunk* c = containerOf(job, struct zipChunk, job);
+	struct timespec start;
+	struct timespec end;
+	unsigned char* raw = NULL;	//pooled window the block is read into, ZIP_CHUNK <= POOL_BUF
+	const unsigned char* in;
+	size_t have = 0;
+	ssize_t n;
+	size_t cap;
+	z_stream z;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (c->data) {
+		in = (const unsigned char*)c->data + c->offset;
+	}
+	else {
+		raw = (unsigned char*)bufferGet();
+		if (raw == NULL) {
+			c->failed = 1;
+			return;
+		}
+		while (have < c->len) {
+			n = pread(c->fd, raw + have, c->len - have, c->offset + have);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) {		//error, or the file shrank under us
+				bufferPut((char*)raw);
+				c->failed = 1;
+				return;
+			}
+			have += n;
+		}
+		in = raw;
+	}
+	c->crc = crc32(crc32(0L, Z_NULL, 0), in, c->len);
+	c->sum = crc32c(0, in, c->len);
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, c->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		bufferPut((char*)raw);
+		c->failed = 1;
+		return;
+	}
+	cap = deflateBound(&z, c->len) + 16;	//room for the flush marker too
+	c->out = malloc(cap);
+	if (c->out == NULL) {
+		deflateEnd(&z);
+		bufferPut((char*)raw);
+		c->failed = 1;
+		return;
+	}
+	z.next_in = (unsigned char*)in;
+	z.avail_in = c->len;
+	z.next_out = c->out;
+	z.avail_out = cap;
+	ret = deflate(&z, c->last ? Z_FINISH : Z_SYNC_FLUSH);
+	if (ret != (c->last ? Z_STREAM_END : Z_OK) || z.avail_in != 0) {
+		c->failed = 1;
+	}
+	c->outLen = cap - z.avail_out;
+	deflateEnd(&z);
+	bufferPut((char*)raw);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	c->nanos = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+}
+
+/*******************************************************************************************
+ * Function:        void zipChunkDone(struct job* job)
+ * Description:		Reactor side of a compressed block: folds the worker's speed into the
+ *                  stream's compression rate and, if the block is next in line for the
+ *                  socket, starts sending. A failed or abandoned request is finished
+ *                  (or its session destroyed) once the last worker lets go.
+ ********************************************************************************************/
+static void zipChunkDone(struct job* job) {
+	struct zipChunk* c = containerOf(job, struct zipChunk, job);
+	struct zipStream* zip = c->zip;
+	struct session* s = zip->session;
+	double rate;
+
+	c->ready = 1;
+	zip->inFlight--;
+	if (!c->failed && c->nanos > 0) {
+		rate = c->len * 1e9 / c->nanos;
+		zip->compressRate = zip->compressRate > 0 ? (3 * zip->compressRate + rate) / 4 : rate;
+	}
+	if (s->destroyPending || zip->aborted) {
+		if (zip->inFlight > 0) {
+			return;
+		}
+		if (s->destroyPending) {
+			destroySession(s);
+		}
+		else {
+			finishData(s);
+		}
+		return;
+	}
+	if (c == zip->head && s->state == SESSION_SENDING) {
+		pumpData(s);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        int zipFill(struct session* s)
+ * Description:		Hands the next blocks of the range to the worker pool, spread over the
+ *                  workers' deques, until ZIP_WINDOW blocks are compressing or waiting for
+ *                  the socket. New blocks use the stream's current level.
+ * Returns:         0, or -1 if a block couldn't be allocated
+ ********************************************************************************************/
+static int zipFill(struct session* s) {
+	struct zipStream* zip = s->zip;
+	struct zipChunk* c;
+
+	while (zip->queued < ZIP_WINDOW && !zip->filled) {
+		c = calloc(1, sizeof(*c));
+		if (c == NULL) {
+			return -1;
+		}
+		c->zip = zip;
+		c->fd = s->fileFD;
+		c->data = s->xfer.data;
+		c->offset = zip->next;
+		c->len = zip->end - zip->next < ZIP_CHUNK ? zip->end - zip->next : ZIP_CHUNK;
+		c->level = zip->level;
+		zip->next += c->len;
+		c->last = zip->filled = zip->next == zip->end;
+		if (zip->tail) {
+			zip->tail->next = c;
+		}
+		else {
+			zip->head = c;
+		}
+		zip->tail = c;
+		zip->queued++;
+		zip->inFlight++;
+		c->job.run = runZipChunk;
+		c->job.done = zipChunkDone;
+		c->job.owner = s->reactor;
+		submitJob(s->reactor->pool, s->reactor->id + zip->inFlight, &c->job);
+	}
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        int zipStart(struct session* s)
+ * Description:		Sets up the compression stage for a get whose file is open: the gzip
+ *                  header is queued as the first data bytes and the first ZIP_WINDOW
+ *                  blocks go to the workers. The data stream is a standard gzip file.
+ * Pre-Conditions: 	sendFile() has set up s->xfer
+ * Returns:         0, or -1 if it couldn't be allocated
+ ********************************************************************************************/
+static int zipStart(struct session* s) {
+	static const unsigned char header[10] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 };
+	struct zipStream* zip;
+
+	zip = calloc(1, sizeof(*zip));
+	s->dataBuf = malloc(sizeof(header));
+	if (zip == NULL || s->dataBuf == NULL) {
+		free(zip);
+		return -1;
+	}
+	memcpy(s->dataBuf, header, sizeof(header));
+	s->dataLen = sizeof(header);
+	s->dataPos = 0;
+	s->dataTotal = sizeof(header);
+
+	zip->session = s;
+	zip->next = s->xfer.offset;
+	zip->end = s->xfer.end;
+	zip->level = ZIP_LEVEL;
+	zip->parallel = s->reactor->pool->count < ZIP_WINDOW ? s->reactor->pool->count : ZIP_WINDOW;
+	if (zip->parallel > sysconf(_SC_NPROCESSORS_ONLN)) {
+		zip->parallel = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	zip->crc = crc32(0L, Z_NULL, 0);
+	s->zip = zip;
+	return zipFill(s);
+}
+
+/*******************************************************************************************
+ * Function:        void zipAdapt(struct zipStream* zip, struct zipChunk* c)
+ * Description:		A block is on the wire: folds the time it took into the data socket's
+ *                  drain rate (only time with a block in hand counts, so waiting on the
+ *                  workers doesn't look like a slow link) and moves the level for the
+ *                  next blocks. When the workers together
+ *                  compress slower than the socket takes raw bytes (at the current ratio)
+ *                  the socket sits idle, so the level goes down; with more than twice
+ *                  the headroom the link is the bottleneck and a higher level pays off.
+ *                  A block that barely shrinks means the data is already compressed:
+ *                  the rest of the range is stored (level 0), which only costs the crc.
+ ********************************************************************************************/
+static void zipAdapt(struct zipStream* zip, struct zipChunk* c) {
+	struct timespec now;
+	double seconds;
+	double link;
+	double supply;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	seconds = (now.tv_sec - c->started.tv_sec) + (now.tv_nsec - c->started.tv_nsec) / 1e9;
+	if (seconds < 1e-6) {
+		seconds = 1e-6;
+	}
+	zip->sendSeconds = zip->sendSeconds * 31 / 32 + seconds;	//older blocks fade out
+	zip->sendBytes = zip->sendBytes * 31 / 32 + c->outLen;
+	zip->drainRate = zip->sendBytes / zip->sendSeconds;
+	if (c->level != Z_NO_COMPRESSION && c->outLen >= c->len - c->len / 32) {
+		zip->level = Z_NO_COMPRESSION;	//packed data the magic check missed, store the rest
+	}
+	if (zip->level == Z_NO_COMPRESSION || zip->compressRate <= 0 || c->outLen == 0) {
+		return;
+	}
+
+	link = zip->drainRate * c->len / c->outLen;	//raw bytes/s the socket takes at this ratio
+	supply = zip->compressRate * zip->parallel;
+	if (supply < link && zip->level > Z_BEST_SPEED) {
+		zip->level--;
+	}
+	else if (supply > 2 * link && zip->level < Z_BEST_COMPRESSION) {
+		zip->level++;
+	}
+	if(DEBUG) {
+		printf("zip: drain %.0f B/s, compress %.0f B/s x %d, level %d\n",
+			   zip->drainRate, zip->compressRate, zip->parallel, zip->level);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void pumpZip(struct session* s)
+ * Description:		pumpData() for a compressed get: sends the blocks in file order as the
+ *                  workers finish them, topping the pipeline up after each, then the gzip
+ *                  trailer (crc32 combined from the blocks' crcs, and the raw length).
+ * Post-Conditions: Waits for EPOLLOUT or for the next block, is on the run queue after
+ *                  ZIP_WINDOW blocks, or the request is finished
+ ********************************************************************************************/
+static void pumpZip(struct session* s) {
+	struct zipStream* zip = s->zip;
+	struct zipChunk* c;
+	ssize_t n;
+	int blocks = ZIP_WINDOW;
+
+	if (zip->aborted) {
+		return;
+	}
+	while ((c = zip->head) != NULL) {
+		if (!c->ready) {
+			return;		//zipChunkDone() calls back
+		}
+		if (c->failed) {
+			printf("ERROR compressing %s\n", s->fileName);
+			failData(s);
+			return;
+		}
+		if (c->outPos == 0 && c->started.tv_sec == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &c->started);
+		}
+		while (c->outPos < c->outLen) {
+			if (schedAllow(s, 0)) {
+				return;
+			}
+			n = tlsSend(s->dataTLS, s->dataFD, c->out + c->outPos, c->outLen - c->outPos, MSG_NOSIGNAL);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN) return;
+				error("ERROR writing to socket");
+				failData(s);
+				return;
+			}
+			c->outPos += n;
+			s->dataTotal += n;
+			schedSpent(s, n);
+		}
+
+		zipAdapt(zip, c);
+		zip->crc = crc32_combine(zip->crc, c->crc, c->len);
+		zip->sum = crc32cCombine(zip->sum, c->sum, c->len);
+		zip->rawLen += c->len;
+		zip->head = c->next;
+		if (zip->head == NULL) {
+			zip->tail = NULL;
+		}
+		zip->queued--;
+		free(c->out);
+		free(c);
+		if (zipFill(s) < 0) {
+			error("ERROR allocating compression block");
+			failData(s);
+			return;
+		}
+		if (--blocks == 0 && zip->head != NULL) {
+			queueReady(s);
+			return;
+		}
+	}
+
+	// gzip trailer: crc32 and length mod 2^32, little endian
+	zip->trailer[0] = zip->crc;
+	zip->trailer[1] = zip->crc >> 8;
+	zip->trailer[2] = zip->crc >> 16;
+	zip->trailer[3] = zip->crc >> 24;
+	zip->trailer[4] = zip->rawLen;
+	zip->trailer[5] = zip->rawLen >> 8;
+	zip->trailer[6] = zip->rawLen >> 16;
+	zip->trailer[7] = zip->rawLen >> 24;
+	while (zip->trailerPos < sizeof(zip->trailer)) {
+		n = tlsSend(s->dataTLS, s->dataFD, zip->trailer + zip->trailerPos, sizeof(zip->trailer) - zip->trailerPos, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) return;
+			error("ERROR writing to socket");
+			failData(s);
+			return;
+		}
+		zip->trailerPos += n;
+		s->dataTotal += n;
+	}
+	if(DEBUG) {
+		printf("bytes sent: %lld compressed from %llu\n", (long long)s->dataTotal, (unsigned long long)zip->rawLen);
+	}
+	finishData(s);
+}
+
+/*******************************************************************************************
+ * Function:        void zipFree(struct session* s)
+ * Description:		Releases the compression stage of the session's get
+ * Pre-Conditions: 	No worker owns any of its blocks
+ ********************************************************************************************/
+static void zipFree(struct session* s) {
+	struct zipChunk* c;
+
+	if (s->zip == NULL) {
+		return;
+	}
+	while ((c = s->zip->head) != NULL) {
+		s->zip->head = c->next;
+		free(c->out);
+		free(c);
+	}
+	free(s->zip);
+	s->zip = NULL;
+}
+
+/*******************************************************************************************
+ * Function:        uint32_t deltaWeak(const unsigned char* p, size_t len, uint32_t* a, uint32_t* b)
+ * Description:		The rsync weak checksum of a block: a = sum of the bytes, b = sum of the
+ *                  bytes weighted len..1, both mod 2^16. a and b are returned for rolling.
+ * Returns:         a | b << 16
+ ********************************************************************************************/
+static uint32_t deltaWeak(const unsigned char* p, size_t len, uint32_t* a, uint32_t* b) {
+	uint32_t sa = 0;
+	uint32_t sb = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		sa += p[i];
+		sb += sa;
+	}
+	*a = sa & 0xffff;
+	*b = sb & 0xffff;
+	return *a | *b << 16;
+}
+
+/*******************************************************************************************
+ * Function:        void deltaEmit(struct deltaScan* scan, int type, off_t offset, off_t length, uint32_t block)
+ * Description:		Appends an op to a segment's list, a literal right after a literal or a
+ *                  block right after the block before it extends the previous op instead
+ * Returns:         0, or -1 if the list couldn't grow
+ ********************************************************************************************/
+static int deltaEmit(struct deltaScan* scan, int type, off_t offset, off_t length, uint32_t block) {
+	struct deltaOp* op = scan->count ? &scan->ops[scan->count - 1] : NULL;
+	struct deltaOp* grown;
+
+	if (length <= 0) {
+		return 0;
+	}
+	if (op && op->type == type && op->offset + op->length == offset &&
+			(type == FT_DELTA_LITERAL || block == op->block + op->length / scan->delta->blockSize)) {
+		op->length += length;
+		return 0;
+	}
+	if (scan->count == scan->cap) {
+		grown = realloc(scan->ops, (scan->cap ? 2 * scan->cap : 64) * sizeof(*grown));
+		if (grown == NULL) {
+			return -1;
+		}
+		scan->ops = grown;
+		scan->cap = scan->cap ? 2 * scan->cap : 64;
+	}
+	op = &scan->ops[scan->count++];
+	op->type = type;
+	op->offset = offset;
+	op->length = length;
+	op->block = block;
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        long deltaMatch(struct delta* d, const unsigned char* window, uint32_t weak)
+ * Description:		Looks a window of the file up in the client's signatures: the weak
+ *                  checksum picks the candidates, the window's MD5 (computed once, only
+ *                  on a weak hit) confirms one
+ * Returns:         the client's block number, or -1
+ ********************************************************************************************/
+static long deltaMatch(struct delta* d, const unsigned char* window, uint32_t weak) {
+	unsigned char strong[16];
+	int hashed = 0;
+	uint32_t i;
+
+	for (i = d->heads[weak & d->mask]; i != DELTA_NONE; i = d->next[i]) {
+		if (ftGet32(d->sigs + (size_t)i * FT_SIG_LEN) != weak) {
+			continue;
+		}
+		if (!hashed) {
+			EVP_Digest(window, d->blockSize, strong, NULL, EVP_md5(), NULL);
+			hashed = 1;
+		}
+		if (memcmp(strong, d->sigs + (size_t)i * FT_SIG_LEN + 4, 16) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*******************************************************************************************
+ * Function:        int deltaRead(struct deltaScan* scan, unsigned char* window, size_t cap,
+ *                                off_t* wStart, off_t* wEnd, off_t from, off_t limit)
+ * Description:		Slides a scan's window to start at from (keeping the bytes it already
+ *                  has from there on) and fills it up to cap bytes or limit with pread().
+ *                  Bytes read for the first time that belong to the segment go into its
+ *                  CRC32C; the window only ever moves forward, so they go in in order.
+ * Returns:         0, or -1 if the file can't be read or shrank
+ ********************************************************************************************/
+static int deltaRead(struct deltaScan* scan, unsigned char* window, size_t cap,
+					 off_t* wStart, off_t* wEnd, off_t from, off_t limit) {
+	struct delta* d = scan->delta;
+	size_t want;
+	ssize_t n;
+
+	memmove(window, window + (from - *wStart), *wEnd - from);
+	*wStart = from;
+	while (*wEnd < limit && (size_t)(*wEnd - *wStart) < cap) {
+		want = cap - (*wEnd - *wStart);
+		if ((off_t)want > limit - *wEnd) {
+			want = limit - *wEnd;
+		}
+		n = pread(d->session->fileFD, window + (*wEnd - *wStart), want, *wEnd);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			return -1;
+		}
+		if (*wEnd < scan->end) {
+			scan->crc = crc32c(scan->crc, window + (*wEnd - *wStart),
+							   scan->end - *wEnd < n ? (size_t)(scan->end - *wEnd) : (size_t)n);
+		}
+		*wEnd += n;
+	}
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        void runDeltaScan(struct job* job)
+ * Description:		Worker side of a delta: finds the client's blocks in one segment of the
+ *                  file. Every byte offset of the segment is a candidate block start, the
+ *                  weak checksum rolls from one to the next in O(1); after a match the scan
+ *                  jumps a whole block. A match may run past the segment's end, the merge
+ *                  sorts that out. The segment's CRC32C comes out of the same pass.
+ *                  The file is read through a sliding window (see cacheRead()).
+ ********************************************************************************************/
+static void runDeltaScan(struct job* job) {
+	struct deltaScan* scan = containerOf(job, struct deltaScan, job);
+	struct delta* d = scan->delta;
+	size_t bs = d->blockSize;
+	size_t cap = 2 * bs > DELTA_WINDOW ? 2 * bs : DELTA_WINDOW;
+	off_t size = d->size;
+	off_t limit = scan->end + (off_t)bs < size ? scan->end + (off_t)bs : size;	//last byte a match can reach
+	off_t pos = scan->start;
+	off_t literal = scan->start;
+	off_t wStart = scan->start;		//window holds the file's bytes wStart..wEnd
+	off_t wEnd = scan->start;
+	unsigned char* window = malloc(cap);
+	const unsigned char* m;			//the window at pos
+	uint32_t a = 0;
+	uint32_t b = 0;
+	uint32_t weak = 0;
+	int rolled = 0;					//weak is the checksum of the block at pos
+	long block;
+
+	scan->crc = 0;
+	if (window == NULL) {
+		scan->failed = 1;
+		return;
+	}
+	while (d->blocks > 0 && pos < scan->end && pos + (off_t)bs <= size) {
+		if (pos + (off_t)bs >= wEnd && wEnd < limit && deltaRead(scan, window, cap, &wStart, &wEnd, pos, limit) < 0) {
+			free(window);
+			scan->failed = 1;
+			return;
+		}
+		m = window + (pos - wStart);
+		if (!rolled) {
+			weak = deltaWeak(m, bs, &a, &b);
+			rolled = 1;
+		}
+		if (d->heads[weak & d->mask] != DELTA_NONE && (block = deltaMatch(d, m, weak)) >= 0) {
+			if (deltaEmit(scan, FT_DELTA_LITERAL, literal, pos - literal, 0) < 0 ||
+					deltaEmit(scan, FT_DELTA_COPY, pos, bs, block) < 0) {
+				free(window);
+				scan->failed = 1;
+				return;
+			}
+			pos += bs;
+			literal = pos;
+			rolled = 0;
+			continue;
+		}
+		if (pos + (off_t)bs < size) {
+			a = (a - m[0] + m[bs]) & 0xffff;
+			b = (b - bs * m[0] + a) & 0xffff;
+			weak = a | b << 16;
+		}
+		pos++;
+	}
+	while (wEnd < scan->end) {		//the rest of the segment, for its checksum
+		if (deltaRead(scan, window, cap, &wStart, &wEnd, wEnd, limit) < 0) {
+			free(window);
+			scan->failed = 1;
+			return;
+		}
+	}
+	free(window);
+	if (scan->end == size || literal < scan->end) {
+		if (deltaEmit(scan, FT_DELTA_LITERAL, literal, scan->end - literal, 0) < 0) {
+			scan->failed = 1;
+		}
+	}
+}
+
+/*******************************************************************************************
+ * Function:        int deltaAppend(struct delta* d, const struct deltaOp* op)
+ * Description:		Adds an op to the merged list, joining it to the previous one if it can
+ * Returns:         0, or -1 if the list couldn't grow
+ ********************************************************************************************/
+static int deltaAppend(struct delta* d, const struct deltaOp* op) {
+	struct deltaOp* last = d->count ? &d->ops[d->count - 1] : NULL;
+	struct deltaOp* grown;
+
+	if (op->length <= 0) {
+		return 0;
+	}
+	if (last && last->type == op->type && last->offset + last->length == op->offset &&
+			(op->type == FT_DELTA_LITERAL || op->block == last->block + last->length / d->blockSize)) {
+		last->length += op->length;
+		return 0;
+	}
+	if (d->count == d->cap) {
+		grown = realloc(d->ops, (d->cap ? 2 * d->cap : 64) * sizeof(*grown));
+		if (grown == NULL) {
+			return -1;
+		}
+		d->ops = grown;
+		d->cap = d->cap ? 2 * d->cap : 64;
+	}
+	d->ops[d->count++] = *op;
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        int deltaMerge(struct session* s)
+ * Description:		Joins the segments' op lists in file order. Where a segment's last match
+ *                  ran into the next segment, the next one's ops up to that point are
+ *                  dropped, or cut down: a literal loses its head, a block run keeps the
+ *                  blocks that start after it (the bytes before them go as a literal).
+ *                  The segment crcs combine into the file's CRC32C.
+ * Returns:         0, or -1 on failure
+ ********************************************************************************************/
+static int deltaMerge(struct session* s) {
+	struct delta* d = s->delta;
+	struct deltaScan* scan;
+	struct deltaOp op;
+	struct deltaOp head;
+	off_t covered = 0;
+	off_t skip;
+	int i;
+	size_t k;
+
+	s->crc = 0;
+	for (i = 0; i < d->segments; i++) {
+		scan = &d->scans[i];
+		if (scan->failed) {
+			return -1;
+		}
+		s->crc = crc32cCombine(s->crc, scan->crc, scan->end - scan->start);
+		for (k = 0; k < scan->count; k++) {
+			op = scan->ops[k];
+			if (op.offset + op.length <= covered) {
+				continue;
+			}
+			if (op.offset < covered) {
+				skip = covered - op.offset;
+				if (op.type == FT_DELTA_COPY) {
+					skip = (skip + d->blockSize - 1) / d->blockSize * d->blockSize;
+					head.type = FT_DELTA_LITERAL;
+					head.offset = covered;
+					head.length = op.offset + (skip < op.length ? skip : op.length) - covered;
+					head.block = 0;
+					if (deltaAppend(d, &head) < 0) {
+						return -1;
+					}
+					op.block += skip / d->blockSize;
+				}
+				if (skip >= op.length) {
+					covered = op.offset + op.length;
+					continue;
+				}
+				op.offset += skip;
+				op.length -= skip;
+			}
+			if (deltaAppend(d, &op) < 0) {
+				return -1;
+			}
+			covered = op.offset + op.length;
+		}
+	}
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        void deltaScanDone(struct job* job)
+ * Description:		Reactor side of a scanned segment. Once every segment is in, the lists
+ *                  are merged, the file's checksum indexed, and the ops start going out.
+ ********************************************************************************************/
+static void deltaScanDone(struct job* job) {
+	struct deltaScan* scan = containerOf(job, struct deltaScan, job);
+	struct delta* d = scan->delta;
+	struct session* s = d->session;
+	size_t literal = 0;
+	size_t k;
+
+	if (--d->inFlight > 0) {
+		return;
+	}
+	if (s->destroyPending) {
+		destroySession(s);
+		return;
+	}
+	if (d->aborted) {
+		finishData(s);
+		return;
+	}
+	if (deltaMerge(s) < 0) {
+		printf("ERROR scanning %s for the delta\n", s->fileName);
+		failData(s);
+		return;
+	}
+	sumRemember(s->reactor, s->cached, s->crc);
+	for (k = 0; k < d->count; k++) {
+		if (d->ops[k].type == FT_DELTA_LITERAL) {
+			literal += d->ops[k].length;
+		}
+	}
+	if (verbose) {
+		printf("Delta of %s: %zu ops, %zu of %lld bytes literal\n", s->fileName, d->count, literal, (long long)d->size);
+	}
+	d->state = DELTA_SEND;
+	d->headPos = FT_DELTA_HEAD;		//nothing pending
+	pumpData(s);
+}
+
+/*******************************************************************************************
+ * Function:        int deltaScan(struct session* s)
+ * Description:		The client's signatures are in: indexes them by weak checksum and splits
+ *                  the file into segments (at least DELTA_SEGMENT bytes, at most
+ *                  one per worker) that the worker pool scans in parallel
+ * Returns:         0, or -1 on failure
+ ********************************************************************************************/
+static int deltaScan(struct session* s) {
+	struct delta* d = s->delta;
+	off_t segment;
+	uint32_t i;
+	uint32_t weak;
+	int n;
+
+	for (d->mask = 1; d->mask < 2 * d->blocks; d->mask <<= 1)
+		;
+	d->heads = malloc(d->mask * sizeof(*d->heads));
+	d->next = malloc((d->blocks ? d->blocks : 1) * sizeof(*d->next));
+	if (d->heads == NULL || d->next == NULL) {
+		return -1;
+	}
+	d->mask--;
+	memset(d->heads, 0xff, (d->mask + 1) * sizeof(*d->heads));		//DELTA_NONE
+	for (i = d->blocks; i-- > 0; ) {	//chains end up in block order, the first copy wins
+		weak = ftGet32(d->sigs + (size_t)i * FT_SIG_LEN);
+		d->next[i] = d->heads[weak & d->mask];
+		d->heads[weak & d->mask] = i;
+	}
+
+	posix_fadvise(s->fileFD, 0, d->size, POSIX_FADV_SEQUENTIAL);
+	n = d->size / DELTA_SEGMENT;
+	if (n > s->reactor->pool->count) {
+		n = s->reactor->pool->count;
+	}
+	if (n < 1) {
+		n = 1;
+	}
+	d->scans = calloc(n, sizeof(*d->scans));
+	if (d->scans == NULL) {
+		return -1;
+	}
+	d->segments = n;
+	segment = d->size / n;
+	d->state = DELTA_SCAN;
+	d->inFlight = n;
+	for (n = 0; n < d->segments; n++) {
+		d->scans[n].delta = d;
+		d->scans[n].start = n * segment;
+		d->scans[n].end = n == d->segments - 1 ? d->size : (n + 1) * segment;
+		d->scans[n].job.run = runDeltaScan;
+		d->scans[n].job.done = deltaScanDone;
+		d->scans[n].job.owner = s->reactor;
+		submitJob(s->reactor->pool, s->reactor->id + n, &d->scans[n].job);
+	}
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        int deltaStart(struct session* s)
+ * Description:		Data channel of a delta is open: the client writes its signatures on it
+ *                  first, so the socket is watched for input as well
+ * Returns:         0, or -1 on failure
+ ********************************************************************************************/
+static int deltaStart(struct session* s) {
+	struct epoll_event ev;
+
+	s->fileFD = s->cached->fd;
+	transferInit(&s->xfer, s->fileFD, 0, 0);
+	s->delta->sigs = malloc((size_t)s->delta->blocks * FT_SIG_LEN + 1);
+	if (s->delta->sigs == NULL) {
+		return -1;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = &s->dataHandle;
+	return epoll_ctl(s->reactor->epollFD, EPOLL_CTL_MOD, s->dataFD, &ev);
+}
+
+/*******************************************************************************************
+ * Function:        int deltaSendHead(struct session* s)
+ * Description:		Sends an op header, corked onto the literal bytes that follow it
+ * Returns:         1 when it's out, 0 if the socket is full, -1 on error
+ ********************************************************************************************/
+static int deltaSendHead(struct session* s) {
+	struct delta* d = s->delta;
+	ssize_t n;
+
+	while (d->headPos < FT_DELTA_HEAD) {
+		n = tlsSend(s->dataTLS, s->dataFD, d->head + d->headPos, FT_DELTA_HEAD - d->headPos, MSG_NOSIGNAL | MSG_MORE);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) return 0;
+			return -1;
+		}
+		d->headPos += n;
+		s->dataTotal += n;
+	}
+	return 1;
+}
+
+/*******************************************************************************************
+ * Function:        void pumpDelta(struct session* s)
+ * Description:		pumpData() for a delta: reads the client's signatures, waits for the
+ *                  scan, then sends the ops. Literal bytes go through the transfer engine
+ *                  (sendfile), copies are just a header. The stream ends with FT_DELTA_END
+ *                  carrying the new file's CRC32C.
+ * Post-Conditions: Waits for the socket or the scan, is on the run queue after a full
+ *                  TRANSFER_CHUNK, or the request is finished
+ ********************************************************************************************/
+static void pumpDelta(struct session* s) {
+	struct delta* d = s->delta;
+	size_t want = (size_t)d->blocks * FT_SIG_LEN;
+	struct deltaOp* op;
+	ssize_t n;
+	int status;
+
+	switch (d->state) {
+	case DELTA_SIGS:
+		while (d->got < want) {
+			n = tlsRecv(s->dataTLS, s->dataFD, d->sigs + d->got, want - d->got, 0);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN) return;
+				error("ERROR reading signatures");
+				failData(s);
+				return;
+			}
+			if (n == 0) {
+				printf("ERROR: %s closed the data connection before sending its signatures\n", s->clientIP);
+				failData(s);
+				return;
+			}
+			d->got += n;
+		}
+		if (deltaScan(s) < 0) {
+			error("ERROR starting delta scan");
+			failData(s);
+		}
+		return;
+
+	case DELTA_SCAN:
+		return;		//deltaScanDone() calls back
+
+	case DELTA_SEND:
+		break;
+	}
+
+	while (1) {
+		if ((status = deltaSendHead(s)) <= 0) {
+			if (status < 0) {
+				error("ERROR writing to socket");
+				failData(s);
+			}
+			return;
+		}
+		if (d->literal) {
+			switch (pacedStep(s, s->dataFD, 0)) {
+			case TRANSFER_BLOCKED:
+				return;
+			case TRANSFER_MORE:
+				queueReady(s);
+				return;
+			case TRANSFER_ERROR:
+				error("ERROR writing to socket");
+				failData(s);
+				return;
+			case TRANSFER_DONE:
+				s->dataTotal += s->xfer.end - d->literalStart;
+				transferFree(&s->xfer);
+				d->literal = 0;
+				break;
+			}
+		}
+		if (d->ended) {
+			finishData(s);
+			return;
+		}
+
+		// next op
+		if (d->sent == d->count) {
+			d->head[0] = FT_DELTA_END;
+			ftPut32(d->head + 1, s->crc);
+			ftPut32(d->head + 5, 0);
+			d->ended = 1;
+		}
+		else {
+			op = &d->ops[d->sent];
+			d->head[0] = op->type;
+			if (op->type == FT_DELTA_LITERAL) {
+				n = op->length < DELTA_LITERAL_MAX ? op->length : DELTA_LITERAL_MAX;
+				ftPut32(d->head + 1, n);
+				ftPut32(d->head + 5, 0);
+				transferInit(&s->xfer, s->fileFD, op->offset, n);
+				s->xfer.tls = tlsSoftware(s->dataTLS, 1);
+				d->literal = 1;
+				d->literalStart = op->offset;
+				op->offset += n;
+				op->length -= n;
+			}
+			else {
+				ftPut32(d->head + 1, op->block);
+				ftPut32(d->head + 5, op->length / d->blockSize);
+				op->length = 0;
+			}
+			if (op->length == 0) {
+				d->sent++;
+			}
+		}
+		d->headPos = 0;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void deltaFree(struct session* s)
+ * Description:		Releases a delta's signatures, tables and ops
+ * Pre-Conditions: 	No worker is scanning it
+ ********************************************************************************************/
+static void deltaFree(struct session* s) {
+	struct delta* d = s->delta;
+	int i;
+
+	if (d == NULL) {
+		return;
+	}
+	for (i = 0; i < d->segments; i++) {
+		free(d->scans[i].ops);
+	}
+	free(d->scans);
+	free(d->ops);
+	free(d->heads);
+	free(d->next);
+	free(d->sigs);
+	free(d);
+	s->delta = NULL;
+}
+
+/*******************************************************************************************
+ * Function:        void dataConnectReady(struct session* s)
+ * Description:		EPOLLOUT on a connecting data socket: check how the connect went and
+ *                  either start serving the request or schedule another attempt.
+ ********************************************************************************************/
+static void dataConnectReady(struct session* s) {
+	int err = 0;
+	socklen_t errLen = sizeof(err);
+
+	if (getsockopt(s->dataFD, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0) {
+		err = errno;
+	}
+	if (err == ECONNREFUSED) {
+		close(s->dataFD);
+		s->dataFD = -1;
+		scheduleRetry(s);
+		return;
+	}
+	if (err != 0) {
+		errno = err;
+		error("ERROR on connecting data socket");
+		failData(s);
+		return;
+	}
+
+	dataConnected(s);
+}
+
+struct batchName {			//a name found by batchWalk()/batchGlob(), before it's sorted
+	ino_t ino;
+	size_t offset;			//in the batch's names
+};
+
+/*******************************************************************************************
+ * Function:        int batchAdd(struct batch* b, const char* name)
+ * Description:		Appends a name to the batch's list
+ * Returns:         its offset in b->names, -1 if it's too long or out of memory
+ ********************************************************************************************/
+static long batchAdd(struct batch* b, const char* name) {
+	size_t len = strlen(name) + 1;
+	size_t offset = b->namesLen;
+	char* grown;
+
+	if (len > BATCH_NAME_MAX) {
+		b->skipped++;
+		return -1;
+	}
+	if (b->namesLen + len > b->namesCap) {
+		b->namesCap = b->namesCap ? 2 * b->namesCap : 64 * 1024;
+		if (b->namesCap < b->namesLen + len) {
+			b->namesCap = b->namesLen + len;
+		}
+		grown = realloc(b->names, b->namesCap);
+		if (grown == NULL) {
+			b->failed = 1;
+			return -1;
+		}
+		b->names = grown;
+	}
+	memcpy(b->names + offset, name, len);
+	b->namesLen += len;
+	return offset;
+}
+
+/*******************************************************************************************
+ * Function:        int batchFound(struct batchName** found, size_t* count, size_t* cap, ino_t ino, long offset)
+ * Description:		Remembers a name a directory read turned up, with its inode number
+ ********************************************************************************************/
+static int batchFound(struct batchName** found, size_t* count, size_t* cap, ino_t ino, long offset) {
+	struct batchName* grown;
+
+	if (offset < 0) {
+		return 0;
+	}
+	if (*count == *cap) {
+		*cap = *cap ? 2 * *cap : 1024;
+		grown = realloc(*found, *cap * sizeof(**found));
+		if (grown == NULL) {
+			return -1;
+		}
+		*found = grown;
+	}
+	(*found)[*count].ino = ino;
+	(*found)[*count].offset = offset;
+	(*count)++;
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        int batchWalk(struct batch* b, int dirFD, char* path, size_t pathLen, ...)
+ * Description:		Adds every regular file under a directory, depth first, with its path
+ *                  relative to the session's directory. Symbolic links to files are
+ *                  followed, links to directories aren't (no loops).
+ * Parameters:		the batch, the open directory (closed here), its path with a trailing
+ *                  '/' in a BATCH_NAME_MAX buffer, and where found names go
+ * Returns:         0, -1 if memory ran out
+ ********************************************************************************************/
+static int batchWalk(struct batch* b, int dirFD, char* path, size_t pathLen,
+					 struct batchName** found, size_t* count, size_t* cap) {
+	DIR* dir = fdopendir(dirFD);
+	struct dirent* d;
+	struct stat info;
+	size_t len;
+	int sub;
+	int isDir;
+	int status = 0;
+
+	if (dir == NULL) {
+		close(dirFD);
+		b->skipped++;
+		return 0;
+	}
+	while (status == 0 && (d = readdir(dir)) != NULL) {
+		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+			continue;
+		}
+		len = strlen(d->d_name);
+		if (pathLen + len + 2 > BATCH_NAME_MAX) {
+			b->skipped++;
+			continue;
+		}
+		memcpy(path + pathLen, d->d_name, len + 1);
+		isDir = d->d_type == DT_DIR;
+		if (d->d_type == DT_UNKNOWN) {
+			isDir = fstatat(dirfd(dir), d->d_name, &info, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(info.st_mode);
+		}
+		if (isDir) {
+			sub = openat(dirfd(dir), d->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (sub < 0) {
+				b->skipped++;
+				continue;
+			}
+			path[pathLen + len] = '/';
+			path[pathLen + len + 1] = '\0';
+			status = batchWalk(b, sub, path, pathLen + len + 1, found, count, cap);
+		}
+		else if (d->d_type == DT_REG ||
+				 (fstatat(dirfd(dir), d->d_name, &info, 0) == 0 && S_ISREG(info.st_mode))) {
+			status = batchFound(found, count, cap, d->d_ino, batchAdd(b, path));
+		}
+	}
+	closedir(dir);
+	return status;
+}
+
+/*******************************************************************************************
+ * Function:        int batchGlob(struct batch* b, ...)
+ * Description:		Adds the regular files of one directory whose names match the last
+ *                  component of the pattern (fnmatch, a leading '.' must match explicitly)
+ * Returns:         0, -1 if memory ran out or the directory can't be read
+ ********************************************************************************************/
+static int batchGlob(struct batch* b, struct batchName** found, size_t* count, size_t* cap) {
+	char path[BATCH_NAME_MAX];
+	const char* slash = strrchr(b->pattern, '/');
+	const char* leaf = slash ? slash + 1 : b->pattern;
+	size_t dirLen = slash ? (size_t)(slash - b->pattern + 1) : 0;
+	struct dirent* d;
+	struct stat info;
+	DIR* dir;
+	int fd;
+
+	memcpy(path, b->pattern, dirLen);
+	path[dirLen] = '\0';
+	fd = openat(b->dirFD, dirLen ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	dir = fd >= 0 ? fdopendir(fd) : NULL;
+	if (dir == NULL) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	while ((d = readdir(dir)) != NULL) {
+		if (fnmatch(leaf, d->d_name, FNM_PERIOD) != 0 || dirLen + strlen(d->d_name) >= BATCH_NAME_MAX) {
+			continue;
+		}
+		if (d->d_type == DT_REG ||
+				((d->d_type == DT_LNK || d->d_type == DT_UNKNOWN) &&
+				 fstatat(dirfd(dir), d->d_name, &info, 0) == 0 && S_ISREG(info.st_mode))) {
+			strcpy(path + dirLen, d->d_name);
+			if (batchFound(found, count, cap, d->d_ino, batchAdd(b, path)) < 0) {
+				closedir(dir);
+				return -1;
+			}
+		}
+	}
+	closedir(dir);
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        int compareIno(const void* a, const void* b)
+ * Description:		qsort() order of found names: by inode number
+ ********************************************************************************************/
+static int compareIno(const void* a, const void* b) {
+	const struct batchName* x = a;
+	const struct batchName* y = b;
+
+	return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+/*******************************************************************************************
+ * Function:        void batchList(struct batch* b)
+ * Description:		Worker side, first fetch: turns the pattern into the list of files. A
+ *                  manifest is sent in its own order; the files of a directory or glob are
+ *                  sent in inode order, which on most filesystems is close to their order
+ *                  on disk, so a cold batch reads mostly sequentially.
+ * Post-Conditions: b->listed, or b->failed if the pattern couldn't be read
+ ********************************************************************************************/
+static void batchList(struct batch* b) {
+	char path[BATCH_NAME_MAX];
+	struct batchName* found = NULL;
+	size_t count = 0;
+	size_t cap = 0;
+	size_t i;
+	struct stat info;
+	char* line = NULL;
+	size_t lineCap = 0;
+	ssize_t len;
+	char* sorted;
+	size_t pos;
+	FILE* manifest;
+	int fd;
+
+	b->listed = 1;
+	if (b->pattern[0] == '@') {
+		fd = openat(b->dirFD, b->pattern + 1, O_RDONLY | O_CLOEXEC);
+		manifest = fd >= 0 ? fdopen(fd, "r") : NULL;
+		if (manifest == NULL) {
+			if (fd >= 0) {
+				close(fd);
+			}
+			b->failed = 1;
+			return;
+		}
+		while ((len = getline(&line, &lineCap, manifest)) > 0) {
+			while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+				line[--len] = '\0';
+			}
+			if (len > 0) {
+				batchAdd(b, line);
+			}
+		}
+		free(line);
+		fclose(manifest);
+		return;
+	}
+
+	if (strpbrk(b->pattern, "*?[") != NULL) {
+		b->failed = batchGlob(b, &found, &count, &cap) < 0;
+	}
+	else if (fstatat(b->dirFD, b->pattern, &info, 0) == 0 && S_ISDIR(info.st_mode)) {
+		fd = openat(b->dirFD, b->pattern, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		snprintf(path, sizeof(path), "%s%s", b->pattern,
+				 b->pattern[strlen(b->pattern) - 1] == '/' ? "" : "/");
+		b->failed = fd < 0 || batchWalk(b, fd, path, strlen(path), &found, &count, &cap) < 0;
+	}
+	else {
+		batchAdd(b, b->pattern);	//a single file, or a name that fails when it's opened
+	}
+
+	if (count > 0 && !b->failed) {
+		qsort(found, count, sizeof(*found), compareIno);
+		sorted = malloc(b->namesLen);
+		if (sorted != NULL) {
+			for (pos = 0, i = 0; i < count; i++) {
+				strcpy(sorted + pos, b->names + found[i].offset);
+				pos += strlen(sorted + pos) + 1;
+			}
+			free(b->names);
+			b->names = sorted;
+			b->namesCap = b->namesLen;
+		}
+	}
+	free(found);
+}
+
+/*******************************************************************************************
+ * Function:        void runBatchFetch(struct job* job)
+ * Description:		Worker side of a batch get's prefetch stage: opens the next files and
+ *                  starts reading them in with posix_fadvise(WILLNEED), so the disk is
+ *                  busy while the reactor sends the files before them. Stops at the room
+ *                  the reactor left (files and bytes). Files that can't be opened are
+ *                  skipped and counted. A batch reads each file once, in order: it goes
+ *                  around the hot-file cache, which would copy the files and evict the
+ *                  hot set, and the page cache readahead is what it needs.
+ ********************************************************************************************/
+static void runBatchFetch(struct job* job) {
+	struct batch* b = containerOf(job, struct batch, job);
+	struct batchFile* f;
+	off_t bytes = 0;
+	const char* name;
+
+	if (!b->listed) {
+		batchList(b);
+	}
+	b->fetchedCount = 0;
+	while (!b->failed && b->nextName < b->namesLen && b->fetchedCount < b->wantFiles && bytes < b->wantBytes) {
+		name = b->names + b->nextName;
+		b->nextName += strlen(name) + 1;
+		f = &b->fetched[b->fetchedCount];
+		f->fd = openat(b->dirFD, name, O_RDONLY | O_CLOEXEC);
+		if (f->fd < 0 || fstat(f->fd, &f->opened) < 0 || !S_ISREG(f->opened.st_mode)) {
+			if (f->fd >= 0) {
+				close(f->fd);
+				errno = EINVAL;
+			}
+			if (verbose) {
+				printf("Batch %s: skipping %s (%s)\n", b->pattern, name, strerror(errno));
+			}
+			b->skipped++;
+			continue;
+		}
+		f->size = f->opened.st_size;
+		f->mtime = f->opened.st_mtime;
+		f->sumKnown = sumLookup(&f->opened, &f->crc);
+		strcpy(f->name, name);
+		if (f->size > 0) {
+			posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			posix_fadvise(f->fd, 0, f->size < BATCH_READAHEAD ? f->size : BATCH_READAHEAD,
+						  POSIX_FADV_WILLNEED);
+		}
+		bytes += f->size;
+		b->fetchedCount++;
+	}
+}
+
+static void batchFetchDone(struct job* job);
+
+/*******************************************************************************************
+ * Function:        void batchFetch(struct session* s)
+ * Description:		Hands the next prefetch to the worker pool, sized to the room in the
+ *                  ready queue
+ ********************************************************************************************/
+static void batchFetch(struct session* s) {
+	struct batch* b = s->batch;
+
+	b->wantFiles = BATCH_WINDOW - b->readyCount;
+	b->wantBytes = BATCH_AHEAD - b->readyBytes;
+	b->inFlight = 1;
+	b->job.run = runBatchFetch;
+	b->job.done = batchFetchDone;
+	b->job.owner = s->reactor;
+	submitJob(s->reactor->pool, s->reactor->id, &b->job);
+}
+
+/*******************************************************************************************
+ * Function:        void batchFetchDone(struct job* job)
+ * Description:		Reactor side of a prefetch: queues the opened files and sends
+ ********************************************************************************************/
+static void batchFetchDone(struct job* job) {
+	struct batch* b = containerOf(job, struct batch, job);
+	struct session* s = b->session;
+	int i;
+
+	b->inFlight = 0;
+	for (i = 0; i < b->fetchedCount; i++) {
+		b->ready[(b->readyHead + b->readyCount) % BATCH_WINDOW] = b->fetched[i];
+		b->readyCount++;
+		b->readyBytes += b->fetched[i].size;
+	}
+	b->fetchedCount = 0;
+	if (s->destroyPending) {
+		destroySession(s);
+		return;
+	}
+	if (b->aborted) {
+		finishData(s);
+		return;
+	}
+	if (b->failed) {
+		printf("ERROR reading batch %s\n", b->pattern);
+		failData(s);
+		return;
+	}
+	pumpData(s);
+}
+
+/*******************************************************************************************
+ * Function:        int batchStart(struct session* s)
+ * Description:		The data channel is open: starts the first prefetch, which also lists
+ *                  the files
+ * Returns:         0, -1 if out of memory
+ ********************************************************************************************/
+static int batchStart(struct session* s) {
+	struct batch* b = s->batch;
+
+	b->fetched = malloc(BATCH_WINDOW * sizeof(*b->fetched));
+	b->ready = malloc(BATCH_WINDOW * sizeof(*b->ready));
+	b->dirFD = dup(s->dirFD);		//the session may cd while the worker lists
+	if (b->fetched == NULL || b->ready == NULL || b->dirFD < 0) {
+		return -1;
+	}
+	batchFetch(s);
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        void batchHead(struct batch* b, off_t size, time_t mtime, const char* name)
+ * Description:		Queues an entry head, or the end record when name is NULL
+ ********************************************************************************************/
+static void batchHead(struct batch* b, off_t size, time_t mtime, const char* name) {
+	size_t nameLen = name ? strlen(name) : 0;
+
+	ftPut64(b->head, size);
+	ftPut64(b->head + 8, mtime);
+	ftPut16(b->head + 16, nameLen);
+	memcpy(b->head + FT_BATCH_HEAD, name, nameLen);
+	b->headLen = FT_BATCH_HEAD + nameLen;
+	b->headPos = 0;
+}
+
+/*******************************************************************************************
+ * Function:        void pumpBatch(struct session* s)
+ * Description:		Sends a batch get: for each prefetched file its head, the file (the
+ *                  same paced transferStep() as a get) and its checksum, then the end
+ *                  record. Asks for the next prefetch while half the window is still
+ *                  queued, so the reactor rarely waits for the disk.
+ ********************************************************************************************/
+static void pumpBatch(struct session* s) {
+	struct batch* b = s->batch;
+	int files = BATCH_TURN;
+	ssize_t n;
+
+	while (1) {
+		if (b->headPos < b->headLen) {
+			if (schedAllow(s, 0)) {
+				return;
+			}
+			n = tlsSend(s->dataTLS, s->dataFD, b->head + b->headPos, b->headLen - b->headPos, MSG_NOSIGNAL | MSG_MORE);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN) return;
+				error("ERROR writing to socket");
+				failData(s);
+				return;
+			}
+			b->headPos += n;
+			s->dataTotal += n;
+			schedSpent(s, n);
+			continue;
+		}
+		if (b->current.fd >= 0) {
+			switch (pacedStep(s, s->dataFD, 0)) {
+			case TRANSFER_BLOCKED:
+				return;
+			case TRANSFER_MORE:
+				queueReady(s);
+				return;
+			case TRANSFER_ERROR:
+				error("ERROR sending batch file");
+				failData(s);
+				return;
+			case TRANSFER_DONE:
+				break;
+			}
+			s->dataTotal += b->current.size;
+			if (!b->current.sumKnown && s->xfer.checksum == 1) {
+				b->current.sumKnown = 1;
+				b->current.crc = s->xfer.crc;
+				sumRememberFile(s->reactor, b->current.fd, &b->current.opened, b->current.crc);
+			}
+			b->head[0] = b->current.sumKnown;
+			ftPut32(b->head + 1, b->current.sumKnown ? b->current.crc : 0);
+			b->headLen = FT_BATCH_TAIL;
+			b->headPos = 0;
+			transferFree(&s->xfer);
+			close(b->current.fd);
+			b->current.fd = -1;
+			b->sent++;
+			continue;
+		}
+		if (b->ended) {
+			if (verbose) {
+				printf("Batch %s: %lu files, %lu skipped, %lld bytes\n", b->pattern, b->sent, b->skipped,
+					   (long long)s->dataTotal);
+			}
+			finishData(s);
+			return;
+		}
+		if (b->readyCount > 0) {
+			if (files-- == 0) {
+				queueReady(s);
+				return;
+			}
+			b->current = b->ready[b->readyHead];
+			b->readyHead = (b->readyHead + 1) % BATCH_WINDOW;
+			b->readyCount--;
+			b->readyBytes -= b->current.size;
+			batchHead(b, b->current.size, b->current.mtime, b->current.name);
+			transferInit(&s->xfer, b->current.fd, 0, b->current.size);
+			s->xfer.tls = tlsSoftware(s->dataTLS, 1);
+			s->xfer.checksum = !b->current.sumKnown;
+			if (transferDirect(&s->xfer) == 0) {
+				metricsAdd(M_DIRECT, 1);
+			}
+			if (!b->inFlight && b->nextName < b->namesLen && b->readyCount < BATCH_WINDOW / 2) {
+				batchFetch(s);
+			}
+			continue;
+		}
+		if (b->inFlight) {
+			return;		//batchFetchDone() calls back
+		}
+		if (b->nextName < b->namesLen) {
+			batchFetch(s);
+			return;
+		}
+		batchHead(b, b->sent, b->skipped, NULL);
+		b->ended = 1;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void batchFree(struct session* s)
+ * Description:		Releases a batch get's files and names
+ * Pre-Conditions: 	no fetch is in flight
+ ********************************************************************************************/
+static void batchFree(struct session* s) {
+	struct batch* b = s->batch;
+
+	if (b == NULL) {
+		return;
+	}
+	if (b->current.fd >= 0) {
+		transferFree(&s->xfer);
+		close(b->current.fd);
+	}
+	for (; b->readyCount > 0; b->readyCount--) {
+		close(b->ready[b->readyHead].fd);
+		b->readyHead = (b->readyHead + 1) % BATCH_WINDOW;
+	}
+	if (b->dirFD >= 0) {
+		close(b->dirFD);
+	}
+	free(b->fetched);
+	free(b->ready);
+	free(b->names);
+	free(b);
+	s->batch = NULL;
+}
+
+/*******************************************************************************************
+ * Function:        void startData(struct session* s)
+ * Description:		The data channel is open: build the listing or open the file and start
+ *                  sending. Inline data always stays on the reactor, it shares the control
+ *                  socket. A compressed get stays on it too, only its blocks go to workers,
+ *                  and so does a delta, which starts by reading the client's signatures.
+ *                  A batch get sends from the reactor once a worker has listed and opened
+ *                  its first files. An upload is received by a worker.
+ ********************************************************************************************/
+static void startData(struct session* s) {
+	long long now = metricsNow();
+
+	if (s->setupAt) {
+		metricsRecord(ST_SETUP, now - s->setupAt);
+		s->setupAt = 0;
+	}
+	metricsRecord(ST_FIRST_BYTE, now - s->commandAt);
+	s->state = SESSION_SENDING;
+	if (s->command == CMD_LIST) {
+		listCmd(s);
+	}
+	else if (s->command == CMD_DELTA) {
+		if (deltaStart(s) < 0) {
+			error("ERROR starting delta");
+			failData(s);
+			return;
+		}
+	}
+	else if (s->command == CMD_MGET) {
+		if (batchStart(s) < 0) {
+			error("ERROR starting batch");
+			failData(s);
+		}
+		return;		//batchFetchDone() starts sending
+	}
+	else if (s->command == CMD_PUT) {
+		offloadPut(s);
+		return;
+	}
+	else {
+		sendFile(s);
+		if (s->compress && s->fileFD >= 0) {
+			if (zipStart(s) < 0) {
+				error("ERROR starting compression");
+				failData(s);
+				return;
+			}
+		}
+		else if (s->dataMode != DATA_INLINE && s->fileFD >= 0 && s->xfer.end - s->xfer.offset >= OFFLOAD_MIN) {
+			offloadTransfer(s);
+			return;
+		}
+	}
+	if (s->dataMode == DATA_INLINE && s->fileFD >= 0) {
+		s->dataEnd = s->xfer.end;
+		s->xfer.end = s->xfer.offset;	//no frame started yet
+	}
+	pumpData(s);
+}
+
+/*******************************************************************************************
+ * Function:        void queueReady(struct session* s)
+ * Description:		Puts a session that still has data to send (but used up its turn) on
+ *                  the reactor's run queue, so one big transfer can't starve the others.
+ ********************************************************************************************/
+static void queueReady(struct session* s) {
+	struct reactor* r = s->reactor;
+
+	if (s->queued) {
+		return;
+	}
+	s->queued = 1;
+	s->readyNext = NULL;
+	if (r->readyTail) {
+		r->readyTail->readyNext = s;
+	}
+	else {
+		r->readyHead = s;
+	}
+	r->readyTail = s;
+}
+
+/*******************************************************************************************
+ * Function:        void pumpData(struct session* s)
+ * Description:		Sends the session's pending data: queued text or the listing (read
+ *                  LIST_TURN batches per turn), then the file through the transfer engine,
+ *                  one TRANSFER_CHUNK per turn, or through the compression stage.
+ * Post-Conditions: Waits for EPOLLOUT if the socket filled up, is on the run queue if
+ *                  there is more to send, otherwise the data socket is closed
+ ********************************************************************************************/
+static void pumpInline(struct session* s);
+
+static void pumpData(struct session* s) {
+	ssize_t dataWritten;
+	int batches = LIST_TURN;
+
+	if (s->dataMode == DATA_INLINE) {
+		pumpInline(s);
+		return;
+	}
+	if (s->delta) {
+		pumpDelta(s);
+		return;
+	}
+	if (s->batch) {
+		pumpBatch(s);
+		return;
+	}
+
+	do {
+		while (s->dataPos < s->dataLen) {
+			if (schedAllow(s, 0)) {
+				return;
+			}
+			dataWritten = tlsSend(s->dataTLS, s->dataFD, s->dataBuf + s->dataPos, s->dataLen - s->dataPos, MSG_NOSIGNAL);
+			if (dataWritten < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN) return;
+				error("ERROR writing to socket");
+				failData(s);
+				return;
+			}
+			s->dataPos += dataWritten;
+			schedSpent(s, dataWritten);
+		}
+	} while (batches-- > 0 && listMore(s));
+	if (s->listing && !s->listing->complete && !s->dataFailed) {
+		queueReady(s);		//more of the directory to read next turn
+		return;
+	}
+	if (s->zip) {
+		pumpZip(s);
+		return;
+	}
+
+	if (s->fileFD >= 0) {
+		switch (pacedStep(s, s->dataFD, 0)) {
+		case TRANSFER_BLOCKED:
+			return;
+		case TRANSFER_MORE:
+			queueReady(s);
+			return;
+		case TRANSFER_ERROR:
+			error("ERROR writing to socket");
+			s->dataFailed = 1;
+			break;
+		case TRANSFER_DONE:
+			if(DEBUG) {
+				printf("bytes sent: %lld (method %d)\n", (long long)s->xfer.offset, s->xfer.method);
+			}
+			break;
+		}
+	}
+	finishData(s);
+}
+
+/*******************************************************************************************
+ * Function:        void pumpInline(struct session* s)
+ * Description:		pumpData() for inline data: the listing or file goes out on the control
+ *                  socket as FT_DATA frames of up to FT_MAX_DATA bytes. A frame's header is
+ *                  corked onto its payload, the payload still goes through the transfer
+ *                  engine (xfer.end is pulled in to the end of the frame). Control replies
+ *                  queued ahead of the data are flushed first.
+ * Post-Conditions: Same as pumpData(), INLINE_FRAMES frames per turn
+ ********************************************************************************************/
+static void pumpInline(struct session* s) {
+	ssize_t n;
+	off_t remaining;
+	int frames = INLINE_FRAMES;
+
+	while (s->state == SESSION_SENDING) {
+		if (s->outPos < s->outLen) {
+			return;			//flushControl() calls back once the replies are out
+		}
+		while (s->frameHeadPos < sizeof(s->frameHead)) {
+			n = tlsSend(s->controlTLS, s->controlFD, s->frameHead + s->frameHeadPos, sizeof(s->frameHead) - s->frameHeadPos,
+					 MSG_NOSIGNAL | MSG_MORE);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN) return;
+				error("ERROR writing to socket");
+				destroySession(s);		//the control connection is gone with it
+				return;
+			}
+			s->frameHeadPos += n;
+		}
+
+		if (s->frameLeft > 0 && s->fileFD >= 0) {
+			switch (pacedStep(s, s->controlFD, 0)) {
+			case TRANSFER_BLOCKED:
+				return;
+			case TRANSFER_MORE:
+				queueReady(s);
+				return;
+			case TRANSFER_ERROR:
+				error("ERROR writing to socket");
+				destroySession(s);		//a frame was cut short, the stream is lost
+				return;
+			case TRANSFER_DONE:
+				s->frameLeft = 0;
+				break;
+			}
+		}
+		while (s->frameLeft > 0 && s->fileFD < 0) {
+			if (schedAllow(s, 0)) {
+				return;
+			}
+			n = tlsSend(s->controlTLS, s->controlFD, s->dataBuf + s->dataPos, s->frameLeft, MSG_NOSIGNAL);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN) return;
+				error("ERROR writing to socket");
+				destroySession(s);
+				return;
+			}
+			s->dataPos += n;
+			s->frameLeft -= n;
+			schedSpent(s, n);
+		}
+
+		// next frame
+		remaining = s->fileFD >= 0 ? s->dataEnd - s->xfer.offset : (off_t)(s->dataLen - s->dataPos);
+		if (remaining == 0 && s->fileFD < 0 && listMore(s)) {
+			remaining = s->dataLen - s->dataPos;
+		}
+		if (remaining == 0) {
+			finishData(s);
+			return;
+		}
+		if (frames-- == 0) {
+			queueReady(s);
+			return;
+		}
+		s->frameLeft = remaining < FT_MAX_DATA ? remaining : FT_MAX_DATA;
+		if (s->fileFD >= 0) {
+			s->xfer.end = s->xfer.offset + s->frameLeft;
+		}
+		ftEncodeHeader(s->frameHead, FT_DATA, s->requestID, s->frameLeft);
+		s->frameHeadPos = 0;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void failData(struct session* s)
+ * Description:		finishData() for a request that didn't make it to the client
+ ********************************************************************************************/
+static void failData(struct session* s) {
+	s->dataFailed = 1;
+	finishData(s);
+}
+
+/*******************************************************************************************
+ * Function:        int transferChecksum(struct session* s)
+ * Description:		Picks up the CRC32C of a get that went out in full: from the index, the
+ *                  compression stage or the transfer engine. A whole file's checksum goes
+ *                  into the index if the file didn't change while it was being sent.
+ * Returns:         1 with s->crc set, 0 if the transfer couldn't checksum its data
+ ********************************************************************************************/
+static int transferChecksum(struct session* s) {
+
+	if (s->sumKnown) {
+		return 1;
+	}
+	if (s->zip) {
+		s->crc = s->zip->sum;
+	}
+	else if (s->xfer.checksum == 1) {
+		s->crc = s->xfer.crc;
+	}
+	else {
+		return 0;
+	}
+	if (s->cached && s->rangeOffset == 0 && s->rangeLength == s->cached->size) {
+		sumRemember(s->reactor, s->cached, s->crc);
+	}
+	return 1;
+}
+
+/*******************************************************************************************
+ * Function:        void finishData(struct session* s)
+ * Description:		Tears down the data side of the current request (socket, file, buffers)
+ *                  and completes the request. Line mode and framed clients get a final
+ *                  DONE <bytes> or error reply for the request, a get's DONE carries the
+ *                  CRC32C of the (raw) bytes: "DONE <bytes> CRC32C <hex>".
+ ********************************************************************************************/
+static void finishData(struct session* s) {
+	char buffer[64];
+	int summed = 0;
+
+	if (s->zip && s->zip->inFlight > 0) {	//workers still read the file, zipChunkDone() comes back
+		s->zip->aborted = 1;
+		return;
+	}
+	if (s->delta && s->delta->inFlight > 0) {	//same for deltaScanDone()
+		s->delta->aborted = 1;
+		return;
+	}
+	if (s->batch && s->batch->inFlight) {		//and batchFetchDone()
+		s->batch->aborted = 1;
+		return;
+	}
+	if (s->command == CMD_GET && s->fileFD >= 0 && !s->dataFailed) {
+		summed = transferChecksum(s);
+	}
+	else if (s->command == CMD_DELTA && !s->dataFailed) {
+		summed = s->delta && s->delta->ended;		//deltaMerge() summed the file
+	}
+	zipFree(s);
+	deltaFree(s);
+	batchFree(s);
+	if (s->dataFD >= 0) {
+		tlsClose(&s->dataTLS);
+		close(s->dataFD);
+		s->dataFD = -1;
+	}
+	closePassive(s);
+	s->dataMode = DATA_ACTIVE;
+	s->frameLeft = 0;
+	s->frameHeadPos = sizeof(s->frameHead);
+	if (s->fileFD >= 0) {
+		transferFree(&s->xfer);
+		s->fileFD = -1;
+	}
+	if (s->cached) {
+		cacheRelease(s->cached);
+		s->cached = NULL;
+	}
+	if (s->putFD >= 0) {
+		close(s->putFD);		//stays behind as <file>.ftpart
+		s->putFD = -1;
+	}
+	if (s->putDirFD >= 0) {
+		close(s->putDirFD);
+		s->putDirFD = -1;
+	}
+	if (s->listing) {
+		listingRelease(s->listing);
+		s->listing = NULL;
+		s->dataBuf = NULL;
+	}
+	free(s->dataBuf);
+	s->dataBuf = NULL;
+	s->dataLen = s->dataPos = 0;
+	s->setupAt = 0;
+	schedRelease(s);
+	metricsRecord(ST_TRANSFER, metricsNow() - s->commandAt);
+	metricsAdd(M_TRANSFERS, 1);
+	metricsAdd(s->command == CMD_PUT ? M_BYTES_RECEIVED : M_BYTES_SENT, s->dataTotal);
+	if (s->dataFailed) {
+		metricsAdd(M_TRANSFERS_FAILED, 1);
+		replyStatus(s, FT_ERROR, 0, "ERROR: transfer failed");
+	}
+	else if (summed) {
+		snprintf(buffer, sizeof(buffer), "DONE %lld CRC32C %08x", (long long)s->dataTotal, s->crc);
+		replyStatus(s, FT_DONE, s->dataTotal, buffer);
+	}
+	else {
+		snprintf(buffer, sizeof(buffer), "DONE %lld", (long long)s->dataTotal);
+		replyStatus(s, FT_DONE, s->dataTotal, buffer);
+	}
+	s->dataFailed = 0;
+	s->dataTotal = 0;
+	requestDone(s);
+}
+
+
+/*******************************************************************************************
+ * Function:        void clearPaths(struct session* s)
+ * Description:		Forgets the session's resolved directories (cd, or the session ends)
+ ********************************************************************************************/
+static void clearPaths(struct session* s) {
+	int i;
+
+	for (i = 0; i < PATH_CACHE; i++) {
+		if (s->paths[i].fd >= 0) {
+			close(s->paths[i].fd);
+			s->paths[i].fd = -1;
+		}
+	}
+}
+
+/*******************************************************************************************
+ * Function:        int resolvePath(struct session* s, const char* path, const char** leaf)
+ * Description:		Splits a client path into a directory descriptor and the last component
+ *                  to look up in it with openat/fstatat. The directory part is resolved
+ *                  against the session's own working directory and remembered for
+ *                  PATH_CACHE_TTL seconds, so repeated gets from the same deep directory
+ *                  don't walk the whole path every time.
+ * Parameters:		the session, the path as the client sent it, where to put the last
+ *                  component
+ * Returns:         a descriptor owned by the session (don't close it)
+ ********************************************************************************************/
+static int resolvePath(struct session* s, const char* path, const char** leaf) {
+	struct pathSlot* slot;
+	const char* slash = strrchr(path, '/');
+	size_t dirLen;
+	time_t now;
+	int fd;
+	int i;
+
+	*leaf = path;
+	if (slash == NULL || path[0] == '/' || slash[1] == '\0' || (size_t)(slash - path) >= sizeof(slot->path)) {
+		return s->dirFD;	//no directory part, absolute, or odd: let openat() take it all
+	}
+	dirLen = slash - path;
+	now = time(NULL);
+	for (i = 0; i < PATH_CACHE; i++) {
+		slot = &s->paths[i];
+		if (slot->fd >= 0 && now - slot->resolved <= PATH_CACHE_TTL &&
+				strncmp(slot->path, path, dirLen) == 0 && slot->path[dirLen] == '\0') {
+			*leaf = slash + 1;
+			return slot->fd;
+		}
+	}
+
+	slot = &s->paths[s->nextPath];
+	memcpy(slot->path, path, dirLen);
+	slot->path[dirLen] = '\0';
+	fd = openat(s->dirFD, slot->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		return s->dirFD;	//the full lookup reports the error
+	}
+	if (slot->fd >= 0) {
+		close(slot->fd);
+	}
+	slot->fd = fd;
+	slot->resolved = now;
+	s->nextPath = (s->nextPath + 1) % PATH_CACHE;
+	*leaf = slash + 1;
+	return fd;
+}
+
+static struct listCache listCache = { .lock = PTHREAD_MUTEX_INITIALIZER, .inotifyFD = -1 };
+
+/*******************************************************************************************
+ * Function:        void listingUnlink(struct listing* l)
+ * Description:		Takes a listing out of the cache (and drops its directory's inotify
+ *                  watch if no other listing shares it)
+ * Pre-Conditions: 	listCache.lock is held
+ ********************************************************************************************/
+static void listingUnlink(struct listing* l) {
+	struct listing** link = &listCache.head;
+	struct listing* other;
+
+	while (*link != l) {
+		link = &(*link)->next;
+	}
+	*link = l->next;
+	listCache.count--;
+	if (l->complete) {
+		listCache.bytes -= l->len;
+	}
+	for (other = listCache.head; other != NULL && other->wd != l->wd; other = other->next)
+		;
+	if (l->wd >= 0 && other == NULL) {
+		inotify_rm_watch(listCache.inotifyFD, l->wd);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void listingFree(struct listing* l)
+ * Description:		Releases an unlinked listing
+ ********************************************************************************************/
+static void listingFree(struct listing* l) {
+	if (l->dirFD >= 0) {
+		close(l->dirFD);
+	}
+	free(l->data);
+	free(l);
+}
+
+/*******************************************************************************************
+ * Function:        void listingSweep(void)
+ * Description:		Reads every pending inotify event and marks the listings of directories
+ *                  that changed stale. Stale listings nobody is sending are dropped, and
+ *                  idle ones are evicted, oldest use first, to stay within LIST_CACHE_MAX
+ *                  listings and LIST_CACHE_BYTES.
+ * Pre-Conditions: 	listCache.lock is held
+ ********************************************************************************************/
+static void listingSweep(void) {
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event* ev;
+	struct listing* l;
+	struct listing* next;
+	struct listing* oldest;
+	ssize_t n;
+	char* p;
+
+	while ((n = read(listCache.inotifyFD, events, sizeof(events))) > 0) {
+		for (p = events; p < events + n; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event*)p;
+			for (l = listCache.head; l != NULL; l = l->next) {
+				if (l->wd == ev->wd || (ev->mask & IN_Q_OVERFLOW)) {
+					l->stale = 1;
+				}
+			}
+		}
+	}
+	for (l = listCache.head; l != NULL; l = next) {
+		next = l->next;
+		if (l->stale && l->refs == 0) {
+			listingUnlink(l);
+			listingFree(l);
+		}
+	}
+	while (listCache.count > LIST_CACHE_MAX || listCache.bytes > LIST_CACHE_BYTES) {
+		oldest = NULL;
+		for (l = listCache.head; l != NULL; l = l->next) {
+			if (l->refs == 0 && (oldest == NULL || l->lastUsed < oldest->lastUsed)) {
+				oldest = l;
+			}
+		}
+		if (oldest == NULL) {
+			break;
+		}
+		listingUnlink(oldest);
+		listingFree(oldest);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        struct listing* listingAcquire(int dirFD, int longFormat)
+ * Description:		Finds an up to date listing of the directory in the cache, or starts a
+ *                  new one. A new listing is only read as it is sent (listingRead()), and
+ *                  is shared with other requests once it is complete. The directory is
+ *                  watched with inotify from before the first read, so any change made
+ *                  while or after it is read makes the listing stale.
+ * Parameters:		an open descriptor of the directory (the listing takes it over) and
+ *                  the format
+ * Returns:         a referenced listing (release it with listingRelease()), or NULL
+ ********************************************************************************************/
+static struct listing* listingAcquire(int dirFD, int longFormat) {
+	struct listing* l;
+	struct stat info;
+	char path[64];
+
+	if (fstat(dirFD, &info) < 0) {
+		close(dirFD);
+		return NULL;
+	}
+	pthread_mutex_lock(&listCache.lock);
+	if (listCache.inotifyFD >= 0) {
+		listingSweep();
+	}
+	for (l = listCache.head; l != NULL; l = l->next) {
+		if (l->complete && !l->stale && l->dev == info.st_dev && l->ino == info.st_ino &&
+				l->longFormat == longFormat) {
+			l->refs++;
+			l->lastUsed = ++listCache.clock;
+			pthread_mutex_unlock(&listCache.lock);
+			close(dirFD);
+			return l;
+		}
+	}
+
+	l = calloc(1, sizeof(*l));
+	if (l == NULL) {
+		pthread_mutex_unlock(&listCache.lock);
+		close(dirFD);
+		return NULL;
+	}
+	l->dev = info.st_dev;
+	l->ino = info.st_ino;
+	l->longFormat = longFormat;
+	l->dirFD = dirFD;
+	l->refs = 1;
+	l->lastUsed = ++listCache.clock;
+	l->wd = -1;
+	if (listCache.inotifyFD >= 0) {
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", dirFD);
+		l->wd = inotify_add_watch(listCache.inotifyFD, path, LIST_EVENTS);
+	}
+	if (l->wd < 0) {
+		l->stale = 1;		//can't tell when it changes: use it once, don't keep it
+	}
+	l->next = listCache.head;
+	listCache.head = l;
+	listCache.count++;
+	pthread_mutex_unlock(&listCache.lock);
+	return l;
+}
+
+/*******************************************************************************************
+ * Function:        int listingRead(struct listing* l)
+ * Description:		Reads one getdents64 batch of the directory and appends its entries to
+ *                  the listing. Only the request that started the listing calls this, no
+ *                  one else can see it until it is complete.
+ * Returns:         1 if entries were added and there are more, 0 once the directory is
+ *                  done (the listing is complete), -1 on error
+ ********************************************************************************************/
+static int listingRead(struct listing* l) {
+	char batch[LIST_BATCH] __attribute__((aligned(8)));
+	struct dirent64* entry;
+	struct stat info;
+	char type;
+	char* grown;
+	size_t need;
+	long n;
+	long pos;
+
+	n = syscall(SYS_getdents64, l->dirFD, batch, sizeof(batch));
+	if (n < 0) {
+		return -1;
+	}
+	if (n == 0) {
+		close(l->dirFD);
+		l->dirFD = -1;
+		pthread_mutex_lock(&listCache.lock);
+		l->complete = 1;
+		listCache.bytes += l->len;
+		pthread_mutex_unlock(&listCache.lock);
+		return 0;
+	}
+	for (pos = 0; pos < n; pos += entry->d_reclen) {
+		entry = (struct dirent64*)(batch + pos);
+		need = strlen(entry->d_name) + (l->longFormat ? 64 : 1);
+		if (l->len + need > l->cap) {
+			while (l->len + need > l->cap) {
+				l->cap = l->cap ? 2 * l->cap : LIST_BATCH;
+			}
+			grown = realloc(l->data, l->cap);
+			if (grown == NULL) {
+				return -1;
+			}
+			l->data = grown;
+		}
+		if (!l->longFormat) {
+			l->len += sprintf(l->data + l->len, "%s ", entry->d_name);
+			continue;
+		}
+		if (fstatat(l->dirFD, entry->d_name, &info, AT_SYMLINK_NOFOLLOW) < 0) {
+			continue;		//removed since getdents, inotify has marked us stale
+		}
+		switch (info.st_mode & S_IFMT) {
+		case S_IFREG: type = 'f'; break;
+		case S_IFDIR: type = 'd'; break;
+		case S_IFLNK: type = 'l'; break;
+		case S_IFIFO: type = 'p'; break;
+		case S_IFSOCK: type = 's'; break;
+		case S_IFCHR: type = 'c'; break;
+		case S_IFBLK: type = 'b'; break;
+		default: type = '?'; break;
+		}
+		l->len += sprintf(l->data + l->len, "%c %lld %lld %s\n", type, (long long)info.st_size,
+						  (long long)info.st_mtime, entry->d_name);
+	}
+	return 1;
+}
+
+/*******************************************************************************************
+ * Function:        void listingRelease(struct listing* l)
+ * Description:		Drops a request's reference. Listings that went stale, or were never
+ *                  finished, go away with their last reference.
+ ********************************************************************************************/
+static void listingRelease(struct listing* l) {
+	pthread_mutex_lock(&listCache.lock);
+	if (--l->refs == 0 && (l->stale || !l->complete)) {
+		listingUnlink(l);
+		listingFree(l);
+	}
+	pthread_mutex_unlock(&listCache.lock);
+}
+
+/*******************************************************************************************
+ * Function:        int listMore(struct session* s)
+ * Description:		The session has sent all of its listing so far: read the next batch
+ *                  of the directory into it
+ * Returns:         1 if there is more to send, 0 if the listing is done (or failed)
+ ********************************************************************************************/
+static int listMore(struct session* s) {
+	struct listing* l = s->listing;
+	int status;
+
+	if (l == NULL || l->complete) {
+		return 0;
+	}
+	status = listingRead(l);
+	if (status < 0) {
+		error("ERROR reading directory");
+		s->dataFailed = 1;
+	}
+	s->dataBuf = l->data;
+	s->dataLen = l->len;
+	s->dataTotal = l->len;
+	return status > 0;
+}
+
+/*******************************************************************************************
+ * Function:        void listCmd(struct session* s)
+ * Description:		Starts sending the current directory contents to the client's data
+ *                  socket, names separated by spaces or, with "long", one
+ *                  "<type> <size> <mtime> <name>" line per entry. A cached listing goes out
+ *                  as is, otherwise the directory is read in getdents64 batches as the
+ *                  socket drains, so a huge directory never has to fit in memory before
+ *                  the first byte is sent.
+ * Parameters:		The session, its data socket is connected to the client
+ * Pre-Conditions: 	The client is ready to receive the directory through the data socket
+ * Post-Conditions: s->dataBuf/dataLen show the listing so far, pumpData() reads the rest
+ ********************************************************************************************/
+void listCmd(struct session* s) {
+	int dirFD;
+
+	if (verbose) {
+		printf("Sending directory list to %s:%d\n", s->clientIP, s->dataPort);
+	}
+
+	dirFD = openat(s->dirFD, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC); //from the session's directory
+	if (dirFD < 0 || (s->listing = listingAcquire(dirFD, s->listLong)) == NULL) {
+		error("ERROR: unable to open directory.");
+		s->dataFailed = 1;
+		return;
+	}
+	s->dataBuf = s->listing->data;
+	s->dataLen = s->listing->len;
+	s->dataPos = 0;
+	s->dataTotal = s->dataLen;
+}
+
+/*******************************************************************************************
+ * Function:        void sendFile(struct session* s)
+ * Description:		Hands the requested file to the transfer engine. The file comes from
+ *                  the hot-file cache: small files are sent from the cached copy, big
+ *                  ones go straight from the page cache to the data socket with sendfile.
+ * Parameters:		The session, s->fileName is the file the client asked for
+ * Pre-Conditions: 	The client is ready to receive the file through the data socket
+ * Post-Conditions: s->xfer is set up for pumpData() with the requested range (checksummed
+ *                  on the way unless the index knows it), or an error message is queued
+ ********************************************************************************************/
+void sendFile(struct session* s) {
+	struct stat fileInfo;
+	const char* leaf;
+	int dirFD;
+	const char* notFound = "ERROR: File not found/could not be opened\n";
+
+	if (verbose) {
+		printf("Sending \"%s\" to %s:%d\n", s->fileName, s->clientIP, s->dataPort);
+	}
+
+	//the file was looked up in the hot-file cache when the request came in
+	if (s->cached == NULL) {
+		dirFD = resolvePath(s, s->fileName, &leaf);
+		s->cached = cacheAcquire(s->reactor, dirFD, leaf, &fileInfo);
+	}
+	if (s->cached == NULL) { //error
+		printf("Error opening %s\n", s->fileName);
+		s->dataBuf = strdup(notFound);
+		s->dataLen = s->dataBuf ? strlen(notFound) : 0;
+		s->dataPos = 0;
+		s->dataFailed = 1;
+		return;
+	}
+	s->fileFD = s->cached->fd;
+	if(DEBUG) {
+		printf("file size: %lld bytes%s\n", (long long)s->cached->size, s->cached->data ? " (in memory)" : "");
+	}
+	if (s->rangeOffset > s->cached->size) {
+		s->rangeOffset = s->cached->size;
+	}
+	if (s->rangeLength == 0 || s->rangeLength > s->cached->size - s->rangeOffset) {
+		s->rangeLength = s->cached->size - s->rangeOffset;
+	}
+	transferInit(&s->xfer, s->fileFD, s->rangeOffset, s->rangeLength);
+	s->xfer.tls = tlsSoftware(s->dataMode == DATA_INLINE ? s->controlTLS : s->dataTLS, 1);
+	s->xfer.checksum = !s->sumKnown;
+	if (s->cached->data) {
+		s->xfer.data = s->cached->data;
+		s->xfer.method = XFER_MEMORY;
+	}
+	else if (s->dataMode != DATA_INLINE && !s->compress && transferDirect(&s->xfer) == 0) {
+		metricsAdd(M_DIRECT, 1);	//inline frames and the compression stage read the file their own way
+	}
+	else {
+		posix_fadvise(s->fileFD, s->rangeOffset, s->rangeLength, POSIX_FADV_SEQUENTIAL);
+	}
+	s->dataTotal = s->rangeLength;
+}
+
+/*******************************************************************************************
+ * Function:        int hexDecode(const char* hex, unsigned char* out, size_t len)
+ * Description:		Reads exactly len bytes written as 2 * len hex digits
+ * Returns:         0, -1 if hex isn't that
+ ********************************************************************************************/
+static int hexDecode(const char* hex, unsigned char* out, size_t len) {
+	unsigned int byte;
+	size_t i;
+
+	if (strspn(hex, "0123456789abcdefABCDEF") != 2 * len) {
+		return -1;
+	}
+	for (i = 0; i < len; i++) {
+		sscanf(hex + 2 * i, "%2x", &byte);
+		out[i] = byte;
+	}
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        void hexEncode(const unsigned char* in, size_t len, char* out)
+ * Description:		Writes len bytes as 2 * len lower case hex digits and a '\0'
+ ********************************************************************************************/
+static void hexEncode(const unsigned char* in, size_t len, char* out) {
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		sprintf(out + 2 * i, "%02x", in[i]);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        int accountKey(const char* password, size_t len, const struct account* a, unsigned char* key)
+ * Description:		The stored form of a password: PBKDF2-HMAC-SHA256 with the account's
+ *                  salt and iteration count, deliberately slow to guess
+ * Returns:         0, -1 if OpenSSL failed
+ ********************************************************************************************/
+static int accountKey(const char* password, size_t len, const struct account* a, unsigned char* key) {
+	return PKCS5_PBKDF2_HMAC(password, len, a->salt, AUTH_SALT_LEN, a->iterations,
+							 EVP_sha256(), AUTH_KEY_LEN, key) == 1 ? 0 : -1;
+}
+
+/*******************************************************************************************
+ * Function:        struct account* accountNew(const char* name, const char* password)
+ * Description:		A new account with a random salt and AUTH_ITERATIONS rounds
+ * Returns:         the account, NULL on failure
+ ********************************************************************************************/
+static struct account* accountNew(const char* name, const char* password) {
+	struct account* a = calloc(1, sizeof(*a));
+
+	if (a == NULL || strlen(name) >= sizeof(a->name) || strchr(name, ':') != NULL) {
+		free(a);
+		return NULL;
+	}
+	strcpy(a->name, name);
+	a->iterations = AUTH_ITERATIONS;
+	if (RAND_bytes(a->salt, AUTH_SALT_LEN) != 1 || accountKey(password, strlen(password), a, a->key) < 0) {
+		free(a);
+		return NULL;
+	}
+	return a;
+}
+
+/*******************************************************************************************
+ * Function:        int accountsLoad(const char* path)
+ * Description:		-U: reads the credential store, one "name:iterations:salt:key" line per
+ *                  login (salt and key in hex, as -A prints them), '#' starts a comment.
+ *                  Without -U the only login is the built-in client/pass, hashed here.
+ * Returns:         0, -1 if the file can't be read or a line is malformed (reported)
+ ********************************************************************************************/
+static int accountsLoad(const char* path) {
+	char line[AUTH_NAME_MAX + 2 * (AUTH_SALT_LEN + AUTH_KEY_LEN) + 32];
+	char* fields[4];
+	char* save;
+	struct account* a;
+	FILE* file;
+	int lineNo = 0;
+	int i;
+
+	if (path == NULL) {
+		accounts.head = accountNew("client", "pass");
+		return accounts.head ? 0 : -1;
+	}
+	file = fopen(path, "r");
+	if (file == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), file) != NULL) {
+		lineNo++;
+		line[strcspn(line, "#\r\n")] = '\0';
+		if (line[strspn(line, " \t")] == '\0') {
+			continue;
+		}
+		fields[0] = strtok_r(line, ":", &save);
+		for (i = 1; i < 4; i++) {
+			fields[i] = strtok_r(NULL, ":", &save);
+		}
+		a = calloc(1, sizeof(*a));
+		if (a == NULL || fields[3] == NULL || strlen(fields[0]) >= sizeof(a->name) ||
+				(a->iterations = atoi(fields[1])) < 1 ||
+				hexDecode(fields[2], a->salt, AUTH_SALT_LEN) < 0 || hexDecode(fields[3], a->key, AUTH_KEY_LEN) < 0) {
+			fprintf(stderr, "ERROR: %s line %d: expected name:iterations:salt:key\n", path, lineNo);
+			free(a);
+			fclose(file);
+			return -1;
+		}
+		strcpy(a->name, fields[0]);
+		a->next = accounts.head;
+		accounts.head = a;
+	}
+	fclose(file);
+	if (accounts.head == NULL) {
+		fprintf(stderr, "ERROR: no logins in %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        int accountCreate(const char* name)
+ * Description:		-A: reads a password from stdin and prints the -U line for it
+ * Returns:         0, -1 on failure (reported)
+ ********************************************************************************************/
+static int accountCreate(const char* name) {
+	char password[256];
+	char salt[2 * AUTH_SALT_LEN + 1];
+	char key[2 * AUTH_KEY_LEN + 1];
+	struct account* a;
+
+	if (fgets(password, sizeof(password), stdin) == NULL) {
+		fprintf(stderr, "ERROR: no password on stdin\n");
+		return -1;
+	}
+	password[strcspn(password, "\r\n")] = '\0';
+	a = accountNew(name, password);
+	OPENSSL_cleanse(password, sizeof(password));
+	if (a == NULL) {
+		fprintf(stderr, "ERROR: can't make a login named %s\n", name);
+		return -1;
+	}
+	hexEncode(a->salt, AUTH_SALT_LEN, salt);
+	hexEncode(a->key, AUTH_KEY_LEN, key);
+	printf("%s:%d:%s:%s\n", a->name, a->iterations, salt, key);
+	free(a);
+	return 0;
+}
+
+/*******************************************************************************************
+ * Function:        int verifyUser(char* clientLogin)
+ * Description:		Function to verify the connecting client against the credential store.
+ *                  The login is the username followed by the password, so every account
+ *                  whose name starts it is tried. Keys are compared in constant time. The
+ *                  PBKDF2 rounds make this slow on purpose: it runs on a worker
+ *                  (runLoginJob()), never on a reactor.
+ * Parameters:		A concatenated string containing the username & password from client
+ * Pre-Conditions: 	char* clientLogin initialized with username & password from client
+ * Post-Conditions: Returns 1 if there isa  match, otherwise returns 0
+ ********************************************************************************************/
+int verifyUser(char* clientLogin) {
+	unsigned char key[AUTH_KEY_LEN];
+	struct account* a;
+	size_t nameLen;
+	size_t len = strlen(clientLogin);
+	int verified = 0;
+
+	for (a = accounts.head; a != NULL && !verified; a = a->next) {
+		nameLen = strlen(a->name);
+		if (strncmp(clientLogin, a->name, nameLen) != 0) {
+			continue;
+		}
+		verified = accountKey(clientLogin + nameLen, len - nameLen, a, key) == 0 &&
+				   CRYPTO_memcmp(key, a->key, AUTH_KEY_LEN) == 0;
+	}
+	OPENSSL_cleanse(key, sizeof(key));
+
+	if (verbose) {
+		printf("Verifying user... username/password %s.\n", verified ? "verified" : "failed");
+	}
+	return verified;
+}
+
+/*******************************************************************************************
+ * Function:        int tlsInit(const char* pem)
+ * Description:		-T: the server's certificate chain and private key (one PEM file). TLS
+ *                  1.3 only. OpenSSL is asked to hand the session keys to the kernel after
+ *                  each handshake (kTLS) so sendfile(2) keeps working on TLS connections.
+ *                  Sessions are resumed from stateless tickets: nothing is cached here, a
+ *                  client reconnecting (or opening a data connection) skips the key exchange.
+ * Returns:         0, -1 on failure (reported)
+ ********************************************************************************************/
+static int tlsInit(const char* pem) {
+	static const unsigned char context[] = "ftserver";
+	SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+
+	if (ctx == NULL || SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION) != 1 ||
+			SSL_CTX_use_certificate_chain_file(ctx, pem) != 1 ||
+			SSL_CTX_use_PrivateKey_file(ctx, pem, SSL_FILETYPE_PEM) != 1 ||
+			SSL_CTX_check_private_key(ctx) != 1) {
+		fprintf(stderr, "ERROR: can't use %s for TLS\n", pem);
+		ERR_print_errors_fp(stderr);
+		SSL_CTX_free(ctx);
+		return -1;
+	}
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	SSL_CTX_set_session_id_context(ctx, context, sizeof(context) - 1);
+	SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+	tlsConfig.ctx = ctx;
+	return 0;
+}
+
+
+/*********************************************************************************************
+ * Function: 		void requestList(struct session* s)
+ * Description:		-l: opens the data channel, listCmd() does the rest
+ * Pre-Conditions: 	s->dataPort/dataMode are set
+ **********************************************************************************************/
+static void requestList(struct session* s) {
+	if (verbose) {
+		printf("List directory requested on port %d\n", s->dataPort);
+	}
+	metricsAdd(M_REQ_LIST, 1);
+	s->command = CMD_LIST;
+	openDataChannel(s);
+}
+
+/*********************************************************************************************
+ * Function: 		void requestGet(struct session* s)
+ * Description:		-g: tells the client the file (or the requested range of it) is coming
+ *					and how many bytes it is, then opens the data channel; sendFile() does
+ *					the rest. A range that doesn't start from 0 is echoed in the reply as
+ *					"(bytes <from>-<to>/<file size>)". The file is looked up in the hot-file
+ *					cache here and the session holds the entry until the data is sent.
+ *					A get that asked for compression is told whether it gets it: " (gzip)"
+ *					in the reply (FT_ENC_GZIP for framed clients), the OK value is still
+ *					the raw length.
+ * Pre-Conditions: 	s->fileName, s->dataPort/dataMode and the range are set
+ **********************************************************************************************/
+static void requestGet(struct session* s) {
+	char buffer[BUF_LEN];
+	struct stat findFile;
+	const char* leaf;
+	const char* encoding;
+	int dirFD;
+	off_t length;
+
+	if (verbose) {
+		printf("File %s requested on port %d\n", s->fileName, s->dataPort);
+	}
+	metricsAdd(M_REQ_GET, 1);
+	dirFD = resolvePath(s, s->fileName, &leaf);
+	s->cached = cacheAcquire(s->reactor, dirFD, leaf, &findFile);
+	if(s->cached == NULL) {
+		printf("ERROR: file stat error. Sending error message to %s:%d\n", s->clientIP, s->dataPort);
+		snprintf(buffer, sizeof(buffer), "ERROR: file not found, unable to open %s", s->fileName);
+		replyStatus(s, FT_ERROR, 0, buffer);
+		requestDone(s);
+		return;
+	}
+	if (s->rangeOffset > findFile.st_size) {
+		snprintf(buffer, sizeof(buffer), "ERROR: offset %lld is past the end of %s (%lld bytes)",
+				 (long long)s->rangeOffset, s->fileName, (long long)findFile.st_size);
+		replyStatus(s, FT_ERROR, 0, buffer);
+		cacheRelease(s->cached);
+		s->cached = NULL;
+		requestDone(s);
+		return;
+	}
+
+	length = findFile.st_size - s->rangeOffset;
+	if (s->rangeLength > 0 && s->rangeLength < length) {
+		length = s->rangeLength;
+	}
+	s->sumKnown = s->rangeOffset == 0 && length == findFile.st_size && sumLookup(&findFile, &s->crc);
+	if (s->compress && (s->dataMode == DATA_INLINE || !compressible(s->cached, s->fileName, length))) {
+		s->compress = 0;	//sent as is, the reply says which
+	}
+	encoding = s->compress ? " (gzip)" : "";
+	if (s->rangeOffset == 0 && length == findFile.st_size) {
+		snprintf(buffer, sizeof(buffer), "Transferring file: %s%s...", s->fileName, encoding);
+	}
+	else {
+		snprintf(buffer, sizeof(buffer), "Transferring file: %s (bytes %lld-%lld/%lld)%s...", s->fileName,
+				 (long long)s->rangeOffset, (long long)(s->rangeOffset + length), (long long)findFile.st_size,
+				 encoding);
+	}
+	replyStatus(s, FT_OK, length, buffer);
+	s->command = CMD_GET;
+	s->bulk = length >= SCHED_BULK;
+	openDataChannel(s);
+}
+
+/*********************************************************************************************
+ * Function: 		void requestDelta(struct session* s, uint32_t blockSize, uint32_t blocks)
+ * Description:		delta: sends s->fileName as the difference from the copy the client
+ *					has. The client describes its copy on the data connection, one signature
+ *					per block of blockSize bytes (blocks of them), and gets back the ops
+ *					that rebuild the file from its blocks and literal bytes. The OK value
+ *					is the size of the file it will end up with.
+ * Pre-Conditions: 	s->fileName and s->dataPort/dataMode are set
+ **********************************************************************************************/
+static void requestDelta(struct session* s, uint32_t blockSize, uint32_t blocks) {
+	char buffer[BUF_LEN];
+	struct stat findFile;
+	const char* leaf;
+	int dirFD;
+
+	if (verbose) {
+		printf("Delta of %s requested on port %d (%u blocks of %u bytes)\n", s->fileName, s->dataPort, blocks, blockSize);
+	}
+	metricsAdd(M_REQ_DELTA, 1);
+	if (blockSize < DELTA_BLOCK_MIN || blockSize > DELTA_BLOCK_MAX || blocks > DELTA_BLOCKS_MAX ||
+			s->dataMode == DATA_INLINE) {
+		replyStatus(s, FT_ERROR, 0, "ERROR: bad delta block size or count, or inline data");
+		requestDone(s);
+		return;
+	}
+	dirFD = resolvePath(s, s->fileName, &leaf);
+	s->cached = cacheAcquire(s->reactor, dirFD, leaf, &findFile);
+	s->delta = s->cached ? calloc(1, sizeof(*s->delta)) : NULL;
+	if (s->delta == NULL) {
+		snprintf(buffer, sizeof(buffer), "ERROR: file not found, unable to open %s", s->fileName);
+		replyStatus(s, FT_ERROR, 0, buffer);
+		if (s->cached) {
+			cacheRelease(s->cached);
+			s->cached = NULL;
+		}
+		requestDone(s);
+		return;
+	}
+	s->delta->session = s;
+	s->delta->blockSize = blockSize;
+	s->delta->blocks = blocks;
+	s->delta->size = findFile.st_size;
+	s->delta->headPos = FT_DELTA_HEAD;
+
+	snprintf(buffer, sizeof(buffer), "Transferring delta: %s...", s->fileName);
+	replyStatus(s, FT_OK, findFile.st_size, buffer);
+	s->command = CMD_DELTA;
+	s->bulk = findFile.st_size >= SCHED_BULK;
+	openDataChannel(s);
+}
+
+/*********************************************************************************************
+ * Function: 		void requestMget(struct session* s, const char* pattern)
+ * Description:		mget: sends every file the pattern names as one stream on one data
+ *					connection (see FT_OP_MGET), so a tree of small files costs one
+ *					request instead of one per file. The OK value is 0, the stream says
+ *					how many files it holds.
+ * Pre-Conditions: 	s->dataPort/dataMode are set
+ **********************************************************************************************/
+static void requestMget(struct session* s, const char* pattern) {
+	char buffer[BUF_LEN];
+
+	if (verbose) {
+		printf("Batch %s requested on port %d\n", pattern, s->dataPort);
+	}
+	metricsAdd(M_REQ_MGET, 1);
+	if (pattern[0] == '\0' || strlen(pattern) >= sizeof(s->batch->pattern) || s->dataMode == DATA_INLINE) {
+		replyStatus(s, FT_ERROR, 0, "ERROR: bad batch pattern, or inline data");
+		requestDone(s);
+		return;
+	}
+	s->batch = calloc(1, sizeof(*s->batch));
+	if (s->batch == NULL) {
+		replyStatus(s, FT_ERROR, 0, "ERROR: out of memory");
+		requestDone(s);
+		return;
+	}
+	s->batch->session = s;
+	s->batch->dirFD = -1;
+	s->batch->current.fd = -1;
+	strcpy(s->batch->pattern, pattern);
+
+	snprintf(buffer, sizeof(buffer), "Transferring files: %s...", pattern);
+	replyStatus(s, FT_OK, 0, buffer);
+	s->command = CMD_MGET;
+	s->bulk = 1;
+	openDataChannel(s);
+}
+
+/*********************************************************************************************
+ * Function: 		void requestSize(struct session* s)
+ * Description:		size: reports the size of s->fileName, for clients planning ranged or
+ *					striped gets ("SIZE <bytes>")
+ **********************************************************************************************/
+static void requestSize(struct session* s) {
+	char buffer[BUF_LEN];
+	struct stat findFile;
+	const char* leaf;
+	int dirFD = resolvePath(s, s->fileName, &leaf);
+
+	metricsAdd(M_REQ_SIZE, 1);
+	if(fstatat(dirFD, leaf, &findFile, 0) == 0 && S_ISREG(findFile.st_mode)) {
+		snprintf(buffer, sizeof(buffer), "SIZE %lld", (long long)findFile.st_size);
+		replyStatus(s, FT_OK, findFile.st_size, buffer);
+	}
+	else {
+		snprintf(buffer, sizeof(buffer), "ERROR: file not found, unable to open %s", s->fileName);
+		replyStatus(s, FT_ERROR, 0, buffer);
+	}
+	requestDone(s);
+}
+
+/*********************************************************************************************
+ * Function: 		void replySum(struct session* s, off_t size)
+ * Description:		Answers a sum query with the file's size and CRC32C
+ *					("SUM <bytes> CRC32C <hex>", the checksum is the value for framed clients)
+ **********************************************************************************************/
+static void replySum(struct session* s, off_t size) {
+	char buffer[BUF_LEN];
+
+	snprintf(buffer, sizeof(buffer), "SUM %lld CRC32C %08x", (long long)size, s->crc);
+	replyStatus(s, FT_OK, s->crc, buffer);
+}
+
+/*********************************************************************************************
+ * Function: 		void runSumJob(struct job* job)
+ * Description:		Worker side of a sum the index couldn't answer: reads the file once
+ **********************************************************************************************/
+static void runSumJob(struct job* job) {
+	struct session* s = containerOf(job, struct session, transferJob);
+
+	s->transferStatus = sumFile(s->cached, &s->crc) == 0 ? TRANSFER_DONE : TRANSFER_ERROR;
+	s->transferErrno = errno;
+}
+
+/*********************************************************************************************
+ * Function: 		void sumJobDone(struct job* job)
+ * Description:		Reactor side of a sum: indexes the checksum (if the file held still
+ *					while it was read) and answers the query
+ **********************************************************************************************/
+static void sumJobDone(struct job* job) {
+	struct session* s = containerOf(job, struct session, transferJob);
+	char buffer[BUF_LEN];
+
+	s->offloaded = 0;
+	if (s->destroyPending) {
+		destroySession(s);
+		return;
+	}
+	if (s->transferStatus == TRANSFER_DONE) {
+		sumRemember(s->reactor, s->cached, s->crc);
+		replySum(s, s->cached->size);
+	}
+	else {
+		errno = s->transferErrno;
+		error("ERROR reading file for checksum");
+		snprintf(buffer, sizeof(buffer), "ERROR: unable to read %s", s->fileName);
+		replyStatus(s, FT_ERROR, 0, buffer);
+	}
+	cacheRelease(s->cached);
+	s->cached = NULL;
+	requestDone(s);
+}
+
+/*********************************************************************************************
+ * Function: 		void requestSum(struct session* s)
+ * Description:		sum: reports the CRC32C of s->fileName, so a client can tell whether a
+ *					copy it has is the same file without transferring it. A file the index
+ *					knows (same inode, mtime and size) is answered without reading it,
+ *					anything else is read once on the worker pool and indexed.
+ **********************************************************************************************/
+static void requestSum(struct session* s) {
+	char buffer[BUF_LEN];
+	struct stat findFile;
+	const char* leaf;
+	int dirFD = resolvePath(s, s->fileName, &leaf);
+
+	metricsAdd(M_REQ_SUM, 1);
+	if(fstatat(dirFD, leaf, &findFile, 0) == 0 && S_ISREG(findFile.st_mode) && sumLookup(&findFile, &s->crc)) {
+		replySum(s, findFile.st_size);
+		requestDone(s);
+		return;
+	}
+	s->cached = cacheAcquire(s->reactor, dirFD, leaf, &findFile);
+	if (s->cached == NULL) {
+		snprintf(buffer, sizeof(buffer), "ERROR: file not found, unable to open %s", s->fileName);
+		replyStatus(s, FT_ERROR, 0, buffer);
+		requestDone(s);
+		return;
+	}
+	s->offloaded = 1;
+	s->transferJob.run = runSumJob;
+	s->transferJob.done = sumJobDone;
+	s->transferJob.owner = s->reactor;
+	submitJob(s->reactor->pool, s->reactor->id, &s->transferJob);
+}
+
+/*********************************************************************************************
+ * Function: 		int putBeneath(int dirFD)
+ * Description:		Whether a session's directory is startDir or below it, found by walking
+ *					".." up from it, so a session that cd'd out (or in through a symlink)
+ *					can't put there
+ * Returns:         1 if it is, 0 if not or on error
+ **********************************************************************************************/
+static int putBeneath(int dirFD) {
+	struct stat info;
+	ino_t ino;
+	dev_t dev;
+	int fd = openat(dirFD, ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	int up;
+
+	while (fd >= 0 && fstat(fd, &info) == 0) {
+		if (info.st_dev == startDir.st_dev && info.st_ino == startDir.st_ino) {
+			close(fd);
+			return 1;
+		}
+		dev = info.st_dev;
+		ino = info.st_ino;
+		up = openat(fd, "..", O_PATH | O_DIRECTORY | O_CLOEXEC);
+		close(fd);
+		fd = up;
+		if (fd >= 0 && fstat(fd, &info) == 0 && info.st_dev == dev && info.st_ino == ino) {
+			break;		//"/" is its own parent
+		}
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	return 0;
+}
+
+/*********************************************************************************************
+ * Function: 		int putOpenDir(struct session* s)
+ * Description:		Opens the directory an upload of s->fileName goes to into s->putDirFD,
+ *					sets s->putLeaf to the file's name in it. The name must be relative
+ *					and free of ".." components, the session must be beneath startDir, and
+ *					the directory part is resolved RESOLVE_BENEATH the session's directory,
+ *					so no symlink on the way leads out either: a client can't put over the
+ *					accounts file, the key or anything else outside the served tree.
+ * Returns:         0, or -1 with errno set (EACCES or EXDEV when the name or directory is refused)
+ **********************************************************************************************/
+static int putOpenDir(struct session* s) {
+	struct open_how how = { .flags = O_PATH | O_DIRECTORY | O_CLOEXEC,
+							.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS };
+	char dir[sizeof(s->fileName)];
+	const char* slash = strrchr(s->fileName, '/');
+	const char* part;
+	size_t len;
+
+	for (part = s->fileName; ; part += len + 1) {
+		len = strcspn(part, "/");
+		if ((len == 0 && part == s->fileName) || (len == 2 && part[0] == '.' && part[1] == '.')) {
+			errno = EACCES;		//absolute, or climbs out
+			return -1;
+		}
+		if (part[len] == '\0') {
+			break;
+		}
+	}
+	s->putLeaf = slash ? slash + 1 : s->fileName;
+	if (s->putLeaf[0] == '\0' || strcmp(s->putLeaf, ".") == 0 || !putBeneath(s->dirFD)) {
+		errno = EACCES;
+		return -1;
+	}
+	if (slash == NULL) {
+		strcpy(dir, ".");
+	}
+	else {
+		memcpy(dir, s->fileName, slash - s->fileName);
+		dir[slash - s->fileName] = '\0';
+	}
+	s->putDirFD = syscall(SYS_openat2, s->dirFD, dir, &how, sizeof(how));
+	return s->putDirFD < 0 ? -1 : 0;
+}
+
+/*********************************************************************************************
+ * Function: 		int putWrite(int fileFD, const char* buffer, size_t len, off_t* offset)
+ * Description:		Writes received bytes at *offset of the upload's file, advancing it
+ * Returns:         0, or -1 on error
+ **********************************************************************************************/
+static int putWrite(int fileFD, const char* buffer, size_t len, off_t* offset) {
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fileFD, buffer, len, *offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			if (n == 0) errno = ENOSPC;
+			return -1;
+		}
+		buffer += n;
+		len -= n;
+		*offset += n;
+	}
+	return 0;
+}
+
+/*********************************************************************************************
+ * Function: 		int putDrain(int pipeFD, int fileFD, size_t len, off_t* offset, char** buffer)
+ * Description:		Splices the len bytes sitting in the pipe into the upload's file. If the
+ *					filesystem can't take a splice, they are read out into a buffer, which
+ *					the caller keeps using for the rest of the upload.
+ * Returns:         0, or -1 on error
+ **********************************************************************************************/
+static int putDrain(int pipeFD, int fileFD, size_t len, off_t* offset, char** buffer) {
+	ssize_t n;
+
+	while (len > 0) {
+		n = splice(pipeFD, NULL, fileFD, offset, len, SPLICE_F_MOVE);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EINVAL || errno == EOPNOTSUPP)) {
+			*buffer = bufferGet();
+			if (*buffer == NULL) {
+				return -1;
+			}
+			while ((n = read(pipeFD, *buffer, len)) < 0 && errno == EINTR)
+				;
+			return n == (ssize_t)len ? putWrite(fileFD, *buffer, len, offset) : -1;
+		}
+		if (n <= 0) {
+			if (n == 0) errno = EIO;
+			return -1;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+/*********************************************************************************************
+ * Function: 		void runPutJob(struct job* job)
+ * Description:		Worker side of an upload: preallocates the rest of the file, then moves
+ *					the data socket -> pipe -> file with splice(2), no copies through user
+ *					space (recv/pwrite if the socket or filesystem can't splice). Writeback
+ *					is started every PUT_SYNC bytes, and whatever was received is synced
+ *					before the worker lets go, so the temporary file's size is always an
+ *					offset the upload can resume from.
+ **********************************************************************************************/
+static void runPutJob(struct job* job) {
+	struct session* s = containerOf(job, struct session, transferJob);
+	off_t offset = s->putOffset;
+	off_t synced = offset;
+	off_t end = s->putSize;
+	int pipeFD[2] = { -1, -1 };
+	char* buffer = NULL;
+	ssize_t n;
+	size_t want;
+
+	s->transferStatus = TRANSFER_DONE;
+	if (end > offset && fallocate(s->putFD, FALLOC_FL_KEEP_SIZE, offset, end - offset) < 0 &&
+			errno != EOPNOTSUPP && errno != ENOSYS) {
+		s->transferStatus = TRANSFER_ERROR;		//no room for it
+		s->transferErrno = errno;
+		return;
+	}
+	if (tlsSoftware(s->dataTLS, 0) == NULL && pipe2(pipeFD, O_CLOEXEC) == 0) {
+		fcntl(pipeFD[1], F_SETPIPE_SZ, PIPE_SIZE);	//best effort, default is 64K
+	}
+	else {
+		buffer = bufferGet();		//no pipe, or records OpenSSL has to decrypt
+	}
+	while (offset < end && (buffer != NULL || pipeFD[0] >= 0)) {
+		want = end - offset < PIPE_SIZE ? end - offset : PIPE_SIZE;
+		if (buffer == NULL) {
+			n = splice(s->dataFD, NULL, pipeFD[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (n < 0 && (errno == EINVAL || errno == EOPNOTSUPP)) {
+				close(pipeFD[0]);		//the socket can't splice
+				close(pipeFD[1]);
+				pipeFD[0] = pipeFD[1] = -1;
+				buffer = bufferGet();
+				continue;
+			}
+			if (n > 0 && putDrain(pipeFD[0], s->putFD, n, &offset, &buffer) < 0) {
+				n = -1;
+			}
+		}
+		else {
+			n = tlsRecv(s->dataTLS, s->dataFD, buffer, want, 0);
+			if (n > 0 && putWrite(s->putFD, buffer, n, &offset) < 0) {
+				n = -1;
+			}
+		}
+		if (n == 0) {			//client closed early, the upload can be resumed
+			break;
+		}
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			s->transferStatus = TRANSFER_ERROR;
+			s->transferErrno = errno == EAGAIN ? ETIMEDOUT : errno;		//SO_RCVTIMEO expired
+			break;
+		}
+		if (offset - synced >= PUT_SYNC) {
+			sync_file_range(s->putFD, synced, offset - synced, SYNC_FILE_RANGE_WRITE);
+			synced = offset;
+		}
+	}
+	if (offset < end && buffer == NULL && pipeFD[0] < 0) {
+		s->transferStatus = TRANSFER_ERROR;
+		s->transferErrno = ENOMEM;
+	}
+	if (fdatasync(s->putFD) < 0 && s->transferStatus != TRANSFER_ERROR) {
+		s->transferStatus = TRANSFER_ERROR;		//not on disk, don't let it be renamed into place
+		s->transferErrno = errno;
+	}
+	if (pipeFD[0] >= 0) {
+		close(pipeFD[0]);
+		close(pipeFD[1]);
+	}
+	bufferPut(buffer);
+	s->dataTotal = offset - s->putOffset;
+	s->putOffset = offset;
+}
+
+/*********************************************************************************************
+ * Function: 		void putJobDone(struct job* job)
+ * Description:		Reactor side of an upload: a complete file (synced by the worker) is
+ *					renamed over s->fileName, atomically, anyone reading the old one keeps
+ *					it. An incomplete one stays in its temporary file for the client to
+ *					resume. The temporary file is closed, dropping its lock, only after the
+ *					rename, so no other put can take over a .ftpart that's being renamed.
+ **********************************************************************************************/
+static void putJobDone(struct job* job) {
+	struct session* s = containerOf(job, struct session, transferJob);
+	char temp[sizeof(s->fileName) + sizeof(PUT_SUFFIX)];
+
+	s->offloaded = 0;
+	if (s->destroyPending) {
+		destroySession(s);
+		return;
+	}
+	if (s->transferStatus == TRANSFER_ERROR) {
+		errno = s->transferErrno;
+		error("ERROR receiving upload");
+		s->dataFailed = 1;
+	}
+	else if (s->putOffset < s->putSize) {
+		if (verbose) {
+			printf("Upload of %s stopped at %lld of %lld bytes\n", s->fileName, (long long)s->putOffset,
+				   (long long)s->putSize);
+		}
+		s->dataFailed = 1;
+	}
+	else {
+		snprintf(temp, sizeof(temp), "%s%s", s->putLeaf, PUT_SUFFIX);
+		if (renameat(s->putDirFD, temp, s->putDirFD, s->putLeaf) < 0) {
+			error("ERROR renaming upload");
+			s->dataFailed = 1;
+		}
+		else if (verbose) {
+			printf("Received %s (%lld bytes)\n", s->fileName, (long long)s->putSize);
+		}
+	}
+	close(s->putFD);
+	s->putFD = -1;
+	close(s->putDirFD);
+	s->putDirFD = -1;
+	finishData(s);
+}
+
+/*********************************************************************************************
+ * Function: 		void offloadPut(struct session* s)
+ * Description:		The data channel of an upload is open: a transfer worker receives it,
+ *					so disk writes never stall the reactor and uploads to different files
+ *					run side by side on the pool
+ * Post-Conditions: The data socket is out of the epoll set and owned by a worker until
+ *                  putJobDone() runs
+ **********************************************************************************************/
+static void offloadPut(struct session* s) {
+	struct timeval timeout = { SEND_TIMEOUT, 0 };
+
+	epoll_ctl(s->reactor->epollFD, EPOLL_CTL_DEL, s->dataFD, NULL);
+	fcntl(s->dataFD, F_SETFL, fcntl(s->dataFD, F_GETFL) & ~O_NONBLOCK);
+	setsockopt(s->dataFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	s->offloaded = 1;
+	s->transferJob.run = runPutJob;
+	s->transferJob.done = putJobDone;
+	s->transferJob.owner = s->reactor;
+	submitJob(s->reactor->pool, s->reactor->id, &s->transferJob);
+}
+
+/*********************************************************************************************
+ * Function: 		void putFail(struct session* s, const char* message)
+ * Description:		Refuses a put with message, closing whatever requestPut() had opened
+ **********************************************************************************************/
+static void putFail(struct session* s, const char* message) {
+	replyStatus(s, FT_ERROR, 0, message);
+	if (s->putFD >= 0) {
+		close(s->putFD);
+		s->putFD = -1;
+	}
+	if (s->putDirFD >= 0) {
+		close(s->putDirFD);
+		s->putDirFD = -1;
+	}
+	requestDone(s);
+}
+
+/*********************************************************************************************
+ * Function: 		void requestPut(struct session* s, off_t size)
+ * Description:		put: receives a file of size bytes from the client into s->fileName.
+ *					The data goes to "<file>.ftpart" first; if that is left over from an
+ *					upload that stopped, the client is asked for the rest only. The reply
+ *					says which bytes to send, "Receiving file: <file> (bytes <from>-<size>)...",
+ *					and the OK value is the offset to start from. A leftover is taken on its
+ *					size alone (no bigger than the new upload), nothing checks that its bytes
+ *					are a prefix of this file: the reply says so when it resumes one. One
+ *					upload per file at a time, the temporary file is locked while it's written.
+ *					Only regular files beneath the server's start directory can be put, see
+ *					putOpenDir().
+ * Pre-Conditions: 	s->fileName and s->dataPort/dataMode are set
+ **********************************************************************************************/
+static void requestPut(struct session* s, off_t size) {
+	char buffer[BUF_LEN];
+	char temp[sizeof(s->fileName) + sizeof(PUT_SUFFIX)];
+	struct stat info;
+
+	if (verbose) {
+		printf("Upload of %s (%lld bytes) requested on port %d\n", s->fileName, (long long)size, s->dataPort);
+	}
+	metricsAdd(M_REQ_PUT, 1);
+	if (s->dataMode == DATA_INLINE) {
+		replyStatus(s, FT_ERROR, 0, "ERROR: put needs a data connection");
+		requestDone(s);
+		return;
+	}
+	if (putOpenDir(s) < 0) {
+		snprintf(buffer, sizeof(buffer), errno == EACCES || errno == EXDEV ? "ERROR: %s is outside the server's directory" :
+				 "ERROR: unable to create %s", s->fileName);
+		putFail(s, buffer);
+		return;
+	}
+	if (fstatat(s->putDirFD, s->putLeaf, &info, AT_SYMLINK_NOFOLLOW) == 0 && !S_ISREG(info.st_mode)) {
+		snprintf(buffer, sizeof(buffer), "ERROR: %s is not a regular file", s->fileName);
+		putFail(s, buffer);
+		return;
+	}
+	snprintf(temp, sizeof(temp), "%s%s", s->putLeaf, PUT_SUFFIX);
+	s->putFD = openat(s->putDirFD, temp, O_WRONLY | O_CREAT | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC, 0644);	//a fifo can't stall the reactor
+	if (s->putFD < 0 || fstat(s->putFD, &info) < 0 || !S_ISREG(info.st_mode)) {
+		snprintf(buffer, sizeof(buffer), "ERROR: unable to create %s", s->fileName);
+		putFail(s, buffer);
+		return;
+	}
+	if (flock(s->putFD, LOCK_EX | LOCK_NB) < 0) {
+		snprintf(buffer, sizeof(buffer), "ERROR: %s is being uploaded", s->fileName);
+		putFail(s, buffer);
+		return;
+	}
+	if (info.st_size > size) {		//left over from a different upload
+		if (ftruncate(s->putFD, 0) < 0) {
+			snprintf(buffer, sizeof(buffer), "ERROR: unable to reuse %s%s", s->fileName, PUT_SUFFIX);
+			putFail(s, buffer);
+			return;
+		}
+		info.st_size = 0;
+	}
+	s->putOffset = info.st_size;
+	s->putSize = size;
+
+	snprintf(buffer, sizeof(buffer), "Receiving file: %s (bytes %lld-%lld)...%s", s->fileName,
+			 (long long)s->putOffset, (long long)size,
+			 s->putOffset > 0 ? " resuming a partial upload, matched on its size only" : "");
+	replyStatus(s, FT_OK, s->putOffset, buffer);
+	s->command = CMD_PUT;
+	openDataChannel(s);
+}
+
+/*********************************************************************************************
+ * Function: 		void requestStats(struct session* s)
+ * Description:		stats: reports the hot-file cache and checksum index counters
+ *					("CACHE hits <n> misses <n> evictions <n> files <n> held <bytes>
+ *					SUMS hits <n> misses <n> files <n>"), the cache hit count is also the
+ *					status value for framed clients
+ **********************************************************************************************/
+static void requestStats(struct session* s) {
+	char buffer[BUF_LEN];
+	int files;
+	size_t held;
+	unsigned long sums;
+
+	metricsAdd(M_REQ_STATS, 1);
+	pthread_mutex_lock(&fileCache.lock);
+	files = fileCache.files;
+	held = fileCache.held;
+	pthread_mutex_unlock(&fileCache.lock);
+	pthread_mutex_lock(&sumIndex.lock);
+	sums = sumIndex.entries;
+	pthread_mutex_unlock(&sumIndex.lock);
+	snprintf(buffer, sizeof(buffer), "CACHE hits %lu misses %lu evictions %lu files %d held %zu "
+			 "SUMS hits %lu misses %lu files %lu",
+			 (unsigned long)fileCache.hits, (unsigned long)fileCache.misses,
+			 (unsigned long)fileCache.evictions, files, held,
+			 (unsigned long)sumIndex.hits, (unsigned long)sumIndex.misses, sums);
+	replyStatus(s, FT_OK, fileCache.hits, buffer);
+	requestDone(s);
+}
+
+/*********************************************************************************************
+ * Function: 		void requestCd(struct session* s, const char* newDir)
+ * Description:		cd: changes the session's directory (not the process's, other sessions
+ *					are unaffected) and answers with the new working directory
+ **********************************************************************************************/
+static void requestCd(struct session* s, const char* newDir) {
+	char buffer[BUF_LEN];
+	char cwd[1024];
+	char link[64];
+	ssize_t len;
+	int newFD;
+
+	if (verbose) {
+		printf("Server directory change to \"%s\" requested\n", newDir);
+	}
+	metricsAdd(M_REQ_CD, 1);
+	newFD = openat(s->dirFD, newDir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(newFD >= 0) {
+		close(s->dirFD);
+		s->dirFD = newFD;
+		clearPaths(s);
+		memset(cwd, '\0', sizeof(cwd));
+		snprintf(link, sizeof(link), "/proc/self/fd/%d", s->dirFD);
+		len = readlink(link, cwd, sizeof(cwd) - 1);
+		if(len >= 0) {
+			cwd[len] = '\0';
+			if (verbose) {
+				printf("Directory successfully changed.\nCurrent Working Dir: %s\n", cwd);
+			}
+		}
+		else {
+			perror("readlink() error\n");
+		}
+		snprintf(buffer, sizeof(buffer), "Server Current Directory: %s", cwd);
+		replyStatus(s, FT_OK, 0, buffer);
+	}
+	else {
+		error("ERROR changing directories");
+		replyStatus(s, FT_ERROR, 0, "ERROR: directory change failure");
+	}
+	requestDone(s);
+}
+
+/*********************************************************************************************
+ * Function: 		void setDataPort(struct session* s, const char* port)
+ * Description:		Takes the data port of a text command: a port number, or "pasv" for the
+ *					server to open one (answered with "PASV <port>")
+ **********************************************************************************************/
+static void setDataPort(struct session* s, const char* port) {
+	if (strcmp(port, "pasv") == 0) {
+		s->dataMode = DATA_PASSIVE;
+		s->dataPort = 0;
+	}
+	else {
+		s->dataPort = atoi(port);	// Get the port number, convert to an integer from a string
+	}
+}
+
+/*********************************************************************************************
+ * Function: 		void ftp_work(struct session* s, char* commandLine)
+ * Description:		Handles one text command from a verified client. -l and -g start a
+ *					data connection back to the client and return right away, the reactor
+ *					finishes them as the sockets become ready. cd and size are answered
+ *					directly, sum as soon as the checksum is known. The session stays open
+ *					for the next command either way.
+ * Parameters:		the session and the NUL terminated command message
+ *					"[#<id>] <server name> <client IP> <command> [<filename>|<directory>] [<data port>]"
+ *					or "[#<id>] quit|stats". -l takes an optional "long" after the data
+ *					port. -g (or get) takes an optional "<offset> [<length>]"
+ *					after the data port, and "gzip" to have the data compressed. delta takes
+ *					"<filename> <data port> <block size> <blocks>", put "<filename> <data port>
+ *					<size>" (the client then sends the bytes the reply asks for), mget
+ *					"<pattern> <data port>". Replies to a tagged
+ *					command carry the same #<id>.
+ * Pre-Conditions: 	The client has been verified
+ * Post-Conditions: The request is in progress or answered, malformed commands get an error
+ **********************************************************************************************/
+void ftp_work(struct session* s, char* commandLine) {
+	char buffer[BUF_LEN];
+	char* client;
+	char* command;
+	char* arg;
+	char* port;
+	char* offset;
+	char* length;
+	char* option;
+	char* save = NULL;
+
+	if(DEBUG) {
+		printf("commandLine: %s\n", commandLine);
+	}
+
+	// "[#<id>] <server name> <client IP> <command> ..."
+	s->tag[0] = '\0';
+	client = strtok_r(commandLine, " \r\n", &save);
+	if (client != NULL && client[0] == '#' && strlen(client) < sizeof(s->tag) - 1) {
+		snprintf(s->tag, sizeof(s->tag), "%s ", client);
+		client = strtok_r(NULL, " \r\n", &save);
+	}
+	if (client != NULL && strcmp(client, "quit") == 0) {
+		replyStatus(s, FT_OK, 0, "Goodbye");
+		closeSession(s);
+		return;
+	}
+	if (client != NULL && strcmp(client, "stats") == 0) {
+		requestStats(s);
+		return;
+	}
+	arg = strtok_r(NULL, " \r\n", &save);
+	command = strtok_r(NULL, " \r\n", &save);
+	if (client == NULL || arg == NULL || command == NULL || strlen(arg) >= sizeof(s->clientIP)) {
+		replyStatus(s, FT_ERROR, 0, "ERROR: malformed command");
+		requestDone(s);
+		return;
+	}
+	strcpy(s->clientIP, arg);
+	if (verbose) {
+		printf("Servicing client %s\n", s->clientIP);
+	}
+	if(DEBUG) {
+		printf("client: %s\nCommand: %s\n", client, command);
+	}
+
+	//command -l (list)
+	if(strcmp(command, "-l") == 0) {
+		port = strtok_r(NULL, " \r\n", &save);
+		if (port == NULL) {
+			replyStatus(s, FT_ERROR, 0, "ERROR: missing data port");
+			requestDone(s);
+			return;
+		}
+		setDataPort(s, port);
+		arg = strtok_r(NULL, " \r\n", &save);
+		s->listLong = arg != NULL && strcmp(arg, "long") == 0;
+		requestList(s);
+	}
+
+	//command -g (get), optionally a range of the file
+	else if(strcmp(command, "-g") == 0 || strcmp(command, "get") == 0) {
+		arg = strtok_r(NULL, " \r\n", &save);
+		port = strtok_r(NULL, " \r\n", &save);
+		offset = length = NULL;
+		while ((option = strtok_r(NULL, " \r\n", &save)) != NULL) {
+			if (strcmp(option, "gzip") == 0) {
+				s->compress = 1;
+			}
+			else if (offset == NULL) {
+				offset = option;
+			}
+			else if (length == NULL) {
+				length = option;
+			}
+		}
+		if (arg == NULL || port == NULL || strlen(arg) >= sizeof(s->fileName) ||
+				(offset != NULL && (s->rangeOffset = strtoll(offset, NULL, 10)) < 0) ||
+				(length != NULL && (s->rangeLength = strtoll(length, NULL, 10)) < 0)) {
+			replyStatus(s, FT_ERROR, 0, "ERROR: usage -g <filename> <data port> [<offset> [<length>]] [gzip]");
+			requestDone(s);
+			return;
+		}
+		strcpy(s->fileName, arg);
+		setDataPort(s, port);
+		requestGet(s);
+	}
+
+	//command delta (get against the client's copy of the file)
+	else if(strcmp(command, "delta") == 0) {
+		arg = strtok_r(NULL, " \r\n", &save);
+		port = strtok_r(NULL, " \r\n", &save);
+		offset = strtok_r(NULL, " \r\n", &save);		//block size
+		length = strtok_r(NULL, " \r\n", &save);		//blocks
+		if (arg == NULL || port == NULL || offset == NULL || length == NULL || strlen(arg) >= sizeof(s->fileName)) {
+			replyStatus(s, FT_ERROR, 0, "ERROR: usage delta <filename> <data port> <block size> <blocks>");
+			requestDone(s);
+			return;
+		}
+		strcpy(s->fileName, arg);
+		setDataPort(s, port);
+		requestDelta(s, strtoul(offset, NULL, 10), strtoul(length, NULL, 10));
+	}
+
+	//command mget (batch get)
+	else if(strcmp(command, "mget") == 0) {
+		arg = strtok_r(NULL, " \r\n", &save);
+		port = strtok_r(NULL, " \r\n", &save);
+		if (arg == NULL || port == NULL) {
+			replyStatus(s, FT_ERROR, 0, "ERROR: usage mget <pattern> <data port>");
+			requestDone(s);
+			return;
+		}
+		setDataPort(s, port);
+		requestMget(s, arg);
+	}
+
+	//command put (upload)
+	else if(strcmp(command, "put") == 0) {
+		arg = strtok_r(NULL, " \r\n", &save);
+		port = strtok_r(NULL, " \r\n", &save);
+		length = strtok_r(NULL, " \r\n", &save);
+		if (arg == NULL || port == NULL || length == NULL || strlen(arg) >= sizeof(s->fileName) ||
+				strtoll(length, NULL, 10) < 0) {
+			replyStatus(s, FT_ERROR, 0, "ERROR: usage put <filename> <data port> <size>");
+			requestDone(s);
+			return;
+		}
+		strcpy(s->fileName, arg);
+		setDataPort(s, port);
+		requestPut(s, strtoll(length, NULL, 10));
+	}
+
+	//command size
+	else if(strcmp(command, "size") == 0) {
+		arg = strtok_r(NULL, " \r\n", &save);
+		if (arg == NULL || strlen(arg) >= sizeof(s->fileName)) {
+			replyStatus(s, FT_ERROR, 0, "ERROR: usage size <filename>");
+			requestDone(s);
+			return;
+		}
+		strcpy(s->fileName, arg);
+		requestSize(s);
+	}
+
+	//command sum (checksum of a server file)
+	else if(strcmp(command, "sum") == 0) {
+		arg = strtok_r(NULL, " \r\n", &save);
+		if (arg == NULL || strlen(arg) >= sizeof(s->fileName)) {
+			replyStatus(s, FT_ERROR, 0, "ERROR: usage sum <filename>");
+			requestDone(s);
+			return;
+		}
+		strcpy(s->fileName, arg);
+		requestSum(s);
+	}
+
+	//command cd (change directory)
+	else if (strncmp(command, "cd", 2) == 0) {
+		arg = strtok_r(NULL, " \r\n", &save);
+		if (arg == NULL) {
+			replyStatus(s, FT_ERROR, 0, "ERROR: directory change failure");
+			requestDone(s);
+			return;
+		}
+		requestCd(s, arg);
+	}
+
+	else {
+		snprintf(buffer, sizeof(buffer), "ERROR: command %s not recognized", command);
+		replyStatus(s, FT_ERROR, 0, buffer);
+		requestDone(s);
+	}
+}
+
+/*********************************************************************************************
+ * Function: 		void frameCommand(struct session* s, const unsigned char* p, size_t len)
+ * Description:		Handles one FT_COMMAND frame, the binary twin of ftp_work(). Arguments
+ *					are length delimited. Active data connections go to the control peer,
+ *					the flags can ask for a passive port or inline FT_DATA frames instead.
+ * Parameters:		the session and the frame payload (op, flags, data port, [range | delta
+ *					block size and count | put size,] argument)
+ **********************************************************************************************/
+static void frameCommand(struct session* s, const unsigned char* p, size_t len) {
+	char arg[sizeof(s->fileName) > 1024 ? sizeof(s->fileName) : 1024];
+	const unsigned char* argStart = p + FT_COMMAND_LEN;
+	size_t argLen = len - FT_COMMAND_LEN;
+	uint32_t blockSize = 0;
+	uint32_t blocks = 0;
+	off_t putSize = -1;
+
+	if (len >= FT_COMMAND_LEN + FT_RANGE_LEN && (p[1] & FT_FLAG_RANGE)) {
+		s->rangeOffset = ftGet64(argStart);
+		s->rangeLength = ftGet64(argStart + 8);
+		argStart += FT_RANGE_LEN;
+		argLen -= FT_RANGE_LEN;
+	}
+	else if (len >= FT_COMMAND_LEN + FT_DELTA_ARG_LEN && p[0] == FT_OP_DELTA) {
+		blockSize = ftGet32(argStart);
+		blocks = ftGet32(argStart + 4);
+		argStart += FT_DELTA_ARG_LEN;
+		argLen -= FT_DELTA_ARG_LEN;
+	}
+	else if (len >= FT_COMMAND_LEN + FT_PUT_ARG_LEN && p[0] == FT_OP_PUT) {
+		putSize = ftGet64(argStart);
+		argStart += FT_PUT_ARG_LEN;
+		argLen -= FT_PUT_ARG_LEN;
+	}
+	if (len < FT_COMMAND_LEN || argLen >= sizeof(arg) || memchr(argStart, '\0', argLen) ||
+			((p[1] & FT_FLAG_RANGE) && len < FT_COMMAND_LEN + FT_RANGE_LEN) ||
+			s->rangeOffset < 0 || s->rangeLength < 0) {
+		replyStatus(s, FT_ERROR, 0, "ERROR: malformed command");
+		requestDone(s);
+		return;
+	}
+	memcpy(arg, argStart, argLen);
+	arg[argLen] = '\0';
+	s->dataPort = ftGet16(p + 2);
+	if (p[1] & FT_FLAG_INLINE) {
+		s->dataMode = DATA_INLINE;
+	}
+	else if (p[1] & FT_FLAG_PASSIVE) {
+		s->dataMode = DATA_PASSIVE;
+	}
+	s->listLong = (p[1] & FT_FLAG_LONG) != 0;
+	s->compress = p[0] == FT_OP_GET && (p[1] & FT_FLAG_COMPRESS);
+
+	switch (p[0]) {
+	case FT_OP_LIST:
+		requestList(s);
+		break;
+	case FT_OP_GET:
+		if (argLen == 0 || argLen >= sizeof(s->fileName)) {
+			replyStatus(s, FT_ERROR, 0, "ERROR: bad file name");
+			requestDone(s);
+			break;
+		}
+		memcpy(s->fileName, arg, argLen + 1);
+		requestGet(s);
+		break;
+	case FT_OP_SIZE:
+		if (argLen == 0 || argLen >= sizeof(s->fileName)) {
+			replyStatus(s, FT_ERROR, 0, "ERROR: bad file name");
+			requestDone(s);
+			break;
+		}
+		memcpy(s->fileName, arg, argLen + 1);
+		requestSize(s);
+		break;
+	case FT_OP_SUM:
+		if (argLen == 0 || argLen >= sizeof(s->fileName)) {
+			replyStatus(s, FT_ERROR, 0, "ERROR: bad file name");
+			requestDone(s);
+			break;
+		}
+		memcpy(s->fileName, arg, argLen + 1);
+		requestSum(s);
+		break;
+	case FT_OP_DELTA:
+		if (argLen == 0 || argLen >= sizeof(s->fileName) || blockSize == 0) {
+			replyStatus(s, FT_ERROR, 0, "ERROR: bad file name");
+			requestDone(s);
+			break;
+		}
+		memcpy(s->fileName, arg, argLen + 1);
+		requestDelta(s, blockSize, blocks);
+		break;
+	case FT_OP_PUT:
+		if (argLen == 0 || argLen >= sizeof(s->fileName) || putSize < 0) {
+			replyStatus(s, FT_ERROR, 0, "ERROR: bad file name");
+			requestDone(s);
+			break;
+		}
+		memcpy(s->fileName, arg, argLen + 1);
+		requestPut(s, putSize);
+		break;
+	case FT_OP_MGET:
+		requestMget(s, arg);
+		break;
+	case FT_OP_CD:
+		requestCd(s, arg);
+		break;
+	case FT_OP_QUIT:
+		replyStatus(s, FT_OK, 0, "Goodbye");
+		closeSession(s);
+		break;
+	case FT_OP_STATS:
+		requestStats(s);
+		break;
+	default:
+		replyStatus(s, FT_ERROR, 0, "ERROR: command not recognized");
+		requestDone(s);
+		break;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void runLoginJob(struct job* job)
+ * Description:		Worker side of a login: the PBKDF2 rounds of verifyUser(), off the
+ *                  reactor so one login doesn't hold up every other session on it
+ ********************************************************************************************/
+static void runLoginJob(struct job* job) {
+	struct session* s = containerOf(job, struct session, transferJob);
+
+	s->verified = verifyUser(s->login);
+	OPENSSL_cleanse(s->login, strlen(s->login));
+	free(s->login);
+	s->login = NULL;
+}
+
+/*******************************************************************************************
+ * Function:        void loginJobDone(struct job* job)
+ * Description:		Reactor side of a login: answers it, and a verified session goes on to
+ *                  the commands that arrived while it was being checked
+ ********************************************************************************************/
+static void loginJobDone(struct job* job) {
+	struct session* s = containerOf(job, struct session, transferJob);
+
+	s->offloaded = 0;
+	if (s->destroyPending) {
+		destroySession(s);
+		return;
+	}
+	if (s->verified) {
+		s->authAt = metricsNow();
+		metricsRecord(ST_AUTH, s->authAt - s->acceptedAt);
+		replyStatus(s, FT_OK, 0, "User verified!");
+		requestDone(s);
+	}
+	else {
+		metricsAdd(M_LOGIN_FAILED, 1);
+		replyStatus(s, FT_ERROR, 0, "Verification failed: username/password incorrect");
+		closeSession(s);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void handleLogin(struct session* s, char* login, int terminated)
+ * Description:		Checks the username/password message, on a worker (loginJobDone()
+ *                  answers it). A login terminated by a newline puts the session in line
+ *                  mode: every command is one line and the client may send the next ones
+ *                  without waiting for replies.
+ ********************************************************************************************/
+static void handleLogin(struct session* s, char* login, int terminated) {
+	char ip[INET_ADDRSTRLEN];
+	size_t len = strlen(login);
+
+	if (len > 0 && login[len - 1] == '\r') {
+		login[len - 1] = '\0';
+	}
+	s->lineMode = terminated;
+	if (tlsConfig.required && s->controlTLS == NULL) {
+		peerName(s->controlFD, ip, sizeof(ip));
+		printf("ERROR: cleartext login from %s refused (-S)\n", ip);
+		metricsAdd(M_LOGIN_FAILED, 1);
+		replyStatus(s, FT_ERROR, 0, "ERROR: TLS required");
+		closeSession(s);
+		return;
+	}
+	s->login = strdup(login);
+	if (s->login == NULL) {
+		replyStatus(s, FT_ERROR, 0, "ERROR: out of memory");
+		closeSession(s);
+		return;
+	}
+	s->state = SESSION_VERIFYING;
+	s->offloaded = 1;
+	s->transferJob.run = runLoginJob;
+	s->transferJob.done = loginJobDone;
+	s->transferJob.owner = s->reactor;
+	submitJob(s->reactor->pool, s->reactor->id, &s->transferJob);
+}
+
+/*******************************************************************************************
+ * Function:        void commandArrived(struct session* s)
+ * Description:		Stamps the command about to be handled, the first one after the login
+ *                  also counts towards the time clients take to get going
+ ********************************************************************************************/
+static void commandArrived(struct session* s) {
+	s->commandAt = metricsNow();
+	if (s->authAt) {
+		metricsRecord(ST_COMMAND, s->commandAt - s->authAt);
+		s->authAt = 0;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void handleFrame(struct session* s, struct ftHeader* h, unsigned char* payload)
+ * Description:		Handles one complete frame from a framed client: FT_HELLO while logging
+ *                  in, FT_COMMAND after. The payload is used in place.
+ ********************************************************************************************/
+static void handleFrame(struct session* s, struct ftHeader* h, unsigned char* payload) {
+	char login[FT_MAX_PAYLOAD + 1];
+	unsigned char* split;
+	size_t userLen;
+
+	s->requestID = h->requestID;
+	if (s->state == SESSION_LOGIN && h->type == FT_HELLO) {
+		// "<username>\0<password>" -> "<username><password>" as verifyUser() expects
+		split = memchr(payload, '\0', h->length);
+		userLen = split ? (size_t)(split - payload) : h->length;
+		memcpy(login, payload, userLen);
+		if (split) {
+			memcpy(login + userLen, split + 1, h->length - userLen - 1);
+			userLen += h->length - userLen - 1;
+		}
+		login[userLen] = '\0';
+		handleLogin(s, login, 0);
+	}
+	else if (s->state == SESSION_COMMAND && h->type == FT_COMMAND) {
+		commandArrived(s);
+		frameCommand(s, payload, h->length);
+		metricsRecord(ST_HANDLER, metricsNow() - s->commandAt);
+	}
+	else {
+		replyStatus(s, FT_ERROR, 0, "ERROR: unexpected frame");
+		closeSession(s);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void handleControl(struct session* s)
+ * Description:		Acts on the control bytes received so far. A first byte of 0xF7 means
+ *                  a framed client (ftproto.h): every complete frame is a message. In line
+ *                  mode every complete line is a message. Either way they are handled in
+ *                  order as long as the session is idle and has room for the replies, and
+ *                  a partial message waits for the rest. Legacy clients (no newlines) are
+ *                  handled like the blocking server this was converted from: whatever one
+ *                  read burst delivers is one message.
+ ********************************************************************************************/
+static void handleControl(struct session* s) {
+	char* line;
+	char* end;
+	size_t used = 0;
+	int terminated;
+
+	struct ftHeader h;
+	int complete;
+
+	s->inHandler = 1;
+	if (s->state == SESSION_LOGIN && s->inLen > 0 && (unsigned char)s->inBuf[0] == (FT_MAGIC >> 8)) {
+		s->framed = 1;
+	}
+	while (used < s->inLen && !s->closing && s->state != SESSION_DEAD &&
+		   (s->state == SESSION_LOGIN || s->state == SESSION_COMMAND) &&
+		   s->outLen + CTRL_REPLY_MAX < CTRL_OUT_LEN) {
+		if (s->framed) {
+			complete = ftDecodeHeader((unsigned char*)s->inBuf + used, s->inLen - used, &h);
+			if (complete < 0 || (s->inLen - used >= FT_HEADER_LEN && h.type == FT_DATA)) {
+				replyStatus(s, FT_ERROR, 0, "ERROR: bad frame");
+				closeSession(s);
+				break;
+			}
+			if (complete == 0) {
+				break;		//rest of the frame is still on its way
+			}
+			line = s->inBuf + used;
+			used += FT_HEADER_LEN + h.length;
+			handleFrame(s, &h, (unsigned char*)line + FT_HEADER_LEN);
+			continue;
+		}
+		line = s->inBuf + used;
+		end = memchr(line, '\n', s->inLen - used);
+		terminated = end != NULL;
+		if (end == NULL) {
+			if ((s->lineMode || s->state == SESSION_LOGIN) && used > 0) {
+				break;		//rest of the line is still on its way
+			}
+			if (s->lineMode && s->inLen < sizeof(s->inBuf) - 1) {
+				break;
+			}
+			end = s->inBuf + s->inLen;
+		}
+		*end = '\0';
+		used = end - s->inBuf + (terminated ? 1 : 0);
+
+		if (s->state == SESSION_LOGIN) {
+			handleLogin(s, line, terminated);
+		}
+		else if (line[0] != '\0' && line[0] != '\r') {
+			commandArrived(s);
+			ftp_work(s, line);
+			metricsRecord(ST_HANDLER, metricsNow() - s->commandAt);
+		}
+	}
+	if (s->state != SESSION_DEAD) {
+		memmove(s->inBuf, s->inBuf + used, s->inLen - used);
+		s->inLen -= used;
+		s->inHandler = 0;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        int controlTLS(struct session* s)
+ * Description:		With -T, a control connection whose first byte is a TLS handshake record
+ *                  (0x16: never the first byte of a login or a frame) is a TLS client. Runs
+ *                  its handshake as the socket allows, the login comes after it.
+ * Returns:         1 if the session can read its login, 0 while the handshake is going or
+ *                  if it failed (the session is destroyed)
+ ********************************************************************************************/
+static int controlTLS(struct session* s) {
+	char ip[INET_ADDRSTRLEN];
+	unsigned char first;
+
+	if (s->controlTLS == NULL) {
+		if (recv(s->controlFD, &first, 1, MSG_PEEK) != 1 || first != TLS_HANDSHAKE) {
+			return 1;		//cleartext, or nothing yet
+		}
+		s->controlTLS = SSL_new(tlsConfig.ctx);
+		if (s->controlTLS == NULL || SSL_set_fd(s->controlTLS, s->controlFD) != 1) {
+			destroySession(s);
+			return 0;
+		}
+		SSL_set_accept_state(s->controlTLS);
+		s->controlHandshake = 1;
+	}
+	if (!s->controlHandshake) {
+		return 1;
+	}
+	switch (tlsHandshake(s->controlTLS)) {
+	case 0:
+		return 0;
+	case 1:
+		s->controlHandshake = 0;
+		tlsEstablished(s->controlTLS, "control");
+		return 1;
+	default:
+		peerName(s->controlFD, ip, sizeof(ip));
+		printf("ERROR: TLS handshake failed on the control connection from %s\n", ip);
+		metricsAdd(M_LOGIN_FAILED, 1);
+		destroySession(s);
+		return 0;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void readControl(struct session* s)
+ * Description:		EPOLLIN on the control socket: read until the socket is drained (edge
+ *                  triggered) or the input buffer is full, and handle what arrived. Also
+ *                  called when a request finishes, to pick up pipelined commands.
+ ********************************************************************************************/
+static void readControl(struct session* s) {
+	ssize_t charsRecv;
+
+	if (s->state == SESSION_LOGIN && s->inLen == 0 && tlsConfig.ctx != NULL && !controlTLS(s)) {
+		return;
+	}
+	do {
+		while (!s->peerClosed && s->inLen < sizeof(s->inBuf) - 1) {
+			charsRecv = tlsRecv(s->controlTLS, s->controlFD, s->inBuf + s->inLen, sizeof(s->inBuf) - 1 - s->inLen, 0);
+			if (charsRecv > 0) {
+				s->inLen += charsRecv;
+				continue;
+			}
+			if (charsRecv < 0 && errno == EINTR) continue;
+			if (charsRecv < 0 && errno == EAGAIN) break;
+			s->peerClosed = 1;	//EOF or reset
+			break;
+		}
+		if (s->state != SESSION_LOGIN && s->state != SESSION_COMMAND) {
+			return;		//commands wait in inBuf until the current request is done
+		}
+		charsRecv = s->inLen;
+		handleControl(s);
+		if (s->state == SESSION_DEAD) {
+			return;
+		}
+		// a full buffer was handled, there may be more on the socket with no new edge coming
+	} while (charsRecv == sizeof(s->inBuf) - 1 && s->inLen < (size_t)charsRecv && !s->peerClosed);
+
+	// nothing in flight for a client that hung up, a transfer in progress gets to finish
+	if (s->peerClosed && (s->state == SESSION_LOGIN || s->state == SESSION_COMMAND)) {
+		closeSession(s);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void destroySession(struct session* s)
+ * Description:		Closes every descriptor the session owns. The memory is released at
+ *                  the end of the reactor pass since later events in the same batch may
+ *                  still point at it. A session whose file is with a worker (sending it,
+ *                  compressing blocks of it, scanning it for a delta or opening a batch's
+ *                  files) is destroyed when the worker hands it back.
+ ********************************************************************************************/
+static void destroySession(struct session* s) {
+	struct reactor* r = s->reactor;
+
+	if (s->state == SESSION_DEAD) {
+		return;
+	}
+	if (s->offloaded || (s->zip && s->zip->inFlight > 0) || (s->delta && s->delta->inFlight > 0) ||
+			(s->batch && s->batch->inFlight)) {
+		s->destroyPending = 1;		//a worker is still using the data socket or file
+		return;
+	}
+	zipFree(s);
+	deltaFree(s);
+	batchFree(s);
+	if (s->dataFD >= 0) {
+		tlsClose(&s->dataTLS);
+		close(s->dataFD);
+	}
+	if (s->fileFD >= 0) {
+		transferFree(&s->xfer);
+	}
+	if (s->cached) {
+		cacheRelease(s->cached);
+	}
+	if (s->putFD >= 0) {
+		close(s->putFD);
+	}
+	if (s->listing) {
+		listingRelease(s->listing);
+		s->dataBuf = NULL;
+	}
+	if (s->timerFD >= 0) {
+		close(s->timerFD);
+	}
+	if (s->passiveFD >= 0) {
+		close(s->passiveFD);
+	}
+	clearPaths(s);
+	schedRelease(s);
+	schedLeave(s);
+	close(s->dirFD);
+	tlsClose(&s->controlTLS);
+	close(s->controlFD);
+	free(s->dataBuf);
+	s->dataBuf = NULL;
+	s->state = SESSION_DEAD;
+	s->deadNext = r->dead;
+	r->dead = s;
+	r->sessions--;
+	metricsAdd(M_CLOSED, 1);
+}
+
+/*******************************************************************************************
+ * Function:        void acceptClients(struct reactor* r)
+ * Description:		Accepts every pending connection on the listen socket and starts a
+ *                  session for each, waiting for the client's username/password.
+ ********************************************************************************************/
+static void acceptClients(struct reactor* r) {
+	int establishedConnect;	//client socket
+	char host[INET_ADDRSTRLEN];
+	struct sockaddr_in clientAddress;
+	socklen_t sizeOfClientInfo;	//size of client address
+	struct session* s;
+	int one = 1;
+	int i;
+
+	while (1) {
+		sizeOfClientInfo = sizeof(clientAddress);
+		establishedConnect = accept4(r->listenFD, (struct sockaddr *)&clientAddress, &sizeOfClientInfo,
+									 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (establishedConnect < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			if (errno != EAGAIN) {
+				error("ERROR on accept");
+			}
+			return;
+		}
+		//replies are small writes that follow each other (OK, data, DONE): don't let Nagle
+		//hold one back for the client's delayed ACK
+		setsockopt(establishedConnect, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		// Get client's address, numeric so the reactor never waits on DNS
+		getnameinfo((struct sockaddr *)&clientAddress, sizeOfClientInfo, host, sizeof(host), NULL, 0, NI_NUMERICHOST);
+		if (verbose) {
+			printf("Connection established with %s\n", host);
+		}
+
+		s = calloc(1, sizeof(*s));
+		if (s == NULL) {
+			error("ERROR allocating session");
+			close(establishedConnect);
+			continue;
+		}
+		s->reactor = r;
+		s->state = SESSION_LOGIN;
+		s->acceptedAt = metricsNow();
+		s->controlFD = establishedConnect;
+		strcpy(s->peerIP, host);
+		s->dataFD = s->timerFD = s->fileFD = s->passiveFD = s->putFD = s->putDirFD = -1;
+		for (i = 0; i < PATH_CACHE; i++) {
+			s->paths[i].fd = -1;
+		}
+		s->dirFD = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);	//sessions start where the server was started
+		if (s->dirFD < 0) {
+			error("ERROR opening session directory");
+			close(establishedConnect);
+			free(s);
+			continue;
+		}
+		s->frameHeadPos = sizeof(s->frameHead);
+		s->retryDelay = CONNECT_RETRY_MS;
+		s->controlHandle.kind = H_CONTROL;
+		s->dataHandle.kind = H_DATA;
+		s->passiveHandle.kind = H_PASSIVE;
+		s->timerHandle.kind = H_TIMER;
+		s->controlHandle.session = s->dataHandle.session = s->timerHandle.session = s;
+		s->passiveHandle.session = s;
+		if (watchFD(r, establishedConnect, &s->controlHandle, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) < 0) {
+			close(establishedConnect);
+			close(s->dirFD);
+			free(s);
+			continue;
+		}
+		r->sessions++;
+		metricsAdd(M_ACCEPTED, 1);
+		schedJoin(s);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void runDoneJobs(struct reactor* r)
+ * Description:		The reactor's eventfd rang: run done() for every job the workers have
+ *                  finished for this reactor
+ ********************************************************************************************/
+static void runDoneJobs(struct reactor* r) {
+	struct job* job;
+	struct job* next;
+	uint64_t count;
+
+	while (read(r->wakeFD, &count, sizeof(count)) > 0)
+		;
+	pthread_mutex_lock(&r->doneLock);
+	job = r->doneHead;
+	r->doneHead = NULL;
+	pthread_mutex_unlock(&r->doneLock);
+	for (; job != NULL; job = next) {
+		next = job->doneNext;
+		job->done(job);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void dispatch(struct epoll_event* ev)
+ * Description:		Routes one epoll event to the session state machine it belongs to
+ ********************************************************************************************/
+static void dispatch(struct reactor* r, struct epoll_event* ev) {
+	struct handle* h = ev->data.ptr;
+	struct session* s = h->session;
+	uint64_t expirations;
+
+	if (h->kind == H_LISTEN) {
+		acceptClients(r);
+		return;
+	}
+	if (h->kind == H_WAKE) {
+		runDoneJobs(r);
+		return;
+	}
+	if (s->state == SESSION_DEAD) {
+		return;
+	}
+	switch (h->kind) {
+	case H_CONTROL:
+		if (ev->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+			readControl(s);
+		}
+		if (s->state != SESSION_DEAD && (ev->events & EPOLLOUT)) {
+			flushControl(s);
+		}
+		break;
+	case H_DATA:
+		if (s->state == SESSION_CONNECTING && s->dataTLS != NULL) {
+			dataHandshake(s);
+		}
+		else if (s->state == SESSION_CONNECTING) {
+			dataConnectReady(s);
+		}
+		else if (s->state == SESSION_SENDING) {
+			pumpData(s);
+		}
+		break;
+	case H_PASSIVE:
+		if (s->state == SESSION_CONNECTING && s->passiveFD >= 0) {
+			passiveAccept(s);
+		}
+		break;
+	case H_TIMER:
+		while (read(s->timerFD, &expirations, sizeof(expirations)) > 0)
+			;
+		if (s->state == SESSION_CONNECTING && s->passiveFD >= 0) {
+			printf("ERROR: %s never connected to its passive data port\n", s->clientIP);
+			failData(s);
+		}
+		else if (s->state == SESSION_CONNECTING && s->dataFD < 0) {
+			initTCPDataConnection(s);
+		}
+		else if (s->state == SESSION_SENDING && s->paced) {
+			s->paced = 0;		//its next bandwidth share is due
+			if (s->pacedOffload) {
+				s->pacedOffload = 0;
+				resumeTransfer(s);
+			}
+			else {
+				pumpData(s);
+			}
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/*******************************************************************************************
+ * Function:        void* runReactor(void* arg)
+ * Description:		A listener thread's event loop: waits on epoll, dispatches events, then
+ *                  gives every session on the run queue one more turn. Never returns.
+ * Parameters:		the reactor, set up by initReactor()
+ ********************************************************************************************/
+static void* runReactor(void* arg) {
+	struct reactor* r = arg;
+	struct epoll_event events[MAX_EVENTS];
+	struct session* s;
+	struct session* next;
+	int n;
+	int i;
+
+	metricsAttach();
+	while (1) {
+		n = epoll_wait(r->epollFD, events, MAX_EVENTS, r->readyHead ? 0 : -1);
+		if (n < 0 && errno != EINTR) {
+			error("ERROR on epoll_wait");
+		}
+		for (i = 0; i < n; i++) {
+			dispatch(r, &events[i]);
+		}
+
+		// sessions that used up their turn with more to send, one chunk each
+		s = r->readyHead;
+		r->readyHead = r->readyTail = NULL;
+		for (; s != NULL; s = next) {
+			next = s->readyNext;
+			s->queued = 0;
+			if (s->state == SESSION_SENDING) {
+				pumpData(s);
+			}
+		}
+
+		while ((s = r->dead) != NULL) {
+			r->dead = s->deadNext;
+			free(s->outBuf);
+			free(s);
+		}
+	}
+	return NULL;
+}
+
+/*******************************************************************************************
+ * Function:        void initReactor(struct reactor* r, int id, int port, int backlog)
+ * Description:		Sets up one listener: its own SO_REUSEPORT listen socket, epoll set and
+ *                  wakeup eventfd
+ * Parameters:		the reactor to fill in, its index, the port and listen() backlog
+ * Post-Conditions: The reactor is ready for runReactor(), exits on failure
+ ********************************************************************************************/
+static void initReactor(struct reactor* r, int id, int port, int backlog) {
+	memset(r, 0, sizeof(*r));
+	r->id = id;
+	r->cpu = -1;
+	pthread_mutex_init(&r->doneLock, NULL);
+
+	// Set up server address struct, connect socket to port
+	r->listenFD = serverSocketInit(port);
+	if (listen(r->listenFD, backlog) < 0) {
+		perror("ERROR on listen");
+		exit(1);
+	}
+
+	r->epollFD = epoll_create1(EPOLL_CLOEXEC);
+	r->wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->epollFD < 0 || r->wakeFD < 0) {
+		perror("ERROR creating epoll instance");
+		exit(1);
+	}
+	// the listener is level triggered so connections left behind by EMFILE get retried
+	r->listenHandle.kind = H_LISTEN;
+	r->wakeHandle.kind = H_WAKE;
+	if (watchFD(r, r->listenFD, &r->listenHandle, EPOLLIN) < 0 ||
+			watchFD(r, r->wakeFD, &r->wakeHandle, EPOLLIN | EPOLLET) < 0) {
+		exit(1);
+	}
+}
+
+/*******************************************************************************************
+ * Function:        int parseCpuList(char* list, int* cpus)
+ * Description:		Parses the -a argument, "all" or a comma separated list of cpus/ranges
+ *                  ("0,2,4-7")
+ * Returns:         the number of cpus, exits on a malformed list
+ ********************************************************************************************/
+static int parseCpuList(char* list, int* cpus) {
+	int n = 0;
+	int first;
+	int last;
+	int online = sysconf(_SC_NPROCESSORS_ONLN);
+	char* item;
+	char* save = NULL;
+
+	if (strcmp(list, "all") == 0) {
+		for (n = 0; n < online && n < MAX_CPUS; n++) {
+			cpus[n] = n;
+		}
+		return n;
+	}
+	for (item = strtok_r(list, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		if (sscanf(item, "%d-%d", &first, &last) != 2) {
+			last = first = atoi(item);
+		}
+		if (first < 0 || last < first || last >= MAX_CPUS) {
+			fprintf(stderr, "ERROR: bad cpu list \"%s\"\n", item);
+			exit(1);
+		}
+		for (; first <= last && n < MAX_CPUS; first++) {
+			cpus[n++] = first;
+		}
+	}
+	return n;
+}
+
+
+/*******************************************************************************************
+ * Function: 		int main(int argc, char *argv[])
+ * Description:		main function of the server gets CL arguments, starts the transfer
+ *			        workers and one reactor per listener thread, then serves clients
+ *			        until the server receives a SIGINT.
+ * Parameters:		-n <listeners>  listener threads, each with its own SO_REUSEPORT
+ *			                        socket (default: one per online cpu)
+ *			        -w <workers>    transfer worker pool size (default: 4 per cpu)
+ *			        -b <backlog>    listen() backlog per listener (default: SOMAXCONN)
+ *			        -a <cpus>       pin listeners and workers round-robin to these cpus,
+ *			                        "all" or a list like "0,2,4-7"
+ *			        -u              workers send through io_uring, falls back to
+ *			                        sendfile if the kernel doesn't support it
+ *			        -v              log every connection and request on stdout
+ *                  <port>          the server's port #
+ * Pre-Conditions: 	The port must be free
+ * Post-Conditions: The server runs until it is interrupted.
+ ********************************************************************************************/
+int main(int argc, char *argv[]) {
+	int portNumber;			//server port #
+	int online = sysconf(_SC_NPROCESSORS_ONLN);
+	int nListeners = online;
+	int nWorkers = 4 * online;
+	int backlog = SOMAXCONN;
+	int cpus[MAX_CPUS];
+	int nCpus = 0;
+	int useUring = 0;
+	int cacheMB = CACHE_BUDGET;
+	char sumDefault[1024];
+	const char* sumPath = sumDefaultPath(sumDefault, sizeof(sumDefault));
+	static sigset_t hup;					//schedReloadMain() waits on it for good
+	pthread_t reloader;
+	const char* metricsAt = NULL;
+	const char* tlsPem = NULL;
+	const char* usersPath = NULL;
+	const char* newAccount = NULL;
+	int opt;
+	int i;
+	struct uring probe;
+	struct reactor* reactors;
+	struct workerPool* pool;
+
+	// Check usage & args
+	while ((opt = getopt(argc, argv, "n:w:b:a:uc:i:m:L:HD:T:SU:A:v")) != -1) {
+		switch (opt) {
+		case 'n': nListeners = atoi(optarg); break;
+		case 'w': nWorkers = atoi(optarg); break;
+		case 'b': backlog = atoi(optarg); break;
+		case 'a': nCpus = parseCpuList(optarg, cpus); break;
+		case 'u': useUring = 1; break;
+		case 'c': cacheMB = atoi(optarg); break;
+		case 'i': sumPath = strcmp(optarg, "none") == 0 ? NULL : optarg; break;
+		case 'm': metricsAt = optarg; break;
+		case 'L': snprintf(scheduler.path, sizeof(scheduler.path), "%s", optarg); break;
+		case 'H': bufferPool.huge = 1; break;
+		case 'D': directMin = (off_t)atoi(optarg) << 20; break;
+		case 'T': tlsPem = optarg; break;
+		case 'S': tlsConfig.required = 1; break;
+		case 'U': usersPath = optarg; break;
+		case 'A': newAccount = optarg; break;
+		case 'v': verbose = 1; break;
+		default: nListeners = 0; break;	//usage below
+		}
+	}
+	if (newAccount != NULL) {
+		exit(accountCreate(newAccount) < 0);
+	}
+	if (optind != argc - 1 || (tlsConfig.required && tlsPem == NULL) || nListeners < 1 || nWorkers < 1 || backlog < 1 || cacheMB < 0 || directMin < 0) {
+		fprintf(stderr,"USAGE: %s [-n listeners] [-w workers] [-b backlog] [-a cpus] [-u] [-c cache MB] [-i index|none] [-m metrics port|socket] [-L limits file] [-H] [-D direct MB] [-T cert.pem [-S]] [-U logins file] [-A new login] [-v] <port number>\n", argv[0]);
+		exit(1);
+	}
+	if (accountsLoad(usersPath) < 0 || (tlsPem != NULL && tlsInit(tlsPem) < 0)) {
+		exit(1);
+	}
+	setvbuf(stdout, NULL, _IOLBF, 0);		//a log line is written when it's printed, not on exit
+	fileCache.budget = (size_t)cacheMB << 20;
+	crc32cInit();
+	sumLoad(sumPath);
+	listCache.inotifyFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (listCache.inotifyFD < 0) {
+		perror("WARNING: inotify unavailable, directory listings won't be cached");
+	}
+
+	// Get the port number, convert to an integer from a string
+	portNumber = atoi(argv[optind]);
+
+	if (stat(".", &startDir) < 0) {
+		perror("ERROR reading the start directory");
+		exit(1);
+	}
+	// a client hanging up mid-transfer is an EPIPE on that session, not a reason to exit
+	signal(SIGPIPE, SIG_IGN);
+	if (scheduler.path[0] != '\0') {
+		schedLoad();
+		sigemptyset(&hup);						//kill -HUP: limits changed
+		sigaddset(&hup, SIGHUP);
+		pthread_sigmask(SIG_BLOCK, &hup, NULL);	//before any other thread starts, they inherit it
+		if (pthread_create(&reloader, NULL, schedReloadMain, &hup) != 0) {
+			perror("ERROR starting the limits reload thread");
+			exit(1);
+		}
+		pthread_detach(reloader);
+	}
+
+	// all sockets are bound before any thread starts so a busy port fails fast
+	reactors = calloc(nListeners, sizeof(*reactors));
+	if (reactors == NULL) {
+		perror("ERROR allocating reactors");
+		exit(1);
+	}
+	for (i = 0; i < nListeners; i++) {
+		initReactor(&reactors[i], i, portNumber, backlog);
+	}
+	if (useUring) {
+		if (uringInit(&probe) < 0) {
+			fprintf(stderr, "WARNING: io_uring not available (%s), using sendfile\n", strerror(errno));
+			useUring = 0;
+		}
+		else {
+			uringFree(&probe);
+		}
+	}
+	pool = startWorkers(nWorkers, cpus, nCpus, useUring);
+	if (metricsAt != NULL) {
+		startMetrics(metricsAt);
+	}
+	printf("FTServer listening on port %d (%d listeners, %d %s workers, backlog %d)...\n",
+		   portNumber, nListeners, nWorkers, useUring ? "io_uring" : "sendfile", backlog);
+
+	// listener 0 runs on the main thread
+	for (i = 0; i < nListeners; i++) {
+		reactors[i].pool = pool;
+		reactors[i].cpu = nCpus ? cpus[i % nCpus] : -1;
+		reactors[i].thread = pthread_self();
+		if (i > 0 && pthread_create(&reactors[i].thread, NULL, runReactor, &reactors[i]) != 0) {
+			perror("ERROR creating listener thread");
+			exit(1);
+		}
+		pinThread(reactors[i].thread, reactors[i].cpu);
+	}
+	runReactor(&reactors[0]);
+
+	// Close the sockets
+	for (i = 0; i < nListeners; i++) {
+		close(reactors[i].listenFD);
+	}
+	printf("Connection closed. Goodbye!\n");
+
 	return 0;
 }
@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+#****************************************************************************************#
+# Filename:		tests/batch.py
+# Description:	Batch gets (FT_OP_MGET) against a running ftserver: a directory and a glob
+#				come back as one stream of entries, parsed and checked against the files.
+# Usage:		batch.py <port> <server directory>	(make check starts the server)
+#****************************************************************************************#
+import os, struct, sys
+from ftwire import *
+
+FT_BATCH_HEAD, FT_BATCH_TAIL = 18, 5
+
+# the entries of a batch stream: ({name: (data, summed, crc)}, files sent, files skipped)
+def parse(stream):
+	entries = {}
+	at = 0
+	while True:
+		size, mtime, nameLen = struct.unpack(">QQH", stream[at:at + FT_BATCH_HEAD])
+		at += FT_BATCH_HEAD
+		if nameLen == 0:
+			assert at == len(stream), (at, len(stream))
+			return entries, size, mtime
+		name = stream[at:at + nameLen].decode()
+		at += nameLen
+		data = stream[at:at + size]
+		at += size
+		summed, crc = struct.unpack(">BI", stream[at:at + FT_BATCH_TAIL])
+		at += FT_BATCH_TAIL
+		entries[name] = (data, summed, crc)
+
+def mget(sckt, pattern):
+	ok, data = passive(sckt, FT_OP_MGET, pattern)
+	stream = recvToEOF(data)
+	requestID, code, value, message = status(sckt)
+	assert code == FT_DONE and value == len(stream), (code, value, message)
+	return parse(stream)
+
+def check(entries, files):
+	assert sorted(entries) == sorted(files), (sorted(entries), sorted(files))
+	for name, (data, summed, crc) in entries.items():
+		assert data == files[name], name
+		assert not summed or crc == crc32c(data), name
+
+def main():
+	port = int(sys.argv[1])
+	files = {
+		"batch/a.txt": b"first\n",
+		"batch/b.txt": b"second\n" * 1000,
+		"batch/empty.txt": b"",
+		"batch/big.bin": os.urandom(3 * 1024 * 1024 + 1),
+		"batch/sub/c.bin": os.urandom(4097),
+	}
+	os.makedirs(os.path.join(sys.argv[2], "batch", "sub"))
+	for name, content in files.items():
+		with open(os.path.join(sys.argv[2], name), "wb") as f:
+			f.write(content)
+	sckt = login(port)
+
+	entries, sent, skipped = mget(sckt, b"batch")
+	check(entries, files)
+	assert sent == len(files) and skipped == 0, (sent, skipped)
+	print("directory batch: ok (%d files)" % sent)
+
+	entries, sent, skipped = mget(sckt, b"batch/*.txt")
+	check(entries, {name: content for name, content in files.items() if name.endswith(".txt") and "sub" not in name})
+	print("glob batch: ok (%d files)" % sent)
+
+main()
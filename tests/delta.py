@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+#****************************************************************************************#
+# Filename:		tests/delta.py
+# Description:	Delta gets (FT_OP_DELTA) against a running ftserver: a client copy that
+#				differs from the server's file in a few places is rebuilt from the ops,
+#				most of it copied from blocks the client already has.
+# Usage:		delta.py <port> <server directory>	(make check starts the server)
+#****************************************************************************************#
+import hashlib, os, struct, sys
+from ftwire import *
+
+FT_DELTA_END, FT_DELTA_LITERAL, FT_DELTA_COPY = 0, 1, 2
+FT_DELTA_HEAD = 9
+BLOCK = 4096
+
+# rsync's rolling checksum of one block, as ftproto.h defines it
+def weak(block):
+	a = b = 0
+	for byte in block:
+		a = (a + byte) & 0xFFFF
+		b = (b + a) & 0xFFFF
+	return a | b << 16
+
+def signatures(old):
+	blocks = len(old) // BLOCK
+	sigs = b"".join(struct.pack(">I", weak(old[i * BLOCK:(i + 1) * BLOCK])) +
+					hashlib.md5(old[i * BLOCK:(i + 1) * BLOCK]).digest() for i in range(blocks))
+	return blocks, sigs
+
+# rebuilds the file from the ops and the old copy: (file, bytes sent as literals, END crc)
+def apply(ops, old, blocks):
+	rebuilt = b""
+	literal = 0
+	at = 0
+	while True:
+		type, a, b = struct.unpack(">BII", ops[at:at + FT_DELTA_HEAD])
+		at += FT_DELTA_HEAD
+		if type == FT_DELTA_END:
+			assert at == len(ops), (at, len(ops))
+			return rebuilt, literal, a
+		if type == FT_DELTA_LITERAL:
+			rebuilt += ops[at:at + a]
+			literal += a
+			at += a
+		else:
+			assert type == FT_DELTA_COPY and a + b <= blocks, (type, a, b)
+			rebuilt += old[a * BLOCK:(a + b) * BLOCK]
+
+def delta(sckt, old):
+	blocks, sigs = signatures(old)
+	ok, data = passive(sckt, FT_OP_DELTA, struct.pack(">II", BLOCK, blocks) + b"delta.bin")
+	data.sendall(sigs)
+	ops = recvToEOF(data)
+	requestID, code, value, message = status(sckt)
+	assert code == FT_DONE, message
+	return apply(ops, old, blocks)
+
+def main():
+	port = int(sys.argv[1])
+	old = os.urandom(64 * BLOCK + 100)
+	new = old[:5000] + b"changed" + old[5007:20 * BLOCK] + os.urandom(3000) + old[20 * BLOCK:60 * BLOCK] + b"tail"
+	with open(os.path.join(sys.argv[2], "delta.bin"), "wb") as f:
+		f.write(new)
+	sckt = login(port)
+
+	rebuilt, literal, crc = delta(sckt, old)
+	assert rebuilt == new and crc == crc32c(new), (len(rebuilt), len(new))
+	assert literal < len(new) // 4, literal
+	print("delta round trip: ok (%d of %d bytes literal)" % (literal, len(new)))
+
+	#no copy at all: the whole file comes back as literals
+	rebuilt, literal, crc = delta(sckt, b"")
+	assert rebuilt == new and literal == len(new) and crc == crc32c(new)
+	print("delta without a copy: ok")
+
+main()
@@ -0,0 +1,30 @@
+#!/usr/bin/env python3
+#****************************************************************************************#
+# Filename:		tests/frames.py
+# Description:	Framed protocol edge cases (ftproto.h) against a running ftserver:
+#				the largest frame the protocol allows is answered, one byte more is refused.
+# Usage:		frames.py <port>	(make check starts the server)
+#****************************************************************************************#
+import sys
+from ftwire import *
+
+def main():
+	port = int(sys.argv[1])
+
+	#largest frame: answered (the name doesn't exist), and the session goes on
+	sckt = login(port)
+	sckt.sendall(command(FT_OP_SIZE, b"n" * (FT_MAX_PAYLOAD - 4)))
+	requestID, code, value, message = status(sckt)
+	assert requestID == 7 and code == FT_ERROR, (requestID, code, message)
+	sckt.sendall(command(FT_OP_SIZE, b"n"))
+	assert status(sckt)[0] == 7
+	print("max size frame: ok")
+
+	#one byte more: refused, not left waiting for the rest
+	sckt = login(port)
+	sckt.sendall(command(FT_OP_SIZE, b"n" * (FT_MAX_PAYLOAD - 3)))
+	requestID, code, value, message = status(sckt)
+	assert code == FT_ERROR and b"bad frame" in message, message
+	print("oversized frame: refused")
+
+main()
@@ -0,0 +1,80 @@
+#****************************************************************************************#
+# Filename:		tests/ftwire.py
+# Description:	Framed protocol (ftproto.h) helpers shared by the tests: frames, login,
+#				passive data connections and a reference CRC32C.
+#****************************************************************************************#
+import socket, struct
+
+FT_HEADER_LEN = 12
+FT_MAX_PAYLOAD = 2048 - 1 - FT_HEADER_LEN
+FT_HELLO, FT_COMMAND, FT_STATUS, FT_DATA = 1, 2, 3, 4
+FT_OK, FT_DONE, FT_ERROR, FT_PASV = 0, 1, 2, 3
+FT_OP_LIST, FT_OP_GET, FT_OP_SIZE, FT_OP_SUM, FT_OP_DELTA, FT_OP_PUT, FT_OP_MGET = 1, 2, 5, 7, 8, 9, 10
+FT_FLAG_PASSIVE, FT_FLAG_INLINE, FT_FLAG_RANGE = 0x01, 0x02, 0x04
+
+def header(type, requestID, length):
+	return struct.pack(">HBBII", 0xF71E, 1, type, requestID, length)
+
+def recvAll(sckt, n):
+	data = bytearray()
+	while len(data) < n:
+		more = sckt.recv(min(n - len(data), 1 << 20))
+		if not more:
+			raise EOFError("server closed the connection")
+		data += more
+	return bytes(data)
+
+def recvToEOF(sckt):
+	data = bytearray()
+	while True:
+		more = sckt.recv(1 << 20)
+		if not more:
+			return bytes(data)
+		data += more
+
+def frame(sckt):
+	magic, version, type, requestID, length = struct.unpack(">HBBII", recvAll(sckt, FT_HEADER_LEN))
+	return type, requestID, recvAll(sckt, length)
+
+# next FT_STATUS: (request id, code, value, message)
+def status(sckt):
+	type, requestID, payload = frame(sckt)
+	assert type == FT_STATUS, type
+	return requestID, payload[0], struct.unpack(">Q", payload[4:12])[0], payload[12:]
+
+def login(port):
+	sckt = socket.create_connection(("127.0.0.1", port))
+	sckt.settimeout(5)
+	sckt.sendall(header(FT_HELLO, 0, 11) + b"client\0pass")
+	assert status(sckt)[1] == FT_OK
+	return sckt
+
+def command(op, argument, flags=0, requestID=7):
+	payload = struct.pack(">BBH", op, flags, 0) + argument
+	return header(FT_COMMAND, requestID, len(payload)) + payload
+
+# sends a passive command, checks FT_OK and connects to the port in FT_PASV: (OK value, data socket)
+def passive(sckt, op, argument, flags=0):
+	sckt.sendall(command(op, argument, flags | FT_FLAG_PASSIVE))
+	requestID, code, value, message = status(sckt)
+	assert code == FT_OK, message
+	ok = value
+	requestID, code, value, message = status(sckt)
+	assert code == FT_PASV, message
+	data = socket.create_connection(("127.0.0.1", value))
+	data.settimeout(5)
+	return ok, data
+
+crcTable = []
+for byte in range(256):
+	crc = byte
+	for bit in range(8):
+		crc = crc >> 1 ^ 0x82F63B78 if crc & 1 else crc >> 1
+	crcTable.append(crc)
+
+# table driven reference for the server's CRC32C
+def crc32c(data, crc=0):
+	crc ^= 0xFFFFFFFF
+	for byte in data:
+		crc = crcTable[(crc ^ byte) & 0xFF] ^ crc >> 8
+	return crc ^ 0xFFFFFFFF
@@ -0,0 +1,121 @@
+/*******************************************************************************************
+ * Filename: 	tests/getall.c
+ * Description: libft (ftlib.h) against a running ftserver: ftClientGetAll() fetches
+ *              several files over a pool smaller than the list, one of them a range and
+ *              one missing, and each local file is compared with the server's.
+ * Usage:       getall <port> <server directory>	(make check starts the server)
+ ********************************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../ftlib.h"
+
+#define FILES		6			//written into the server's directory
+#define GETS		(FILES + 2)	//and a range of the last one and a file that isn't there
+
+/*******************************************************************************************
+ * Function:        char* slurp(const char* path, long* size)
+ * Returns:         the file's bytes (malloc'd) and their count, NULL if it can't be read
+ ********************************************************************************************/
+static char* slurp(const char* path, long* size) {
+	FILE* f = fopen(path, "rb");
+	char* data;
+
+	if (f == NULL) {
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	rewind(f);
+	data = malloc(*size + 1);
+	if (data == NULL || fread(data, 1, *size, f) != (size_t)*size) {
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	return data;
+}
+
+/*******************************************************************************************
+ * Function:        int same(const char* local, const char* remote, long long offset, long long length)
+ * Returns:         1 if local holds exactly that range of remote (length 0 = to EOF)
+ ********************************************************************************************/
+static int same(const char* local, const char* remote, long long offset, long long length) {
+	long localSize, remoteSize;
+	char* got = slurp(local, &localSize);
+	char* want = slurp(remote, &remoteSize);
+	int ok = got != NULL && want != NULL;
+
+	if (ok && length == 0) {
+		length = remoteSize - offset;
+	}
+	ok = ok && localSize == length && memcmp(got, want + offset, length) == 0;
+	free(got);
+	free(want);
+	return ok;
+}
+
+int main(int argc, char* argv[]) {
+	char remote[GETS][64], local[GETS][256], server[GETS][256];
+	char error[FT_MESSAGE_LEN];
+	struct ftGet gets[GETS];
+	struct ftOptions options = { .host = "127.0.0.1", .connections = 3 };
+	struct ftClient* client;
+	FILE* f;
+	long k;
+	int i, failed;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <port> <server directory>\n", argv[0]);
+		return 2;
+	}
+	options.port = atoi(argv[1]);
+	srand(42);
+	memset(gets, 0, sizeof(gets));
+	for (i = 0; i < GETS; i++) {
+		snprintf(remote[i], sizeof(remote[i]), "getall%d.bin", i < FILES ? i : FILES - 1);
+		snprintf(local[i], sizeof(local[i]), "%s/got%d.bin", argv[2], i);
+		snprintf(server[i], sizeof(server[i]), "%s/%s", argv[2], remote[i]);
+		if (i < FILES) {		//sizes from empty to a few MB, none a whole number of payloads
+			f = fopen(server[i], "wb");
+			for (k = 0; f != NULL && k < (i * i * 300001L) % (5 * 1024 * 1024); k++) {
+				fputc(rand(), f);
+			}
+			if (f == NULL || fclose(f) != 0) {
+				perror("ERROR writing the test files");
+				return 1;
+			}
+		}
+		gets[i].remote = remote[i];
+		gets[i].local = local[i];
+	}
+	gets[FILES].offset = 12345;
+	gets[FILES].length = 100000;
+	gets[FILES + 1].remote = "getall-missing.bin";
+
+	client = ftClientOpen(&options, error, sizeof(error));
+	if (client == NULL) {
+		fprintf(stderr, "ftClientOpen: %s\n", error);
+		return 1;
+	}
+	failed = ftClientGetAll(client, gets, GETS);
+	ftClientClose(client);
+
+	for (i = 0; i <= FILES; i++) {
+		if (gets[i].failed || !same(local[i], server[i], gets[i].offset, gets[i].length)) {
+			fprintf(stderr, "get of %s (%lld+%lld) is wrong: %s\n", remote[i], gets[i].offset,
+					gets[i].length, gets[i].message);
+			return 1;
+		}
+	}
+	if (failed != 1 || !gets[FILES + 1].failed) {
+		fprintf(stderr, "%d gets failed, the missing file %s\n", failed,
+				gets[FILES + 1].failed ? "among them" : "not among them");
+		return 1;
+	}
+	printf("ftClientGetAll: ok (%d files, a range and a missing file over %d connections)\n", FILES,
+		   options.connections);
+	return 0;
+}
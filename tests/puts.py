@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+#****************************************************************************************#
+# Filename:		tests/puts.py
+# Description:	Uploads (FT_OP_PUT) against a running ftserver: an upload that stops
+#				halfway stays behind as <file>.ftpart and the next put of the file
+#				resumes it; names outside the server's directory are refused.
+# Usage:		puts.py <port> <server directory>	(make check starts the server)
+#****************************************************************************************#
+import os, struct, sys
+from ftwire import *
+
+def putArg(size, name):
+	return struct.pack(">Q", size) + name
+
+def main():
+	port = int(sys.argv[1])
+	directory = sys.argv[2]
+	content = os.urandom(2 * 1024 * 1024 + 77)
+	half = 1024 * 1024 + 5
+	sckt = login(port)
+
+	#interrupted: the client closes the data connection after half the file
+	offset, data = passive(sckt, FT_OP_PUT, putArg(len(content), b"up.bin"))
+	assert offset == 0, offset
+	data.sendall(content[:half])
+	data.close()
+	requestID, code, value, message = status(sckt)
+	assert code == FT_ERROR, (code, value, message)
+	assert not os.path.exists(os.path.join(directory, "up.bin"))
+	assert os.path.getsize(os.path.join(directory, "up.bin.ftpart")) == half
+	print("interrupted put: left as up.bin.ftpart")
+
+	#resumed: asked for the rest only
+	offset, data = passive(sckt, FT_OP_PUT, putArg(len(content), b"up.bin"))
+	assert offset == half, offset
+	data.sendall(content[offset:])
+	data.close()
+	requestID, code, value, message = status(sckt)
+	assert code == FT_DONE and value == len(content) - half, (code, value, message)
+	with open(os.path.join(directory, "up.bin"), "rb") as f:
+		assert f.read() == content
+	assert not os.path.exists(os.path.join(directory, "up.bin.ftpart"))
+	print("resumed put: ok")
+
+	#outside the server's directory
+	for name in (b"../up.bin", b"/tmp/up.bin", b"sub/../../up.bin"):
+		sckt.sendall(command(FT_OP_PUT, putArg(1, name), FT_FLAG_PASSIVE))
+		requestID, code, value, message = status(sckt)
+		assert code == FT_ERROR, (name, message)
+	print("names outside: refused")
+
+main()
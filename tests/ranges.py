@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+#****************************************************************************************#
+# Filename:		tests/ranges.py
+# Description:	Ranged gets (FT_FLAG_RANGE) against a running ftserver: a range in the
+#				middle of a file, one running to EOF, one past the end; passive and inline.
+# Usage:		ranges.py <port> <server directory>	(make check starts the server)
+#****************************************************************************************#
+import os, struct, sys
+from ftwire import *
+
+def rangeArg(offset, length, name):
+	return struct.pack(">QQ", offset, length) + name
+
+def main():
+	port = int(sys.argv[1])
+	content = os.urandom(3 * 1024 * 1024 + 123)
+	with open(os.path.join(sys.argv[2], "ranges.bin"), "wb") as f:
+		f.write(content)
+	sckt = login(port)
+
+	#passive, from the middle: OK says the length, DONE sums exactly those bytes
+	for offset, length in ((100, 1000), (1024 * 1024 + 7, 1024 * 1024)):
+		ok, data = passive(sckt, FT_OP_GET, rangeArg(offset, length, b"ranges.bin"), FT_FLAG_RANGE)
+		got = recvToEOF(data)
+		requestID, code, value, message = status(sckt)
+		assert ok == length and got == content[offset:offset + length], (offset, length, ok, len(got))
+		assert code == FT_DONE and value == length, message
+		assert message == b"DONE %d CRC32C %08x" % (length, crc32c(got)), message
+	print("passive ranges: ok")
+
+	#inline, length 0: the rest of the file
+	offset = len(content) - 5000
+	sckt.sendall(command(FT_OP_GET, rangeArg(offset, 0, b"ranges.bin"), FT_FLAG_RANGE | FT_FLAG_INLINE))
+	requestID, code, value, message = status(sckt)
+	assert code == FT_OK and value == 5000, message
+	got = b""
+	while True:
+		type, requestID, payload = frame(sckt)
+		if type != FT_DATA:
+			break
+		got += payload
+	assert payload[0] == FT_DONE and got == content[offset:], (payload, len(got))
+	print("inline range to EOF: ok")
+
+	#past the end: refused, the session goes on
+	sckt.sendall(command(FT_OP_GET, rangeArg(len(content) + 1, 10, b"ranges.bin"), FT_FLAG_RANGE | FT_FLAG_INLINE))
+	requestID, code, value, message = status(sckt)
+	assert code == FT_ERROR and b"past the end" in message, message
+	sckt.sendall(command(FT_OP_SIZE, b"ranges.bin"))
+	assert status(sckt)[2] == len(content)
+	print("range past the end: refused")
+
+main()
@@ -0,0 +1,46 @@
+#!/usr/bin/env python3
+#****************************************************************************************#
+# Filename:		tests/sums.py
+# Description:	CRC32C checksums against a running ftserver: the known answer for
+#				"123456789" (e3069283), odd sized files against tests/ftwire.py's table,
+#				and the checksum a whole get reports in DONE.
+# Usage:		sums.py <port> <server directory>	(make check starts the server)
+#****************************************************************************************#
+import os, sys
+from ftwire import *
+
+def serverSum(sckt, name):
+	sckt.sendall(command(FT_OP_SUM, name))
+	requestID, code, value, message = status(sckt)
+	assert code == FT_OK, message
+	return value
+
+def main():
+	port = int(sys.argv[1])
+	files = {
+		b"check.txt": b"123456789",
+		b"empty.txt": b"",
+		b"odd.bin": os.urandom(1024 * 1024 + 13),	#whole 8 byte words, then a tail
+		b"small.bin": os.urandom(7),
+	}
+	for name, content in files.items():
+		with open(os.path.join(sys.argv[2], name.decode()), "wb") as f:
+			f.write(content)
+	sckt = login(port)
+
+	assert serverSum(sckt, b"check.txt") == 0xE3069283
+	assert crc32c(b"123456789") == 0xE3069283
+	print("known answer: ok")
+
+	for name, content in files.items():
+		assert serverSum(sckt, name) == crc32c(content), name
+	print("sizes: ok")
+
+	#a get sums the bytes it sends, whichever path sent them
+	ok, data = passive(sckt, FT_OP_GET, b"odd.bin")
+	got = recvToEOF(data)
+	requestID, code, value, message = status(sckt)
+	assert got == files[b"odd.bin"] and message == b"DONE %d CRC32C %08x" % (len(got), crc32c(got)), message
+	print("get checksum: ok")
+
+main()